@@ -0,0 +1,1247 @@
+// Micro-benchmarks for the intersection and shading kernels.
+//
+// Every benchmark reseeds the generator, so two runs on the same machine trace exactly the same rays.
+// Results are printed as CSV (one row per benchmark) so they can be diffed or plotted across commits:
+//
+//     benchmark,calls,ns_per_call,mrays_per_s
+//
+// Usage: raytracer_bench [--quick] [--filter <substring>]
+
+#include "aarect.h"
+#include "accel.h"
+#include "arena.h"
+#include "box.h"
+#include "bvh.h"
+#include "compressed_bvh.h"
+#include "constants.h"
+#include "flat_bvh.h"
+#include "guiding.h"
+#include "integrator.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "motion_bvh.h"
+#include "moving_sphere.h"
+#include "path_batch.h"
+#include "render.h"
+#include "scenes.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Heap traffic counters for the scene build benchmarks. Other benchmarks allocate from worker threads (the
+// radiance cache fill, for one), so the counters are atomic; relaxed increments do, since they are only read
+// between builds.
+// With glibc the bytes include what malloc really reserves per block (rounding and header).
+static std::atomic<size_t> g_heap_allocations { 0 };
+static std::atomic<size_t> g_heap_bytes { 0 };
+
+static void count_allocation(void* p, size_t size)
+{
+    g_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+#ifdef __GLIBC__
+    (void)size;
+    g_heap_bytes.fetch_add(malloc_usable_size(p) + sizeof(size_t), std::memory_order_relaxed);
+#else
+    (void)p;
+    g_heap_bytes.fetch_add(size, std::memory_order_relaxed);
+#endif
+}
+
+static void* counted_alloc(size_t size)
+{
+    void* p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    count_allocation(p, size);
+    return p;
+}
+
+static void* counted_aligned_alloc(size_t size, std::align_val_t alignment)
+{
+    const size_t align = std::max(static_cast<size_t>(alignment), sizeof(void*));
+#ifdef _MSC_VER
+    void* p = _aligned_malloc(size ? size : 1, align);
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, align, size ? size : 1) != 0)
+        p = nullptr;
+#endif
+    if (!p)
+        throw std::bad_alloc();
+    count_allocation(p, size);
+    return p;
+}
+
+static void aligned_free(void* p)
+{
+#ifdef _MSC_VER
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+void* operator new(size_t size) { return counted_alloc(size); }
+void* operator new[](size_t size) { return counted_alloc(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return counted_aligned_alloc(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return counted_aligned_alloc(size, alignment); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { aligned_free(p); }
+
+namespace
+{
+    const unsigned int BENCH_SEED = 1234;
+
+    // Keeps the optimiser from discarding results of the measured calls.
+    volatile double g_sink = 0.0;
+
+    struct bench_options
+    {
+        double m_scale = 1.0;
+        std::string m_filter;
+    };
+
+    // Counts top-level hit() queries, i.e. traced rays, without touching the kernels themselves.
+    class counting_hittable : public hittable
+    {
+    public:
+        counting_hittable(const hittable& inner) : m_inner(inner) {}
+
+        virtual bool hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const override
+        {
+            ++m_rays;
+            return m_inner.hit(r_in, t_min, t_max, hit_rec);
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+        {
+            return m_inner.bounding_box(time0, time1, output_box);
+        }
+
+        mutable long long m_rays = 0;
+
+    private:
+        const hittable& m_inner;
+    };
+
+    // rays < 0 marks benchmarks that do not trace rays; their Mrays/s column is left empty.
+    void report(const std::string& name, long long calls, double seconds, long long rays)
+    {
+        std::cout << name << ','
+                  << calls << ','
+                  << std::fixed << std::setprecision(2) << seconds * 1e9 / calls << ',';
+        if (rays >= 0)
+            std::cout << std::setprecision(3) << rays / seconds * 1e-6;
+        std::cout << std::endl;
+    }
+
+    bool selected(const bench_options& opts, const std::string& name)
+    {
+        return opts.m_filter.empty() || name.find(opts.m_filter) != std::string::npos;
+    }
+
+    double seconds_since(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Rays with origins scattered around the unit cube, aimed at random points inside it.
+    std::vector<ray> make_rays(size_t count, double spread)
+    {
+        std::vector<ray> rays;
+        rays.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            const point3 origin = vec3::random(-spread, spread);
+            const point3 target = vec3::random(-1, 1);
+            rays.emplace_back(origin, target - origin);
+        }
+        return rays;
+    }
+
+    // Runs kernel over the ray set until `calls` invocations have been timed.
+    void bench_rays(const bench_options& opts, const std::string& name, long long calls, double spread,
+                    const std::function<bool(const ray&)>& kernel, bool traces_rays = true)
+    {
+        if (!selected(opts, name))
+            return;
+
+        seed_random(BENCH_SEED);
+        const auto rays = make_rays(4096, spread);
+        calls = static_cast<long long>(calls * opts.m_scale);
+
+        long long hits = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (long long i = 0; i < calls; i++)
+            hits += kernel(rays[i & 4095]);
+        const double seconds = seconds_since(start);
+
+        g_sink = g_sink + hits;
+        report(name, calls, seconds, traces_rays ? calls : -1);
+    }
+
+    void bench_primitives(const bench_options& opts)
+    {
+        const auto mat = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+        const aabb box(point3(-1, -1, -1), point3(1, 1, 1));
+        bench_rays(opts, "aabb::hit", 20000000, 4.0, [&](const ray& r) { return box.hit(r, 0.001, INF); });
+
+        const sphere ball(point3(0, 0, 0), 1.0, mat);
+        bench_rays(opts, "sphere::hit", 20000000, 4.0, [&](const ray& r) { hit_record rec; return ball.hit(r, 0.001, INF, rec); });
+
+        const xy_rect rect_xy(-1, 1, -1, 1, 0, mat);
+        const xz_rect rect_xz(-1, 1, -1, 1, 0, mat);
+        const yz_rect rect_yz(-1, 1, -1, 1, 0, mat);
+        bench_rays(opts, "xy_rect::hit", 20000000, 4.0, [&](const ray& r) { hit_record rec; return rect_xy.hit(r, 0.001, INF, rec); });
+        bench_rays(opts, "xz_rect::hit", 20000000, 4.0, [&](const ray& r) { hit_record rec; return rect_xz.hit(r, 0.001, INF, rec); });
+        bench_rays(opts, "yz_rect::hit", 20000000, 4.0, [&](const ray& r) { hit_record rec; return rect_yz.hit(r, 0.001, INF, rec); });
+
+        const ::box cube(point3(-1, -1, -1), point3(1, 1, 1), mat);
+        bench_rays(opts, "box::hit", 5000000, 4.0, [&](const ray& r) { hit_record rec; return cube.hit(r, 0.001, INF, rec); });
+    }
+
+    hittable_objects random_spheres(int count)
+    {
+        hittable_objects objects;
+        const auto mat = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        for (int i = 0; i < count; i++)
+            objects.add(std::make_shared<sphere>(vec3::random(-1, 1), random_double(0.005, 0.03), mat));
+        return objects;
+    }
+
+    void bench_bvh(const bench_options& opts)
+    {
+        for (int count : { 1000, 10000 })
+        {
+            seed_random(BENCH_SEED);
+            const hittable_objects objects = random_spheres(count);
+
+            const std::string build_name = "bvh_node::build/" + std::to_string(count) + "_spheres";
+            const std::string hit_name = "bvh_node::hit/" + std::to_string(count) + "_spheres";
+
+            if (selected(opts, build_name))
+            {
+                const int builds = std::max(1, static_cast<int>((count >= 10000 ? 2 : 20) * opts.m_scale));
+                const auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < builds; i++)
+                {
+                    bvh_node node(objects, 0, 1);
+                    aabb bounds;
+                    node.bounding_box(0, 1, bounds);
+                    g_sink = g_sink + bounds.max().x();
+                }
+                const double seconds = seconds_since(start);
+                report(build_name, builds, seconds, -1);
+            }
+
+            if (selected(opts, hit_name))
+            {
+                seed_random(BENCH_SEED);
+                const bvh_node node(objects, 0, 1);
+                bench_rays(opts, hit_name, 2000000, 3.0, [&](const ray& r) { hit_record rec; return node.hit(r, 0.001, INF, rec); });
+            }
+        }
+
+        if (selected(opts, "bvh_node::hit/final_scene"))
+        {
+            seed_random(BENCH_SEED);
+            const hittable_objects world = final_scene();
+
+            // Rays from around the final scene's camera into the box field.
+            std::vector<ray> rays;
+            for (int i = 0; i < 4096; i++)
+                rays.emplace_back(point3(478, 278, -600) + vec3::random(-50, 50), vec3::random(-1000, 1000) - point3(478, 278, -600));
+
+            const long long calls = static_cast<long long>(2000000 * opts.m_scale);
+            long long hits = 0;
+            const auto start = std::chrono::steady_clock::now();
+            for (long long i = 0; i < calls; i++)
+            {
+                hit_record rec;
+                hits += world.hit(rays[i & 4095], 0.001, INF, rec);
+            }
+            const double seconds = seconds_since(start);
+            g_sink = g_sink + hits;
+            report("bvh_node::hit/final_scene", calls, seconds, calls);
+        }
+    }
+
+    // The same objects traced through bvh_node, flat_bvh and compressed_bvh. Their memory goes to stderr.
+    void bench_accel(const bench_options& opts)
+    {
+        const auto run = [&](const std::string& name, const hittable& world, const std::vector<ray>& rays)
+        {
+            if (!selected(opts, name))
+                return;
+            const long long calls = static_cast<long long>(2000000 * opts.m_scale);
+            long long hits = 0;
+            const auto start = std::chrono::steady_clock::now();
+            for (long long i = 0; i < calls; i++)
+            {
+                hit_record rec;
+                hits += world.hit(rays[i & 4095], 0.001, INF, rec);
+            }
+            const double seconds = seconds_since(start);
+            g_sink = g_sink + hits;
+            report(name, calls, seconds, calls);
+        };
+
+        for (int count : { 1000, 10000 })
+        {
+            seed_random(BENCH_SEED);
+            const hittable_objects objects = random_spheres(count);
+            seed_random(BENCH_SEED);
+            const auto rays = make_rays(4096, 3.0);
+            const std::string suffix = "/" + std::to_string(count) + "_spheres";
+
+            seed_random(BENCH_SEED);
+            const bvh_node node(objects, 0, 1);
+            const flat_bvh flat(objects, 0, 1);
+            const compressed_bvh compressed(flat);
+
+            if (selected(opts, "accel/bvh_node" + suffix) || selected(opts, "accel/flat_bvh" + suffix) || selected(opts, "accel/compressed_bvh" + suffix))
+                std::cerr << "# memory" << suffix << ": bvh_node " << node.node_count() * sizeof(bvh_node)
+                      << " bytes in " << node.node_count() << " nodes, flat_bvh " << flat.memory_bytes()
+                      << " bytes, compressed_bvh " << compressed.memory_bytes() << " bytes\n";
+
+            run("accel/bvh_node" + suffix, node, rays);
+            run("accel/flat_bvh" + suffix, flat, rays);
+            run("accel/compressed_bvh" + suffix, compressed, rays);
+        }
+
+        std::vector<ray> rays;
+        seed_random(BENCH_SEED);
+        for (int i = 0; i < 4096; i++)
+            rays.emplace_back(point3(478, 278, -600) + vec3::random(-50, 50), vec3::random(-1000, 1000) - point3(478, 278, -600));
+
+        for (const auto kind : { accel_kind::bvh, accel_kind::flat, accel_kind::compressed })
+        {
+            static const char* const NAMES[] = { "bvh_node", "flat_bvh", "compressed_bvh" };
+            const std::string name = std::string("accel/") + NAMES[static_cast<int>(kind)] + "/final_scene";
+            if (!selected(opts, name))
+                continue;
+            seed_random(BENCH_SEED);
+            hittable_objects world = final_scene();
+            apply_accel(world, kind, 0, 1);
+            run(name, world, rays);
+        }
+
+        // Object splits only against object plus spatial splits, where large primitives overlap everything:
+        // a huge ground sphere and walls around small spheres and long rotated boxes with inflated bounds.
+        seed_random(BENCH_SEED);
+        hittable_objects overlap;
+        const auto mat = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        overlap.add(std::make_shared<sphere>(point3(0, -1000, 0), 999, mat));
+        overlap.add(std::make_shared<yz_rect>(-3, 3, -3, 3, -2, mat));
+        overlap.add(std::make_shared<xy_rect>(-3, 3, -3, 3, -2, mat));
+        for (int i = 0; i < 2000; i++)
+            overlap.add(std::make_shared<sphere>(vec3::random(-1, 1), random_double(0.005, 0.03), mat));
+        for (int i = 0; i < 200; i++)
+        {
+            std::shared_ptr<hittable> plank = std::make_shared<::box>(point3(-1, 0, 0), point3(1, 0.02, 0.02), mat);
+            plank = std::make_shared<rotate_y>(plank, random_double(20, 70));
+            overlap.add(std::make_shared<translate>(plank, vec3::random(-1, 1)));
+        }
+
+        seed_random(BENCH_SEED);
+        std::vector<ray> overlap_rays;
+        for (int i = 0; i < 4096; i++)
+        {
+            const point3 origin = vec3::random(-1, 1);
+            overlap_rays.emplace_back(origin, random_unit_vector());
+        }
+
+        for (double budget : { 0.0, 0.5 })
+        {
+            const std::string name = budget > 0 ? "accel/sbvh/overlap" : "accel/flat_bvh/overlap";
+            if (!selected(opts, name))
+                continue;
+
+            flat_bvh_settings settings;
+            settings.m_split_budget = budget;
+            const auto build_start = std::chrono::steady_clock::now();
+            const flat_bvh flat(overlap, 0, 1, settings);
+            const double build_seconds = seconds_since(build_start);
+
+            std::cerr << "# " << name << ": " << flat.primitives().size() << " references to " << flat.objects().size()
+                      << " objects, " << flat.nodes().size() << " nodes, built in " << build_seconds * 1000.0 << " ms\n";
+            run(name, flat, overlap_rays);
+        }
+
+        // The built-in scenes with object splits only and with spatial splits, traced with camera rays and one
+        // diffuse bounce from where each of them lands. Reference counts go to stderr.
+        for (int num = 0; num <= 10; num++)
+        {
+            const std::string suffix = "/scene" + std::to_string(num);
+            if (!selected(opts, "accel/flat_bvh" + suffix) && !selected(opts, "accel/sbvh" + suffix))
+                continue;
+
+            seed_random(BENCH_SEED);
+            scene_description scene;
+            if (!load_scene(num, scene))
+                continue;
+
+            const camera cam = scene.make_camera();
+            std::vector<ray> scene_rays;
+            seed_random(BENCH_SEED);
+            while (scene_rays.size() < 4096)
+            {
+                const ray r = cam.get_ray(random_double(), random_double());
+                scene_rays.push_back(r);
+                hit_record rec;
+                if (scene.m_world.hit(r, 0.001, INF, rec))
+                    scene_rays.emplace_back(rec.m_point, rec.m_normal + random_unit_vector(), r.time());
+            }
+            scene_rays.resize(4096);
+
+            for (double budget : { 0.0, 0.5 })
+            {
+                const std::string name = std::string(budget > 0 ? "accel/sbvh" : "accel/flat_bvh") + suffix;
+                if (!selected(opts, name))
+                    continue;
+
+                flat_bvh_settings settings;
+                settings.m_split_budget = budget;
+                hittable_objects world = scene.m_world;
+                apply_accel(world, accel_kind::flat, scene.m_time0, scene.m_time1, settings);
+                for (const flat_bvh* flat : flat_bvhs(world))
+                    std::cerr << "# " << name << ": " << flat->primitives().size() << " references to "
+                              << flat->objects().size() << " objects, " << flat->nodes().size() << " nodes\n";
+                run(name, world, scene_rays);
+            }
+        }
+    }
+
+    // Node orders of one large flat_bvh, traced with more distinct rays than fit in cache. hot_first is
+    // profiled with a separate ray set from the same distribution.
+    void bench_layout(const bench_options& opts)
+    {
+        const std::vector<std::pair<std::string, bvh_layout>> layouts = {
+            { "layout/depth_first/500000_spheres", bvh_layout::depth_first },
+            { "layout/van_emde_boas/500000_spheres", bvh_layout::van_emde_boas },
+            { "layout/hot_first/500000_spheres", bvh_layout::hot_first },
+        };
+
+        bool any = false;
+        for (const auto& layout : layouts)
+            any = any || selected(opts, layout.first);
+        if (!any)
+            return;
+
+        seed_random(BENCH_SEED);
+        hittable_objects objects;
+        const auto mat = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        for (int i = 0; i < 500000; i++)
+            objects.add(std::make_shared<sphere>(vec3::random(-1, 1), random_double(0.0007, 0.004), mat));
+
+        const auto profile_rays = make_rays(1 << 16, 3.0);
+        const auto rays = make_rays(1 << 18, 3.0);
+
+        for (const auto& layout : layouts)
+        {
+            if (!selected(opts, layout.first))
+                continue;
+
+            flat_bvh flat(objects, 0, 1);
+            if (layout.second == bvh_layout::hot_first)
+            {
+                flat.set_profiling(true);
+                for (const ray& r : profile_rays)
+                {
+                    hit_record rec;
+                    flat.hit(r, 0.001, INF, rec);
+                }
+            }
+
+            const auto layout_start = std::chrono::steady_clock::now();
+            flat.reorder(layout.second);
+            flat.set_profiling(false);
+            std::cerr << "# " << layout.first << ": " << flat.nodes().size() << " nodes laid out in "
+                      << seconds_since(layout_start) * 1000.0 << " ms\n";
+
+            const long long calls = static_cast<long long>(1000000 * opts.m_scale);
+            long long hits = 0;
+            const auto start = std::chrono::steady_clock::now();
+            for (long long i = 0; i < calls; i++)
+            {
+                hit_record rec;
+                hits += flat.hit(rays[i & (rays.size() - 1)], 0.001, INF, rec);
+            }
+            const double seconds = seconds_since(start);
+            g_sink = g_sink + hits;
+            report(layout.first, calls, seconds, calls);
+        }
+    }
+
+    // Spheres that each travel a random distance of up to `travel` over the shutter [0, 1].
+    // The swept-box bvh_node and the interpolating motion_bvh_node are traced with the same timed rays.
+    void bench_motion(const bench_options& opts)
+    {
+        for (double travel : { 0.05, 0.5 })
+        {
+            seed_random(BENCH_SEED);
+            hittable_objects objects;
+            const auto mat = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
+            for (int i = 0; i < 10000; i++)
+            {
+                const point3 center0 = vec3::random(-1, 1);
+                const point3 center1 = center0 + travel * vec3::random(-1, 1);
+                objects.add(std::make_shared<moving_sphere>(center0, center1, 0.0, 1.0, random_double(0.005, 0.03), mat));
+            }
+
+            std::vector<ray> rays;
+            for (int i = 0; i < 4096; i++)
+            {
+                const point3 origin = vec3::random(-3, 3);
+                rays.emplace_back(origin, vec3::random(-1, 1) - origin, random_double());
+            }
+
+            const std::string suffix = "/10000_spheres_travel_" + std::to_string(travel).substr(0, 4);
+            const auto run = [&](const std::string& name, const hittable& node)
+            {
+                if (!selected(opts, name))
+                    return;
+                const long long calls = static_cast<long long>(1000000 * opts.m_scale);
+                long long hits = 0;
+                const auto start = std::chrono::steady_clock::now();
+                for (long long i = 0; i < calls; i++)
+                {
+                    hit_record rec;
+                    hits += node.hit(rays[i & 4095], 0.001, INF, rec);
+                }
+                const double seconds = seconds_since(start);
+                g_sink = g_sink + hits;
+                report(name, calls, seconds, calls);
+            };
+
+            seed_random(BENCH_SEED);
+            run("bvh_node::hit" + suffix, bvh_node(objects, 0, 1));
+            seed_random(BENCH_SEED);
+            run("motion_bvh_node::hit" + suffix, motion_bvh_node(objects, 0, 1));
+        }
+    }
+
+    void bench_materials(const bench_options& opts)
+    {
+        const std::vector<std::pair<std::string, std::shared_ptr<material>>> materials = {
+            { "lambertian::scatter", std::make_shared<lambertian>(color(0.5, 0.5, 0.5)) },
+            { "metal::scatter",      std::make_shared<metal>(color(0.8, 0.6, 0.2)) },
+            { "dielectric::scatter", std::make_shared<dielectric>(1.5) },
+            { "isotropic::scatter",  std::make_shared<isotropic>(color(0.5, 0.5, 0.5)) },
+        };
+
+        for (const auto& entry : materials)
+        {
+            const std::string& name = entry.first;
+            const std::shared_ptr<material>& mat = entry.second;
+
+            const sphere ball(point3(0, 0, 0), 1.0, mat);
+            hit_record rec;
+            ray r(point3(0.3, 0.2, -3), vec3(0, 0, 1));
+            ball.hit(r, 0.001, INF, rec);
+
+            bench_rays(opts, name, 10000000, 4.0, [&](const ray&)
+            {
+                color attenuation;
+                ray scattered;
+                const bool did = mat->scatter(r, rec, attenuation, scattered);
+                g_sink = g_sink + scattered.dir().x();
+                return did;
+            }, false);
+
+            // Same call through the kind switch, as the integrator makes it.
+            bench_rays(opts, name + "/dispatch", 10000000, 4.0, [&](const ray&)
+            {
+                color attenuation;
+                ray scattered;
+                const bool did = scatter_material(*mat, r, rec, attenuation, scattered);
+                g_sink = g_sink + scattered.dir().x();
+                return did;
+            }, false);
+        }
+    }
+
+    // Full paths through ray_color on a small image of each built-in scene.
+    // Builds final_scene() (400 boxes of 6 rects each, plus a BVH) with every object on the heap
+    // and with the scene arena. Heap traffic per build goes to stderr so the CSV stays uniform.
+    void bench_scene_build(const bench_options& opts)
+    {
+        for (const bool use_arena : { false, true })
+        {
+            const std::string name = std::string("scene_build/final_scene/") + (use_arena ? "arena" : "heap");
+            if (!selected(opts, name))
+                continue;
+
+            const int builds = std::max(1, static_cast<int>(50 * opts.m_scale));
+            size_t allocations = 0;
+            size_t bytes = 0;
+            size_t arena_used = 0;
+            size_t arena_reserved = 0;
+            double seconds = 0.0;
+            for (int i = 0; i < builds; i++)
+            {
+                seed_random(BENCH_SEED);
+                const size_t allocations_before = g_heap_allocations;
+                const size_t bytes_before = g_heap_bytes;
+                const auto start = std::chrono::steady_clock::now();
+                {
+                    std::unique_ptr<scene_arena::scope> arena(use_arena ? new scene_arena::scope() : nullptr);
+                    hittable_objects world = final_scene();
+                    g_sink = g_sink + static_cast<double>(world.get_m_objects().size());
+                    arena_used += arena ? arena->arena().bytes_used() : 0;
+                    arena_reserved += arena ? arena->arena().bytes_reserved() : 0;
+                }
+                seconds += seconds_since(start);
+                allocations += g_heap_allocations - allocations_before;
+                bytes += g_heap_bytes - bytes_before;
+            }
+
+            report(name, builds, seconds, -1);
+            std::cerr << "# " << name << ": " << allocations / builds << " heap allocations, "
+                      << bytes / builds << " bytes per build";
+            if (use_arena)
+                std::cerr << " (" << arena_used / builds << " bytes of objects in " << arena_reserved / builds
+                          << " bytes of arena chunks)";
+            std::cerr << std::endl;
+        }
+    }
+
+    void bench_scenes(const bench_options& opts)
+    {
+        const char* names[] = { "materials", "cornell_box_with_smokes", "final_scene" };
+
+        for (int num = 0; num < 3; num++)
+        {
+            const std::string name = std::string("ray_color/") + names[num];
+            if (!selected(opts, name))
+                continue;
+
+            seed_random(BENCH_SEED);
+            scene_description scene;
+            load_scene(num, scene);
+
+            const int width = 64;
+            const int height = static_cast<int>(width / scene.m_aspect_ratio);
+            const int spp = std::max(1, static_cast<int>(8 * opts.m_scale));
+            const camera cam = scene.make_camera();
+            const counting_hittable world(scene.m_world);
+
+            seed_random(BENCH_SEED);
+            color sum(0, 0, 0);
+            const auto start = std::chrono::steady_clock::now();
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                    for (int s = 0; s < spp; s++)
+                    {
+                        const ray r = cam.get_ray((i + random_double()) / (width - 1), (j + random_double()) / (height - 1));
+                        sum += ray_color(r, scene.m_background, world, 50, scene.lights());
+                    }
+            const double seconds = seconds_since(start);
+
+            g_sink = g_sink + sum.x();
+            report(name, static_cast<long long>(width) * height * spp, seconds, world.m_rays);
+        }
+    }
+
+    // Traces the same camera rays of each built-in scene path by path, bounce by bounce in pixel order, and
+    // bounce by bounce with secondary rays sorted; the speedup of sorting over unsorted batches goes to stderr.
+    void bench_trace_order(const bench_options& opts)
+    {
+        // The million sphere field is the one scene whose BVH does not fit in cache.
+        const std::pair<int, const char*> scenes[] = {
+            { 0, "materials" }, { 1, "cornell_box_with_smokes" }, { 2, "final_scene" }, { 3, "cornell_box_with_grid_smoke" },
+            { 4, "textured_spheres" }, { 5, "motion_blur" }, { 6, "orbiting_spheres" }, { 7, "sun_sky" },
+            { 10, "sphere_field" } };
+        const std::pair<trace_order, const char*> orders[] = {
+            { trace_order::recursive, "recursive" }, { trace_order::batched, "batched" }, { trace_order::sorted, "sorted" } };
+
+        for (const auto& scene_name : scenes)
+        {
+            const char* scene_label = scene_name.second;
+            bool any = false;
+            for (const auto& order : orders)
+                any = any || selected(opts, std::string("trace/") + order.second + "/" + scene_label);
+            if (!any)
+                continue;
+
+            seed_random(BENCH_SEED);
+            scene_description scene;
+            load_scene(scene_name.first, scene);
+
+            const int width = 64;
+            const int height = static_cast<int>(width / scene.m_aspect_ratio);
+            const int spp = std::max(1, static_cast<int>(16 * opts.m_scale));
+            const camera cam = scene.make_camera();
+            const counting_hittable world(scene.m_world);
+
+            aabb bounds;
+            scene.m_world.bounding_box(scene.m_time0, scene.m_time1, bounds);
+
+            seed_random(BENCH_SEED);
+            std::vector<ray> camera_rays;
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                    for (int s = 0; s < spp; s++)
+                        camera_rays.push_back(cam.get_ray((i + random_double()) / (width - 1), (j + random_double()) / (height - 1)));
+
+            double batched_rate = 0.0;
+            for (const auto& order : orders)
+            {
+                const std::string name = std::string("trace/") + order.second + "/" + scene_label;
+                if (!selected(opts, name))
+                    continue;
+
+                world.m_rays = 0;
+                seed_random(BENCH_SEED);
+                color sum(0, 0, 0);
+                const auto start = std::chrono::steady_clock::now();
+                if (order.first == trace_order::recursive)
+                {
+                    for (const ray& r : camera_rays)
+                        sum += ray_color(r, scene.m_background, world, 50, scene.lights());
+                }
+                else
+                {
+                    std::vector<path_state> paths;
+                    paths.reserve(camera_rays.size());
+                    for (const ray& r : camera_rays)
+                        paths.emplace_back(r);
+                    trace_paths(paths, world, scene.m_background, scene.lights(), nullptr, 50, BENCH_SEED, order.first, bounds);
+                    for (const path_state& path : paths)
+                        sum += path.m_radiance;
+                }
+                const double seconds = seconds_since(start);
+
+                g_sink = g_sink + sum.x();
+                report(name, static_cast<long long>(camera_rays.size()), seconds, world.m_rays);
+
+                const double rate = world.m_rays / seconds;
+                if (order.first == trace_order::batched)
+                    batched_rate = rate;
+                else if (order.first == trace_order::sorted && batched_rate > 0)
+                    std::cerr << "# trace/" << scene_label << ": sorting secondary rays runs at " << std::setprecision(2)
+                              << rate / batched_rate << "x the rays/s of unsorted batches" << std::endl;
+            }
+        }
+    }
+
+    // Sampling cost of an environment map, and the error left at a fixed sample count when the sun and sky
+    // scene is lit by sampling the map uniformly or by its luminance; the RMS errors go to stderr.
+    void bench_environment(const bench_options& opts)
+    {
+        if (selected(opts, "environment/sample"))
+        {
+            const auto env = environment_map::sun_sky(1024, 35.0, 120.0, 1.5, 2000.0);
+            const long long calls = std::max(1LL, static_cast<long long>(5000000 * opts.m_scale));
+            seed_random(BENCH_SEED);
+            double sum = 0.0;
+            const auto start = std::chrono::steady_clock::now();
+            for (long long i = 0; i < calls; i++)
+            {
+                vec3 dir;
+                sum += env->sample(random_double(), random_double(), dir) + dir.y();
+            }
+            g_sink = g_sink + sum;
+            report("environment/sample", calls, seconds_since(start), -1);
+        }
+
+        const bool uniform = selected(opts, "environment/uniform/sun_sky");
+        const bool importance = selected(opts, "environment/importance/sun_sky");
+        if (!uniform && !importance)
+            return;
+
+        seed_random(BENCH_SEED);
+        scene_description scene;
+        load_scene(7, scene);
+
+        const int width = 48;
+        const int height = static_cast<int>(width / scene.m_aspect_ratio);
+        const camera cam = scene.make_camera();
+        const counting_hittable world(scene.m_world);
+
+        const auto render = [&](int spp, std::vector<color>& image)
+        {
+            image.assign(static_cast<size_t>(width) * height, color(0, 0, 0));
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                {
+                    color& pixel = image[static_cast<size_t>(j) * width + i];
+                    for (int s = 0; s < spp; s++)
+                    {
+                        const ray r = cam.get_ray((i + random_double()) / (width - 1), (j + random_double()) / (height - 1));
+                        pixel += ray_color(r, scene.m_background, world, 50, scene.lights());
+                    }
+                    pixel /= spp;
+                }
+        };
+
+        std::vector<color> reference;
+        seed_random(BENCH_SEED + 1);
+        render(std::max(16, static_cast<int>(1024 * opts.m_scale)), reference);
+
+        for (const bool importance_sampled : { false, true })
+        {
+            const std::string name = std::string("environment/") + (importance_sampled ? "importance" : "uniform") + "/sun_sky";
+            if (!selected(opts, name))
+                continue;
+
+            scene.m_environment->set_importance_sampling(importance_sampled);
+            const int spp = 16;
+            std::vector<color> image;
+            world.m_rays = 0;
+            seed_random(BENCH_SEED);
+            const auto start = std::chrono::steady_clock::now();
+            render(spp, image);
+            const double seconds = seconds_since(start);
+
+            double squared_error = 0.0;
+            for (size_t p = 0; p < image.size(); p++)
+            {
+                const vec3 d = image[p] - reference[p];
+                squared_error += dot(d, d) / 3;
+            }
+            report(name, static_cast<long long>(width) * height * spp, seconds, world.m_rays);
+            std::cerr << "# " << name << ": RMS error " << sqrt(squared_error / image.size()) << " at " << spp << " spp" << std::endl;
+        }
+    }
+
+    // Cost of picking a light among 1000 to 100000 emitters scattered through a cube, and the error left at a
+    // fixed sample count in the many lights scene without direct light sampling, with lights picked uniformly
+    // and with the light BVH; the RMS errors go to stderr.
+    void bench_lights(const bench_options& opts)
+    {
+        for (const int count : { 1000, 10000, 100000 })
+        {
+            const std::string name = "lights/sample/" + std::to_string(count);
+            if (!selected(opts, name))
+                continue;
+
+            seed_random(BENCH_SEED);
+            hittable_objects emitters;
+            for (int i = 0; i < count; i++)
+            {
+                const point3 corner(random_double(0, 1000), random_double(0, 1000), random_double(0, 1000));
+                emitters.add(std::make_shared<xz_rect>(corner.x(), corner.x() + 2, corner.z(), corner.z() + 2, corner.y(),
+                                                       std::make_shared<diffuse_light>(color::random(0.1, 10.0))));
+            }
+            const light_bvh lights(emitters, light_sampling::bvh);
+
+            const long long calls = std::max(1LL, static_cast<long long>(2000000 * opts.m_scale));
+            double sum = 0.0;
+            const auto start = std::chrono::steady_clock::now();
+            for (long long i = 0; i < calls; i++)
+            {
+                const point3 p(random_double(0, 1000), random_double(0, 1000), random_double(0, 1000));
+                double pmf = 0.0;
+                const hittable* light = lights.sample(p, vec3(0, 1, 0), random_double(), pmf);
+                sum += pmf + (light ? 1.0 : 0.0);
+            }
+            g_sink = g_sink + sum;
+            report(name, calls, seconds_since(start), -1);
+        }
+
+        const std::pair<light_sampling, const char*> modes[] = {
+            { light_sampling::none, "none" }, { light_sampling::uniform, "uniform" }, { light_sampling::bvh, "bvh" } };
+        bool any = false;
+        for (const auto& mode : modes)
+            any = any || selected(opts, std::string("lights/") + mode.second + "/many_lights");
+        if (!any)
+            return;
+
+        seed_random(BENCH_SEED);
+        scene_description scene;
+        load_scene(8, scene);
+
+        const int width = 48;
+        const int height = static_cast<int>(width / scene.m_aspect_ratio);
+        const camera cam = scene.make_camera();
+        const counting_hittable world(scene.m_world);
+
+        // Camera rays go through pixel centres: the lights seen directly would otherwise leave edge noise
+        // that no light sampling can remove.
+        const auto render = [&](int spp, std::vector<color>& image)
+        {
+            image.assign(static_cast<size_t>(width) * height, color(0, 0, 0));
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                {
+                    color& pixel = image[static_cast<size_t>(j) * width + i];
+                    for (int s = 0; s < spp; s++)
+                    {
+                        const ray r = cam.get_ray((i + 0.5) / (width - 1), (j + 0.5) / (height - 1));
+                        pixel += ray_color(r, scene.m_background, world, 50, scene.lights());
+                    }
+                    pixel /= spp;
+                }
+        };
+
+        std::vector<color> reference;
+        scene.m_emitters = std::make_shared<light_bvh>(scene.m_world, light_sampling::bvh);
+        seed_random(BENCH_SEED + 1);
+        render(std::max(16, static_cast<int>(512 * opts.m_scale)), reference);
+
+        for (const auto& mode : modes)
+        {
+            const std::string name = std::string("lights/") + mode.second + "/many_lights";
+            if (!selected(opts, name))
+                continue;
+
+            scene.m_emitters = mode.first == light_sampling::none ? nullptr : std::make_shared<light_bvh>(scene.m_world, mode.first);
+            const int spp = 16;
+            std::vector<color> image;
+            world.m_rays = 0;
+            seed_random(BENCH_SEED);
+            const auto start = std::chrono::steady_clock::now();
+            render(spp, image);
+            const double seconds = seconds_since(start);
+
+            double squared_error = 0.0;
+            for (size_t p = 0; p < image.size(); p++)
+            {
+                const vec3 d = image[p] - reference[p];
+                squared_error += dot(d, d) / 3;
+            }
+            report(name, static_cast<long long>(width) * height * spp, seconds, world.m_rays);
+            std::cerr << "# " << name << ": RMS error " << sqrt(squared_error / image.size()) << " at " << spp << " spp" << std::endl;
+        }
+    }
+
+    // Path guiding in the smoke-filled Cornell box, lit only through its one ceiling light: the time to train
+    // a guiding_field over six doubling passes, and the error left at a fixed sample count without and with
+    // it; the RMS errors go to stderr.
+    void bench_guiding(const bench_options& opts)
+    {
+        const char* names[] = { "guiding/train/cornell_box_with_smokes", "guiding/off/cornell_box_with_smokes",
+                                "guiding/on/cornell_box_with_smokes" };
+        bool any = false;
+        for (const char* name : names)
+            any = any || selected(opts, name);
+        if (!any)
+            return;
+
+        seed_random(BENCH_SEED);
+        scene_description scene;
+        load_scene(1, scene);
+
+        const int width = 48;
+        const int height = static_cast<int>(width / scene.m_aspect_ratio);
+        const camera cam = scene.make_camera();
+        const counting_hittable world(scene.m_world);
+
+        const auto render = [&](int spp, const guiding_field* guide, std::vector<color>& image)
+        {
+            image.assign(static_cast<size_t>(width) * height, color(0, 0, 0));
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                {
+                    color& pixel = image[static_cast<size_t>(j) * width + i];
+                    for (int s = 0; s < spp; s++)
+                    {
+                        const ray r = cam.get_ray((i + random_double()) / (width - 1), (j + random_double()) / (height - 1));
+                        pixel += ray_color(r, scene.m_background, world, 50, scene.lights(), guide);
+                    }
+                    pixel /= spp;
+                }
+        };
+
+        std::vector<color> reference;
+        seed_random(BENCH_SEED + 1);
+        render(std::max(16, static_cast<int>(2048 * opts.m_scale)), nullptr, reference);
+
+        aabb bounds;
+        scene.m_world.bounding_box(scene.m_time0, scene.m_time1, bounds);
+        guiding_field guide(bounds);
+        guide.set_recording(true);
+        std::vector<color> image;
+        world.m_rays = 0;
+        seed_random(BENCH_SEED + 2);
+        const auto train_start = std::chrono::steady_clock::now();
+        for (int pass = 0; pass < 6; pass++)
+        {
+            render(1 << pass, &guide, image);
+            guide.refine(pass);
+        }
+        guide.set_recording(false);
+        if (selected(opts, names[0]))
+        {
+            report(names[0], static_cast<long long>(width) * height * 63, seconds_since(train_start), world.m_rays);
+            std::cerr << "# " << names[0] << ": " << guide.leaf_count() << " regions, " << guide.memory_bytes() / 1024 << " KiB" << std::endl;
+        }
+
+        for (const bool guided : { false, true })
+        {
+            const char* name = names[guided ? 2 : 1];
+            if (!selected(opts, name))
+                continue;
+
+            const int spp = 32;
+            world.m_rays = 0;
+            seed_random(BENCH_SEED);
+            const auto start = std::chrono::steady_clock::now();
+            render(spp, guided ? &guide : nullptr, image);
+            const double seconds = seconds_since(start);
+
+            double squared_error = 0.0;
+            for (size_t p = 0; p < image.size(); p++)
+            {
+                const vec3 d = image[p] - reference[p];
+                squared_error += dot(d, d) / 3;
+            }
+            report(name, static_cast<long long>(width) * height * spp, seconds, world.m_rays);
+            std::cerr << "# " << name << ": RMS error " << sqrt(squared_error / image.size()) << " at " << spp << " spp" << std::endl;
+        }
+    }
+
+    // Caustic photons in the caustics scene, lit through a light BVH: the time to trace one pass of photons
+    // and to gather them at a point, and the error left at a fixed sample count without and with them, spread
+    // over four photon passes; the RMS errors go to stderr.
+    void bench_photons(const bench_options& opts)
+    {
+        const char* names[] = { "photons/trace/caustics", "photons/gather/caustics", "photons/off/caustics",
+                                "photons/on/caustics" };
+        bool any = false;
+        for (const char* name : names)
+            any = any || selected(opts, name);
+        if (!any)
+            return;
+
+        seed_random(BENCH_SEED);
+        scene_description scene;
+        load_scene(9, scene);
+        scene.m_emitters = std::make_shared<light_bvh>(scene.m_world, light_sampling::bvh);
+
+        const int photons_per_pass = std::max(1000, static_cast<int>(100000 * opts.m_scale));
+        const caustic_photons caustics(scene.m_world, scene.m_background, nullptr, scene.m_time0, photons_per_pass, 0.0, BENCH_SEED);
+
+        const auto trace_start = std::chrono::steady_clock::now();
+        const std::shared_ptr<const photon_map> first_map = caustics.pass(0);
+        const photon_map& first = *first_map;
+        if (selected(opts, names[0]))
+        {
+            report(names[0], photons_per_pass, seconds_since(trace_start), -1);
+            std::cerr << "# " << names[0] << ": " << first.size() << " photons stored, " << first.memory_bytes() / 1024
+                      << " KiB" << std::endl;
+        }
+
+        if (selected(opts, names[1]))
+        {
+            const long long calls = std::max(1LL, static_cast<long long>(2000000 * opts.m_scale));
+            seed_random(BENCH_SEED);
+            double sum = 0.0;
+            const auto start = std::chrono::steady_clock::now();
+            for (long long i = 0; i < calls; i++)
+                sum += first.irradiance(point3(random_double(0, 555), 0, random_double(0, 555)), vec3(0, 1, 0)).x();
+            g_sink = g_sink + sum;
+            report(names[1], calls, seconds_since(start), -1);
+        }
+
+        const int width = 48;
+        const int height = static_cast<int>(width / scene.m_aspect_ratio);
+        const camera cam = scene.make_camera();
+        const counting_hittable world(scene.m_world);
+
+        // Each of `passes` passes renders its share of the samples with the photons of that pass, if any. Camera
+        // rays go through pixel centres, as the edges of the small, bright light would otherwise dominate the error.
+        const auto render = [&](int spp, int passes, const caustic_photons* photons, std::vector<color>& image)
+        {
+            image.assign(static_cast<size_t>(width) * height, color(0, 0, 0));
+            for (int pass = 0; pass < passes; pass++)
+            {
+                scene_lights lights = scene.lights();
+                const std::shared_ptr<const photon_map> map = photons ? photons->pass(pass) : nullptr;
+                lights.m_caustics = map.get();
+                for (int j = 0; j < height; j++)
+                    for (int i = 0; i < width; i++)
+                    {
+                        color& pixel = image[static_cast<size_t>(j) * width + i];
+                        for (int s = 0; s < spp / passes; s++)
+                        {
+                            const ray r = cam.get_ray((i + 0.5) / (width - 1), (j + 0.5) / (height - 1));
+                            pixel += ray_color(r, scene.m_background, world, 50, lights) / spp;
+                        }
+                    }
+            }
+        };
+
+        std::vector<color> reference;
+        seed_random(BENCH_SEED + 1);
+        render(std::max(16, static_cast<int>(2048 * opts.m_scale)), 1, nullptr, reference);
+
+        for (const bool with_photons : { false, true })
+        {
+            const char* name = names[with_photons ? 3 : 2];
+            if (!selected(opts, name))
+                continue;
+
+            const int spp = 128;
+            std::vector<color> image;
+            world.m_rays = 0;
+            seed_random(BENCH_SEED);
+            const auto start = std::chrono::steady_clock::now();
+            render(spp, 4, with_photons ? &caustics : nullptr, image);
+            const double seconds = seconds_since(start);
+
+            double squared_error = 0.0;
+            for (size_t p = 0; p < image.size(); p++)
+            {
+                const vec3 d = image[p] - reference[p];
+                squared_error += dot(d, d) / 3;
+            }
+            report(name, static_cast<long long>(width) * height * spp, seconds, world.m_rays);
+            std::cerr << "# " << name << ": RMS error " << sqrt(squared_error / image.size()) << " at " << spp << " spp" << std::endl;
+        }
+    }
+
+    // The radiance cache in the smoke-filled Cornell box: the time to fill four passes of it, and the rays traced
+    // and error left at a fixed sample count with paths ending in it after their first diffuse hit, and without
+    // it; the RMS errors go to stderr.
+    void bench_radiance_cache(const bench_options& opts)
+    {
+        const char* names[] = { "radiance_cache/fill/cornell_box_with_smokes", "radiance_cache/off/cornell_box_with_smokes",
+                                "radiance_cache/on/cornell_box_with_smokes" };
+        bool any = false;
+        for (const char* name : names)
+            any = any || selected(opts, name);
+        if (!any)
+            return;
+
+        seed_random(BENCH_SEED);
+        scene_description scene;
+        load_scene(1, scene);
+
+        render_settings settings;
+        settings.m_image_width = 48;
+        settings.m_image_height = static_cast<int>(settings.m_image_width / scene.m_aspect_ratio);
+        settings.m_seed = BENCH_SEED;
+        settings.m_cache_paths = 16384;  // fewer would leave most cells below radiance_cache::MIN_SAMPLES
+        aabb bounds;
+        scene.m_world.bounding_box(scene.m_time0, scene.m_time1, bounds);
+        scene.m_radiance = std::make_shared<radiance_cache_passes>((bounds.max() - bounds.min()).length() / 128, 1,
+                                                                   settings.m_cache_paths);
+
+        constexpr int FILL_PASSES = 4;
+        const auto fill_start = std::chrono::steady_clock::now();
+        std::shared_ptr<const radiance_cache> filled;
+        for (int pass = 0; pass < FILL_PASSES; pass++)
+            filled = radiance_cache_pass(scene, settings, pass);
+        const radiance_cache& cache = *filled;
+        if (selected(opts, names[0]))
+        {
+            report(names[0], static_cast<long long>(FILL_PASSES) * settings.m_cache_paths, seconds_since(fill_start), -1);
+            std::cerr << "# " << names[0] << ": " << cache.size() << " cells, " << cache.memory_bytes() / 1024 << " KiB" << std::endl;
+        }
+
+        const int width = settings.m_image_width;
+        const int height = settings.m_image_height;
+        const camera cam = scene.make_camera();
+        const counting_hittable world(scene.m_world);
+
+        const auto render = [&](int spp, const radiance_cache* radiance, std::vector<color>& image)
+        {
+            scene_lights lights = scene.lights();
+            lights.m_radiance = radiance;
+            lights.m_radiance_bounces = 1;
+            image.assign(static_cast<size_t>(width) * height, color(0, 0, 0));
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                {
+                    color& pixel = image[static_cast<size_t>(j) * width + i];
+                    for (int s = 0; s < spp; s++)
+                    {
+                        const ray r = cam.get_ray((i + random_double()) / (width - 1), (j + random_double()) / (height - 1));
+                        pixel += ray_color(r, scene.m_background, world, 50, lights);
+                    }
+                    pixel /= spp;
+                }
+        };
+
+        std::vector<color> reference;
+        seed_random(BENCH_SEED + 1);
+        render(std::max(16, static_cast<int>(2048 * opts.m_scale)), nullptr, reference);
+
+        for (const bool cached : { false, true })
+        {
+            const char* name = names[cached ? 2 : 1];
+            if (!selected(opts, name))
+                continue;
+
+            const int spp = 32;
+            std::vector<color> image;
+            world.m_rays = 0;
+            seed_random(BENCH_SEED);
+            const auto start = std::chrono::steady_clock::now();
+            render(spp, cached ? &cache : nullptr, image);
+            const double seconds = seconds_since(start);
+
+            double squared_error = 0.0;
+            for (size_t p = 0; p < image.size(); p++)
+            {
+                const vec3 d = image[p] - reference[p];
+                squared_error += dot(d, d) / 3;
+            }
+            const long long samples = static_cast<long long>(width) * height * spp;
+            report(name, samples, seconds, world.m_rays);
+            std::cerr << "# " << name << ": RMS error " << sqrt(squared_error / image.size()) << " at " << spp << " spp, "
+                      << std::setprecision(3) << static_cast<double>(world.m_rays) / samples << " rays per sample" << std::endl;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    bench_options opts;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--quick"))
+            opts.m_scale = 0.1;
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+            opts.m_filter = argv[++i];
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--quick] [--filter <substring>]\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::cout << "benchmark,calls,ns_per_call,mrays_per_s" << std::endl;
+
+    bench_primitives(opts);
+    bench_bvh(opts);
+    bench_accel(opts);
+    bench_layout(opts);
+    bench_motion(opts);
+    bench_materials(opts);
+    bench_scene_build(opts);
+    bench_scenes(opts);
+    bench_trace_order(opts);
+    bench_environment(opts);
+    bench_lights(opts);
+    bench_guiding(opts);
+    bench_photons(opts);
+    bench_radiance_cache(opts);
+
+    return EXIT_SUCCESS;
+}
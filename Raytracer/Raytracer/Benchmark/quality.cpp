@@ -0,0 +1,201 @@
+// Time-to-quality benchmark: how soon the integrator gets a clean image, not just how fast it traces rays.
+//
+// Scenes 0, 1 and 2 are rendered at a small size in steps of 1, 2, 4, ... samples per pixel, each step with a
+// fixed seed of its own, until the time budget of the scene is spent. After every step the accumulated image is
+// compared with a stored high sample count reference, and a row of the error-vs-time curve is printed as CSV:
+//
+//     scene,spp,seconds,rmse,relmse
+//
+// seconds is the wall-clock render time so far, on the one render thread. rmse is the root mean squared error of
+// the linear radiance, and relmse the mean of (image - reference)^2 / (reference^2 + 0.01) over pixels and
+// channels, which weighs errors in dark regions as much as in bright ones. For a given commit the errors of a step
+// are always the same, so convergence changes show up in them and speed changes in the seconds.
+//
+// Usage: raytracer_quality [--budget <seconds>] [--scene <n>] [--references <dir>]
+//        raytracer_quality --write-references [--reference-spp <n>] [--scene <n>] [--references <dir>]
+
+#include "render.h"
+#include "scenes.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef RAYTRACER_REFERENCE_DIR
+#define RAYTRACER_REFERENCE_DIR "references"
+#endif
+
+namespace
+{
+    const unsigned int QUALITY_SEED = 1234;
+    const unsigned int REFERENCE_SEED = 4321;
+    const int QUALITY_WIDTH = 64;
+    const int MAX_STEPS = 16;  // at most 2^16 - 1 samples per pixel
+
+    struct quality_options
+    {
+        double m_budget = 8.0;  // seconds per scene
+        int m_scene = -1;       // all of 0, 1 and 2
+        std::string m_references = RAYTRACER_REFERENCE_DIR;
+        bool m_write_references = false;
+        int m_reference_spp = 16384;
+    };
+
+    std::string reference_path(const quality_options& opts, int scene)
+    {
+        return opts.m_references + "/scene" + std::to_string(scene) + ".pfm";
+    }
+
+    // Scenes are always built with QUALITY_SEED, since some of them place their objects at random.
+    bool load_quality_scene(int num, int samples_per_pixel, render_settings& settings, scene_description& scene)
+    {
+        settings = render_settings();
+        settings.m_scene = num;
+        settings.m_seed = QUALITY_SEED;
+        settings.m_samples_per_pixel = samples_per_pixel;
+        if (!load_render_scene(settings, scene))
+            return false;
+        settings.m_image_width = QUALITY_WIDTH;
+        settings.m_image_height = static_cast<int>(QUALITY_WIDTH / scene.m_aspect_ratio);
+        return true;
+    }
+
+    // Renders the scene with opts.m_reference_spp samples per pixel, in passes of at most 256, and stores it.
+    bool write_reference(const quality_options& opts, int num)
+    {
+        render_settings settings;
+        scene_description scene;
+        if (!load_quality_scene(num, opts.m_reference_spp, settings, scene))
+            return false;
+        settings.m_seed = REFERENCE_SEED;
+        settings.m_passes = std::max(1, opts.m_reference_spp / 256);
+
+        render_control control;
+        control.m_tile_done = [num](const image_tile&, int tiles_done, int tile_count)
+        {
+            std::cerr << "\rScene " << num << ": tiles remaining: " << tile_count - tiles_done << ' ' << std::flush;
+        };
+        framebuffer fb(settings.m_image_width, settings.m_image_height);
+        render_local(scene, settings, fb, control);
+
+        const std::string path = reference_path(opts, num);
+        std::ofstream ofs(path, std::ios::binary);
+        fb.write_pfm(ofs);
+        if (!ofs)
+        {
+            std::cerr << "Cannot write " << path << ".\n";
+            return false;
+        }
+        std::cerr << "\nWrote " << path << std::endl;
+        return true;
+    }
+
+    bool measure(const quality_options& opts, int num)
+    {
+        const std::string path = reference_path(opts, num);
+        std::ifstream ifs(path, std::ios::binary);
+        int width = 0, height = 0;
+        std::vector<float> reference;
+        if (!ifs || !environment_map::read_pfm(ifs, width, height, reference))
+        {
+            std::cerr << "Cannot read reference " << path << "; create it with --write-references.\n";
+            return false;
+        }
+
+        render_settings settings;
+        scene_description scene;
+        if (!load_quality_scene(num, 1, settings, scene))
+            return false;
+        if (width != settings.m_image_width || height != settings.m_image_height)
+        {
+            std::cerr << "Reference " << path << " is " << width << "x" << height << ", not " << settings.m_image_width
+                      << "x" << settings.m_image_height << ".\n";
+            return false;
+        }
+
+        const camera cam = make_render_camera(scene, settings);
+        const std::vector<image_tile> tiles = make_tiles(width, height, settings.m_tile_size);
+        framebuffer fb(width, height);
+        std::vector<float> sums;
+        double seconds = 0.0;
+        int spp = 0;
+
+        for (int step = 0; step < MAX_STEPS && seconds < opts.m_budget; step++)
+        {
+            settings.m_samples_per_pixel = 1 << step;
+            settings.m_seed = mix_seed(QUALITY_SEED + step);
+
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t t = 0; t < tiles.size(); t++)
+            {
+                render_tile(scene, cam, settings, tiles, static_cast<int>(t), 0, sums);
+                fb.add_tile(tiles[t], sums.data(), settings.m_samples_per_pixel);
+            }
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            spp += settings.m_samples_per_pixel;
+
+            // The reference's rows run from the top, the framebuffer's from the bottom.
+            double squared = 0.0, relative = 0.0;
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                {
+                    const color c = fb.pixel(i, j);
+                    const float* r = &reference[3 * (static_cast<size_t>(height - 1 - j) * width + i)];
+                    for (int a = 0; a < 3; a++)
+                    {
+                        const double d = c[a] - r[a];
+                        squared += d * d;
+                        relative += d * d / (static_cast<double>(r[a]) * r[a] + 0.01);
+                    }
+                }
+            const double count = 3.0 * width * height;
+
+            std::cout << num << ',' << spp << ',' << std::fixed << std::setprecision(3) << seconds << ','
+                      << std::setprecision(6) << sqrt(squared / count) << ',' << relative / count << std::endl;
+        }
+        return true;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    quality_options opts;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--budget") && has_value)
+            opts.m_budget = std::max(atof(argv[++i]), 0.0);
+        else if (!strcmp(argv[i], "--scene") && has_value)
+            opts.m_scene = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--references") && has_value)
+            opts.m_references = argv[++i];
+        else if (!strcmp(argv[i], "--write-references"))
+            opts.m_write_references = true;
+        else if (!strcmp(argv[i], "--reference-spp") && has_value)
+            opts.m_reference_spp = std::max(atoi(argv[++i]), 1);
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--budget <seconds>] [--scene <n>] [--references <dir>]\n"
+                      << "       " << argv[0] << " --write-references [--reference-spp <n>] [--scene <n>] [--references <dir>]\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<int> scenes = { 0, 1, 2 };
+    if (opts.m_scene >= 0)
+        scenes = { opts.m_scene };
+
+    if (!opts.m_write_references)
+        std::cout << "scene,spp,seconds,rmse,relmse" << std::endl;
+    for (const int num : scenes)
+        if (!(opts.m_write_references ? write_reference(opts, num) : measure(opts, num)))
+            return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include "constants.h"
+#include "stats.h"
 
 class aabb
 {
@@ -13,8 +14,15 @@ public:
     point3 min() const { return m_min; }
     point3 max() const { return m_max; }
 
+    double surface_area() const
+    {
+        const vec3 d = m_max - m_min;
+        return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
     bool hit(const ray& r_in, double t_min, double t_max) const
     {
+        RT_STAT(m_aabb_tests);
         for (int a = 0; a < 3; a++)
         {
             const auto invD = 1.0f / r_in.dir()[a];
@@ -30,12 +38,30 @@ public:
         return true;
     }
 
+    // Same slab test as hit(), but narrows [t_min, t_max] to the part of the ray inside the box.
+    bool clip(const ray& r_in, double& t_min, double& t_max) const
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            const auto invD = 1.0 / r_in.dir()[a];
+            auto t0 = (min()[a] - r_in.origin()[a]) * invD;
+            auto t1 = (max()[a] - r_in.origin()[a]) * invD;
+            if (invD < 0.0)
+                std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max <= t_min)
+                return false;
+        }
+        return true;
+    }
+
 private:
     point3 m_min;
     point3 m_max;
 };
 
-aabb surrounding_box(aabb box0, aabb box1)
+inline aabb surrounding_box(aabb box0, aabb box1)
 {
     point3 small(fmin(box0.min().x(), box1.min().x()),
                  fmin(box0.min().y(), box1.min().y()),
@@ -47,3 +73,31 @@ aabb surrounding_box(aabb box0, aabb box1)
 
     return aabb(small, big);
 }
+
+// Restricts box to lo <= p[axis] <= hi. Returns false if nothing is left.
+inline bool clip_box(aabb& box, int axis, double lo, double hi)
+{
+    point3 small = box.min();
+    point3 big = box.max();
+    small[axis] = fmax(small[axis], lo);
+    big[axis] = fmin(big[axis], hi);
+    if (small[axis] > big[axis])
+        return false;
+    box = aabb(small, big);
+    return true;
+}
+
+// Overlap of two boxes. Returns false if they are disjoint.
+inline bool intersect_boxes(const aabb& box0, const aabb& box1, aabb& output_box)
+{
+    point3 small, big;
+    for (int a = 0; a < 3; a++)
+    {
+        small[a] = fmax(box0.min()[a], box1.min()[a]);
+        big[a] = fmin(box0.max()[a], box1.max()[a]);
+        if (small[a] > big[a])
+            return false;
+    }
+    output_box = aabb(small, big);
+    return true;
+}
@@ -2,13 +2,13 @@
 
 #include "hittable.h"
 
-class xy_rect : public hittable
+class xy_rect final : public hittable
 {
 public:
-    xy_rect() {}
+    xy_rect() : hittable(hittable_kind::xy_rect) {}
 
     xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, std::shared_ptr<material> mat)
-        : m_x0(_x0), m_x1(_x1), m_y0(_y0), m_y1(_y1), m_k(_k), m_mat_ptr(mat)
+        : hittable(hittable_kind::xy_rect), m_x0(_x0), m_x1(_x1), m_y0(_y0), m_y1(_y1), m_k(_k), m_mat_ptr(mat)
     {};
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
@@ -24,8 +24,10 @@ public:
     double m_x0, m_x1, m_y0, m_y1, m_k;
 };
 
-bool xy_rect::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+inline bool xy_rect::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
 {
+    RT_STAT(m_primitive_tests);
+
     auto t = (m_k - r_in.origin().z()) / r_in.dir().z();
     if (t < t_min || t > t_max)
         return false;
@@ -38,23 +40,25 @@ bool xy_rect::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_r
 
     hit_rec.m_u = (x - m_x0) / (m_x1 - m_x0);
     hit_rec.m_v = (y - m_y0) / (m_y1 - m_y0);
+    hit_rec.m_uv_scale = 1.0 / fmin(m_x1 - m_x0, m_y1 - m_y0);
     hit_rec.m_t = t;
 
     auto outward_normal = vec3(0, 0, 1);
     hit_rec.set_face_normal(r_in, outward_normal);
     hit_rec.m_mat_ptr = m_mat_ptr;
     hit_rec.m_point = r_in.at(t);
+    hit_rec.m_object = this;
 
     return true;
 }
 
-class xz_rect : public hittable
+class xz_rect final : public hittable
 {
 public:
-    xz_rect() {}
+    xz_rect() : hittable(hittable_kind::xz_rect) {}
 
     xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, std::shared_ptr<material> mat)
-        : m_x0(_x0), m_x1(_x1), m_z0(_z0), m_z1(_z1), m_k(_k), m_mat_ptr(mat)
+        : hittable(hittable_kind::xz_rect), m_x0(_x0), m_x1(_x1), m_z0(_z0), m_z1(_z1), m_k(_k), m_mat_ptr(mat)
     {};
 
     virtual bool hit(const ray& r_in, double t_min, double t_max, hit_record& rec) const override;
@@ -70,8 +74,10 @@ public:
     double m_x0, m_x1, m_z0, m_z1, m_k;
 };
 
-bool xz_rect::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+inline bool xz_rect::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
 {
+    RT_STAT(m_primitive_tests);
+
     auto t = (m_k - r_in.origin().y()) / r_in.dir().y();
     if (t < t_min || t > t_max)
         return false;
@@ -84,23 +90,25 @@ bool xz_rect::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_r
 
     hit_rec.m_u = (x - m_x0) / (m_x1 - m_x0);
     hit_rec.m_v = (z - m_z0) / (m_z1 - m_z0);
+    hit_rec.m_uv_scale = 1.0 / fmin(m_x1 - m_x0, m_z1 - m_z0);
     hit_rec.m_t = t;
 
     auto outward_normal = vec3(0, 1, 0);
     hit_rec.set_face_normal(r_in, outward_normal);
     hit_rec.m_mat_ptr = m_mat_ptr;
     hit_rec.m_point = r_in.at(t);
+    hit_rec.m_object = this;
 
     return true;
 }
 
-class yz_rect : public hittable
+class yz_rect final : public hittable
 {
 public:
-    yz_rect() {}
+    yz_rect() : hittable(hittable_kind::yz_rect) {}
 
     yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, std::shared_ptr<material> mat)
-        : m_y0(_y0), m_y1(_y1), m_z0(_z0), m_z1(_z1), m_k(_k), m_mat_ptr(mat)
+        : hittable(hittable_kind::yz_rect), m_y0(_y0), m_y1(_y1), m_z0(_z0), m_z1(_z1), m_k(_k), m_mat_ptr(mat)
     {};
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
@@ -116,8 +124,10 @@ public:
     double m_y0, m_y1, m_z0, m_z1, m_k;
 };
 
-bool yz_rect::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+inline bool yz_rect::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
 {
+    RT_STAT(m_primitive_tests);
+
     auto t = (m_k - r_in.origin().x()) / r_in.dir().x();
     if (t < t_min || t > t_max)
         return false;
@@ -130,12 +140,14 @@ bool yz_rect::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_r
 
     hit_rec.m_u = (y - m_y0) / (m_y1 - m_y0);
     hit_rec.m_v = (z - m_z0) / (m_z1 - m_z0);
+    hit_rec.m_uv_scale = 1.0 / fmin(m_y1 - m_y0, m_z1 - m_z0);
     hit_rec.m_t = t;
 
     auto outward_normal = vec3(1, 0, 0);
     hit_rec.set_face_normal(r_in, outward_normal);
     hit_rec.m_mat_ptr = m_mat_ptr;
     hit_rec.m_point = r_in.at(t);
+    hit_rec.m_object = this;
 
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,93 @@
+#pragma once
+#include "bvh.h"
+#include "compressed_bvh.h"
+#include "flat_bvh.h"
+#include "hittable_objects.h"
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// Acceleration structure the static part of a scene is rendered with.
+enum class accel_kind { bvh, flat, compressed };
+
+// Parses the name given to --accel; returns false for an unknown name.
+inline bool parse_accel(const char* name, accel_kind& kind)
+{
+    if (!strcmp(name, "bvh"))
+        kind = accel_kind::bvh;
+    else if (!strcmp(name, "flat"))
+        kind = accel_kind::flat;
+    else if (!strcmp(name, "compressed"))
+        kind = accel_kind::compressed;
+    else
+        return false;
+    return true;
+}
+
+// Parses the name given to --layout; returns false for an unknown name.
+inline bool parse_layout(const char* name, bvh_layout& layout)
+{
+    if (!strcmp(name, "depth_first"))
+        layout = bvh_layout::depth_first;
+    else if (!strcmp(name, "van_emde_boas"))
+        layout = bvh_layout::van_emde_boas;
+    else if (!strcmp(name, "hot_first"))
+        layout = bvh_layout::hot_first;
+    else
+        return false;
+    return true;
+}
+
+// The flat BVHs among the top-level objects of world.
+inline std::vector<flat_bvh*> flat_bvhs(const hittable_objects& world)
+{
+    std::vector<flat_bvh*> flats;
+    for (const auto& object : world.get_m_objects())
+        if (const auto flat = dynamic_cast<flat_bvh*>(object.get()))
+            flats.push_back(flat);
+    return flats;
+}
+
+// Replaces the flat BVHs among the top-level objects of world with compressed ones, in the same node order.
+inline void compress_accel(hittable_objects& world)
+{
+    hittable_objects converted;
+    for (const auto& object : world.get_m_objects())
+    {
+        if (const auto flat = dynamic_cast<const flat_bvh*>(object.get()))
+            converted.add(std::make_shared<compressed_bvh>(*flat));
+        else
+            converted.add(object);
+    }
+    world = converted;
+}
+
+// Gathers the static objects of world, with any bvh_node among them expanded into its leaves, into
+// one flat_bvh or compressed_bvh built with the given settings. Animated objects stay as they are,
+// since only bvh_node can refit between frames.
+inline void apply_accel(hittable_objects& world, accel_kind kind, double time0, double time1,
+                        const flat_bvh_settings& settings = flat_bvh_settings())
+{
+    if (kind == accel_kind::bvh)
+        return;
+
+    hittable_objects converted;
+    std::vector<std::shared_ptr<hittable>> objects;
+    for (const auto& object : world.get_m_objects())
+    {
+        if (object->is_animated())
+            converted.add(object);
+        else if (const auto node = dynamic_cast<const bvh_node*>(object.get()))
+            node->collect_objects(objects);
+        else
+            objects.push_back(object);
+    }
+
+    if (!objects.empty())
+        converted.add(std::make_shared<flat_bvh>(objects, time0, time1, settings));
+    world = converted;
+
+    if (kind == accel_kind::compressed)
+        compress_accel(world);
+}
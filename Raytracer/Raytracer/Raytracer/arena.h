@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Separate regions of an arena, so that objects traversed together end up next to each other:
+// BVH nodes in one run of memory, the primitives they point at in another.
+enum class arena_pool { general, nodes, primitives, count };
+
+// Pool a type is allocated from; specialised for the hot types below.
+template <class T>
+struct arena_pool_of
+{
+    static constexpr arena_pool value = arena_pool::general;
+};
+
+class bvh_node;
+class motion_bvh_node;
+class sphere;
+class moving_sphere;
+class xy_rect;
+class xz_rect;
+class yz_rect;
+class box;
+
+template <> struct arena_pool_of<bvh_node> { static constexpr arena_pool value = arena_pool::nodes; };
+template <> struct arena_pool_of<motion_bvh_node> { static constexpr arena_pool value = arena_pool::nodes; };
+template <> struct arena_pool_of<sphere> { static constexpr arena_pool value = arena_pool::primitives; };
+template <> struct arena_pool_of<moving_sphere> { static constexpr arena_pool value = arena_pool::primitives; };
+template <> struct arena_pool_of<xy_rect> { static constexpr arena_pool value = arena_pool::primitives; };
+template <> struct arena_pool_of<xz_rect> { static constexpr arena_pool value = arena_pool::primitives; };
+template <> struct arena_pool_of<yz_rect> { static constexpr arena_pool value = arena_pool::primitives; };
+template <> struct arena_pool_of<box> { static constexpr arena_pool value = arena_pool::primitives; };
+
+// Linear allocator for the objects of one scene. Memory is handed out by bumping a pointer through
+// large chunks and is never reused; it is all released at once when the arena goes away.
+// The arena is reference counted by its scope and by every object allocated from it, so it lives
+// exactly as long as the last of them. Allocation is not thread-safe: a scene is built by one thread.
+class scene_arena
+{
+public:
+    // Chunks of a region start small and double up to the maximum, so small scenes stay small.
+    static constexpr size_t MIN_CHUNK_SIZE = 4 * 1024;
+    static constexpr size_t MAX_CHUNK_SIZE = 16 * 1024;
+
+    // Makes a new arena the target of arena_make() on this thread until the scope ends.
+    class scope
+    {
+    public:
+        scope()
+            : m_arena(new scene_arena())
+            , m_previous(current_slot())
+        {
+            current_slot() = m_arena;
+        }
+
+        ~scope()
+        {
+            current_slot() = m_previous;
+            m_arena->release();
+        }
+
+        scope(const scope&) = delete;
+        scope& operator = (const scope&) = delete;
+
+        scene_arena& arena() const { return *m_arena; }
+
+    private:
+        scene_arena* m_arena;
+        scene_arena* m_previous;
+    };
+
+    // Arena that arena_make() allocates from on this thread, or nullptr.
+    static scene_arena* current() { return current_slot(); }
+
+    void* allocate(size_t bytes, size_t alignment, arena_pool pool)
+    {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+        m_bytes_used += bytes;
+
+        region& r = m_regions[static_cast<int>(pool)];
+        uintptr_t p = (reinterpret_cast<uintptr_t>(r.m_next) + alignment - 1) & ~(alignment - 1);
+        if (!r.m_next || p + bytes > reinterpret_cast<uintptr_t>(r.m_end))
+        {
+            // Oversized requests get a chunk of their own so the current one keeps filling up.
+            const bool oversized = bytes + alignment > MAX_CHUNK_SIZE / 4;
+            const size_t size = oversized ? bytes + alignment : r.m_next_chunk_size;
+            r.m_chunks.emplace_back(new unsigned char[size]);
+            m_bytes_reserved += size;
+            unsigned char* chunk = r.m_chunks.back().get();
+            p = (reinterpret_cast<uintptr_t>(chunk) + alignment - 1) & ~(alignment - 1);
+            if (oversized)
+                return reinterpret_cast<void*>(p);
+            r.m_end = chunk + size;
+            r.m_next_chunk_size = std::min(2 * r.m_next_chunk_size, MAX_CHUNK_SIZE);
+        }
+
+        r.m_next = reinterpret_cast<unsigned char*>(p + bytes);
+        return reinterpret_cast<void*>(p);
+    }
+
+    // Objects are freed together with the arena; this only drops their reference.
+    void deallocate()
+    {
+        release();
+    }
+
+    size_t bytes_used() const { return m_bytes_used; }
+    size_t bytes_reserved() const { return m_bytes_reserved; }
+
+private:
+    struct region
+    {
+        std::vector<std::unique_ptr<unsigned char[]>> m_chunks;
+        unsigned char* m_next = nullptr;
+        unsigned char* m_end = nullptr;
+        size_t m_next_chunk_size = MIN_CHUNK_SIZE;
+    };
+
+    scene_arena() {}
+
+    void release()
+    {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    static scene_arena*& current_slot()
+    {
+        thread_local scene_arena* current = nullptr;
+        return current;
+    }
+
+private:
+    std::atomic<size_t> m_refs { 1 };
+    size_t m_bytes_used = 0;
+    size_t m_bytes_reserved = 0;
+    region m_regions[static_cast<int>(arena_pool::count)];
+};
+
+// Standard allocator over a scene_arena. Only a pointer wide, so it adds little to a shared_ptr control block.
+template <class T, arena_pool Pool>
+class arena_allocator
+{
+public:
+    using value_type = T;
+
+    template <class U>
+    struct rebind
+    {
+        using other = arena_allocator<U, Pool>;
+    };
+
+    explicit arena_allocator(scene_arena* arena) : m_arena(arena) {}
+
+    template <class U>
+    arena_allocator(const arena_allocator<U, Pool>& other) : m_arena(other.arena()) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T), Pool)); }
+    void deallocate(T*, size_t) { m_arena->deallocate(); }
+
+    scene_arena* arena() const { return m_arena; }
+
+    template <class U>
+    bool operator == (const arena_allocator<U, Pool>& other) const { return m_arena == other.arena(); }
+    template <class U>
+    bool operator != (const arena_allocator<U, Pool>& other) const { return m_arena != other.arena(); }
+
+private:
+    scene_arena* m_arena;
+};
+
+// make_shared() that places the object and its control block in the current scene arena, if there is one.
+template <class T, class... Args>
+std::shared_ptr<T> arena_make(Args&&... args)
+{
+    if (scene_arena* arena = scene_arena::current())
+        return std::allocate_shared<T>(arena_allocator<T, arena_pool_of<T>::value>(arena), std::forward<Args>(args)...);
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
@@ -2,12 +2,11 @@
 #include "constants.h"
 
 #include "aarect.h"
-#include "hittable_objects.h"
 
-class box : public hittable
+class box final : public hittable
 {
 public:
-    box() {}
+    box() : hittable(hittable_kind::box) {}
     box(const point3& p0, const point3& p1, std::shared_ptr<material> ptr);
 
     virtual bool hit(const ray& r_in, double t_min, double t_max, hit_record& rec) const override;
@@ -18,28 +17,72 @@ public:
         return true;
     }
 
+    virtual void collect_primitives(std::vector<const hittable*>& primitives) const override
+    {
+        for (const auto& side : m_xy_sides)
+            primitives.push_back(&side);
+        for (const auto& side : m_xz_sides)
+            primitives.push_back(&side);
+        for (const auto& side : m_yz_sides)
+            primitives.push_back(&side);
+    }
+
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const override
+    {
+        t_enter = t_min;
+        t_exit = t_max;
+        return aabb(m_box_min, m_box_max).clip(r_in, t_enter, t_exit);
+    }
+
 public:
     point3 m_box_min;
     point3 m_box_max;
-    hittable_objects m_sides;
+
+    // The sides live inside the box, so a box is a single allocation.
+    xy_rect m_xy_sides[2];
+    xz_rect m_xz_sides[2];
+    yz_rect m_yz_sides[2];
 };
 
-box::box(const point3& p0, const point3& p1, std::shared_ptr<material> ptr)
+inline box::box(const point3& p0, const point3& p1, std::shared_ptr<material> ptr)
+    : hittable(hittable_kind::box)
 {
     m_box_min = p0;
     m_box_max = p1;
 
-    m_sides.add(std::make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-    m_sides.add(std::make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+    m_xy_sides[0] = xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
+    m_xy_sides[1] = xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr);
 
-    m_sides.add(std::make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-    m_sides.add(std::make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+    m_xz_sides[0] = xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
+    m_xz_sides[1] = xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr);
 
-    m_sides.add(std::make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-    m_sides.add(std::make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+    m_yz_sides[0] = yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
+    m_yz_sides[1] = yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr);
 }
 
-bool box::hit(const ray& r_in, double t_min, double t_max, hit_record& rec) const
+inline bool box::hit(const ray& r_in, double t_min, double t_max, hit_record& rec) const
 {
-    return m_sides.hit(r_in, t_min, t_max, rec);
+    hit_record tmp_rec;
+    bool hit_any = false;
+    double closest_so_far = t_max;
+
+    const auto test = [&](const auto& side)
+    {
+        RT_STAT(m_list_tests);
+        if (side.hit(r_in, t_min, closest_so_far, tmp_rec))
+        {
+            hit_any = true;
+            closest_so_far = tmp_rec.m_t;
+            rec = tmp_rec;
+        }
+    };
+
+    for (const auto& side : m_xy_sides)
+        test(side);
+    for (const auto& side : m_xz_sides)
+        test(side);
+    for (const auto& side : m_yz_sides)
+        test(side);
+
+    return hit_any;
 }
@@ -1,21 +1,17 @@
 #pragma once
 
+#include "arena.h"
 #include "constants.h"
 #include "hittable.h"
 #include "hittable_objects.h"
+#include "primitive_dispatch.h"
 
 #include <algorithm>
 
-inline bool box_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b, int axis);
-
-bool box_x_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b);
-bool box_y_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b);
-bool box_z_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b);
-
-class bvh_node : public hittable
+class bvh_node final : public hittable
 {
 public:
-    bvh_node() {}
+    bvh_node() : hittable(hittable_kind::bvh_node) {}
 
     bvh_node(const hittable_objects& list, double time0, double time1)
         : bvh_node(list.get_m_objects(), 0, list.get_m_objects().size(), time0, time1)
@@ -26,37 +22,124 @@ public:
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const override
+    {
+        return first_interval(*this, r_in, t_min, t_max, t_enter, t_exit);
+    }
+
+    virtual void hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const override;
+
+    virtual bool is_animated() const override { return m_animated; }
+    virtual bool is_stochastic() const override { return m_left->is_stochastic() || m_right->is_stochastic(); }
+
+    // Refits the boxes of animated subtrees bottom-up, then rebuilds the largest subtrees whose
+    // SAH cost has grown past REBUILD_RATIO times the cost they had when they were built.
+    virtual void refit(double time0, double time1, refit_summary& summary) override
+    {
+        refit_bounds(time0, time1, summary);
+        rebuild_degraded(time0, time1, summary);
+    }
+
+    // Expected cost of a ray that hits the node's box, in units of one primitive test.
+    double sah_cost() const { return m_cost; }
+
+    virtual void collect_primitives(std::vector<const hittable*>& primitives) const override
+    {
+        m_left->collect_primitives(primitives);
+        if (m_right != m_left)
+            m_right->collect_primitives(primitives);
+    }
+
+    // Appends the objects under this node (the leaves of the tree) to objects.
+    void collect_objects(std::vector<std::shared_ptr<hittable>>& objects) const;
+
+    // Number of bvh_nodes in the tree rooted here.
+    size_t node_count() const
+    {
+        const auto count_child = [](const std::shared_ptr<hittable>& child)
+        {
+            const auto node = dynamic_cast<const bvh_node*>(child.get());
+            return node ? node->node_count() : 0;
+        };
+        return 1 + count_child(m_left) + (m_right != m_left ? count_child(m_right) : 0);
+    }
+
+private:
+    // Inner nodes and built-in primitives are called directly rather than through the vtable.
+    static bool hit_child(const hittable& child, const ray& r, double t_min, double t_max, hit_record& hit_rec)
+    {
+        if (child.kind() == hittable_kind::bvh_node)
+            return static_cast<const bvh_node&>(child).bvh_node::hit(r, t_min, t_max, hit_rec);
+        return hit_primitive(child, r, t_min, t_max, hit_rec);
+    }
+
+    // A rebuild is triggered once refitting has made a subtree this much worse than when it was built.
+    static constexpr double REBUILD_RATIO = 1.5;
+
+    void build(std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1);
+    void update_box(double time0, double time1);
+    void refit_bounds(double time0, double time1, refit_summary& summary);
+    void rebuild_degraded(double time0, double time1, refit_summary& summary);
+
 private:
     std::shared_ptr<hittable> m_left;
     std::shared_ptr<hittable> m_right;
     aabb m_box;
+    double m_cost = 1.0;
+    double m_build_cost = 1.0;
+    bool m_animated = false;
 };
 
-bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
+inline bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
 {
     output_box = m_box;
     return true;
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& hit_rec) const
+inline bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& hit_rec) const
 {
+    RT_STAT(m_bvh_nodes_visited);
+
     if (!m_box.hit(r, t_min, t_max))
         return false;
 
-    const bool hit_left = m_left->hit(r, t_min, t_max, hit_rec);
-    const bool hit_right = m_right->hit(r, t_min, hit_left ? hit_rec.m_t : t_max, hit_rec);
+    const bool hit_left = hit_child(*m_left, r, t_min, t_max, hit_rec);
+    const bool hit_right = hit_child(*m_right, r, t_min, hit_left ? hit_rec.m_t : t_max, hit_rec);
 
     return hit_left || hit_right;
 }
 
-bvh_node::bvh_node(const std::vector<std::shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1)
+inline void bvh_node::hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const
 {
+    if (!m_box.hit(r_in, t_min, t_max))
+        return;
+
+    m_left->hit_intervals(r_in, t_min, t_max, spans);
+    if (m_right != m_left)
+        m_right->hit_intervals(r_in, t_min, t_max, spans);
+}
+
+inline bvh_node::bvh_node(const std::vector<std::shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1)
+    : hittable(hittable_kind::bvh_node)
+{
+    // One copy for the whole tree; the recursion sorts sub-ranges of it in place.
     auto objects = src_objects;
+    build(objects, start, end, time0, time1);
+}
 
+inline void bvh_node::build(std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1)
+{
     int axis = random_int(0, 2);
-    auto comparator = (axis == 0) ? box_x_compare
-                    : (axis == 1) ? box_y_compare
-                                  : box_z_compare;
+    auto comparator = [time0, axis](const std::shared_ptr<hittable>& a, const std::shared_ptr<hittable>& b)
+    {
+        aabb box_a;
+        aabb box_b;
+
+        if (!a->bounding_box(time0, time0, box_a) || !b->bounding_box(time0, time0, box_b))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+
+        return box_a.min()[axis] < box_b.min()[axis];
+    };
 
     size_t object_span = end - start;
 
@@ -82,41 +165,99 @@ bvh_node::bvh_node(const std::vector<std::shared_ptr<hittable>>& src_objects, si
         std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
         auto mid = start + object_span / 2;
-        m_left = std::make_shared<bvh_node>(objects, start, mid, time0, time1);
-        m_right = std::make_shared<bvh_node>(objects, mid, end, time0, time1);
+        auto left = arena_make<bvh_node>();
+        auto right = arena_make<bvh_node>();
+        left->build(objects, start, mid, time0, time1);
+        right->build(objects, mid, end, time0, time1);
+        m_left = left;
+        m_right = right;
     }
 
+    m_animated = m_left->is_animated() || m_right->is_animated();
+    update_box(time0, time1);
+    m_build_cost = m_cost;
+}
+
+inline void bvh_node::update_box(double time0, double time1)
+{
     aabb box_left, box_right;
 
     if (!m_left->bounding_box(time0, time1, box_left) || !m_right->bounding_box(time0, time1, box_right))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+        std::cerr << "No bounding box in bvh_node.\n";
 
     m_box = surrounding_box(box_left, box_right);
+
+    // SAH: one traversal step plus each child's cost, weighted by the chance that a ray through this box hits the child.
+    const auto child_cost = [](const std::shared_ptr<hittable>& child)
+    {
+        const auto node = dynamic_cast<const bvh_node*>(child.get());
+        return node ? node->m_cost : 1.0;
+    };
+    const double area = m_box.surface_area();
+    if (area > 0)
+        m_cost = 1.0 + (box_left.surface_area() * child_cost(m_left) + box_right.surface_area() * child_cost(m_right)) / area;
+    else
+        m_cost = 1.0 + child_cost(m_left) + child_cost(m_right);
 }
 
-inline bool box_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b, int axis)
+inline void bvh_node::refit_bounds(double time0, double time1, refit_summary& summary)
 {
-    aabb box_a;
-    aabb box_b;
+    if (!m_animated)
+        return;
 
-    if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+    // Child nodes are refitted directly so that the rebuild decision is made once, from the top.
+    const auto refit_child = [&](const std::shared_ptr<hittable>& child)
+    {
+        if (const auto node = dynamic_cast<bvh_node*>(child.get()))
+            node->refit_bounds(time0, time1, summary);
+        else if (child->is_animated())
+            child->refit(time0, time1, summary);
+    };
+    refit_child(m_left);
+    if (m_right != m_left)
+        refit_child(m_right);
 
-    return box_a.min()[axis] < box_b.min()[axis];
+    update_box(time0, time1);
+    summary.m_nodes_refit++;
 }
 
-
-bool box_x_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b)
+inline void bvh_node::rebuild_degraded(double time0, double time1, refit_summary& summary)
 {
-    return box_compare(a, b, 0);
-}
+    if (!m_animated)
+        return;
 
-bool box_y_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b)
-{
-    return box_compare(a, b, 1);
+    if (m_cost > REBUILD_RATIO * m_build_cost)
+    {
+        std::vector<std::shared_ptr<hittable>> objects;
+        collect_objects(objects);
+        build(objects, 0, objects.size(), time0, time1);
+        summary.m_subtrees_rebuilt++;
+        summary.m_objects_rebuilt += objects.size();
+        return;
+    }
+
+    const auto left = dynamic_cast<bvh_node*>(m_left.get());
+    const auto right = dynamic_cast<bvh_node*>(m_right.get());
+    if (left)
+        left->rebuild_degraded(time0, time1, summary);
+    if (right && right != left)
+        right->rebuild_degraded(time0, time1, summary);
+
+    // A rebuilt child may have made this node cheaper too.
+    if (left || right)
+        update_box(time0, time1);
 }
 
-bool box_z_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b)
+inline void bvh_node::collect_objects(std::vector<std::shared_ptr<hittable>>& objects) const
 {
-    return box_compare(a, b, 2);
+    const auto collect_child = [&](const std::shared_ptr<hittable>& child)
+    {
+        if (const auto node = dynamic_cast<const bvh_node*>(child.get()))
+            node->collect_objects(objects);
+        else
+            objects.push_back(child);
+    };
+    collect_child(m_left);
+    if (m_right != m_left)
+        collect_child(m_right);
 }
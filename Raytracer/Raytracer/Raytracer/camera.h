@@ -4,7 +4,11 @@
 class camera
 {
 public:
-    camera(point3 lookfrom, point3 lookat, vec3 vup, double vfov, double aspect_ratio, double aperture, double focus_dist)
+    // The shutter is open from time0 to time1; rays get a uniformly distributed time in between.
+    camera(point3 lookfrom, point3 lookat, vec3 vup, double vfov, double aspect_ratio, double aperture, double focus_dist,
+           double time0 = 0.0, double time1 = 0.0)
+        : m_time0(time0)
+        , m_time1(time1)
     {
         const double theta = degrees_to_radians(vfov);
         const double h = tan(theta / 2);
@@ -21,6 +25,14 @@ public:
         m_lower_left_corner = m_origin - m_horizontal / 2 - m_vertical / 2 - focus_dist * w;
 
         m_lens_radius = aperture / 2;
+        m_viewport_height = viewport_height;
+        m_pixel_spread = 0.0;
+    }
+
+    // Enables ray cones for texture filtering: each primary ray spreads by one pixel's angle.
+    void set_image_height(int image_height)
+    {
+        m_pixel_spread = m_viewport_height / image_height;
     }
 
     ray get_ray(double s, double t) const
@@ -28,7 +40,11 @@ public:
         const vec3 rd = m_lens_radius * random_in_unit_disk();
         const vec3 offset = m_u * rd.x() + m_v * rd.y();
 
-        return ray(m_origin + offset, m_lower_left_corner + s * m_horizontal + t * m_vertical - m_origin - offset);
+        const double time = m_time1 > m_time0 ? random_double(m_time0, m_time1) : m_time0;
+
+        ray r(m_origin + offset, m_lower_left_corner + s * m_horizontal + t * m_vertical - m_origin - offset, time);
+        r.set_cone(0.0, m_pixel_spread);
+        return r;
     }
 
 private:
@@ -38,4 +54,8 @@ private:
     vec3 m_vertical;
     vec3 m_u, m_v, m_w;
     double m_lens_radius;
+    double m_viewport_height;
+    double m_pixel_spread;
+    double m_time0;
+    double m_time1;
 };
\ No newline at end of file
@@ -3,8 +3,9 @@
 
 #include <iostream>
 
-void write_color (std::ostream& out, const color& pixel_color, int samples_per_pixel)
-{   
+// Gamma-corrected 8-bit channels of the mean of samples_per_pixel samples.
+inline void color_bytes(const color& pixel_color, int samples_per_pixel, int rgb[3])
+{
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -15,7 +16,14 @@ void write_color (std::ostream& out, const color& pixel_color, int samples_per_p
     g = sqrt(scale * g);
     b = sqrt(scale * b);
 
-    out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
+    rgb[0] = static_cast<int>(256 * clamp(r, 0.0, 0.999));
+    rgb[1] = static_cast<int>(256 * clamp(g, 0.0, 0.999));
+    rgb[2] = static_cast<int>(256 * clamp(b, 0.0, 0.999));
+}
+
+inline void write_color (std::ostream& out, const color& pixel_color, int samples_per_pixel)
+{   
+    int rgb[3];
+    color_bytes(pixel_color, samples_per_pixel, rgb);
+    out << rgb[0] << ' ' << rgb[1] << ' ' << rgb[2] << '\n';
 }
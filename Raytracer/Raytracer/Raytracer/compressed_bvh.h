@@ -0,0 +1,298 @@
+#pragma once
+#include "constants.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "primitive_dispatch.h"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Inner node of a compressed_bvh: 20 bytes. The boxes of both children are stored as 8-bit offsets
+// on a 255-step grid spanning this node's own (decoded) box, rounded outwards, so a decoded box
+// always encloses the child. A child reference is either an inner node index or a leaf (high bit set) holding
+// the first primitive in its low 27 bits and the primitive count minus one in the next 4.
+struct compressed_bvh_node
+{
+    uint8_t m_lo[2][3];
+    uint8_t m_hi[2][3];
+    uint32_t m_child[2];
+};
+
+static_assert(sizeof(compressed_bvh_node) == 20, "compressed_bvh_node should stay 20 bytes");
+
+// BVH with quantized child bounds, built from a flat_bvh and traversed by decoding boxes on the fly.
+// Uses about 40% of the memory of flat_bvh and a small fraction of a bvh_node tree, at some cost in speed.
+class compressed_bvh : public hittable
+{
+public:
+    static constexpr uint32_t LEAF_BIT = 0x80000000u;
+    static constexpr uint32_t FIRST_MASK = (1u << 27) - 1;
+    static constexpr int COUNT_SHIFT = 27;
+    static constexpr uint32_t MAX_LEAF_COUNT = 16;
+
+    explicit compressed_bvh(const flat_bvh& source);
+
+    virtual bool hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const override;
+    virtual void hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const override;
+
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const override
+    {
+        return first_interval(*this, r_in, t_min, t_max, t_enter, t_exit);
+    }
+
+    virtual void collect_primitives(std::vector<const hittable*>& primitives) const override
+    {
+        for (const auto& object : m_objects)
+            object->collect_primitives(primitives);
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+    {
+        output_box = aabb(point3(m_root_lo[0], m_root_lo[1], m_root_lo[2]), point3(m_root_hi[0], m_root_hi[1], m_root_hi[2]));
+        return m_valid;
+    }
+
+    size_t memory_bytes() const
+    {
+        return m_nodes.size() * sizeof(compressed_bvh_node) + m_primitives.size() * sizeof(const hittable*);
+    }
+
+private:
+    struct decoded_box
+    {
+        double m_lo[3];
+        double m_hi[3];
+    };
+
+    // Grid spacing of a parent extent. Padded by a few ulps so the last grid line never rounds
+    // below the parent's upper bound, which keeps decoding branch-free.
+    static double grid_step(double lo, double hi)
+    {
+        return (hi - lo) * (1.0 / 255.0) * (1.0 + 8 * std::numeric_limits<double>::epsilon());
+    }
+
+    static double decode(double lo, double step, uint8_t q)
+    {
+        return lo + q * step;
+    }
+
+    // Decodes the boxes of both children of node, whose own box is parent.
+    static void child_boxes(const compressed_bvh_node& node, const decoded_box& parent, decoded_box children[2])
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            const double lo = parent.m_lo[a];
+            const double step = grid_step(lo, parent.m_hi[a]);
+            for (int c = 0; c < 2; c++)
+            {
+                children[c].m_lo[a] = decode(lo, step, node.m_lo[c][a]);
+                children[c].m_hi[a] = decode(lo, step, node.m_hi[c][a]);
+            }
+        }
+    }
+
+    static uint32_t leaf_reference(uint32_t first, uint32_t count)
+    {
+        return LEAF_BIT | ((count - 1) << COUNT_SHIFT) | first;
+    }
+
+    // node_index maps the inner nodes of source to their index here, so the flat node order carries over.
+    uint32_t encode(const flat_bvh& source, const std::vector<uint32_t>& node_index, uint32_t flat_index, const decoded_box& box);
+
+    template <class LeafVisitor>
+    void traverse(const ray& r_in, double t_min, double t_max, LeafVisitor&& visit_leaf) const;
+
+private:
+    std::vector<std::shared_ptr<hittable>> m_objects;
+    std::vector<const hittable*> m_primitives;
+    std::vector<compressed_bvh_node> m_nodes;
+    double m_root_lo[3] = { 0, 0, 0 };
+    double m_root_hi[3] = { 0, 0, 0 };
+    uint32_t m_root = 0;
+    bool m_valid = false;
+};
+
+inline compressed_bvh::compressed_bvh(const flat_bvh& source)
+    : m_objects(source.objects())
+    , m_primitives(source.primitives())
+{
+    const auto& flat_nodes = source.nodes();
+    if (flat_nodes.empty())
+        return;
+
+    if (m_primitives.size() > FIRST_MASK)
+    {
+        std::cerr << "Too many primitives for compressed_bvh.\n";
+        return;
+    }
+
+    decoded_box root;
+    for (int a = 0; a < 3; a++)
+    {
+        root.m_lo[a] = m_root_lo[a] = flat_nodes[0].m_min[a];
+        root.m_hi[a] = m_root_hi[a] = flat_nodes[0].m_max[a];
+    }
+
+    std::vector<uint32_t> node_index(flat_nodes.size());
+    uint32_t inner = 0;
+    for (size_t i = 0; i < flat_nodes.size(); i++)
+        if (flat_nodes[i].m_count == 0)
+            node_index[i] = inner++;
+
+    m_nodes.resize(inner);
+    m_root = encode(source, node_index, 0, root);
+    m_valid = true;
+}
+
+inline uint32_t compressed_bvh::encode(const flat_bvh& source, const std::vector<uint32_t>& node_index, uint32_t flat_index, const decoded_box& box)
+{
+    const flat_bvh_node& flat = source.nodes()[flat_index];
+    if (flat.m_count > 0)
+    {
+        if (flat.m_count > MAX_LEAF_COUNT)
+            std::cerr << "flat_bvh leaf too large for compressed_bvh.\n";
+        return leaf_reference(flat.m_offset, flat.m_count);
+    }
+
+    const uint32_t index = node_index[flat_index];
+    const uint32_t children[2] = { flat.m_offset, flat.m_offset + 1 };
+    compressed_bvh_node& node = m_nodes[index];
+
+    for (int a = 0; a < 3; a++)
+    {
+        const double parent_lo = box.m_lo[a];
+        const double step = grid_step(parent_lo, box.m_hi[a]);
+
+        for (int c = 0; c < 2; c++)
+        {
+            const flat_bvh_node& child = source.nodes()[children[c]];
+
+            // Start from the nearest grid line and move outwards until the decoded value encloses the child.
+            int lo = step > 0 ? static_cast<int>(floor((child.m_min[a] - parent_lo) / step)) : 0;
+            lo = std::clamp(lo, 0, 255);
+            while (lo > 0 && decode(parent_lo, step, static_cast<uint8_t>(lo)) > child.m_min[a])
+                lo--;
+
+            int hi = step > 0 ? static_cast<int>(ceil((child.m_max[a] - parent_lo) / step)) : 255;
+            hi = std::clamp(hi, 0, 255);
+            while (hi < 255 && decode(parent_lo, step, static_cast<uint8_t>(hi)) < child.m_max[a])
+                hi++;
+            if (decode(parent_lo, step, static_cast<uint8_t>(hi)) < child.m_max[a])
+                std::cerr << "compressed_bvh child box exceeds its parent.\n";
+
+            node.m_lo[c][a] = static_cast<uint8_t>(lo);
+            node.m_hi[c][a] = static_cast<uint8_t>(hi);
+        }
+    }
+
+    decoded_box child_box[2];
+    child_boxes(node, box, child_box);
+
+    // Children are encoded against the boxes traversal will decode, not their exact bounds.
+    node.m_child[0] = encode(source, node_index, children[0], child_box[0]);
+    node.m_child[1] = encode(source, node_index, children[1], child_box[1]);
+    return index;
+}
+
+template <class LeafVisitor>
+void compressed_bvh::traverse(const ray& r_in, double t_min, double t_max, LeafVisitor&& visit_leaf) const
+{
+    if (!m_valid)
+        return;
+
+    const point3 origin = r_in.origin();
+    const vec3 inv_dir(1.0 / r_in.dir().x(), 1.0 / r_in.dir().y(), 1.0 / r_in.dir().z());
+
+    // The near child is visited straight away, so only far children and their decoded boxes go on the stack.
+    // Each remembers where the ray enters it, and is skipped once a closer hit has been found.
+    struct entry
+    {
+        uint32_t m_reference;
+        double m_t_enter;
+        decoded_box m_box;
+    };
+    entry stack[flat_bvh::STACK_SIZE];
+    int stack_size = 0;
+
+    decoded_box box;
+    for (int a = 0; a < 3; a++)
+    {
+        box.m_lo[a] = m_root_lo[a];
+        box.m_hi[a] = m_root_hi[a];
+    }
+
+    double t_enter;
+    RT_STAT(m_aabb_tests);
+    if (!slab_hit(box.m_lo, box.m_hi, origin, inv_dir, t_min, t_max, t_enter))
+        return;
+    uint32_t reference = m_root;
+
+    while (true)
+    {
+        RT_STAT(m_bvh_nodes_visited);
+
+        if (reference & LEAF_BIT)
+        {
+            visit_leaf(reference & FIRST_MASK, ((reference >> COUNT_SHIFT) & 0xf) + 1, t_max);
+        }
+        else
+        {
+            const compressed_bvh_node& node = m_nodes[reference];
+            decoded_box children[2];
+            child_boxes(node, box, children);
+
+            double t_child[2];
+            RT_STAT(m_aabb_tests);
+            RT_STAT(m_aabb_tests);
+            const bool hit_left = slab_hit(children[0].m_lo, children[0].m_hi, origin, inv_dir, t_min, t_max, t_child[0]);
+            const bool hit_right = slab_hit(children[1].m_lo, children[1].m_hi, origin, inv_dir, t_min, t_max, t_child[1]);
+
+            if (hit_left || hit_right)
+            {
+                int near = hit_left ? 0 : 1;
+                if (hit_left && hit_right)
+                {
+                    near = t_child[0] <= t_child[1] ? 0 : 1;
+                    stack[stack_size++] = { node.m_child[1 - near], t_child[1 - near], children[1 - near] };
+                }
+                reference = node.m_child[near];
+                box = children[near];
+                continue;
+            }
+        }
+
+        do
+        {
+            if (stack_size == 0)
+                return;
+            --stack_size;
+        } while (stack[stack_size].m_t_enter > t_max);
+        reference = stack[stack_size].m_reference;
+        box = stack[stack_size].m_box;
+    }
+}
+
+inline bool compressed_bvh::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+{
+    bool hit_anything = false;
+    traverse(r_in, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest)
+    {
+        for (uint32_t i = first; i < first + count; i++)
+            if (hit_primitive(*m_primitives[i], r_in, t_min, closest, hit_rec))
+            {
+                hit_anything = true;
+                closest = hit_rec.m_t;
+            }
+    });
+    return hit_anything;
+}
+
+inline void compressed_bvh::hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const
+{
+    traverse(r_in, t_min, t_max, [&](uint32_t first, uint32_t count, double&)
+    {
+        for (uint32_t i = first; i < first + count; i++)
+            m_primitives[i]->hit_intervals(r_in, t_min, t_max, spans);
+    });
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -13,9 +14,36 @@ inline double degrees_to_radians(double degrees)
     return degrees * PI / 180.0;
 }
 
+// Each thread owns its generator state, so threads and worker processes can be seeded
+// independently and reproducibly (see seed_random).
+inline uint64_t& random_state()
+{
+    thread_local uint64_t state = 0x853c49e6748fea9bULL;
+    return state;
+}
+
+// SplitMix64 finaliser; also used to derive independent seeds from (seed, index) pairs.
+inline uint64_t mix_seed(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline void seed_random(uint64_t seed)
+{
+    random_state() = mix_seed(seed) | 1;  // xorshift must not start from zero
+}
+
 inline double random_double()
 {
-    return rand() / (RAND_MAX + 1.0);
+    // xorshift64*, top 53 bits scaled into [0, 1).
+    uint64_t& x = random_state();
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return ((x * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
 }
 
 inline double random_double(double min, double max)
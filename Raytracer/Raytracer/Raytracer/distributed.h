@@ -0,0 +1,813 @@
+#pragma once
+#include "numa.h"
+#include "render.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Coordinator/worker rendering over a Unix or TCP socket.
+//
+// The coordinator splits the image into (tile, pass) jobs and hands one job at a time to each
+// connected worker. Workers send back float radiance sums for the tile and the number of samples
+// they contain. A tile is added to the output once all of its passes are in, always in
+// pass order, so the merged image does not depend on which worker rendered what. Jobs held by a
+// worker that disconnects are put back in the queue, and so are jobs that run far longer than the
+// median job, in case their worker has hung; whichever copy finishes first is kept.
+//
+// Endpoints are written "unix:/path/to/socket" or "tcp:host:port". Messages are sent in host byte
+// order, so all machines taking part must share endianness.
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <csignal>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum class message_type : uint32_t
+{
+    job = 1,
+    result = 2,
+    shutdown = 3,
+
+    // Render server (render_server.h).
+    render_request = 4,
+    render_started = 5,
+    tile = 6,
+    render_done = 7
+};
+
+struct job_message
+{
+    uint32_t m_job_id;
+    int32_t m_scene;
+    int32_t m_image_width;
+    int32_t m_image_height;
+    int32_t m_samples_per_pixel;
+    int32_t m_max_depth;
+    int32_t m_tile_size;
+    int32_t m_passes;
+    uint64_t m_seed;
+    double m_split_budget;
+    int32_t m_accel;
+    int32_t m_layout;
+    int32_t m_trace;
+    int32_t m_lights;
+    int32_t m_guiding;
+    int32_t m_photons;
+    double m_photon_radius;
+    int32_t m_radiance_cache;
+    int32_t m_cache_paths;
+    double m_cache_cell;
+    int32_t m_page_geometry;
+    int32_t m_view_flags;  // 1: m_lookfrom is set, 2: m_lookat is set
+    double m_lookfrom[3];
+    double m_lookat[3];
+    double m_vfov;
+    int32_t m_tile_index;
+    int32_t m_pass;
+    int32_t m_heatmaps;       // 1: send each pixel's BVH node and primitive test costs after the radiance sums
+    int32_t m_grid_size[3];
+    char m_environment[256];  // render_settings::m_environment, null-terminated
+    char m_density_grid[256];  // render_settings::m_density_grid, null-terminated
+};
+
+struct result_header
+{
+    uint32_t m_job_id;
+    int32_t m_samples;
+    uint32_t m_float_count;
+    int32_t m_numa_node;          // node the worker rendered the job on, -1 if unknown
+    double m_seconds;             // time the worker spent rendering the job
+    render_counters m_counters;   // what the job added to the worker's counters, with RT_ENABLE_STATS
+};
+
+// Work done on one NUMA node, summed over the results of the workers there.
+struct numa_node_counters
+{
+    int m_workers = 0;       // local workers placed on the node
+    long long m_jobs = 0;
+    double m_samples = 0.0;  // camera samples: pixels times samples per pixel
+    double m_seconds = 0.0;  // render time, summed over workers
+};
+
+// A job running longer than this many times the median job is handed out again.
+constexpr double JOB_DEADLINE_FACTOR = 10.0;
+constexpr double JOB_DEADLINE_MIN_SECONDS = 1.0;
+constexpr int JOB_DEADLINE_MIN_SAMPLES = 4;  // jobs to finish before deadlines apply
+
+// The job for one pass of a tile; render_server.h also sends whole images this way, with both left at 0.
+inline job_message make_job_message(const render_settings& settings, uint32_t job_id, int tile_index, int pass)
+{
+    const view_override& view = settings.m_view;
+    job_message job { job_id, settings.m_scene, settings.m_image_width, settings.m_image_height,
+                      settings.m_samples_per_pixel, settings.m_max_depth, settings.m_tile_size, settings.m_passes,
+                      settings.m_seed, settings.m_split_budget, static_cast<int32_t>(settings.m_accel),
+                      static_cast<int32_t>(settings.m_layout), static_cast<int32_t>(settings.m_trace),
+                      static_cast<int32_t>(settings.m_lights), settings.m_guiding, settings.m_photons,
+                      settings.m_photon_radius, settings.m_radiance_cache, settings.m_cache_paths, settings.m_cache_cell,
+                      settings.m_page_geometry ? 1 : 0, (view.m_has_lookfrom ? 1 : 0) | (view.m_has_lookat ? 2 : 0),
+                      { view.m_lookfrom.x(), view.m_lookfrom.y(), view.m_lookfrom.z() },
+                      { view.m_lookat.x(), view.m_lookat.y(), view.m_lookat.z() }, view.m_vfov,
+                      tile_index, pass, 0, { settings.m_grid_size[0], settings.m_grid_size[1], settings.m_grid_size[2] },
+                      {}, {} };
+    strncpy(job.m_environment, settings.m_environment.c_str(), sizeof(job.m_environment) - 1);
+    strncpy(job.m_density_grid, settings.m_density_grid.c_str(), sizeof(job.m_density_grid) - 1);
+    return job;
+}
+
+// The settings a job was made from.
+inline render_settings job_settings(const job_message& job)
+{
+    render_settings settings;
+    settings.m_scene = job.m_scene;
+    settings.m_image_width = job.m_image_width;
+    settings.m_image_height = job.m_image_height;
+    settings.m_samples_per_pixel = job.m_samples_per_pixel;
+    settings.m_max_depth = job.m_max_depth;
+    settings.m_tile_size = job.m_tile_size;
+    settings.m_passes = job.m_passes;
+    settings.m_seed = job.m_seed;
+    settings.m_accel = static_cast<accel_kind>(job.m_accel);
+    settings.m_split_budget = job.m_split_budget;
+    settings.m_layout = static_cast<bvh_layout>(job.m_layout);
+    settings.m_trace = static_cast<trace_order>(job.m_trace);
+    settings.m_lights = static_cast<light_sampling>(job.m_lights);
+    settings.m_guiding = job.m_guiding;
+    settings.m_photons = job.m_photons;
+    settings.m_photon_radius = job.m_photon_radius;
+    settings.m_radiance_cache = job.m_radiance_cache;
+    settings.m_cache_paths = job.m_cache_paths;
+    settings.m_cache_cell = job.m_cache_cell;
+    settings.m_page_geometry = job.m_page_geometry != 0;
+    settings.m_view.m_has_lookfrom = (job.m_view_flags & 1) != 0;
+    settings.m_view.m_has_lookat = (job.m_view_flags & 2) != 0;
+    settings.m_view.m_lookfrom = point3(job.m_lookfrom[0], job.m_lookfrom[1], job.m_lookfrom[2]);
+    settings.m_view.m_lookat = point3(job.m_lookat[0], job.m_lookat[1], job.m_lookat[2]);
+    settings.m_view.m_vfov = job.m_vfov;
+    settings.m_environment.assign(job.m_environment, strnlen(job.m_environment, sizeof(job.m_environment)));
+    settings.m_density_grid.assign(job.m_density_grid, strnlen(job.m_density_grid, sizeof(job.m_density_grid)));
+    for (int a = 0; a < 3; a++)
+        settings.m_grid_size[a] = job.m_grid_size[a];
+    return settings;
+}
+
+inline bool send_all(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        const ssize_t n = send(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+inline bool recv_all(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size > 0)
+    {
+        const ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Opens a listening (listening = true) or connected socket for the endpoint. Returns -1 on failure.
+inline int open_endpoint(const std::string& endpoint, bool listening)
+{
+    if (endpoint.compare(0, 5, "unix:") == 0)
+    {
+        const std::string path = endpoint.substr(5);
+        sockaddr_un addr {};
+        if (path.size() >= sizeof(addr.sun_path))
+        {
+            std::cerr << "Socket path too long: " << path << ".\n";
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+
+        if (listening)
+        {
+            unlink(path.c_str());
+            if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 && listen(fd, 64) == 0)
+                return fd;
+        }
+        else if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+            return fd;
+
+        close(fd);
+        return -1;
+    }
+
+    if (endpoint.compare(0, 4, "tcp:") == 0)
+    {
+        const std::string host_port = endpoint.substr(4);
+        const size_t colon = host_port.rfind(':');
+        if (colon == std::string::npos)
+        {
+            std::cerr << "Expected tcp:host:port, got " << endpoint << ".\n";
+            return -1;
+        }
+        const std::string host = host_port.substr(0, colon);
+        const std::string port = host_port.substr(colon + 1);
+
+        addrinfo hints {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+        addrinfo* found = nullptr;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0)
+            return -1;
+
+        int fd = -1;
+        for (addrinfo* ai = found; ai && fd < 0; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+
+            const int one = 1;
+            bool ok;
+            if (listening)
+            {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0;
+            }
+            else
+            {
+                ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+                if (ok)
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+
+            if (!ok)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+        return fd;
+    }
+
+    std::cerr << "Unknown endpoint " << endpoint << " (expected unix:<path> or tcp:<host>:<port>).\n";
+    return -1;
+}
+
+// Renders jobs from the coordinator at endpoint until it shuts down. With pin_node >= 0 the worker first pins
+// itself to that node, so the scene it loads, its acceleration structures and its tile buffers are first touched,
+// and therefore placed, on the node whose CPUs read them.
+inline int run_worker(const std::string& endpoint, int pin_node = -1)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    const std::vector<numa_node> nodes = numa_topology();
+    if (pin_node >= 0)
+    {
+        bool pinned = false;
+        for (const numa_node& node : nodes)
+            if (node.m_id == pin_node)
+                pinned = bind_to_numa_node(node);
+        if (!pinned)
+        {
+            std::cerr << "Worker cannot be pinned to NUMA node " << pin_node << ".\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The coordinator may still be starting up.
+    int fd = -1;
+    for (int attempt = 0; attempt < 50 && fd < 0; attempt++)
+    {
+        fd = open_endpoint(endpoint, false);
+        if (fd < 0)
+            usleep(100000);
+    }
+    if (fd < 0)
+    {
+        std::cerr << "Worker cannot connect to " << endpoint << ".\n";
+        return EXIT_FAILURE;
+    }
+
+    // The scene stays loaded for as long as jobs keep referring to it.
+    render_settings loaded;
+    bool have_scene = false;
+    scene_description scene;
+    std::vector<image_tile> tiles;
+    std::vector<float> sums;
+    std::unique_ptr<stats_heatmap> node_costs, primitive_costs;
+
+    while (true)
+    {
+        message_type type;
+        if (!recv_all(fd, &type, sizeof(type)) || type == message_type::shutdown)
+            break;
+
+        job_message job;
+        if (type != message_type::job || !recv_all(fd, &job, sizeof(job)))
+            break;
+
+        const render_settings settings = job_settings(job);
+        if (!have_scene || !same_scene_build(loaded, settings))
+        {
+            scene = scene_description();
+            if (!load_render_scene(settings, scene))
+            {
+                std::cerr << "Worker cannot load scene " << settings.m_scene << ".\n";
+                break;
+            }
+            have_scene = true;
+        }
+        if (loaded.m_image_width != settings.m_image_width || loaded.m_image_height != settings.m_image_height
+            || loaded.m_tile_size != settings.m_tile_size || tiles.empty())
+            tiles = make_tiles(settings.m_image_width, settings.m_image_height, settings.m_tile_size);
+        loaded = settings;
+
+        if (job.m_heatmaps && (!node_costs || node_costs->width() != settings.m_image_width
+                               || node_costs->height() != settings.m_image_height))
+        {
+            node_costs = std::make_unique<stats_heatmap>(settings.m_image_width, settings.m_image_height);
+            primitive_costs = std::make_unique<stats_heatmap>(settings.m_image_width, settings.m_image_height);
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        render_tile(scene, make_render_camera(scene, settings), settings, tiles, job.m_tile_index, job.m_pass, sums,
+                    job.m_heatmaps ? node_costs.get() : nullptr, job.m_heatmaps ? primitive_costs.get() : nullptr);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // The pixel costs follow the radiance sums, nodes then primitive tests, in the same pixel order.
+        if (job.m_heatmaps)
+        {
+            const image_tile& tile = tiles[job.m_tile_index];
+            for (stats_heatmap* costs : { node_costs.get(), primitive_costs.get() })
+                for (int j = tile.m_y0; j < tile.m_y1; ++j)
+                    for (int i = tile.m_x0; i < tile.m_x1; ++i)
+                        sums.push_back(static_cast<float>(costs->take(i, j)));
+        }
+
+        const message_type reply = message_type::result;
+        const result_header header { job.m_job_id, pass_samples(settings, job.m_pass), static_cast<uint32_t>(sums.size()),
+                                     pin_node >= 0 ? pin_node : current_numa_node(nodes), seconds,
+                                     render_stats::local() };
+        render_stats::local() = render_counters();
+        if (!send_all(fd, &reply, sizeof(reply)) || !send_all(fd, &header, sizeof(header))
+            || !send_all(fd, sums.data(), sums.size() * sizeof(float)))
+            break;
+    }
+
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+// Renders settings into out using remote or local workers. If local_workers > 0, that many
+// `program --worker <endpoint>` processes are started on this host (program is usually argv[0]).
+// The workers' render counters are added to the calling thread's, and their per-pixel costs to the heatmaps
+// when those are given, as a local render would.
+// With numa_placement they are dealt out over the NUMA nodes in turn, each pinned to its node and with its own
+// copy of the scene there. Render throughput per node is reported at the end when workers were placed, or when
+// this host has more than one node.
+inline bool run_coordinator(const render_settings& settings, const std::string& endpoint, const std::string& program,
+                            int local_workers, tile_sink& out, bool numa_placement = false,
+                            stats_heatmap* node_heatmap = nullptr, stats_heatmap* primitive_heatmap = nullptr)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    if (settings.m_environment.size() >= sizeof(job_message::m_environment))
+    {
+        std::cerr << "Environment map path is too long for distributed rendering.\n";
+        return false;
+    }
+    if (settings.m_density_grid.size() >= sizeof(job_message::m_density_grid))
+    {
+        std::cerr << "Density grid path is too long for distributed rendering.\n";
+        return false;
+    }
+
+    const int listen_fd = open_endpoint(endpoint, true);
+    if (listen_fd < 0)
+    {
+        std::cerr << "Coordinator cannot listen on " << endpoint << ".\n";
+        return false;
+    }
+
+    // argv[0] may be a bare name resolved through PATH; prefer the running image where available.
+    const std::string executable = access("/proc/self/exe", X_OK) == 0 ? "/proc/self/exe" : program;
+
+    const std::vector<numa_node> nodes = numa_topology();
+    std::map<int, numa_node_counters> node_counters;
+
+    std::vector<pid_t> children;
+    for (int w = 0; w < local_workers; w++)
+    {
+        const std::string node = numa_placement ? std::to_string(nodes[w % nodes.size()].m_id) : "";
+        const pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(listen_fd);
+            if (numa_placement)
+                execl(executable.c_str(), program.c_str(), "--worker", endpoint.c_str(), "--numa-node", node.c_str(),
+                      static_cast<char*>(nullptr));
+            else
+                execl(executable.c_str(), program.c_str(), "--worker", endpoint.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        if (pid > 0)
+        {
+            children.push_back(pid);
+            if (numa_placement)
+                node_counters[nodes[w % nodes.size()].m_id].m_workers++;
+        }
+    }
+
+    const std::vector<image_tile> tiles = make_tiles(settings.m_image_width, settings.m_image_height, settings.m_tile_size);
+    const int job_count = static_cast<int>(tiles.size()) * settings.m_passes;
+
+    // Job id = tile_index * passes + pass. A job may be out with several workers at once after it was handed out
+    // again; m_copies counts them, and only the first result for it is used.
+    struct job_state
+    {
+        bool m_done = false;
+        bool m_queued = true;
+        int m_copies = 0;
+    };
+    std::vector<job_state> jobs(job_count);
+    std::deque<int> pending;
+    for (int job = 0; job < job_count; job++)
+        pending.push_back(job);
+
+    const auto requeue = [&](int id)
+    {
+        if (jobs[id].m_done || jobs[id].m_queued)
+            return;
+        pending.push_front(id);
+        jobs[id].m_queued = true;
+    };
+
+    std::map<int, std::vector<std::vector<float>>> partial_tiles;
+    std::vector<int> passes_done(tiles.size(), 0);
+    int tiles_done = 0;
+
+    // Wall time from handing out a job to its result, for the deadline. A worker's first job also loads the
+    // scene, so those are kept apart and the slowest is allowed on top of the deadline for a first job.
+    std::vector<double> job_seconds;
+    double slowest_first_job = 0.0;
+
+    struct worker_connection
+    {
+        int m_fd;
+        int m_job;
+        std::chrono::steady_clock::time_point m_started;
+        bool m_reissued;  // m_job was handed out again after it passed its deadline
+        int m_jobs_done;
+        std::vector<char> m_received;  // bytes of the result not yet complete
+    };
+    std::vector<worker_connection> workers;
+
+    const bool heatmaps = node_heatmap && primitive_heatmap;
+    const auto result_floats = [&](int id)
+    {
+        return static_cast<size_t>(tiles[id / settings.m_passes].pixel_count()) * (heatmaps ? 5 : 3);
+    };
+
+    // Reads what the worker has sent of its result without blocking, never more than that one message, so a worker
+    // that sends part of a result and stalls holds up nobody else; its job runs into the deadline instead. The
+    // header is checked against the worker's job before the payload is read. Returns false if the worker has gone
+    // or sent something else; complete is set once the whole result is in m_received.
+    const auto receive_result = [&](worker_connection& worker, bool& complete)
+    {
+        constexpr size_t header_size = sizeof(message_type) + sizeof(result_header);
+        std::vector<char>& received = worker.m_received;
+        complete = false;
+        while (true)
+        {
+            size_t needed = header_size;
+            if (received.size() >= header_size)
+            {
+                message_type type;
+                result_header header;
+                memcpy(&type, received.data(), sizeof(type));
+                memcpy(&header, received.data() + sizeof(type), sizeof(header));
+                if (type != message_type::result || worker.m_job < 0
+                    || header.m_job_id != static_cast<uint32_t>(worker.m_job)
+                    || header.m_float_count != result_floats(worker.m_job))
+                    return false;
+                needed += header.m_float_count * sizeof(float);
+                if (received.size() == needed)
+                {
+                    complete = true;
+                    return true;
+                }
+            }
+
+            const size_t have = received.size();
+            received.resize(needed);
+            const ssize_t n = recv(worker.m_fd, received.data() + have, needed - have, MSG_DONTWAIT);
+            received.resize(have + std::max<ssize_t>(n, 0));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (n <= 0)
+                return false;
+        }
+    };
+
+    const auto assign = [&](worker_connection& worker)
+    {
+        worker.m_job = -1;
+        while (!pending.empty() && jobs[pending.front()].m_done)
+        {
+            jobs[pending.front()].m_queued = false;
+            pending.pop_front();
+        }
+        if (pending.empty())
+            return true;
+
+        const int id = pending.front();
+        pending.pop_front();
+        jobs[id].m_queued = false;
+
+        job_message job = make_job_message(settings, static_cast<uint32_t>(id), id / settings.m_passes,
+                                           id % settings.m_passes);
+        job.m_heatmaps = heatmaps ? 1 : 0;
+        const message_type type = message_type::job;
+        if (!send_all(worker.m_fd, &type, sizeof(type)) || !send_all(worker.m_fd, &job, sizeof(job)))
+        {
+            requeue(id);
+            return false;
+        }
+        worker.m_job = id;
+        worker.m_started = std::chrono::steady_clock::now();
+        worker.m_reissued = false;
+        jobs[id].m_copies++;
+        return true;
+    };
+
+    const auto drop = [&](size_t w)
+    {
+        const int id = workers[w].m_job;
+        if (id >= 0 && --jobs[id].m_copies == 0 && !jobs[id].m_done)
+        {
+            std::cerr << "\nWorker lost; requeueing job " << id << ".\n";
+            requeue(id);
+        }
+        close(workers[w].m_fd);
+        workers.erase(workers.begin() + w);
+    };
+
+    // Seconds a job may run before it is handed out again, or a negative value while too few jobs have finished
+    // to tell.
+    const auto job_deadline = [&](const worker_connection& worker)
+    {
+        if (static_cast<int>(job_seconds.size()) < JOB_DEADLINE_MIN_SAMPLES)
+            return -1.0;
+        std::vector<double> sorted = job_seconds;
+        std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+        const double deadline = std::max(JOB_DEADLINE_FACTOR * sorted[sorted.size() / 2], JOB_DEADLINE_MIN_SECONDS);
+        return worker.m_jobs_done == 0 ? deadline + slowest_first_job : deadline;
+    };
+
+    bool ok = true;
+    while (tiles_done < static_cast<int>(tiles.size()))
+    {
+        std::vector<pollfd> fds;
+        fds.push_back({ listen_fd, POLLIN, 0 });
+        for (const auto& worker : workers)
+            fds.push_back({ worker.m_fd, POLLIN, 0 });
+
+        const int ready = poll(fds.data(), fds.size(), 1000);
+        if (ready < 0 && errno != EINTR)
+        {
+            ok = false;
+            break;
+        }
+
+        // A worker may hang without disconnecting; its job goes to the next free worker, and the worker keeps it
+        // in case it still finishes first.
+        const auto now = std::chrono::steady_clock::now();
+        for (worker_connection& worker : workers)
+        {
+            if (worker.m_job < 0 || worker.m_reissued || jobs[worker.m_job].m_done)
+                continue;
+            const double deadline = job_deadline(worker);
+            if (deadline >= 0 && std::chrono::duration<double>(now - worker.m_started).count() > deadline)
+            {
+                std::cerr << "\nJob " << worker.m_job << " is overdue; handing it out again.\n";
+                worker.m_reissued = true;
+                requeue(worker.m_job);
+            }
+        }
+
+        if (ready <= 0)
+        {
+            // Nobody left to do the work and nobody who could still connect.
+            for (size_t c = 0; c < children.size(); )
+            {
+                if (waitpid(children[c], nullptr, WNOHANG) == children[c])
+                    children.erase(children.begin() + c);
+                else
+                    ++c;
+            }
+            if (local_workers > 0 && children.empty() && workers.empty())
+            {
+                std::cerr << "\nAll local workers exited before the render finished.\n";
+                ok = false;
+                break;
+            }
+            continue;
+        }
+
+        // Walk workers back to front so drop() does not shift entries still to be visited.
+        for (size_t w = workers.size(); w-- > 0; )
+        {
+            if (!(fds[w + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            bool complete = false;
+            if (!receive_result(workers[w], complete))
+            {
+                drop(w);
+                continue;
+            }
+            if (!complete)
+                continue;
+
+            result_header header;
+            const char* payload = workers[w].m_received.data() + sizeof(message_type);
+            memcpy(&header, payload, sizeof(header));
+            std::vector<float> sums(header.m_float_count);
+            memcpy(sums.data(), payload + sizeof(header), sums.size() * sizeof(float));
+            workers[w].m_received.clear();
+
+            const int id = static_cast<int>(header.m_job_id);
+            const int tile_index = id / settings.m_passes;
+            const int pass = id % settings.m_passes;
+
+            jobs[id].m_copies--;
+            const auto finished = std::chrono::steady_clock::now();
+            const double seconds = std::chrono::duration<double>(finished - workers[w].m_started).count();
+            if (workers[w].m_jobs_done++ == 0)
+                slowest_first_job = std::max(slowest_first_job, seconds);
+            else
+                job_seconds.push_back(seconds);
+
+            // The other copy of a job that was handed out again got there first.
+            if (jobs[id].m_done)
+            {
+                if (!assign(workers[w]))
+                    drop(w);
+                continue;
+            }
+            jobs[id].m_done = true;
+
+            render_stats::local() += header.m_counters;
+            const image_tile& tile = tiles[tile_index];
+            if (heatmaps)
+            {
+                const float* costs = sums.data() + 3 * tile.pixel_count();
+                for (stats_heatmap* heatmap : { node_heatmap, primitive_heatmap })
+                    for (int j = tile.m_y0; j < tile.m_y1; ++j)
+                        for (int i = tile.m_x0; i < tile.m_x1; ++i)
+                            heatmap->add(i, j, *costs++);
+                sums.resize(3 * static_cast<size_t>(tile.pixel_count()));
+            }
+
+            if (header.m_numa_node >= 0)
+            {
+                numa_node_counters& counters = node_counters[header.m_numa_node];
+                counters.m_jobs++;
+                counters.m_samples += static_cast<double>(tiles[tile_index].pixel_count()) * header.m_samples;
+                counters.m_seconds += header.m_seconds;
+            }
+
+            auto& passes = partial_tiles[tile_index];
+            passes.resize(settings.m_passes);
+            passes[pass] = std::move(sums);
+
+            if (++passes_done[tile_index] == settings.m_passes)
+            {
+                out.add_passes(tiles[tile_index], passes, settings);
+                partial_tiles.erase(tile_index);
+                ++tiles_done;
+                std::cerr << "\rTiles remaining: " << tiles.size() - tiles_done << ' ' << std::flush;
+            }
+
+            if (!assign(workers[w]))
+                drop(w);
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            const int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                workers.push_back({ fd, -1, {}, false, 0, {} });
+                if (!assign(workers.back()))
+                    drop(workers.size() - 1);
+            }
+        }
+
+        // Idle workers pick up jobs that were requeued after a failure or a missed deadline.
+        for (size_t w = workers.size(); w-- > 0; )
+            if (workers[w].m_job < 0 && !pending.empty() && !assign(workers[w]))
+                drop(w);
+    }
+
+    for (const auto& worker : workers)
+    {
+        const message_type type = message_type::shutdown;
+        send_all(worker.m_fd, &type, sizeof(type));
+        close(worker.m_fd);
+    }
+    close(listen_fd);
+    if (endpoint.compare(0, 5, "unix:") == 0)
+        unlink(endpoint.substr(5).c_str());
+
+    // Workers left holding a job that another worker finished may be hung; local ones get a moment to see the
+    // shutdown and are then killed.
+    for (int wait = 0; wait < 20 && !children.empty(); wait++)
+    {
+        for (size_t c = 0; c < children.size(); )
+        {
+            if (waitpid(children[c], nullptr, WNOHANG) == children[c])
+                children.erase(children.begin() + c);
+            else
+                ++c;
+        }
+        if (!children.empty())
+            usleep(100000);
+    }
+    for (const pid_t pid : children)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+
+    if (numa_placement || nodes.size() > 1)
+    {
+        std::cerr << '\n';
+        for (const auto& entry : node_counters)
+        {
+            const numa_node_counters& counters = entry.second;
+            std::cerr << "NUMA node " << entry.first << ": ";
+            if (numa_placement)
+                std::cerr << counters.m_workers << " workers, ";
+            std::cerr << counters.m_jobs << " jobs, "
+                      << (counters.m_seconds > 0 ? counters.m_samples / counters.m_seconds / 1e6 : 0.0)
+                      << " M samples/s per worker.\n";
+        }
+    }
+
+    return ok;
+}
+
+#else
+
+inline int run_worker(const std::string& endpoint, int pin_node = -1)
+{
+    std::cerr << "Distributed rendering is only available on POSIX systems.\n";
+    return EXIT_FAILURE;
+}
+
+inline bool run_coordinator(const render_settings& settings, const std::string& endpoint, const std::string& program,
+                            int local_workers, tile_sink& out, bool numa_placement = false,
+                            stats_heatmap* node_heatmap = nullptr, stats_heatmap* primitive_heatmap = nullptr)
+{
+    std::cerr << "Distributed rendering is only available on POSIX systems.\n";
+    return false;
+}
+
+#endif
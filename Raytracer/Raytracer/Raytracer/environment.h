@@ -0,0 +1,346 @@
+#pragma once
+#include "constants.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Equirectangular HDR environment seen by rays that leave the scene. Column u covers the azimuth
+// atan2(z, x) from 0 to 2 pi, row v the angle from +y (top row) down to -y. Texels are looked up
+// nearest-neighbour, so the radiance is piecewise constant and can be sampled exactly: a marginal CDF
+// over the rows and a conditional CDF within each row, weighted by luminance times the solid angle of
+// the row, send directions towards the sun and the bright parts of the sky.
+class environment_map
+{
+public:
+    // texels: width * height RGB triples, top row first.
+    environment_map(int width, int height, std::vector<float> texels, double scale = 1.0);
+
+    // Reads a Radiance RGBE (.hdr) or portable float map (.pfm) image. Returns nullptr on failure.
+    static std::shared_ptr<environment_map> load(const std::string& path);
+
+    // Reads the RGB pixels of a portable float map, top row first.
+    static bool read_pfm(std::ifstream& ifs, int& width, int& height, std::vector<float>& texels);
+
+    // Procedural clear sky with a sun disc of the given angular radius at the given elevation and azimuth (degrees).
+    static std::shared_ptr<environment_map> sun_sky(int width, double sun_elevation, double sun_azimuth,
+                                                    double sun_radius, double sun_radiance);
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    color radiance(const vec3& dir) const
+    {
+        int x, y;
+        texel_of(dir, x, y);
+        const float* t = &m_texels[3 * (static_cast<size_t>(y) * m_width + x)];
+        return m_scale * color(t[0], t[1], t[2]);
+    }
+
+    // Picks a direction from the luminance distribution, or uniformly over the sphere when importance sampling is
+    // off. Returns its density per unit solid angle, 0 if nothing can be sampled.
+    double sample(double u1, double u2, vec3& dir) const;
+
+    // Density per unit solid angle with which sample() picks dir.
+    double pdf(const vec3& dir) const;
+
+    bool importance_sampled() const { return m_importance; }
+    void set_importance_sampling(bool on) { m_importance = on; }
+
+    size_t memory_bytes() const
+    {
+        return m_texels.size() * sizeof(float) + (m_row_cdf.size() + m_column_cdf.size()) * sizeof(double);
+    }
+
+private:
+    static vec3 direction(double u, double v)
+    {
+        const double phi = 2 * PI * u;
+        const double theta = PI * v;
+        return vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+    }
+
+    void texel_of(const vec3& dir, int& x, int& y) const
+    {
+        const vec3 d = unit_vector(dir);
+        double phi = atan2(d.z(), d.x());
+        if (phi < 0)
+            phi += 2 * PI;
+        const double theta = acos(clamp(d.y(), -1.0, 1.0));
+        x = std::min(static_cast<int>(phi / (2 * PI) * m_width), m_width - 1);
+        y = std::min(static_cast<int>(theta / PI * m_height), m_height - 1);
+    }
+
+    // Interval of the count + 1 entry cdf that u falls into, and where in it.
+    static int sample_cdf(const double* cdf, int count, double u, double& offset)
+    {
+        const int i = std::clamp(static_cast<int>(std::upper_bound(cdf, cdf + count + 1, u) - cdf) - 1, 0, count - 1);
+        const double width = cdf[i + 1] - cdf[i];
+        offset = width > 0 ? clamp((u - cdf[i]) / width, 0.0, 1.0) : 0.5;
+        return i;
+    }
+
+    static bool read_hdr(std::ifstream& ifs, int& width, int& height, std::vector<float>& texels);
+
+private:
+    int m_width;
+    int m_height;
+    double m_scale;
+    bool m_importance = true;
+    std::vector<float> m_texels;
+    std::vector<double> m_weights;     // per texel: luminance times sin(theta) of its row
+    std::vector<double> m_row_cdf;     // m_height + 1 entries over the row sums of m_weights
+    std::vector<double> m_column_cdf;  // m_width + 1 entries per row
+    double m_weight_sum = 0.0;
+};
+
+inline environment_map::environment_map(int width, int height, std::vector<float> texels, double scale)
+    : m_width(width)
+    , m_height(height)
+    , m_scale(scale)
+    , m_texels(std::move(texels))
+    , m_weights(static_cast<size_t>(width) * height)
+    , m_row_cdf(height + 1, 0.0)
+    , m_column_cdf(static_cast<size_t>(width + 1) * height, 0.0)
+{
+    for (int y = 0; y < m_height; y++)
+    {
+        const double sin_theta = sin(PI * (y + 0.5) / m_height);
+        double* cdf = &m_column_cdf[static_cast<size_t>(y) * (m_width + 1)];
+        for (int x = 0; x < m_width; x++)
+        {
+            const size_t i = static_cast<size_t>(y) * m_width + x;
+            const float* t = &m_texels[3 * i];
+            m_weights[i] = std::max(0.2126 * t[0] + 0.7152 * t[1] + 0.0722 * t[2], 0.0) * sin_theta;
+            cdf[x + 1] = cdf[x] + m_weights[i];
+        }
+
+        const double row_sum = cdf[m_width];
+        m_row_cdf[y + 1] = m_row_cdf[y] + row_sum;
+        for (int x = 1; x <= m_width; x++)
+            cdf[x] = row_sum > 0 ? cdf[x] / row_sum : static_cast<double>(x) / m_width;
+    }
+
+    m_weight_sum = m_row_cdf[m_height];
+    for (int y = 1; y <= m_height; y++)
+        m_row_cdf[y] = m_weight_sum > 0 ? m_row_cdf[y] / m_weight_sum : static_cast<double>(y) / m_height;
+}
+
+inline double environment_map::sample(double u1, double u2, vec3& dir) const
+{
+    if (!m_importance)
+    {
+        const double z = 1 - 2 * u1;
+        const double r = sqrt(std::max(0.0, 1 - z * z));
+        dir = vec3(r * cos(2 * PI * u2), z, r * sin(2 * PI * u2));
+        return 1 / (4 * PI);
+    }
+
+    if (m_weight_sum <= 0)
+        return 0.0;
+
+    double v_offset, u_offset;
+    const int y = sample_cdf(m_row_cdf.data(), m_height, u1, v_offset);
+    const int x = sample_cdf(&m_column_cdf[static_cast<size_t>(y) * (m_width + 1)], m_width, u2, u_offset);
+
+    const double v = (y + v_offset) / m_height;
+    dir = direction((x + u_offset) / m_width, v);
+
+    const double sin_theta = sin(PI * v);
+    if (sin_theta <= 0)
+        return 0.0;
+    const double pdf_uv = m_weights[static_cast<size_t>(y) * m_width + x] * m_width * m_height / m_weight_sum;
+    return pdf_uv / (2 * PI * PI * sin_theta);
+}
+
+inline double environment_map::pdf(const vec3& dir) const
+{
+    if (!m_importance)
+        return 1 / (4 * PI);
+    if (m_weight_sum <= 0)
+        return 0.0;
+
+    int x, y;
+    texel_of(dir, x, y);
+    const double sin_theta = sqrt(std::max(0.0, 1 - unit_vector(dir).y() * unit_vector(dir).y()));
+    if (sin_theta <= 0)
+        return 0.0;
+    const double pdf_uv = m_weights[static_cast<size_t>(y) * m_width + x] * m_width * m_height / m_weight_sum;
+    return pdf_uv / (2 * PI * PI * sin_theta);
+}
+
+inline std::shared_ptr<environment_map> environment_map::load(const std::string& path)
+{
+    std::ifstream ifs(path, std::ios_base::in | std::ios_base::binary);
+    int width = 0, height = 0;
+    std::vector<float> texels;
+
+    const bool pfm = path.size() > 4 && path.compare(path.size() - 4, 4, ".pfm") == 0;
+    if (!ifs || !(pfm ? read_pfm(ifs, width, height, texels) : read_hdr(ifs, width, height, texels)))
+    {
+        std::cerr << "Cannot read environment map " << path << ".\n";
+        return nullptr;
+    }
+
+    return std::make_shared<environment_map>(width, height, std::move(texels));
+}
+
+inline bool environment_map::read_hdr(std::ifstream& ifs, int& width, int& height, std::vector<float>& texels)
+{
+    std::string line;
+    if (!std::getline(ifs, line) || line.compare(0, 2, "#?") != 0)
+        return false;
+
+    bool rgbe = true;
+    while (std::getline(ifs, line) && !line.empty())
+        if (line.compare(0, 7, "FORMAT=") == 0)
+            rgbe = line == "FORMAT=32-bit_rle_rgbe";
+
+    // Only the common orientation: rows from the top, columns from the left.
+    char y_axis[3] = {}, x_axis[3] = {};
+    if (!rgbe || !std::getline(ifs, line) || sscanf(line.c_str(), "%2s %d %2s %d", y_axis, &height, x_axis, &width) != 4
+        || std::string(y_axis) != "-Y" || std::string(x_axis) != "+X" || width <= 0 || height <= 0)
+        return false;
+
+    texels.resize(static_cast<size_t>(width) * height * 3);
+    std::vector<uint8_t> scanline(static_cast<size_t>(width) * 4);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint8_t head[4];
+        if (!ifs.read(reinterpret_cast<char*>(head), 4))
+            return false;
+
+        if (width < 8 || width > 0x7fff || head[0] != 2 || head[1] != 2 || (head[2] & 0x80))
+        {
+            // Flat scanline: width RGBE pixels, the first of them already read.
+            std::copy(head, head + 4, scanline.begin());
+            if (!ifs.read(reinterpret_cast<char*>(scanline.data()) + 4, scanline.size() - 4))
+                return false;
+        }
+        else
+        {
+            if (((head[2] << 8) | head[3]) != width)
+                return false;
+
+            // Run-length encoded: the four components one after another.
+            for (int c = 0; c < 4; c++)
+                for (int x = 0; x < width;)
+                {
+                    int count = ifs.get();
+                    if (count == EOF)
+                        return false;
+                    if (count > 128)
+                    {
+                        count -= 128;
+                        const int value = ifs.get();
+                        if (value == EOF || x + count > width)
+                            return false;
+                        for (; count > 0; count--)
+                            scanline[4 * x++ + c] = static_cast<uint8_t>(value);
+                    }
+                    else
+                    {
+                        if (count == 0 || x + count > width)
+                            return false;
+                        for (; count > 0; count--)
+                        {
+                            const int value = ifs.get();
+                            if (value == EOF)
+                                return false;
+                            scanline[4 * x++ + c] = static_cast<uint8_t>(value);
+                        }
+                    }
+                }
+        }
+
+        for (int x = 0; x < width; x++)
+        {
+            const uint8_t* p = &scanline[4 * x];
+            const double f = p[3] ? ldexp(1.0, p[3] - (128 + 8)) : 0.0;
+            float* t = &texels[3 * (static_cast<size_t>(y) * width + x)];
+            for (int c = 0; c < 3; c++)
+                t[c] = p[3] ? static_cast<float>((p[c] + 0.5) * f) : 0.f;
+        }
+    }
+    return true;
+}
+
+inline bool environment_map::read_pfm(std::ifstream& ifs, int& width, int& height, std::vector<float>& texels)
+{
+    std::string magic;
+    double scale = 0;
+    ifs >> magic >> width >> height >> scale;
+    if (!ifs || magic != "PF" || width <= 0 || height <= 0 || scale == 0)
+        return false;
+    ifs.get();
+
+    const size_t count = static_cast<size_t>(width) * height * 3;
+    texels.resize(count);
+    if (!ifs.read(reinterpret_cast<char*>(texels.data()), count * sizeof(float)))
+        return false;
+
+    // A negative scale marks little-endian data.
+    const uint16_t probe = 1;
+    const bool host_little = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+    if ((scale < 0) != host_little)
+        for (float& t : texels)
+        {
+            uint8_t* b = reinterpret_cast<uint8_t*>(&t);
+            std::swap(b[0], b[3]);
+            std::swap(b[1], b[2]);
+        }
+
+    // PFM rows run bottom to top.
+    for (int y = 0; y < height / 2; y++)
+        std::swap_ranges(texels.begin() + static_cast<size_t>(y) * width * 3, texels.begin() + static_cast<size_t>(y + 1) * width * 3,
+                         texels.begin() + static_cast<size_t>(height - 1 - y) * width * 3);
+    return true;
+}
+
+inline std::shared_ptr<environment_map> environment_map::sun_sky(int width, double sun_elevation, double sun_azimuth,
+                                                                 double sun_radius, double sun_radiance)
+{
+    const int height = std::max(width / 2, 1);
+    const double elevation = degrees_to_radians(sun_elevation);
+    const double azimuth = degrees_to_radians(sun_azimuth);
+    const vec3 sun(cos(elevation) * cos(azimuth), sin(elevation), cos(elevation) * sin(azimuth));
+    const double cos_radius = cos(degrees_to_radians(sun_radius));
+
+    const color zenith(0.25, 0.45, 0.95);
+    const color horizon(0.85, 0.9, 1.0);
+    const color ground(0.25, 0.22, 0.2);
+
+    std::vector<float> texels(static_cast<size_t>(width) * height * 3);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            const vec3 d = direction((x + 0.5) / width, (y + 0.5) / height);
+            color c;
+            if (dot(d, sun) >= cos_radius)
+                c = color(sun_radiance, sun_radiance * 0.95, sun_radiance * 0.85);
+            else if (d.y() >= 0)
+            {
+                // Brighter towards the horizon and around the sun.
+                const double t = pow(1 - d.y(), 4);
+                const double glow = pow(std::max(dot(d, sun), 0.0), 32);
+                c = (1 - t) * zenith + t * horizon + glow * color(1.5, 1.3, 1.0);
+            }
+            else
+                c = ground;
+
+            float* t = &texels[3 * (static_cast<size_t>(y) * width + x)];
+            t[0] = static_cast<float>(c.x());
+            t[1] = static_cast<float>(c.y());
+            t[2] = static_cast<float>(c.z());
+        }
+
+    return std::make_shared<environment_map>(width, height, std::move(texels));
+}
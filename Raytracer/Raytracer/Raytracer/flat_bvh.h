@@ -0,0 +1,692 @@
+#pragma once
+#include "constants.h"
+#include "hittable.h"
+#include "hittable_objects.h"
+#include "primitive_dispatch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <vector>
+
+// Node of a flat_bvh: 32 bytes, single-precision bounds rounded outwards.
+struct flat_bvh_node
+{
+    float m_min[3];
+    float m_max[3];
+    uint32_t m_offset;  // leaf: first primitive; inner node: index of the child below the split, the other one follows it
+    uint16_t m_count;   // number of primitives in a leaf, 0 for an inner node
+    uint8_t m_axis;     // split axis of an inner node
+    uint8_t m_pad;
+};
+
+static_assert(sizeof(flat_bvh_node) == 32, "flat_bvh_node should stay 32 bytes");
+
+inline float round_down_float(double d)
+{
+    float f = static_cast<float>(d);
+    return f > d ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up_float(double d)
+{
+    float f = static_cast<float>(d);
+    return f < d ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Slab test of a ray against [lo, hi] using the precomputed reciprocal direction.
+inline bool slab_hit(const double lo[3], const double hi[3], const point3& origin, const vec3& inv_dir, double t_min, double t_max, double& t_enter)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        double t0 = (lo[a] - origin[a]) * inv_dir[a];
+        double t1 = (hi[a] - origin[a]) * inv_dir[a];
+        if (inv_dir[a] < 0.0)
+            std::swap(t0, t1);
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max <= t_min)
+            return false;
+    }
+    t_enter = t_min;
+    return true;
+}
+
+// Node orders flat_bvh::reorder() can produce. Sibling pairs always stay together.
+enum class bvh_layout
+{
+    depth_first,    // build order: every subtree occupies one run of the array
+    van_emde_boas,  // cache-oblivious: the top half of the tree's height first, then each bottom subtree, recursively
+    hot_first       // page-sized clusters of the most visited pairs first, from the counts recorded while profiling
+};
+
+// Options of a flat_bvh build.
+struct flat_bvh_settings
+{
+    // Spatial splits may add up to this fraction of the object count as extra references; 0 turns them off.
+    double m_split_budget = 0.0;
+
+    // Spatial splits are only tried where the children of the best object split overlap by more
+    // than this fraction of the root's surface area. Lower than the usual 1e-5, because one huge
+    // primitive such as a ground sphere can make the root box many orders larger than the rest.
+    double m_overlap_threshold = 1e-8;
+};
+
+// BVH stored as one array of compact nodes in depth-first order and traversed with an explicit stack,
+// instead of a tree of shared_ptr-linked bvh_nodes. Built with binned SAH over the objects' bounds.
+// With a split budget the build also considers spatial splits (SBVH): an object straddling the split
+// plane is referenced from both sides, each reference bounded by the part of the object on its side.
+class flat_bvh : public hittable
+{
+public:
+    static constexpr int MAX_LEAF_SIZE = 4;
+    static constexpr int STACK_SIZE = 128;
+
+    flat_bvh(const hittable_objects& list, double time0, double time1, const flat_bvh_settings& settings = flat_bvh_settings())
+        : flat_bvh(list.get_m_objects(), time0, time1, settings)
+    {}
+
+    flat_bvh(const std::vector<std::shared_ptr<hittable>>& objects, double time0, double time1,
+             const flat_bvh_settings& settings = flat_bvh_settings());
+
+    virtual bool hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const override;
+    virtual void hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const override;
+
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const override
+    {
+        return first_interval(*this, r_in, t_min, t_max, t_enter, t_exit);
+    }
+
+    virtual void collect_primitives(std::vector<const hittable*>& primitives) const override
+    {
+        for (const auto& object : m_objects)
+            object->collect_primitives(primitives);
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+    {
+        output_box = m_bounds;
+        return !m_nodes.empty();
+    }
+
+    const std::vector<flat_bvh_node>& nodes() const { return m_nodes; }
+    const std::vector<const hittable*>& primitives() const { return m_primitives; }
+    const std::vector<std::shared_ptr<hittable>>& objects() const { return m_objects; }
+
+    // While profiling, traversal counts the visits of every node (not thread-safe). Enabling resets the counts.
+    void set_profiling(bool enabled) { m_visits.assign(enabled ? m_nodes.size() : 0, 0); }
+    const std::vector<uint32_t>& visits() const { return m_visits; }
+
+    // Moves the nodes into the given order; what rays hit does not change.
+    void reorder(bvh_layout layout);
+
+    // Bytes taken by the nodes and the primitive references.
+    size_t memory_bytes() const
+    {
+        return m_nodes.size() * sizeof(flat_bvh_node) + m_primitives.size() * sizeof(const hittable*);
+    }
+
+private:
+    struct build_ref
+    {
+        aabb m_box;
+        point3 m_centroid;
+        uint32_t m_object;
+        bool m_splittable;  // false for objects a ray must test only once (hittable::is_stochastic) and flat ones
+    };
+
+    // Rectangles and other boxes much thinner than they are wide. Clipping one only narrows it within its
+    // own plane, and every cell that then holds a piece of it grows to its extent: on a ceiling or floor
+    // under thousands of small objects that made rays visit a third more nodes than object splits alone.
+    static bool is_flat(const aabb& box)
+    {
+        const vec3 extent = box.max() - box.min();
+        return fmin(extent.x(), fmin(extent.y(), extent.z())) < 1e-3 * fmax(extent.x(), fmax(extent.y(), extent.z()));
+    }
+
+    struct build_context
+    {
+        flat_bvh_settings m_settings;
+        double m_time0;
+        double m_time1;
+        double m_root_area;
+        size_t m_references;
+        size_t m_max_references;
+    };
+
+    // Fills node index from refs; the children of an inner node are allocated as an adjacent pair.
+    void build(std::vector<build_ref>& refs, int depth, build_context& context, uint32_t index);
+
+    // Part of ref with lo <= p[axis] <= hi; false if the object has nothing there.
+    bool clip_ref(const build_ref& ref, int axis, double lo, double hi, const build_context& context, build_ref& output) const;
+
+    // The root is a unit of the layout on its own; every other unit is a sibling pair, named by its first node.
+    static uint32_t unit_size(uint32_t unit) { return unit == 0 ? 1 : 2; }
+
+    template <class Visitor>
+    void for_each_child_unit(uint32_t unit, Visitor&& visit) const
+    {
+        for (uint32_t i = unit; i < unit + unit_size(unit); i++)
+            if (m_nodes[i].m_count == 0)
+                visit(m_nodes[i].m_offset);
+    }
+
+    int unit_height(uint32_t unit) const;
+    void collect_units(uint32_t unit, int depth, std::vector<uint32_t>& units) const;
+    void layout_depth_first(uint32_t unit, std::vector<uint32_t>& units) const;
+    void layout_van_emde_boas(uint32_t unit, int levels, std::vector<uint32_t>& units) const;
+    void layout_hot_first(std::vector<uint32_t>& units) const;
+
+    // Visits the leaves whose boxes the ray enters, nearest child first. visit_leaf(first, count, t_max)
+    // may shrink t_max to cull farther nodes.
+    template <class LeafVisitor>
+    void traverse(const ray& r_in, double t_min, double t_max, LeafVisitor&& visit_leaf) const;
+
+private:
+    std::vector<std::shared_ptr<hittable>> m_objects;
+    std::vector<const hittable*> m_primitives;
+    std::vector<flat_bvh_node> m_nodes;
+    mutable std::vector<uint32_t> m_visits;
+    aabb m_bounds;
+};
+
+inline flat_bvh::flat_bvh(const std::vector<std::shared_ptr<hittable>>& objects, double time0, double time1, const flat_bvh_settings& settings)
+    : m_objects(objects)
+{
+    std::vector<build_ref> refs;
+    refs.reserve(m_objects.size());
+    for (size_t i = 0; i < m_objects.size(); i++)
+    {
+        aabb box;
+        if (!m_objects[i]->bounding_box(time0, time1, box))
+        {
+            std::cerr << "No bounding box in flat_bvh constructor.\n";
+            continue;
+        }
+        refs.push_back({ box, 0.5 * (box.min() + box.max()), static_cast<uint32_t>(i), !m_objects[i]->is_stochastic() && !is_flat(box) });
+    }
+
+    if (refs.empty())
+        return;
+
+    aabb root_box = refs[0].m_box;
+    for (const build_ref& ref : refs)
+        root_box = surrounding_box(root_box, ref.m_box);
+
+    build_context context { settings, time0, time1, fmax(root_box.surface_area(), 1e-300), refs.size(),
+                            refs.size() + static_cast<size_t>(settings.m_split_budget * refs.size()) };
+
+    m_nodes.reserve(2 * refs.size());
+    m_primitives.reserve(context.m_max_references);
+    m_nodes.emplace_back();
+    build(refs, 0, context, 0);
+
+    const flat_bvh_node& root = m_nodes[0];
+    m_bounds = aabb(point3(root.m_min[0], root.m_min[1], root.m_min[2]), point3(root.m_max[0], root.m_max[1], root.m_max[2]));
+}
+
+inline bool flat_bvh::clip_ref(const build_ref& ref, int axis, double lo, double hi, const build_context& context, build_ref& output) const
+{
+    aabb box;
+    if (!m_objects[ref.m_object]->clipped_box(context.m_time0, context.m_time1, axis, lo, hi, box)
+        || !intersect_boxes(box, ref.m_box, box))
+        return false;
+    output = { box, 0.5 * (box.min() + box.max()), ref.m_object, ref.m_splittable };
+    return true;
+}
+
+inline void flat_bvh::build(std::vector<build_ref>& refs, int depth, build_context& context, uint32_t index)
+{
+    aabb bounds = refs[0].m_box;
+    aabb centroid_bounds(refs[0].m_centroid, refs[0].m_centroid);
+    for (size_t i = 1; i < refs.size(); i++)
+    {
+        bounds = surrounding_box(bounds, refs[i].m_box);
+        centroid_bounds = surrounding_box(centroid_bounds, aabb(refs[i].m_centroid, refs[i].m_centroid));
+    }
+
+    for (int a = 0; a < 3; a++)
+    {
+        m_nodes[index].m_min[a] = round_down_float(bounds.min()[a]);
+        m_nodes[index].m_max[a] = round_up_float(bounds.max()[a]);
+    }
+
+    const size_t count = refs.size();
+    const auto make_leaf = [&]()
+    {
+        m_nodes[index].m_offset = static_cast<uint32_t>(m_primitives.size());
+        m_nodes[index].m_count = static_cast<uint16_t>(count);
+        for (const build_ref& ref : refs)
+            m_primitives.push_back(m_objects[ref.m_object].get());
+    };
+
+    if (count == 1)
+        return make_leaf();
+
+    // Binned SAH over the centroids; a split costs one traversal step (1/8 of a primitive test).
+    constexpr int BINS = 12;
+    constexpr int SPATIAL_BINS = 16;
+    constexpr double TRAVERSAL_COST = 0.125;
+
+    int best_axis = -1;
+    int best_split = 0;
+    double best_cost = INF;
+    aabb best_left, best_right;
+    const double parent_area = fmax(bounds.surface_area(), 1e-300);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const double lo = centroid_bounds.min()[axis];
+        const double extent = centroid_bounds.max()[axis] - lo;
+        if (extent <= 0)
+            continue;
+
+        int bin_count[BINS] = {};
+        aabb bin_box[BINS];
+        for (const build_ref& ref : refs)
+        {
+            const int b = std::min(BINS - 1, static_cast<int>(BINS * (ref.m_centroid[axis] - lo) / extent));
+            bin_box[b] = bin_count[b]++ ? surrounding_box(bin_box[b], ref.m_box) : ref.m_box;
+        }
+
+        // Sweep from the right to get the cost of everything right of each split, then from the left.
+        aabb right_box[BINS];
+        int right_count[BINS];
+        aabb acc;
+        int n = 0;
+        for (int b = BINS - 1; b > 0; b--)
+        {
+            if (bin_count[b])
+                acc = n ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+            n += bin_count[b];
+            right_count[b] = n;
+            right_box[b] = acc;
+        }
+
+        n = 0;
+        for (int b = 0; b < BINS - 1; b++)
+        {
+            if (bin_count[b])
+                acc = n ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+            n += bin_count[b];
+            if (n == 0 || right_count[b + 1] == 0)
+                continue;
+            const double cost = TRAVERSAL_COST + (n * acc.surface_area() + right_count[b + 1] * right_box[b + 1].surface_area()) / parent_area;
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+                best_left = acc;
+                best_right = right_box[b + 1];
+            }
+        }
+    }
+
+    // Spatial splits, where the object split leaves children that overlap noticeably and the budget allows.
+    int spatial_axis = -1;
+    double spatial_plane = 0.0;
+    aabb overlap;
+    const bool overlapping = best_axis < 0 || (intersect_boxes(best_left, best_right, overlap)
+        && overlap.surface_area() > context.m_settings.m_overlap_threshold * context.m_root_area);
+
+    if (context.m_references < context.m_max_references && overlapping && depth <= STACK_SIZE / 2)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const double lo = bounds.min()[axis];
+            const double extent = bounds.max()[axis] - lo;
+            if (extent <= 0)
+                continue;
+
+            const double width = extent / SPATIAL_BINS;
+            const auto bin_of = [&](double x) { return std::clamp(static_cast<int>((x - lo) / width), 0, SPATIAL_BINS - 1); };
+
+            // Each reference is clipped into every bin it crosses; it enters the first and exits the last.
+            // Unsplittable ones go whole into the bin of their centroid, as in an object split.
+            int entries[SPATIAL_BINS] = {};
+            int exits[SPATIAL_BINS] = {};
+            bool used[SPATIAL_BINS] = {};
+            aabb bin_box[SPATIAL_BINS];
+            for (const build_ref& ref : refs)
+            {
+                const int first = bin_of(ref.m_splittable ? ref.m_box.min()[axis] : ref.m_centroid[axis]);
+                const int last = ref.m_splittable ? bin_of(ref.m_box.max()[axis]) : first;
+                entries[first]++;
+                exits[last]++;
+                for (int b = first; b <= last; b++)
+                {
+                    build_ref piece = ref;
+                    if (first != last && !clip_ref(ref, axis, lo + b * width, lo + (b + 1) * width, context, piece))
+                        continue;
+                    bin_box[b] = used[b] ? surrounding_box(bin_box[b], piece.m_box) : piece.m_box;
+                    used[b] = true;
+                }
+            }
+
+            aabb right_box[SPATIAL_BINS];
+            int right_count[SPATIAL_BINS];
+            aabb acc;
+            bool any = false;
+            int n = 0;
+            for (int b = SPATIAL_BINS - 1; b > 0; b--)
+            {
+                if (used[b])
+                {
+                    acc = any ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+                    any = true;
+                }
+                n += exits[b];
+                right_count[b] = n;
+                right_box[b] = acc;
+            }
+
+            any = false;
+            n = 0;
+            for (int b = 0; b < SPATIAL_BINS - 1; b++)
+            {
+                if (used[b])
+                {
+                    acc = any ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+                    any = true;
+                }
+                n += entries[b];
+                const int right = right_count[b + 1];
+                if (n == 0 || right == 0 || static_cast<size_t>(n) >= count || static_cast<size_t>(right) >= count
+                    || context.m_references + (n + right - count) > context.m_max_references)
+                    continue;
+                const double cost = TRAVERSAL_COST + (n * acc.surface_area() + right * right_box[b + 1].surface_area()) / parent_area;
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    spatial_axis = axis;
+                    spatial_plane = lo + (b + 1) * width;
+                }
+            }
+        }
+    }
+
+    // All centroids coincide, or the tree got too deep for the traversal stack: halve by count.
+    const bool halve = spatial_axis < 0 && (best_axis < 0 || depth > STACK_SIZE / 2);
+    if (count <= MAX_LEAF_SIZE && (halve || static_cast<double>(count) <= best_cost))
+        return make_leaf();
+
+    std::vector<build_ref> right;
+    if (spatial_axis >= 0)
+    {
+        // References on one side stay whole; the ones straddling the plane are clipped into both, unless they
+        // are unsplittable, which follow their centroid.
+        std::vector<build_ref> left;
+        left.reserve(count);
+        right.reserve(count);
+        for (const build_ref& ref : refs)
+        {
+            if (ref.m_box.max()[spatial_axis] <= spatial_plane || (!ref.m_splittable && ref.m_centroid[spatial_axis] < spatial_plane))
+                left.push_back(ref);
+            else if (!ref.m_splittable)
+                right.push_back(ref);
+            else if (ref.m_box.min()[spatial_axis] >= spatial_plane)
+                right.push_back(ref);
+            else
+            {
+                build_ref piece;
+                if (clip_ref(ref, spatial_axis, -INF, spatial_plane, context, piece))
+                    left.push_back(piece);
+                if (clip_ref(ref, spatial_axis, spatial_plane, INF, context, piece))
+                    right.push_back(piece);
+            }
+        }
+
+        if (left.empty() || right.empty())
+        {
+            right.clear();
+            spatial_axis = -1;
+        }
+        else
+        {
+            context.m_references += left.size() + right.size() - count;
+            refs.swap(left);
+            best_axis = spatial_axis;
+        }
+    }
+
+    if (spatial_axis < 0 && (halve || best_axis < 0))
+    {
+        best_axis = best_axis < 0 ? 0 : best_axis;
+        const size_t mid = count / 2;
+        std::nth_element(refs.begin(), refs.begin() + mid, refs.end(),
+                         [best_axis](const build_ref& a, const build_ref& b) { return a.m_centroid[best_axis] < b.m_centroid[best_axis]; });
+        right.assign(refs.begin() + mid, refs.end());
+        refs.resize(mid);
+    }
+    else if (spatial_axis < 0)
+    {
+        const double lo = centroid_bounds.min()[best_axis];
+        const double extent = centroid_bounds.max()[best_axis] - lo;
+        const size_t mid = std::partition(refs.begin(), refs.end(), [&](const build_ref& ref)
+        {
+            return std::min(BINS - 1, static_cast<int>(BINS * (ref.m_centroid[best_axis] - lo) / extent)) <= best_split;
+        }) - refs.begin();
+        right.assign(refs.begin() + mid, refs.end());
+        refs.resize(mid);
+    }
+
+    const uint32_t first = static_cast<uint32_t>(m_nodes.size());
+    m_nodes.resize(first + 2);
+    m_nodes[index].m_offset = first;
+    m_nodes[index].m_count = 0;
+    m_nodes[index].m_axis = static_cast<uint8_t>(best_axis);
+
+    build(refs, depth + 1, context, first);
+    build(right, depth + 1, context, first + 1);
+}
+
+inline void flat_bvh::reorder(bvh_layout layout)
+{
+    if (m_nodes.empty())
+        return;
+
+    std::vector<uint32_t> units;
+    units.reserve(m_nodes.size() / 2 + 1);
+    switch (layout)
+    {
+        case bvh_layout::depth_first:
+            layout_depth_first(0, units);
+            break;
+        case bvh_layout::van_emde_boas:
+            layout_van_emde_boas(0, unit_height(0), units);
+            break;
+        case bvh_layout::hot_first:
+            if (m_visits.empty())
+                std::cerr << "No traversal profile for a hot_first layout; keeping the build order.\n";
+            layout_hot_first(units);
+            break;
+    }
+
+    std::vector<uint32_t> new_index(m_nodes.size());
+    uint32_t next = 0;
+    for (const uint32_t unit : units)
+        for (uint32_t i = unit; i < unit + unit_size(unit); i++)
+            new_index[i] = next++;
+
+    std::vector<flat_bvh_node> nodes(m_nodes.size());
+    std::vector<uint32_t> visits(m_visits.size());
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        flat_bvh_node node = m_nodes[i];
+        if (node.m_count == 0)
+            node.m_offset = new_index[node.m_offset];
+        nodes[new_index[i]] = node;
+        if (!m_visits.empty())
+            visits[new_index[i]] = m_visits[i];
+    }
+    m_nodes.swap(nodes);
+    m_visits.swap(visits);
+}
+
+inline int flat_bvh::unit_height(uint32_t unit) const
+{
+    int height = 0;
+    for_each_child_unit(unit, [&](uint32_t child) { height = std::max(height, unit_height(child)); });
+    return height + 1;
+}
+
+// Units exactly depth levels below unit, left to right.
+inline void flat_bvh::collect_units(uint32_t unit, int depth, std::vector<uint32_t>& units) const
+{
+    if (depth == 0)
+    {
+        units.push_back(unit);
+        return;
+    }
+    for_each_child_unit(unit, [&](uint32_t child) { collect_units(child, depth - 1, units); });
+}
+
+inline void flat_bvh::layout_depth_first(uint32_t unit, std::vector<uint32_t>& units) const
+{
+    units.push_back(unit);
+    for_each_child_unit(unit, [&](uint32_t child) { layout_depth_first(child, units); });
+}
+
+// Lays out the units less than `levels` below unit: the top half of those levels first, then every
+// subtree hanging below it, each recursively the same way. A subtree of any size then spans few cache
+// lines and pages without knowing their sizes.
+inline void flat_bvh::layout_van_emde_boas(uint32_t unit, int levels, std::vector<uint32_t>& units) const
+{
+    if (levels <= 1)
+    {
+        units.push_back(unit);
+        return;
+    }
+
+    const int top = (levels + 1) / 2;
+    layout_van_emde_boas(unit, top, units);
+
+    std::vector<uint32_t> bottoms;
+    collect_units(unit, top, bottoms);
+    for (const uint32_t bottom : bottoms)
+        layout_van_emde_boas(bottom, levels - top, units);
+}
+
+// Packs the tree into page-sized clusters. Each cluster grows best-first from its root, taking the
+// hottest unit next to those already in it; the units it could not take become roots of further
+// clusters, which are laid out hottest first. The paths most rays take thereby share pages and
+// cache lines, and rarely visited subtrees end up behind them.
+inline void flat_bvh::layout_hot_first(std::vector<uint32_t>& units) const
+{
+    constexpr size_t CLUSTER_UNITS = 4096 / (2 * sizeof(flat_bvh_node));
+
+    const auto heat = [this](uint32_t unit)
+    {
+        uint64_t sum = 0;
+        if (!m_visits.empty())
+            for (uint32_t i = unit; i < unit + unit_size(unit); i++)
+                sum += m_visits[i];
+        return sum;
+    };
+
+    // Ties, such as never visited units, keep their build order.
+    using entry = std::pair<uint64_t, uint32_t>;
+    const auto colder = [](const entry& a, const entry& b) { return a.first != b.first ? a.first < b.first : a.second > b.second; };
+    using unit_queue = std::priority_queue<entry, std::vector<entry>, decltype(colder)>;
+
+    unit_queue roots(colder);
+    roots.push({ heat(0), 0 });
+    while (!roots.empty())
+    {
+        unit_queue frontier(colder);
+        frontier.push(roots.top());
+        roots.pop();
+
+        for (size_t taken = 0; taken < CLUSTER_UNITS && !frontier.empty(); taken++)
+        {
+            const uint32_t unit = frontier.top().second;
+            frontier.pop();
+            units.push_back(unit);
+            for_each_child_unit(unit, [&](uint32_t child) { frontier.push({ heat(child), child }); });
+        }
+
+        for (; !frontier.empty(); frontier.pop())
+            roots.push(frontier.top());
+    }
+}
+
+template <class LeafVisitor>
+void flat_bvh::traverse(const ray& r_in, double t_min, double t_max, LeafVisitor&& visit_leaf) const
+{
+    if (m_nodes.empty())
+        return;
+
+    const point3 origin = r_in.origin();
+    const vec3 inv_dir(1.0 / r_in.dir().x(), 1.0 / r_in.dir().y(), 1.0 / r_in.dir().z());
+
+    uint32_t stack[STACK_SIZE];
+    int stack_size = 0;
+    uint32_t index = 0;
+
+    while (true)
+    {
+        RT_STAT(m_bvh_nodes_visited);
+        RT_STAT(m_aabb_tests);
+        if (!m_visits.empty())
+            m_visits[index]++;
+
+        const flat_bvh_node& node = m_nodes[index];
+        const double lo[3] = { node.m_min[0], node.m_min[1], node.m_min[2] };
+        const double hi[3] = { node.m_max[0], node.m_max[1], node.m_max[2] };
+        double t_enter;
+
+        if (slab_hit(lo, hi, origin, inv_dir, t_min, t_max, t_enter))
+        {
+            if (node.m_count > 0)
+            {
+                visit_leaf(node.m_offset, node.m_count, t_max);
+            }
+            else
+            {
+                // Visit the child on the near side of the split plane first.
+                if (inv_dir[node.m_axis] < 0)
+                {
+                    stack[stack_size++] = node.m_offset;
+                    index = node.m_offset + 1;
+                }
+                else
+                {
+                    stack[stack_size++] = node.m_offset + 1;
+                    index = node.m_offset;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        index = stack[--stack_size];
+    }
+}
+
+inline bool flat_bvh::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+{
+    bool hit_anything = false;
+    traverse(r_in, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest)
+    {
+        for (uint32_t i = first; i < first + count; i++)
+            if (hit_primitive(*m_primitives[i], r_in, t_min, closest, hit_rec))
+            {
+                hit_anything = true;
+                closest = hit_rec.m_t;
+            }
+    });
+    return hit_anything;
+}
+
+inline void flat_bvh::hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const
+{
+    traverse(r_in, t_min, t_max, [&](uint32_t first, uint32_t count, double&)
+    {
+        for (uint32_t i = first; i < first + count; i++)
+            m_primitives[i]->hit_intervals(r_in, t_min, t_max, spans);
+    });
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "flat_bvh.h"
+#include "lru_tile_cache.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// One sphere as a geometry cluster stores it: 40 bytes, with the material as an index into a table kept in memory.
+struct sphere_record
+{
+    double m_center[3];
+    double m_radius;
+    uint32_t m_material;
+    uint32_t m_pad;
+};
+
+static_assert(sizeof(sphere_record) == 40, "sphere_record should stay 40 bytes");
+
+// A leaf subtree of paged geometry: its nodes, whose leaves index m_spheres, and the spheres themselves.
+struct geometry_cluster
+{
+    size_t bytes() const
+    {
+        return m_nodes.size() * sizeof(flat_bvh_node) + m_spheres.size() * sizeof(sphere_record);
+    }
+
+    std::vector<flat_bvh_node> m_nodes;
+    std::vector<sphere_record> m_spheres;
+};
+
+// Anything that can read clusters back on demand; the cache calls read_cluster on a miss.
+class cluster_source
+{
+public:
+    virtual void read_cluster(uint32_t cluster, geometry_cluster& out) const = 0;
+};
+
+// Process-wide cluster cache, sharing its LRU and budget handling with texture_cache.
+class geometry_cache
+{
+public:
+    static geometry_cache& instance()
+    {
+        static geometry_cache cache;
+        return cache;
+    }
+
+    // Ids are never reused, so stale thread-local entries can never alias new geometry.
+    uint32_t register_geometry() { return m_next_geometry_id++; }
+
+    void set_budget(size_t bytes) { m_clusters.set_budget(bytes); }
+    cache_stats stats() { return m_clusters.stats(); }
+
+    // The cluster stays valid until the calling thread's next cluster() call, which is all one leaf of a traversal
+    // needs; a ray that stays in one cluster takes no reference counting at all.
+    const geometry_cluster& cluster(const cluster_source& source, uint32_t geometry_id, uint32_t cluster)
+    {
+        return m_clusters.pin(make_key(geometry_id, cluster), [&](geometry_cluster& loaded)
+        {
+            source.read_cluster(cluster, loaded);
+            return loaded.bytes();
+        });
+    }
+
+private:
+    geometry_cache() : m_clusters("geometry") {}
+
+    static uint64_t make_key(uint32_t geometry_id, uint32_t cluster)
+    {
+        return (static_cast<uint64_t>(geometry_id) << 32) | cluster;
+    }
+
+private:
+    lru_tile_cache<geometry_cluster> m_clusters;
+    std::atomic<uint32_t> m_next_geometry_id { 1 };
+};
@@ -0,0 +1,283 @@
+#pragma once
+
+#include "arena.h"
+#include "constants.h"
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Voxel density field. Values sit at voxel centres and are trilinearly interpolated.
+class density_grid
+{
+public:
+    density_grid(int nx, int ny, int nz, std::vector<float> values)
+        : m_nx(nx), m_ny(ny), m_nz(nz), m_values(std::move(values))
+    {}
+
+    // Fills the grid by evaluating f at voxel centres in [0,1]^3.
+    density_grid(int nx, int ny, int nz, const std::function<double(const point3&)>& f);
+
+    // Loads nx*ny*nz little-endian float32 values, x varying fastest (see --density-grid).
+    static std::shared_ptr<density_grid> load_raw(const std::string& path, int nx, int ny, int nz);
+
+    int nx() const { return m_nx; }
+    int ny() const { return m_ny; }
+    int nz() const { return m_nz; }
+
+    double voxel(int x, int y, int z) const
+    {
+        x = std::clamp(x, 0, m_nx - 1);
+        y = std::clamp(y, 0, m_ny - 1);
+        z = std::clamp(z, 0, m_nz - 1);
+        return m_values[(static_cast<size_t>(z) * m_ny + y) * m_nx + x];
+    }
+
+    // p is in voxel units, i.e. [0,nx] x [0,ny] x [0,nz].
+    double sample(const point3& p) const
+    {
+        const double fx = p.x() - 0.5;
+        const double fy = p.y() - 0.5;
+        const double fz = p.z() - 0.5;
+        const int x0 = static_cast<int>(floor(fx));
+        const int y0 = static_cast<int>(floor(fy));
+        const int z0 = static_cast<int>(floor(fz));
+        const double tx = fx - x0;
+        const double ty = fy - y0;
+        const double tz = fz - z0;
+
+        double result = 0.0;
+        for (int k = 0; k < 2; k++)
+            for (int j = 0; j < 2; j++)
+                for (int i = 0; i < 2; i++)
+                    result += (i ? tx : 1 - tx) * (j ? ty : 1 - ty) * (k ? tz : 1 - tz) * voxel(x0 + i, y0 + j, z0 + k);
+        return result;
+    }
+
+private:
+    int m_nx, m_ny, m_nz;
+    std::vector<float> m_values;
+};
+
+inline density_grid::density_grid(int nx, int ny, int nz, const std::function<double(const point3&)>& f)
+    : m_nx(nx), m_ny(ny), m_nz(nz), m_values(static_cast<size_t>(nx) * ny * nz)
+{
+    size_t idx = 0;
+    for (int z = 0; z < nz; z++)
+        for (int y = 0; y < ny; y++)
+            for (int x = 0; x < nx; x++)
+                m_values[idx++] = static_cast<float>(f(point3((x + 0.5) / nx, (y + 0.5) / ny, (z + 0.5) / nz)));
+}
+
+inline std::shared_ptr<density_grid> density_grid::load_raw(const std::string& path, int nx, int ny, int nz)
+{
+    std::ifstream ifs(path, std::ios_base::in | std::ios_base::binary);
+    if (!ifs)
+    {
+        std::cerr << "Cannot open density grid " << path << ".\n";
+        return nullptr;
+    }
+
+    std::vector<float> values(static_cast<size_t>(nx) * ny * nz);
+    ifs.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(float));
+    if (static_cast<size_t>(ifs.gcount()) != values.size() * sizeof(float))
+    {
+        std::cerr << "Density grid " << path << " is smaller than " << nx << 'x' << ny << 'x' << nz << ".\n";
+        return nullptr;
+    }
+
+    return std::make_shared<density_grid>(nx, ny, nz, std::move(values));
+}
+
+// Heterogeneous medium filling an axis-aligned box. Free paths are sampled with delta tracking
+// against a coarse grid of per-cell majorants, walked with a 3D DDA, so empty cells cost one step.
+class grid_env : public hittable
+{
+public:
+    grid_env(std::shared_ptr<density_grid> grid, const aabb& bounds, double density_scale, std::shared_ptr<texture> a, int cell_size = 8);
+
+    grid_env(std::shared_ptr<density_grid> grid, const aabb& bounds, double density_scale, color c, int cell_size = 8)
+        : grid_env(grid, bounds, density_scale, arena_make<solid_color>(c), cell_size)
+    {}
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+    {
+        output_box = m_bounds;
+        return true;
+    }
+
+    virtual bool is_stochastic() const override { return true; }
+
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const override
+    {
+        t_enter = t_min;
+        t_exit = t_max;
+        return m_bounds.clip(r_in, t_enter, t_exit);
+    }
+
+private:
+    // Calls visit(t_enter, t_exit, majorant) for each majorant cell the ray crosses, front to back,
+    // until visit returns true. Returns whether visit stopped the walk.
+    template <typename Visitor>
+    bool walk_majorants(const ray& r_in, double t_min, double t_max, Visitor&& visit) const;
+
+    double density_at(const point3& p) const
+    {
+        const point3 local = p - m_bounds.min();
+        return m_density_scale * m_grid->sample(point3(local.x() * m_world_to_voxel[0],
+                                                        local.y() * m_world_to_voxel[1],
+                                                        local.z() * m_world_to_voxel[2]));
+    }
+
+    double majorant(int x, int y, int z) const
+    {
+        return m_majorants[(static_cast<size_t>(z) * m_cells[1] + y) * m_cells[0] + x];
+    }
+
+public:
+    std::shared_ptr<density_grid> m_grid;
+    std::shared_ptr<material> m_phase_function;
+
+private:
+    aabb m_bounds;
+    double m_density_scale;
+    vec3 m_world_to_voxel;
+    int m_cell_size;
+    int m_cells[3];
+    std::vector<double> m_majorants;
+};
+
+inline grid_env::grid_env(std::shared_ptr<density_grid> grid, const aabb& bounds, double density_scale, std::shared_ptr<texture> a, int cell_size)
+    : m_grid(grid)
+    , m_phase_function(arena_make<isotropic>(a))
+    , m_bounds(bounds)
+    , m_density_scale(density_scale)
+    , m_cell_size(std::max(cell_size, 1))
+{
+    const vec3 extent = bounds.max() - bounds.min();
+    m_world_to_voxel = vec3(grid->nx() / extent.x(), grid->ny() / extent.y(), grid->nz() / extent.z());
+
+    m_cells[0] = (grid->nx() + m_cell_size - 1) / m_cell_size;
+    m_cells[1] = (grid->ny() + m_cell_size - 1) / m_cell_size;
+    m_cells[2] = (grid->nz() + m_cell_size - 1) / m_cell_size;
+    m_majorants.assign(static_cast<size_t>(m_cells[0]) * m_cells[1] * m_cells[2], 0.0);
+
+    // Trilinear lookups inside a cell reach one voxel past its border, so the max is taken over a dilated block.
+    size_t idx = 0;
+    for (int cz = 0; cz < m_cells[2]; cz++)
+        for (int cy = 0; cy < m_cells[1]; cy++)
+            for (int cx = 0; cx < m_cells[0]; cx++)
+            {
+                double max_density = 0.0;
+                for (int z = cz * m_cell_size - 1; z <= (cz + 1) * m_cell_size; z++)
+                    for (int y = cy * m_cell_size - 1; y <= (cy + 1) * m_cell_size; y++)
+                        for (int x = cx * m_cell_size - 1; x <= (cx + 1) * m_cell_size; x++)
+                            max_density = fmax(max_density, grid->voxel(x, y, z));
+                m_majorants[idx++] = m_density_scale * max_density;
+            }
+}
+
+template <typename Visitor>
+bool grid_env::walk_majorants(const ray& r_in, double t_min, double t_max, Visitor&& visit) const
+{
+    if (!m_bounds.clip(r_in, t_min, t_max))
+        return false;
+
+    // Ray in majorant cell coordinates; the parametrisation in t is unchanged.
+    const vec3 to_cell(m_world_to_voxel.x() / m_cell_size, m_world_to_voxel.y() / m_cell_size, m_world_to_voxel.z() / m_cell_size);
+    const point3 entry = r_in.at(t_min) - m_bounds.min();
+
+    int cell[3], step[3];
+    double t_next[3], t_delta[3];
+
+    for (int a = 0; a < 3; a++)
+    {
+        const double o = entry[a] * to_cell[a];
+        const double d = r_in.dir()[a] * to_cell[a];
+
+        cell[a] = std::clamp(static_cast<int>(floor(o)), 0, m_cells[a] - 1);
+
+        if (d > 0)
+        {
+            step[a] = 1;
+            t_delta[a] = 1 / d;
+            t_next[a] = t_min + (cell[a] + 1 - o) / d;
+        }
+        else if (d < 0)
+        {
+            step[a] = -1;
+            t_delta[a] = -1 / d;
+            t_next[a] = t_min + (cell[a] - o) / d;
+        }
+        else
+        {
+            step[a] = 0;
+            t_delta[a] = INF;
+            t_next[a] = INF;
+        }
+    }
+
+    double t = t_min;
+    while (t < t_max)
+    {
+        const int axis = (t_next[0] < t_next[1])
+                       ? (t_next[0] < t_next[2] ? 0 : 2)
+                       : (t_next[1] < t_next[2] ? 1 : 2);
+        const double t_exit = fmin(t_next[axis], t_max);
+
+        const double mu = majorant(cell[0], cell[1], cell[2]);
+        if (mu > 0 && visit(t, t_exit, mu))
+            return true;
+
+        t = t_exit;
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= m_cells[axis])
+            break;
+        t_next[axis] += t_delta[axis];
+    }
+
+    return false;
+}
+
+inline bool grid_env::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+{
+    const auto ray_length = r_in.dir().length();
+    double t_hit = 0.0;
+
+    // Delta tracking. Since free-flight sampling is memoryless, a tentative step that leaves
+    // the cell is simply restarted at the cell boundary with the next majorant.
+    const bool scattered = walk_majorants(r_in, t_min, t_max, [&](double t0, double t1, double mu)
+    {
+        double t = t0;
+        while (true)
+        {
+            t -= log(1 - random_double()) / (mu * ray_length);
+            if (t >= t1)
+                return false;
+            if (random_double() * mu < density_at(r_in.at(t)))
+            {
+                t_hit = t;
+                return true;
+            }
+        }
+    });
+
+    if (!scattered)
+        return false;
+
+    hit_rec.m_t = t_hit;
+    hit_rec.m_point = r_in.at(t_hit);
+
+    hit_rec.m_normal = vec3(1, 0, 0);  // arbitrary
+    hit_rec.m_front_face = true;     // also arbitrary
+    hit_rec.m_mat_ptr = m_phase_function;
+    hit_rec.m_object = nullptr;
+
+    return true;
+}
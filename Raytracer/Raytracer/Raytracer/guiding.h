@@ -0,0 +1,331 @@
+#pragma once
+#include "aabb.h"
+#include "constants.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Share of the directions at a guided hit drawn from the learned distribution rather than the material's.
+constexpr double GUIDE_FRACTION = 0.5;
+
+// Piecewise-constant distribution of incident light over the sphere of directions, stored as a quadtree over
+// the cylindrical map (cos theta, phi) -> [0, 1)^2, which preserves area. Each node keeps the energy of its four
+// quadrants; a quadrant without a child is a leaf of uniform density.
+class directional_tree
+{
+public:
+    static constexpr int MAX_DEPTH = 20;
+    static constexpr double SUBDIVIDE_FRACTION = 0.01;  // quadrants with more of the energy than this get children
+
+    directional_tree() : m_nodes(1), m_recorded(4, 0.0) {}
+
+    // Whether any light was recorded; untrained trees are not sampled.
+    bool trained() const { return m_total > 0; }
+    size_t node_count() const { return m_nodes.size(); }
+
+    vec3 sample(double u1, double u2) const;
+    double pdf(const vec3& dir) const;
+
+    // Adds radiance arriving from dir, divided by the density it was sampled with, to every level.
+    void record(const vec3& dir, double radiance) const;
+
+    // Makes the recorded energy the distribution that is sampled next, on a quadtree subdivided where much
+    // of it arrived, and starts recording afresh.
+    void refine();
+
+private:
+    struct node
+    {
+        uint32_t m_child[4] = { 0, 0, 0, 0 };  // 0 for a leaf quadrant; the root is never a child
+        double m_sum[4] = { 0, 0, 0, 0 };
+    };
+
+    static void to_square(const vec3& dir, double& u, double& v);
+    static vec3 from_square(double u, double v);
+    static int quadrant(double& u, double& v);
+
+    // Appends a node for the region below old node `from` (or a leaf quadrant of it, spread evenly when
+    // from_leaf_energy >= 0) to nodes.
+    uint32_t build(std::vector<node>& nodes, uint32_t from, double from_leaf_energy, int depth) const;
+
+private:
+    std::vector<node> m_nodes;
+    mutable std::vector<double> m_recorded;  // per node and quadrant, as m_sum
+    double m_total = 0.0;
+};
+
+inline void directional_tree::to_square(const vec3& dir, double& u, double& v)
+{
+    const double cos_theta = clamp(dir.y() / dir.length(), -1.0, 1.0);
+    double phi = atan2(dir.z(), dir.x());
+    if (phi < 0)
+        phi += 2 * PI;
+    u = std::min(0.5 * (cos_theta + 1), 1 - 1e-12);
+    v = std::min(phi / (2 * PI), 1 - 1e-12);
+}
+
+inline vec3 directional_tree::from_square(double u, double v)
+{
+    const double cos_theta = 2 * u - 1;
+    const double sin_theta = sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+    const double phi = 2 * PI * v;
+    return vec3(sin_theta * cos(phi), cos_theta, sin_theta * sin(phi));
+}
+
+// Quadrant of (u, v) in the unit square, which is then rescaled to the quadrant.
+inline int directional_tree::quadrant(double& u, double& v)
+{
+    const int qu = u >= 0.5 ? 1 : 0;
+    const int qv = v >= 0.5 ? 1 : 0;
+    u = 2 * u - qu;
+    v = 2 * v - qv;
+    return qu + 2 * qv;
+}
+
+inline vec3 directional_tree::sample(double u1, double u2) const
+{
+    // Pick the u half, then the v half within it, reusing each random number rescaled to the chosen side;
+    // what is left of them places the direction inside the final leaf.
+    double origin_u = 0.0, origin_v = 0.0, size = 1.0;
+    uint32_t index = 0;
+    while (true)
+    {
+        const node& n = m_nodes[index];
+        const double low = n.m_sum[0] + n.m_sum[2];
+        const double total = low + n.m_sum[1] + n.m_sum[3];
+        double p = total > 0 ? low / total : 0.5;
+
+        int qu = 0;
+        if (u1 < p)
+            u1 = u1 / p;
+        else
+        {
+            u1 = p < 1 ? (u1 - p) / (1 - p) : 0.0;
+            qu = 1;
+        }
+
+        const double side = n.m_sum[qu] + n.m_sum[qu + 2];
+        p = side > 0 ? n.m_sum[qu] / side : 0.5;
+        int qv = 0;
+        if (u2 < p)
+            u2 = u2 / p;
+        else
+        {
+            u2 = p < 1 ? (u2 - p) / (1 - p) : 0.0;
+            qv = 1;
+        }
+
+        size *= 0.5;
+        origin_u += qu * size;
+        origin_v += qv * size;
+
+        const uint32_t child = n.m_child[qu + 2 * qv];
+        if (!child)
+            return from_square(origin_u + size * std::min(u1, 1 - 1e-12), origin_v + size * std::min(u2, 1 - 1e-12));
+        index = child;
+    }
+}
+
+inline double directional_tree::pdf(const vec3& dir) const
+{
+    double u, v;
+    to_square(dir, u, v);
+
+    double density = 1.0;
+    uint32_t index = 0;
+    while (true)
+    {
+        const node& n = m_nodes[index];
+        const double total = n.m_sum[0] + n.m_sum[1] + n.m_sum[2] + n.m_sum[3];
+        const int q = quadrant(u, v);
+        if (total > 0)
+            density *= 4 * n.m_sum[q] / total;
+        if (!n.m_child[q] || density <= 0)
+            break;
+        index = n.m_child[q];
+    }
+    return density / (4 * PI);
+}
+
+inline void directional_tree::record(const vec3& dir, double radiance) const
+{
+    double u, v;
+    to_square(dir, u, v);
+
+    uint32_t index = 0;
+    while (true)
+    {
+        const int q = quadrant(u, v);
+        m_recorded[4 * index + q] += radiance;
+        index = m_nodes[index].m_child[q];
+        if (!index)
+            break;
+    }
+}
+
+inline uint32_t directional_tree::build(std::vector<node>& nodes, uint32_t from, double from_leaf_energy, int depth) const
+{
+    const uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back({});
+
+    for (int q = 0; q < 4; q++)
+    {
+        const bool old_child = from_leaf_energy < 0 && m_nodes[from].m_child[q];
+        const double energy = from_leaf_energy >= 0 ? from_leaf_energy / 4 : m_recorded[4 * from + q];
+        nodes[index].m_sum[q] = energy;
+
+        if (depth + 1 < MAX_DEPTH && energy > SUBDIVIDE_FRACTION * m_total)
+        {
+            const uint32_t child = old_child ? build(nodes, m_nodes[from].m_child[q], -1.0, depth + 1)
+                                             : build(nodes, from, energy, depth + 1);
+            nodes[index].m_child[q] = child;
+        }
+    }
+    return index;
+}
+
+inline void directional_tree::refine()
+{
+    m_total = m_recorded[0] + m_recorded[1] + m_recorded[2] + m_recorded[3];
+    if (m_total > 0)
+    {
+        std::vector<node> nodes;
+        build(nodes, 0, -1.0, 0);
+        m_nodes.swap(nodes);
+    }
+    else
+    {
+        // Nothing arrived here: keep the shape and start over.
+        for (node& n : m_nodes)
+            std::fill(n.m_sum, n.m_sum + 4, 0.0);
+    }
+    m_recorded.assign(4 * m_nodes.size(), 0.0);
+}
+
+// Learned incident light over the scene: a binary tree over space, split in the middle of alternating axes,
+// with a directional_tree in each leaf. It is trained over a sequence of passes that each double the sample
+// count: during a pass, paths are guided by what the previous passes learned and record what they find;
+// afterwards refine() makes that the new distribution, splitting leaves that received many samples.
+// Recording is not thread-safe.
+class guiding_field
+{
+public:
+    static constexpr double SPLIT_SAMPLES = 2000;  // recorded samples that split a leaf after the first pass
+
+    guiding_field(const aabb& bounds);
+
+    // Distribution learned around p, or nullptr where nothing has been learned.
+    const directional_tree* lookup(const point3& p) const;
+
+    bool recording() const { return m_recording; }
+    void set_recording(bool recording) { m_recording = recording; }
+
+    // Records radiance arriving at p from dir, divided by the density it was sampled with.
+    void record(const point3& p, const vec3& dir, double radiance) const;
+
+    // Ends training pass `pass` (0 for the first): see the class comment.
+    void refine(int pass);
+
+    size_t leaf_count() const { return m_trees.size(); }
+    size_t memory_bytes() const;
+
+private:
+    struct spatial_node
+    {
+        uint32_t m_child;  // children at m_child and m_child + 1; 0 for a leaf
+        uint32_t m_tree;   // directional tree of a leaf
+        int m_axis;        // axis the node splits along
+    };
+
+    // Leaf containing p.
+    uint32_t leaf(const point3& p) const;
+
+private:
+    aabb m_bounds;
+    std::vector<spatial_node> m_nodes;
+    std::vector<directional_tree> m_trees;
+    mutable std::vector<uint64_t> m_samples;  // recorded samples per tree during the current pass
+    bool m_recording = false;
+};
+
+inline guiding_field::guiding_field(const aabb& bounds)
+    : m_bounds(bounds)
+    , m_nodes { { 0, 0, 0 } }
+    , m_trees(1)
+    , m_samples(1, 0)
+{
+}
+
+inline uint32_t guiding_field::leaf(const point3& p) const
+{
+    point3 low = m_bounds.min();
+    point3 high = m_bounds.max();
+    uint32_t index = 0;
+    while (m_nodes[index].m_child)
+    {
+        const int axis = m_nodes[index].m_axis;
+        const double mid = 0.5 * (low[axis] + high[axis]);
+        if (p[axis] < mid)
+        {
+            high[axis] = mid;
+            index = m_nodes[index].m_child;
+        }
+        else
+        {
+            low[axis] = mid;
+            index = m_nodes[index].m_child + 1;
+        }
+    }
+    return index;
+}
+
+inline const directional_tree* guiding_field::lookup(const point3& p) const
+{
+    const directional_tree& tree = m_trees[m_nodes[leaf(p)].m_tree];
+    return tree.trained() ? &tree : nullptr;
+}
+
+inline void guiding_field::record(const point3& p, const vec3& dir, double radiance) const
+{
+    const uint32_t tree = m_nodes[leaf(p)].m_tree;
+    m_samples[tree]++;
+    if (radiance > 0)
+        m_trees[tree].record(dir, radiance);
+}
+
+inline void guiding_field::refine(int pass)
+{
+    for (directional_tree& tree : m_trees)
+        tree.refine();
+
+    // Leaves are split while they would still have received more than the threshold; each half is assumed
+    // to have received half the samples. The threshold grows with the square root of the pass's samples.
+    const double threshold = SPLIT_SAMPLES * sqrt(static_cast<double>(1u << std::min(pass, 30)));
+    std::vector<double> samples(m_samples.begin(), m_samples.end());
+    for (size_t index = 0; index < m_nodes.size(); index++)
+    {
+        const spatial_node n = m_nodes[index];
+        if (n.m_child || samples[n.m_tree] <= threshold)
+            continue;
+
+        const uint32_t second_tree = static_cast<uint32_t>(m_trees.size());
+        m_trees.push_back(m_trees[n.m_tree]);
+        samples[n.m_tree] /= 2;
+        samples.push_back(samples[n.m_tree]);
+
+        const int axis = (n.m_axis + 1) % 3;
+        m_nodes[index].m_child = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.push_back({ 0, n.m_tree, axis });
+        m_nodes.push_back({ 0, second_tree, axis });
+    }
+    m_samples.assign(m_trees.size(), 0);
+}
+
+inline size_t guiding_field::memory_bytes() const
+{
+    size_t bytes = m_nodes.size() * sizeof(spatial_node) + m_samples.size() * sizeof(uint64_t);
+    for (const directional_tree& tree : m_trees)
+        bytes += sizeof(directional_tree) + tree.node_count() * (4 * sizeof(uint32_t) + 8 * sizeof(double));
+    return bytes;
+}
@@ -3,6 +3,10 @@
 #include "constants.h"
 #include "ray.h"
 
+#include <algorithm>
+#include <vector>
+
+class hittable;
 class material;
 
 struct hit_record
@@ -19,16 +23,146 @@ struct hit_record
     double m_t;
     double m_u;
     double m_v;
+    double m_uv_scale = 0.0;   // uv units per world unit at the hit, 0 if the surface has no texture mapping
+    double m_footprint = 0.0;  // filled in by the integrator from the ray cone
+    const hittable* m_object = nullptr;  // primitive that was hit, in world space; null inside transforms and media
     bool m_front_face;
 };
 
+// Span of ray parameters [m_t0, m_t1] spent inside a closed object.
+struct interval
+{
+    double m_t0;
+    double m_t1;
+};
+
+// Work done by one refit() call, for reporting per-frame setup cost.
+struct refit_summary
+{
+    size_t m_nodes_refit = 0;
+    size_t m_subtrees_rebuilt = 0;
+    size_t m_objects_rebuilt = 0;
+};
+
+// Closed set of built-in hittable types. Hot loops switch on it to call hit() without going through
+// the vtable (see hit_primitive()); custom covers everything else, which keeps the virtual interface.
+enum class hittable_kind
+{
+    sphere,
+    moving_sphere,
+    xy_rect,
+    xz_rect,
+    yz_rect,
+    box,
+    bvh_node,
+    motion_bvh_node,
+    custom
+};
+
 class hittable
 {
 public:
+    hittable(hittable_kind kind = hittable_kind::custom) : m_kind(kind) {}
+
+    hittable_kind kind() const { return m_kind; }
+
     virtual bool hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const = 0;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+    // Entry and exit of the first span of the ray inside the object that overlaps [t_min, t_max],
+    // clipped to that range. Only meaningful for closed objects. The default falls back to two hit() queries.
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const;
+
+    // Appends every span of the ray inside the object that overlaps [t_min, t_max], clipped to that range.
+    // Spans from different children may overlap; merge_intervals() turns them into a sorted disjoint list.
+    virtual void hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const
+    {
+        double t_enter, t_exit;
+        if (hit_interval(r_in, t_min, t_max, t_enter, t_exit))
+            spans.push_back({ t_enter, t_exit });
+    }
+
+    // Bounds of the part of the object with lo <= p[axis] <= hi, used by spatial splits in a BVH build.
+    // Returns false if nothing is left. The default clips the bounding box, which is exact for axis-aligned shapes.
+    virtual bool clipped_box(double time0, double time1, int axis, double lo, double hi, aabb& output_box) const;
+
+    // Appends the primitives that hits on this object report in hit_record::m_object. Composites
+    // recurse into their children; everything else, transforms included, appends itself.
+    virtual void collect_primitives(std::vector<const hittable*>& primitives) const { primitives.push_back(this); }
+
+    // True if the bounds depend on the time window, i.e. the object moves during an animation.
+    virtual bool is_animated() const { return false; }
+
+    // True if hit() draws random numbers, as participating media do. A ray must test such an object once per
+    // traversal, so BVH builds never split its references across children.
+    virtual bool is_stochastic() const { return false; }
+
+    // Called between frames of an animation with the new time window, so that cached bounds
+    // (BVH boxes, rotated boxes) can be brought up to date without rebuilding the scene.
+    virtual void refit(double time0, double time1, refit_summary& summary) {}
+
+private:
+    hittable_kind m_kind;
 };
 
+inline bool hittable::hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const
+{
+    hit_record hit_rec1, hit_rec2;
+
+    if (!hit(r_in, -INF, INF, hit_rec1))
+        return false;
+
+    if (!hit(r_in, hit_rec1.m_t + 0.0001, INF, hit_rec2))
+        return false;
+
+    t_enter = fmax(hit_rec1.m_t, t_min);
+    t_exit = fmin(hit_rec2.m_t, t_max);
+
+    return t_enter < t_exit;
+}
+
+inline bool hittable::clipped_box(double time0, double time1, int axis, double lo, double hi, aabb& output_box) const
+{
+    if (!bounding_box(time0, time1, output_box))
+        return false;
+    return clip_box(output_box, axis, lo, hi);
+}
+
+inline void merge_intervals(std::vector<interval>& spans)
+{
+    if (spans.empty())
+        return;
+
+    std::sort(spans.begin(), spans.end(), [](const interval& a, const interval& b) { return a.m_t0 < b.m_t0; });
+
+    size_t last = 0;
+    for (size_t i = 1; i < spans.size(); i++)
+    {
+        if (spans[i].m_t0 <= spans[last].m_t1)
+            spans[last].m_t1 = fmax(spans[last].m_t1, spans[i].m_t1);
+        else
+            spans[++last] = spans[i];
+    }
+    spans.resize(last + 1);
+}
+
+// hit_interval() for composites: gathers the children's spans and reports the nearest merged one.
+inline bool first_interval(const hittable& object, const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit)
+{
+    thread_local std::vector<interval> spans;
+    spans.clear();
+
+    object.hit_intervals(r_in, t_min, t_max, spans);
+    merge_intervals(spans);
+
+    if (spans.empty())
+        return false;
+
+    t_enter = spans.front().m_t0;
+    t_exit = spans.front().m_t1;
+    return true;
+}
+
 class translate : public hittable
 {
 public:
@@ -41,12 +175,34 @@ public:
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const override
+    {
+        return m_ptr->hit_interval(ray(r_in.origin() - m_offset, r_in.dir(), r_in.time()), t_min, t_max, t_enter, t_exit);
+    }
+
+    virtual void hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const override
+    {
+        m_ptr->hit_intervals(ray(r_in.origin() - m_offset, r_in.dir(), r_in.time()), t_min, t_max, spans);
+    }
+
+    virtual bool clipped_box(double time0, double time1, int axis, double lo, double hi, aabb& output_box) const override
+    {
+        if (!m_ptr->clipped_box(time0, time1, axis, lo - m_offset[axis], hi - m_offset[axis], output_box))
+            return false;
+        output_box = aabb(output_box.min() + m_offset, output_box.max() + m_offset);
+        return true;
+    }
+
+    virtual bool is_animated() const override { return m_ptr->is_animated(); }
+    virtual bool is_stochastic() const override { return m_ptr->is_stochastic(); }
+    virtual void refit(double time0, double time1, refit_summary& summary) override { m_ptr->refit(time0, time1, summary); }
+
 private:
     std::shared_ptr<hittable> m_ptr;
     vec3 m_offset;
 };
 
-bool translate::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+inline bool translate::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
 {
     ray moved_r(r_in.origin() - m_offset, r_in.dir(), r_in.time());
     if (!m_ptr->hit(moved_r, t_min, t_max, hit_rec))
@@ -54,11 +210,12 @@ bool translate::hit(const ray& r_in, double t_min, double t_max, hit_record& hit
 
     hit_rec.m_point += m_offset;
     hit_rec.set_face_normal(moved_r, hit_rec.m_normal);
+    hit_rec.m_object = nullptr;
 
     return true;
 }
 
-bool translate::bounding_box(double time0, double time1, aabb& output_box) const
+inline bool translate::bounding_box(double time0, double time1, aabb& output_box) const
 {
     if (!m_ptr->bounding_box(time0, time1, output_box))
         return false;
@@ -81,6 +238,47 @@ public:
         return m_hasbox;
     }
 
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const override
+    {
+        return m_ptr->hit_interval(to_object(r_in), t_min, t_max, t_enter, t_exit);
+    }
+
+    virtual void hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const override
+    {
+        m_ptr->hit_intervals(to_object(r_in), t_min, t_max, spans);
+    }
+
+    virtual bool clipped_box(double time0, double time1, int axis, double lo, double hi, aabb& output_box) const override;
+
+    virtual bool is_animated() const override { return m_ptr->is_animated(); }
+    virtual bool is_stochastic() const override { return m_ptr->is_stochastic(); }
+
+    virtual void refit(double time0, double time1, refit_summary& summary) override
+    {
+        m_ptr->refit(time0, time1, summary);
+        update_box(time0, time1);
+    }
+
+private:
+    void update_box(double time0, double time1);
+
+    // Box around an object-space box once rotated into the world.
+    aabb to_world(const aabb& box) const;
+
+    ray to_object(const ray& r_in) const
+    {
+        auto origin = r_in.origin();
+        auto direction = r_in.dir();
+
+        origin[0] = m_cos_theta * r_in.origin()[0] - m_sin_theta * r_in.origin()[2];
+        origin[2] = m_sin_theta * r_in.origin()[0] + m_cos_theta * r_in.origin()[2];
+
+        direction[0] = m_cos_theta * r_in.dir()[0] - m_sin_theta * r_in.dir()[2];
+        direction[2] = m_sin_theta * r_in.dir()[0] + m_cos_theta * r_in.dir()[2];
+
+        return ray(origin, direction, r_in.time());
+    }
+
 private:
     std::shared_ptr<hittable> m_ptr;
     double m_sin_theta;
@@ -89,13 +287,22 @@ private:
     aabb m_bbox;
 };
 
-rotate_y::rotate_y(std::shared_ptr<hittable> p, double angle) : m_ptr(p)
+inline rotate_y::rotate_y(std::shared_ptr<hittable> p, double angle) : m_ptr(p)
 {
     const double radians = degrees_to_radians(angle);
     m_sin_theta = sin(radians);
     m_cos_theta = cos(radians);
-    m_hasbox = m_ptr->bounding_box(0, 1, m_bbox);
+    update_box(0, 1);
+}
+
+inline void rotate_y::update_box(double time0, double time1)
+{
+    m_hasbox = m_ptr->bounding_box(time0, time1, m_bbox);
+    m_bbox = to_world(m_bbox);
+}
 
+inline aabb rotate_y::to_world(const aabb& box) const
+{
     point3 min(INF, INF, INF);
     point3 max(-INF, -INF, -INF);
 
@@ -105,9 +312,9 @@ rotate_y::rotate_y(std::shared_ptr<hittable> p, double angle) : m_ptr(p)
         {
             for (int k = 0; k < 2; k++)
             {
-                auto x = i * m_bbox.max().x() + (1 - i) * m_bbox.min().x();
-                auto y = j * m_bbox.max().y() + (1 - j) * m_bbox.min().y();
-                auto z = k * m_bbox.max().z() + (1 - k) * m_bbox.min().z();
+                auto x = i * box.max().x() + (1 - i) * box.min().x();
+                auto y = j * box.max().y() + (1 - j) * box.min().y();
+                auto z = k * box.max().z() + (1 - k) * box.min().z();
 
                 auto newx = m_cos_theta * x + m_sin_theta * z;
                 auto newz = -m_sin_theta * x + m_cos_theta * z;
@@ -123,21 +330,77 @@ rotate_y::rotate_y(std::shared_ptr<hittable> p, double angle) : m_ptr(p)
         }
     }
 
-    m_bbox = aabb(min, max);
+    return aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+// Planes across the rotation axis stay planes in object space, so those are clipped there. Otherwise
+// the rotated object box is cut by the slab: its corners inside plus the points where its edges cross the planes.
+inline bool rotate_y::clipped_box(double time0, double time1, int axis, double lo, double hi, aabb& output_box) const
 {
-    auto origin = r_in.origin();
-    auto direction = r_in.dir();
+    if (axis == 1)
+    {
+        if (!m_ptr->clipped_box(time0, time1, axis, lo, hi, output_box))
+            return false;
+        output_box = to_world(output_box);
+        return true;
+    }
 
-    origin[0] = m_cos_theta * r_in.origin()[0] - m_sin_theta * r_in.origin()[2];
-    origin[2] = m_sin_theta * r_in.origin()[0] + m_cos_theta * r_in.origin()[2];
+    aabb inner;
+    if (!m_ptr->bounding_box(time0, time1, inner))
+        return false;
+
+    point3 corners[8];
+    for (int i = 0; i < 8; i++)
+    {
+        const double x = i & 1 ? inner.max().x() : inner.min().x();
+        const double y = i & 2 ? inner.max().y() : inner.min().y();
+        const double z = i & 4 ? inner.max().z() : inner.min().z();
+        corners[i] = point3(m_cos_theta * x + m_sin_theta * z, y, -m_sin_theta * x + m_cos_theta * z);
+    }
 
-    direction[0] = m_cos_theta * r_in.dir()[0] - m_sin_theta * r_in.dir()[2];
-    direction[2] = m_sin_theta * r_in.dir()[0] + m_cos_theta * r_in.dir()[2];
+    point3 small(INF, INF, INF);
+    point3 big(-INF, -INF, -INF);
+    bool any = false;
+    const auto add = [&](const point3& p)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            small[c] = fmin(small[c], p[c]);
+            big[c] = fmax(big[c], p[c]);
+        }
+        any = true;
+    };
 
-    ray rotated_r(origin, direction, r_in.time());
+    for (int i = 0; i < 8; i++)
+    {
+        if (corners[i][axis] >= lo && corners[i][axis] <= hi)
+            add(corners[i]);
+
+        for (int bit = 1; bit < 8; bit <<= 1)
+        {
+            if (i & bit)
+                continue;
+            const point3& p = corners[i];
+            const point3& q = corners[i | bit];
+            for (const double plane : { lo, hi })
+                if ((p[axis] - plane) * (q[axis] - plane) < 0)
+                {
+                    point3 crossing = p + (plane - p[axis]) / (q[axis] - p[axis]) * (q - p);
+                    crossing[axis] = plane;
+                    add(crossing);
+                }
+        }
+    }
+
+    if (!any)
+        return false;
+    output_box = aabb(small, big);
+    return true;
+}
+
+inline bool rotate_y::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+{
+    const ray rotated_r = to_object(r_in);
 
     if (!m_ptr->hit(rotated_r, t_min, t_max, hit_rec))
         return false;
@@ -153,6 +416,7 @@ bool rotate_y::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_
 
     hit_rec.m_point = p;
     hit_rec.set_face_normal(rotated_r, normal);
+    hit_rec.m_object = nullptr;
 
     return true;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include "hittable.h"
+#include "primitive_dispatch.h"
 
 #include <memory>
 #include <vector>
@@ -11,7 +12,15 @@ public:
     hittable_objects(std::shared_ptr<hittable> object) { add(object); }
 
     void add(std::shared_ptr<hittable> object) { m_objects.push_back(object); }
+    void reserve(size_t count) { m_objects.reserve(count); }
     void clear() { m_objects.clear(); }
+
+    virtual void collect_primitives(std::vector<const hittable*>& primitives) const override
+    {
+        for (const auto& obj : m_objects)
+            obj->collect_primitives(primitives);
+    }
+
     std::vector<std::shared_ptr<hittable>> get_m_objects() const
     {
         return m_objects;
@@ -20,11 +29,45 @@ public:
     virtual bool hit(const ray& ray, double t_min, double t_max, hit_record& hit_rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const override
+    {
+        return first_interval(*this, r_in, t_min, t_max, t_enter, t_exit);
+    }
+
+    virtual void hit_intervals(const ray& r_in, double t_min, double t_max, std::vector<interval>& spans) const override
+    {
+        for (const auto& obj : m_objects)
+            obj->hit_intervals(r_in, t_min, t_max, spans);
+    }
+
+    virtual bool is_animated() const override
+    {
+        for (const auto& obj : m_objects)
+            if (obj->is_animated())
+                return true;
+        return false;
+    }
+
+    virtual bool is_stochastic() const override
+    {
+        for (const auto& obj : m_objects)
+            if (obj->is_stochastic())
+                return true;
+        return false;
+    }
+
+    virtual void refit(double time0, double time1, refit_summary& summary) override
+    {
+        for (const auto& obj : m_objects)
+            if (obj->is_animated())
+                obj->refit(time0, time1, summary);
+    }
+
 private:
     std::vector<std::shared_ptr<hittable>> m_objects;
 };
 
-bool hittable_objects::hit(const ray& ray, double t_min, double t_max, hit_record& hit_rec) const
+inline bool hittable_objects::hit(const ray& ray, double t_min, double t_max, hit_record& hit_rec) const
 {
     hit_record tmp_hit_rec;
     bool hit_smth = false;
@@ -32,7 +75,8 @@ bool hittable_objects::hit(const ray& ray, double t_min, double t_max, hit_recor
 
     for (const auto& obj : m_objects)
     {
-        if (obj->hit(ray, t_min, closest_so_far, tmp_hit_rec))
+        RT_STAT(m_list_tests);
+        if (hit_primitive(*obj, ray, t_min, closest_so_far, tmp_hit_rec))
         {
             hit_smth = true;
             closest_so_far = tmp_hit_rec.m_t;
@@ -42,7 +86,7 @@ bool hittable_objects::hit(const ray& ray, double t_min, double t_max, hit_recor
     return hit_smth;
 }
 
-bool hittable_objects::bounding_box(double time0, double time1, aabb& output_box) const
+inline bool hittable_objects::bounding_box(double time0, double time1, aabb& output_box) const
 {
     if (m_objects.empty()) return false;
 
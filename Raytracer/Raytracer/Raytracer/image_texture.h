@@ -0,0 +1,237 @@
+#pragma once
+#include "constants.h"
+#include "texture.h"
+#include "texture_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Mip-mapped image texture. At construction the image and its mip chain are cut into tiles
+// and written to an anonymous temporary file; from then on texels are only reachable through
+// the process-wide texture_cache, so resident memory is bounded by the cache budget rather
+// than by the size of the texture set.
+class image_texture : public texture, public tile_source
+{
+public:
+    // texels: width * height RGB triples, top row first.
+    image_texture(int width, int height, const std::vector<float>& texels);
+    ~image_texture();
+
+    image_texture(const image_texture&) = delete;
+    image_texture& operator = (const image_texture&) = delete;
+
+    // Reads a binary (P6) or ASCII (P3) PPM. Returns nullptr on failure.
+    static std::shared_ptr<image_texture> load_ppm(const std::string& path);
+
+    int width() const { return m_levels.empty() ? 0 : m_levels[0].m_width; }
+    int height() const { return m_levels.empty() ? 0 : m_levels[0].m_height; }
+    int levels() const { return static_cast<int>(m_levels.size()); }
+
+    virtual color value(double u, double v, const point3& p) const override
+    {
+        return bilinear(0, u, v);
+    }
+
+    // Trilinear lookup: the mip level is chosen so one texel roughly covers the footprint.
+    virtual color filtered_value(double u, double v, const point3& p, double footprint) const override
+    {
+        if (footprint <= 0 || m_levels.size() == 1)
+            return bilinear(0, u, v);
+
+        const double texels = footprint * std::max(width(), height());
+        const double lod = clamp(log2(fmax(texels, 1e-8)), 0.0, static_cast<double>(m_levels.size() - 1));
+        const int level = static_cast<int>(lod);
+        const double t = lod - level;
+
+        if (t <= 0 || level + 1 >= static_cast<int>(m_levels.size()))
+            return bilinear(level, u, v);
+
+        return (1 - t) * bilinear(level, u, v) + t * bilinear(level + 1, u, v);
+    }
+
+    virtual void read_tile(int level, int tile_x, int tile_y, texture_tile& out) const override;
+
+private:
+    struct mip_level
+    {
+        int m_width;
+        int m_height;
+        int m_tiles_x;
+        int m_tiles_y;
+        long m_file_offset;
+    };
+
+    static color texel(const cached_tile& tile, int x, int y)
+    {
+        const float* t = tile.m_value.data() + 3 * morton_index(x & (TEXTURE_TILE_SIZE - 1), y & (TEXTURE_TILE_SIZE - 1));
+        return color(t[0], t[1], t[2]);
+    }
+
+    color bilinear(int level, double u, double v) const
+    {
+        const mip_level& l = m_levels[level];
+
+        // Image rows run top to bottom while v runs bottom to top.
+        const double x = clamp(u, 0.0, 1.0) * l.m_width - 0.5;
+        const double y = (1.0 - clamp(v, 0.0, 1.0)) * l.m_height - 0.5;
+        const int x0 = static_cast<int>(floor(x));
+        const int y0 = static_cast<int>(floor(y));
+        const double tx = x - x0;
+        const double ty = y - y0;
+
+        const int xa = std::clamp(x0, 0, l.m_width - 1);
+        const int xb = std::clamp(x0 + 1, 0, l.m_width - 1);
+        const int ya = std::clamp(y0, 0, l.m_height - 1);
+        const int yb = std::clamp(y0 + 1, 0, l.m_height - 1);
+
+        // The four texels are pinned tile by tile; unless the footprint straddles a tile edge they share one.
+        const int tile_xa = xa >> TEXTURE_TILE_LOG2, tile_xb = xb >> TEXTURE_TILE_LOG2;
+        const int tile_ya = ya >> TEXTURE_TILE_LOG2, tile_yb = yb >> TEXTURE_TILE_LOG2;
+        texture_cache& cache = texture_cache::instance();
+        const auto aa = cache.tile(*this, m_id, level, tile_xa, tile_ya);
+        const auto ba = tile_xb != tile_xa ? cache.tile(*this, m_id, level, tile_xb, tile_ya) : nullptr;
+        const auto ab = tile_yb != tile_ya ? cache.tile(*this, m_id, level, tile_xa, tile_yb) : nullptr;
+        const auto bb = ba && ab ? cache.tile(*this, m_id, level, tile_xb, tile_yb) : nullptr;
+        const cached_tile& tile_ba = ba ? *ba : *aa;
+        const cached_tile& tile_ab = ab ? *ab : *aa;
+        const cached_tile& tile_bb = bb ? *bb : ba ? *ba : tile_ab;
+
+        return (1 - ty) * ((1 - tx) * texel(*aa, xa, ya) + tx * texel(tile_ba, xb, ya))
+             + ty * ((1 - tx) * texel(tile_ab, xa, yb) + tx * texel(tile_bb, xb, yb));
+    }
+
+private:
+    uint32_t m_id;
+    std::vector<mip_level> m_levels;
+    std::FILE* m_backing;
+    mutable std::mutex m_backing_mutex;
+};
+
+inline image_texture::image_texture(int width, int height, const std::vector<float>& texels)
+    : m_id(texture_cache::instance().register_texture())
+    , m_backing(std::tmpfile())
+{
+    if (!m_backing)
+        std::cerr << "Cannot create backing file for image texture.\n";
+
+    std::vector<float> level_texels(texels);
+    int w = width;
+    int h = height;
+    long offset = 0;
+    std::vector<float> tile(TEXTURE_TILE_FLOATS);
+
+    while (true)
+    {
+        const mip_level level { w, h, (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE, (h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE, offset };
+        m_levels.push_back(level);
+
+        for (int ty = 0; ty < level.m_tiles_y; ty++)
+            for (int tx = 0; tx < level.m_tiles_x; tx++)
+            {
+                // Texels past the image edge repeat the border, so every tile is full-size.
+                for (int y = 0; y < TEXTURE_TILE_SIZE; y++)
+                    for (int x = 0; x < TEXTURE_TILE_SIZE; x++)
+                    {
+                        const int sx = std::min(tx * TEXTURE_TILE_SIZE + x, w - 1);
+                        const int sy = std::min(ty * TEXTURE_TILE_SIZE + y, h - 1);
+                        const float* src = &level_texels[(static_cast<size_t>(sy) * w + sx) * 3];
+                        float* dst = &tile[3 * morton_index(x, y)];
+                        dst[0] = src[0];
+                        dst[1] = src[1];
+                        dst[2] = src[2];
+                    }
+                if (m_backing)
+                    std::fwrite(tile.data(), sizeof(float), tile.size(), m_backing);
+                offset += static_cast<long>(tile.size() * sizeof(float));
+            }
+
+        if (w == 1 && h == 1)
+            break;
+
+        // 2x2 box filter; odd edges fold their last texel into the previous pair.
+        const int nw = std::max(w / 2, 1);
+        const int nh = std::max(h / 2, 1);
+        std::vector<float> next(static_cast<size_t>(nw) * nh * 3);
+        for (int y = 0; y < nh; y++)
+            for (int x = 0; x < nw; x++)
+                for (int c = 0; c < 3; c++)
+                {
+                    double sum = 0;
+                    int n = 0;
+                    for (int sy = 2 * y; sy < std::min(2 * y + 2 + (y == nh - 1 ? h % 2 : 0), h); sy++)
+                        for (int sx = 2 * x; sx < std::min(2 * x + 2 + (x == nw - 1 ? w % 2 : 0), w); sx++, n++)
+                            sum += level_texels[(static_cast<size_t>(sy) * w + sx) * 3 + c];
+                    next[(static_cast<size_t>(y) * nw + x) * 3 + c] = static_cast<float>(sum / n);
+                }
+
+        level_texels.swap(next);
+        w = nw;
+        h = nh;
+    }
+
+    if (m_backing)
+        std::fflush(m_backing);
+}
+
+inline image_texture::~image_texture()
+{
+    if (m_backing)
+        std::fclose(m_backing);
+}
+
+inline void image_texture::read_tile(int level, int tile_x, int tile_y, texture_tile& out) const
+{
+    const mip_level& l = m_levels[level];
+    const long offset = l.m_file_offset + static_cast<long>((tile_y * l.m_tiles_x + tile_x) * TEXTURE_TILE_FLOATS * sizeof(float));
+
+    std::lock_guard<std::mutex> lock(m_backing_mutex);
+    if (!m_backing || std::fseek(m_backing, offset, SEEK_SET) != 0
+        || std::fread(out.data(), sizeof(float), TEXTURE_TILE_FLOATS, m_backing) != TEXTURE_TILE_FLOATS)
+    {
+        // Magenta makes a failed read obvious in the image.
+        for (size_t i = 0; i < TEXTURE_TILE_FLOATS; i += 3)
+        {
+            out[i] = 1.f;
+            out[i + 1] = 0.f;
+            out[i + 2] = 1.f;
+        }
+    }
+}
+
+inline std::shared_ptr<image_texture> image_texture::load_ppm(const std::string& path)
+{
+    std::ifstream ifs(path, std::ios_base::in | std::ios_base::binary);
+    std::string magic;
+    int width = 0, height = 0, max_value = 0;
+    ifs >> magic >> width >> height >> max_value;
+
+    if (!ifs || (magic != "P6" && magic != "P3") || width <= 0 || height <= 0 || max_value <= 0 || max_value > 255)
+    {
+        std::cerr << "Cannot read PPM texture " << path << ".\n";
+        return nullptr;
+    }
+    ifs.get();
+
+    std::vector<float> texels(static_cast<size_t>(width) * height * 3);
+    for (auto& t : texels)
+    {
+        int value;
+        if (magic == "P6")
+            value = ifs.get();
+        else
+            ifs >> value;
+        t = static_cast<float>(value) / max_value;
+    }
+
+    if (!ifs)
+    {
+        std::cerr << "PPM texture " << path << " is truncated.\n";
+        return nullptr;
+    }
+
+    return std::make_shared<image_texture>(width, height, texels);
+}
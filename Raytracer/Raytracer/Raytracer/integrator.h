@@ -0,0 +1,315 @@
+#pragma once
+#include "constants.h"
+#include "environment.h"
+#include "guiding.h"
+#include "hittable.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "photon_map.h"
+#include "radiance_cache.h"
+#include "stats.h"
+
+// Emission and scattering of the material at a hit of r_in. Returns false when the path ends there.
+inline bool shade_hit(const ray& r_in, hit_record& hit_rec, color& emitted, color& attenuation, ray& scattered)
+{
+    const double cone_width = r_in.cone_width_at(hit_rec.m_t);
+    hit_rec.m_footprint = cone_width * hit_rec.m_uv_scale;
+
+    const material& mat = *hit_rec.m_mat_ptr;
+    emitted = emitted_material(mat, hit_rec.m_u, hit_rec.m_v, hit_rec.m_point);
+
+#ifdef RT_ENABLE_STATS
+    const material_kind kind = mat.kind();
+    RT_STAT_MATERIAL(m_material_hits, kind);
+    if (emitted.x() > 0 || emitted.y() > 0 || emitted.z() > 0)
+        RT_STAT_MATERIAL(m_emissions, kind);
+#endif
+
+    if (!scatter_material(mat, r_in, hit_rec, attenuation, scattered))
+        return false;
+
+    RT_STAT_MATERIAL(m_scatters, mat.kind());
+
+    // The cone carries on from the hit point; surface curvature is ignored.
+    scattered.set_cone(cone_width, r_in.cone_spread());
+    return true;
+}
+
+// Power heuristic weight of a sample drawn with density pdf when other_pdf could also have drawn it.
+inline double power_heuristic(double pdf, double other_pdf)
+{
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// The previous vertex of a path, as far as weighting the light its scattered ray finds is concerned.
+// m_pdf is the density with which it scattered the ray, or 0 if it sampled no light directly; m_normal is
+// its surface normal, or 0 in a medium. m_gathered is set when caustic photons were gathered at an earlier
+// vertex and every vertex since was specular, and m_caustic when the last of those was also a photon target:
+// light the ray finds then was already gathered (see caustic_photons). m_diffuse_bounces counts the hits of the
+// path so far that a radiance cache could hold, while one is in use.
+struct scatter_vertex
+{
+    vec3 m_normal { 0, 0, 0 };
+    double m_pdf = 0.0;
+    bool m_gathered = false;
+    bool m_caustic = false;
+    int m_diffuse_bounces = 0;
+};
+
+// Radiance of env seen along dir by a ray scattered at from. When that hit also sampled env directly the two
+// estimates are combined with multiple importance sampling.
+inline color environment_light(const environment_map& env, const vec3& dir, const scatter_vertex& from)
+{
+    const color light = env.radiance(dir);
+    return from.m_pdf > 0 ? power_heuristic(from.m_pdf, env.pdf(dir)) * light : light;
+}
+
+// Light brought back by a ray scattered at from that leaves the scene along dir.
+inline color background_light(const scene_lights& lights, const color& background, const vec3& dir, const scatter_vertex& from)
+{
+    if (from.m_caustic && lights.m_caustics && lights.m_caustics->sources().lights_background())
+        return color(0, 0, 0);
+    return lights.m_environment ? environment_light(*lights.m_environment, dir, from) : background;
+}
+
+// emitted, the light given off at a hit of r_in, weighted against sampling the same emitter from the
+// previous vertex, r_in.origin(), with lights.m_emitters.
+inline color emitter_light(const scene_lights& lights, const ray& r_in, const hit_record& hit_rec, const color& emitted, const scatter_vertex& from)
+{
+    if (!hit_rec.m_object || (emitted.x() <= 0 && emitted.y() <= 0 && emitted.z() <= 0))
+        return emitted;
+
+    if (from.m_caustic && lights.m_caustics && lights.m_caustics->sources().is_emitter(hit_rec.m_object))
+        return color(0, 0, 0);
+
+    const light_bvh* emitters = lights.m_emitters;
+    if (!emitters || from.m_pdf <= 0 || !emitters->contains(hit_rec.m_object))
+        return emitted;
+
+    const double light_pdf = emitters->pmf(r_in.origin(), from.m_normal, hit_rec.m_object)
+                           * light_direction_pdf(*hit_rec.m_object, r_in.origin(), r_in.dir(), hit_rec);
+    return power_heuristic(from.m_pdf, light_pdf) * emitted;
+}
+
+// Whether the radiance leaving a hit is the same in every direction, so that a radiance cache can hold it, and
+// the normal the cache files it under: zero in a medium.
+inline bool cacheable_hit(const hit_record& hit_rec, vec3& normal)
+{
+    switch (hit_rec.m_mat_ptr->kind())
+    {
+        case material_kind::lambertian:
+            normal = hit_rec.m_normal;
+            return true;
+        case material_kind::isotropic:
+            normal = vec3(0, 0, 0);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether a path scattered at from ends at hit_rec in lights.m_radiance, which then gives the radiance leaving
+// the hit; otherwise counts the hit into next.
+inline bool cached_radiance(const scene_lights& lights, const hit_record& hit_rec, const scatter_vertex& from,
+                            scatter_vertex& next, color& radiance)
+{
+    if (!lights.m_radiance)
+        return false;
+
+    vec3 normal;
+    const bool diffuse = cacheable_hit(hit_rec, normal);
+    if (diffuse && from.m_diffuse_bounces >= lights.m_radiance_bounces
+        && lights.m_radiance->lookup(hit_rec.m_point, normal, radiance))
+        return true;
+    // next may be from itself.
+    next.m_diffuse_bounces = from.m_diffuse_bounces + (diffuse ? 1 : 0);
+    return false;
+}
+
+// Caustic light gathered from the photons of lights at a hit whose material gave attenuation, and the photon
+// bookkeeping of next (see scatter_vertex). Photons are gathered on lambertian surfaces, where attenuation is
+// the albedo.
+inline color gather_caustics(const scene_lights& lights, const hit_record& hit_rec, const color& attenuation,
+                             const scatter_vertex& from, scatter_vertex& next)
+{
+    bool gathered = false;
+    bool caustic = false;
+    color light(0, 0, 0);
+    if (lights.m_caustics)
+    {
+        switch (hit_rec.m_mat_ptr->kind())
+        {
+            case material_kind::lambertian:
+                gathered = true;
+                light = attenuation / PI * lights.m_caustics->irradiance(hit_rec.m_point, hit_rec.m_normal);
+                break;
+            case material_kind::dielectric:
+            case material_kind::metal:
+                gathered = from.m_gathered;
+                caustic = gathered && lights.m_caustics->sources().is_target(hit_rec.m_object);
+                break;
+            default:
+                break;
+        }
+    }
+    // next may be from itself.
+    next.m_gathered = gathered;
+    next.m_caustic = caustic;
+    return light;
+}
+
+// Density with which a hit scatters towards dir when its material alone would pick dir with material_pdf:
+// with a learned distribution guide the two are mixed.
+inline double guided_pdf(const directional_tree* guide, double material_pdf, const vec3& dir)
+{
+    return guide ? (1 - GUIDE_FRACTION) * material_pdf + GUIDE_FRACTION * guide->pdf(dir) : material_pdf;
+}
+
+// For materials that can evaluate() directions: with a learned distribution guide, redraws the direction the
+// path continues in from the mix of it and the material's own choice, scattered, updating scattered and
+// attenuation. Returns the density of the direction taken, or 0 for other materials, which keep their own.
+inline double guided_scatter(const ray& r_in, const hit_record& hit_rec, const directional_tree* guide, ray& scattered, color& attenuation)
+{
+    const material& mat = *hit_rec.m_mat_ptr;
+    color value;
+    double material_pdf;
+    if (!evaluate_material(mat, r_in, hit_rec, scattered.dir(), value, material_pdf))
+        return 0.0;
+    if (!guide)
+        return material_pdf;
+
+    if (random_double() < GUIDE_FRACTION)
+    {
+        const vec3 dir = guide->sample(random_double(), random_double());
+        ray guided(hit_rec.m_point, dir, r_in.time());
+        guided.set_cone(scattered.cone_width_at(0), scattered.cone_spread());
+        scattered = guided;
+        evaluate_material(mat, r_in, hit_rec, dir, value, material_pdf);
+    }
+
+    const double pdf = guided_pdf(guide, material_pdf, scattered.dir());
+    attenuation = pdf > 0 ? value / pdf : color(0, 0, 0);
+    return pdf;
+}
+
+// Light from env reaching a hit of a material that can evaluate() directions, estimated with one shadow
+// ray in a direction drawn from env.
+inline color direct_environment(const ray& r_in, const hit_record& hit_rec, const hittable& world, const environment_map& env,
+                                const directional_tree* guide)
+{
+    const material& mat = *hit_rec.m_mat_ptr;
+    vec3 dir;
+    color value;
+    double material_pdf;
+    const double light_pdf = env.sample(random_double(), random_double(), dir);
+    if (light_pdf <= 0 || !evaluate_material(mat, r_in, hit_rec, dir, value, material_pdf)
+        || (value.x() <= 0 && value.y() <= 0 && value.z() <= 0))
+        return color(0, 0, 0);
+
+    RT_STAT(m_rays);
+    hit_record shadow_rec;
+    if (world.hit(ray(hit_rec.m_point, dir, r_in.time()), 0.001, INF, shadow_rec))
+        return color(0, 0, 0);
+
+    return power_heuristic(light_pdf, guided_pdf(guide, material_pdf, dir)) / light_pdf * value * env.radiance(dir);
+}
+
+// Light from one emitter picked by lights reaching such a hit, with normal n, estimated with one shadow ray
+// towards a point of the emitter.
+inline color direct_emitter(const ray& r_in, const hit_record& hit_rec, const vec3& n, const hittable& world, const light_bvh& lights,
+                            const directional_tree* guide)
+{
+    double pmf;
+    const point3& p = hit_rec.m_point;
+    const hittable* light = lights.sample(p, n, random_double(), pmf);
+    if (!light)
+        return color(0, 0, 0);
+
+    const ray to_light(p, sample_light_direction(*light, p, random_double(), random_double()), r_in.time());
+    hit_record light_rec;
+    if (!light->hit(to_light, 0.001, INF, light_rec))
+        return color(0, 0, 0);
+
+    const material& mat = *hit_rec.m_mat_ptr;
+    color value;
+    double material_pdf;
+    const double light_pdf = pmf * light_direction_pdf(*light, p, to_light.dir(), light_rec);
+    if (light_pdf <= 0 || !evaluate_material(mat, r_in, hit_rec, to_light.dir(), value, material_pdf)
+        || (value.x() <= 0 && value.y() <= 0 && value.z() <= 0))
+        return color(0, 0, 0);
+
+    // Stop just short of the light so that it does not shadow itself.
+    RT_STAT(m_rays);
+    hit_record shadow_rec;
+    if (world.hit(to_light, 0.001, light_rec.m_t * (1 - 1e-6), shadow_rec))
+        return color(0, 0, 0);
+
+    const color light_emitted = emitted_material(*light_rec.m_mat_ptr, light_rec.m_u, light_rec.m_v, light_rec.m_point);
+    return power_heuristic(light_pdf, guided_pdf(guide, material_pdf, to_light.dir())) / light_pdf * value * light_emitted;
+}
+
+// Light from lights reaching a hit directly, for materials that can evaluate() a direction, which scattered
+// with scatter_pdf > 0 (see guided_scatter). next is set up for weighting what the scattered ray finds.
+inline color direct_light(const ray& r_in, const hit_record& hit_rec, const hittable& world, const scene_lights& lights,
+                          const directional_tree* guide, double scatter_pdf, scatter_vertex& next)
+{
+    next.m_pdf = 0.0;
+    if ((!lights.m_environment && !lights.m_emitters) || scatter_pdf <= 0)
+        return color(0, 0, 0);
+
+    next.m_pdf = scatter_pdf;
+    next.m_normal = hit_rec.m_mat_ptr->kind() == material_kind::isotropic ? vec3(0, 0, 0) : hit_rec.m_normal;
+
+    color direct(0, 0, 0);
+    if (lights.m_environment)
+        direct += direct_environment(r_in, hit_rec, world, *lights.m_environment, guide);
+    if (lights.m_emitters)
+        direct += direct_emitter(r_in, hit_rec, next.m_normal, world, *lights.m_emitters, guide);
+    return direct;
+}
+
+// lights.m_environment replaces background, and it and lights.m_emitters are also sampled directly at diffuse
+// hits, where caustics are gathered from lights.m_caustics and paths may end in lights.m_radiance. With guide,
+// diffuse hits also scatter by its learned distributions, and record what they find while it is recording.
+// from is internal: the hit that scattered r_in.
+inline color ray_color(const ray& r_in, const color& background, const hittable& world, int depth,
+                       const scene_lights& lights = {}, const guiding_field* guide = nullptr, const scatter_vertex& from = {})
+{
+    hit_record hit_rec;
+
+    if (depth <= 0)
+        return color(0.f, 0.f, 0.f);
+
+    RT_STAT(m_rays);
+
+    if (!world.hit(r_in, 0.001, INF, hit_rec))
+        return background_light(lights, background, r_in.dir(), from);
+
+    ray scattered;
+    color emitted, attenuation;
+    const bool scatters = shade_hit(r_in, hit_rec, emitted, attenuation, scattered);
+    emitted = emitter_light(lights, r_in, hit_rec, emitted, from);
+    if (!scatters)
+        return emitted;
+
+    scatter_vertex next;
+    color cached;
+    if (cached_radiance(lights, hit_rec, from, next, cached))
+        return emitted + cached;
+    emitted += gather_caustics(lights, hit_rec, attenuation, from, next);
+
+    const directional_tree* guide_tree = guide ? guide->lookup(hit_rec.m_point) : nullptr;
+    double scatter_pdf = 0.0;
+    if (guide || lights.m_environment || lights.m_emitters)
+        scatter_pdf = guided_scatter(r_in, hit_rec, guide_tree, scattered, attenuation);
+
+    emitted += direct_light(r_in, hit_rec, world, lights, guide_tree, scatter_pdf, next);
+    if (guide_tree && attenuation.near_zero())
+        return emitted;
+
+    const color incoming = ray_color(scattered, background, world, depth - 1, lights, guide, next);
+    if (guide && guide->recording() && scatter_pdf > 0)
+        guide->record(hit_rec.m_point, scattered.dir(), luminance(incoming) / scatter_pdf);
+
+    return emitted + attenuation * incoming;
+}
@@ -0,0 +1,601 @@
+#pragma once
+#include "aarect.h"
+#include "constants.h"
+#include "environment.h"
+#include "hittable.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// How emitters are picked for direct light sampling at diffuse hits. none leaves them to be found by
+// scattered rays; uniform picks one with equal probability; bvh descends a light_bvh by estimated contribution.
+enum class light_sampling { none, uniform, bvh };
+
+// Parses the name given to --lights; returns false for an unknown name.
+inline bool parse_light_sampling(const char* name, light_sampling& mode)
+{
+    if (!strcmp(name, "none"))
+        mode = light_sampling::none;
+    else if (!strcmp(name, "uniform"))
+        mode = light_sampling::uniform;
+    else if (!strcmp(name, "bvh"))
+        mode = light_sampling::bvh;
+    else
+        return false;
+    return true;
+}
+
+// Bounds of a set of emitters: where they are, how much power they emit and in which directions.
+// Emitted directions lie within m_cos_theta_e of a normal, and the normals within m_cos_theta_o of m_axis.
+struct light_bounds
+{
+    aabb m_box;
+    vec3 m_axis = vec3(0, 0, 1);
+    double m_cos_theta_o = 1.0;
+    double m_cos_theta_e = 0.0;
+    double m_power = 0.0;
+    bool m_two_sided = false;
+
+    // Upper estimate of the light reaching p, on a surface with normal n or in a medium (n = 0),
+    // up to a common factor. Zero only where none of the emitters can contribute.
+    double importance(const point3& p, const vec3& n) const;
+};
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b.
+inline double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b)
+{
+    return cos_a > cos_b ? 1.0 : cos_a * cos_b + sin_a * sin_b;
+}
+
+inline double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b)
+{
+    return cos_a > cos_b ? 0.0 : sin_a * cos_b - cos_a * sin_b;
+}
+
+inline double safe_sqrt(double x)
+{
+    return sqrt(std::max(x, 0.0));
+}
+
+inline double light_bounds::importance(const point3& p, const vec3& n) const
+{
+    const point3 center = 0.5 * (m_box.min() + m_box.max());
+    const double radius_squared = 0.25 * (m_box.max() - m_box.min()).length_squared();
+    const double distance_squared = (p - center).length_squared();
+    if (distance_squared <= 0)
+        return m_power / std::max(radius_squared, 1e-12);
+
+    const vec3 wi = (p - center) / sqrt(distance_squared);
+    double cos_w = dot(m_axis, wi);
+    if (m_two_sided)
+        cos_w = fabs(cos_w);
+    const double sin_w = safe_sqrt(1 - cos_w * cos_w);
+
+    // Angle the bounding sphere of the box subtends from p.
+    double cos_b = -1.0;
+    if (distance_squared > radius_squared)
+        cos_b = safe_sqrt(1 - radius_squared / distance_squared);
+    const double sin_b = safe_sqrt(1 - cos_b * cos_b);
+
+    // Smallest angle between an emitted direction and the direction to p.
+    const double sin_o = safe_sqrt(1 - m_cos_theta_o * m_cos_theta_o);
+    const double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, m_cos_theta_o);
+    const double sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, m_cos_theta_o);
+    const double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+    if (cos_p <= m_cos_theta_e)
+        return 0.0;
+
+    double importance = m_power * cos_p / std::max(distance_squared, radius_squared);
+
+    if (n.length_squared() > 0)
+    {
+        const double cos_i = fabs(dot(wi, n));
+        const double sin_i = safe_sqrt(1 - cos_i * cos_i);
+        importance *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+    }
+    return std::max(importance, 0.0);
+}
+
+// Rotates v by angle around the unit vector axis.
+inline vec3 rotate_around(const vec3& v, const vec3& axis, double angle)
+{
+    return v * cos(angle) + cross(axis, v) * sin(angle) + axis * dot(axis, v) * (1 - cos(angle));
+}
+
+inline light_bounds union_bounds(const light_bounds& a, const light_bounds& b)
+{
+    if (a.m_power <= 0)
+        return b;
+    if (b.m_power <= 0)
+        return a;
+
+    light_bounds u;
+    u.m_box = surrounding_box(a.m_box, b.m_box);
+    u.m_power = a.m_power + b.m_power;
+    u.m_cos_theta_e = std::min(a.m_cos_theta_e, b.m_cos_theta_e);
+    u.m_two_sided = a.m_two_sided || b.m_two_sided;
+
+    // Smallest cone around both normal cones.
+    const double theta_a = acos(clamp(a.m_cos_theta_o, -1.0, 1.0));
+    const double theta_b = acos(clamp(b.m_cos_theta_o, -1.0, 1.0));
+    const double theta_d = acos(clamp(dot(a.m_axis, b.m_axis), -1.0, 1.0));
+    if (std::min(theta_d + theta_b, PI) <= theta_a)
+    {
+        u.m_axis = a.m_axis;
+        u.m_cos_theta_o = a.m_cos_theta_o;
+    }
+    else if (std::min(theta_d + theta_a, PI) <= theta_b)
+    {
+        u.m_axis = b.m_axis;
+        u.m_cos_theta_o = b.m_cos_theta_o;
+    }
+    else
+    {
+        const double theta_o = 0.5 * (theta_a + theta_d + theta_b);
+        const vec3 rotation_axis = cross(a.m_axis, b.m_axis);
+        if (theta_o >= PI || rotation_axis.length_squared() == 0)
+        {
+            u.m_axis = a.m_axis;
+            u.m_cos_theta_o = -1.0;
+        }
+        else
+        {
+            u.m_axis = unit_vector(rotate_around(a.m_axis, unit_vector(rotation_axis), theta_o - theta_a));
+            u.m_cos_theta_o = cos(theta_o);
+        }
+    }
+    return u;
+}
+
+// Emitters the light BVH can sample: static spheres and axis-aligned rectangles with a diffuse_light material.
+inline const std::shared_ptr<material>& light_material(const hittable& object)
+{
+    static const std::shared_ptr<material> none;
+    switch (object.kind())
+    {
+        case hittable_kind::sphere:
+            return static_cast<const sphere&>(object).material_ptr();
+        case hittable_kind::xy_rect:
+            return static_cast<const xy_rect&>(object).m_mat_ptr;
+        case hittable_kind::xz_rect:
+            return static_cast<const xz_rect&>(object).m_mat_ptr;
+        case hittable_kind::yz_rect:
+            return static_cast<const yz_rect&>(object).m_mat_ptr;
+        default:
+            return none;
+    }
+}
+
+// Bounds of one emitter; false if it is not one the light BVH can sample.
+inline bool emitter_bounds(const hittable& object, light_bounds& bounds)
+{
+    const std::shared_ptr<material>& mat = light_material(object);
+    if (!mat || mat->kind() != material_kind::diffuse_light || !object.bounding_box(0, 0, bounds.m_box))
+        return false;
+
+    // Power from the emission in the middle of the surface; it only steers sampling.
+    const color emission = emitted_material(*mat, 0.5, 0.5, 0.5 * (bounds.m_box.min() + bounds.m_box.max()));
+    const double radiance = luminance(emission);
+
+    double area;
+    switch (object.kind())
+    {
+        case hittable_kind::sphere:
+        {
+            const double r = static_cast<const sphere&>(object).radius();
+            area = 4 * PI * r * r;
+            bounds.m_cos_theta_o = -1.0;
+            bounds.m_two_sided = false;
+            break;
+        }
+        case hittable_kind::xy_rect:
+        {
+            const auto& rect = static_cast<const xy_rect&>(object);
+            area = 2 * (rect.m_x1 - rect.m_x0) * (rect.m_y1 - rect.m_y0);
+            bounds.m_axis = vec3(0, 0, 1);
+            bounds.m_two_sided = true;
+            break;
+        }
+        case hittable_kind::xz_rect:
+        {
+            const auto& rect = static_cast<const xz_rect&>(object);
+            area = 2 * (rect.m_x1 - rect.m_x0) * (rect.m_z1 - rect.m_z0);
+            bounds.m_axis = vec3(0, 1, 0);
+            bounds.m_two_sided = true;
+            break;
+        }
+        default:
+        {
+            const auto& rect = static_cast<const yz_rect&>(object);
+            area = 2 * (rect.m_y1 - rect.m_y0) * (rect.m_z1 - rect.m_z0);
+            bounds.m_axis = vec3(1, 0, 0);
+            bounds.m_two_sided = true;
+            break;
+        }
+    }
+
+    bounds.m_power = PI * area * radiance;
+    return bounds.m_power > 0;
+}
+
+// 1 - cos(theta_max) of the cone of directions in which a sphere of radius_squared is seen from distance_squared
+// away, written to keep its precision for small, distant spheres; 2, the whole sphere of directions, from inside.
+inline double sphere_cone_one_minus_cos(double radius_squared, double distance_squared)
+{
+    if (distance_squared <= radius_squared)
+        return 2.0;
+    const double sin_squared = radius_squared / distance_squared;
+    return sin_squared / (1 + sqrt(1 - sin_squared));
+}
+
+// Direction drawn uniformly by solid angle from the cone around the unit vector w whose half-angle has the given
+// 1 - cos; its density is 1 / (2 pi one_minus_cos).
+inline vec3 sample_cone(const vec3& w, double one_minus_cos, double u1, double u2)
+{
+    const double cos_theta = 1 - u1 * one_minus_cos;
+    const double sin_theta = safe_sqrt(1 - cos_theta * cos_theta);
+    const double phi = 2 * PI * u2;
+
+    const vec3 a = fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    const vec3 v = unit_vector(cross(w, a));
+    const vec3 u = cross(w, v);
+    return sin_theta * cos(phi) * u + sin_theta * sin(phi) * v + cos_theta * w;
+}
+
+// Point drawn uniformly by area from the surface of a sphere or rectangle light, with the normal there and the
+// area of the surface. Rectangles face +z, +y or +x.
+inline point3 sample_light_point(const hittable& light, double u1, double u2, vec3& normal, double& area)
+{
+    switch (light.kind())
+    {
+        case hittable_kind::sphere:
+        {
+            const auto& s = static_cast<const sphere&>(light);
+            normal = sample_cone(vec3(0, 0, 1), 2.0, u1, u2);
+            area = 4 * PI * s.radius() * s.radius();
+            return s.center() + s.radius() * normal;
+        }
+        case hittable_kind::xy_rect:
+        {
+            const auto& r = static_cast<const xy_rect&>(light);
+            normal = vec3(0, 0, 1);
+            area = (r.m_x1 - r.m_x0) * (r.m_y1 - r.m_y0);
+            return point3(r.m_x0 + u1 * (r.m_x1 - r.m_x0), r.m_y0 + u2 * (r.m_y1 - r.m_y0), r.m_k);
+        }
+        case hittable_kind::xz_rect:
+        {
+            const auto& r = static_cast<const xz_rect&>(light);
+            normal = vec3(0, 1, 0);
+            area = (r.m_x1 - r.m_x0) * (r.m_z1 - r.m_z0);
+            return point3(r.m_x0 + u1 * (r.m_x1 - r.m_x0), r.m_k, r.m_z0 + u2 * (r.m_z1 - r.m_z0));
+        }
+        default:
+        {
+            const auto& r = static_cast<const yz_rect&>(light);
+            normal = vec3(1, 0, 0);
+            area = (r.m_y1 - r.m_y0) * (r.m_z1 - r.m_z0);
+            return point3(r.m_k, r.m_y0 + u1 * (r.m_y1 - r.m_y0), r.m_z0 + u2 * (r.m_z1 - r.m_z0));
+        }
+    }
+}
+
+// Direction from origin towards a point of light, drawn with light_direction_pdf(). Rectangles are
+// sampled by area, spheres by the cone of directions in which they are seen.
+inline vec3 sample_light_direction(const hittable& light, const point3& origin, double u1, double u2)
+{
+    if (light.kind() == hittable_kind::sphere)
+    {
+        const auto& s = static_cast<const sphere&>(light);
+        const vec3 to_center = s.center() - origin;
+        const double distance_squared = to_center.length_squared();
+        const vec3 w = distance_squared > 0 ? unit_vector(to_center) : vec3(0, 0, 1);
+        return sample_cone(w, sphere_cone_one_minus_cos(s.radius() * s.radius(), distance_squared), u1, u2);
+    }
+
+    vec3 normal;
+    double area;
+    return sample_light_point(light, u1, u2, normal, area) - origin;
+}
+
+// Density per unit solid angle with which sample_light_direction() picks dir, given the hit of
+// ray(origin, dir) on the light.
+inline double light_direction_pdf(const hittable& light, const point3& origin, const vec3& dir, const hit_record& light_rec)
+{
+    double area;
+    switch (light.kind())
+    {
+        case hittable_kind::sphere:
+        {
+            const auto& s = static_cast<const sphere&>(light);
+            return 1 / (2 * PI * sphere_cone_one_minus_cos(s.radius() * s.radius(), (s.center() - origin).length_squared()));
+        }
+        case hittable_kind::xy_rect:
+        {
+            const auto& r = static_cast<const xy_rect&>(light);
+            area = (r.m_x1 - r.m_x0) * (r.m_y1 - r.m_y0);
+            break;
+        }
+        case hittable_kind::xz_rect:
+        {
+            const auto& r = static_cast<const xz_rect&>(light);
+            area = (r.m_x1 - r.m_x0) * (r.m_z1 - r.m_z0);
+            break;
+        }
+        default:
+        {
+            const auto& r = static_cast<const yz_rect&>(light);
+            area = (r.m_y1 - r.m_y0) * (r.m_z1 - r.m_z0);
+            break;
+        }
+    }
+
+    const double length = dir.length();
+    const double cosine = fabs(dot(light_rec.m_normal, dir)) / length;
+    const double distance = light_rec.m_t * length;
+    return cosine > 0 && area > 0 ? distance * distance / (cosine * area) : 0.0;
+}
+
+// Node of a light_bvh. Inner nodes have their first child right after them and the second at m_index;
+// leaves hold one light, whose position in the light list is m_index.
+struct light_bvh_node
+{
+    light_bounds m_bounds;
+    uint32_t m_index;
+    uint32_t m_parent;
+    bool m_leaf;
+};
+
+// Hierarchy over the emitters of a scene for many-light sampling. Each node bounds the position, power and
+// emission directions of its lights; sampling walks from the root, choosing a child in proportion to its
+// importance at the shading point, so a sample costs time logarithmic in the number of lights.
+// Emitters are gathered once, so they must not move.
+class light_bvh
+{
+public:
+    static constexpr int BUCKETS = 12;
+
+    light_bvh(const hittable& world, light_sampling mode);
+
+    light_sampling mode() const { return m_mode; }
+    size_t light_count() const { return m_lights.size(); }
+    size_t node_count() const { return m_nodes.size(); }
+
+    bool contains(const hittable* light) const { return m_light_index.count(light) != 0; }
+
+    // Picks a light for the point p with normal n (0 in media) and sets pmf to the probability of the choice.
+    // Returns nullptr if no light can contribute.
+    const hittable* sample(const point3& p, const vec3& n, double u, double& pmf) const;
+
+    // Probability that sample() picks light at p.
+    double pmf(const point3& p, const vec3& n, const hittable* light) const;
+
+private:
+    struct build_light
+    {
+        light_bounds m_bounds;
+        point3 m_centroid;
+        uint32_t m_light;
+    };
+
+    uint32_t build(std::vector<build_light>& lights, size_t start, size_t end, uint32_t parent);
+
+    // Surface area orientation heuristic cost of a group of lights, for a split along axis of a node with
+    // extent diagonal.
+    static double split_cost(const light_bounds& bounds, const vec3& diagonal, int axis);
+
+private:
+    light_sampling m_mode;
+    std::vector<const hittable*> m_lights;
+    std::vector<light_bvh_node> m_nodes;
+    std::vector<uint32_t> m_leaf_of_light;
+    std::unordered_map<const hittable*, uint32_t> m_light_index;
+};
+
+inline light_bvh::light_bvh(const hittable& world, light_sampling mode)
+    : m_mode(mode)
+{
+    std::vector<const hittable*> primitives;
+    world.collect_primitives(primitives);
+
+    std::vector<build_light> lights;
+    for (const hittable* primitive : primitives)
+    {
+        build_light light;
+        if (m_light_index.count(primitive) || !emitter_bounds(*primitive, light.m_bounds))
+            continue;
+        light.m_centroid = 0.5 * (light.m_bounds.m_box.min() + light.m_bounds.m_box.max());
+        light.m_light = static_cast<uint32_t>(m_lights.size());
+        m_light_index[primitive] = light.m_light;
+        m_lights.push_back(primitive);
+        lights.push_back(light);
+    }
+
+    m_leaf_of_light.resize(m_lights.size());
+    if (!lights.empty())
+    {
+        m_nodes.reserve(2 * lights.size() - 1);
+        build(lights, 0, lights.size(), 0);
+    }
+}
+
+inline double light_bvh::split_cost(const light_bounds& bounds, const vec3& diagonal, int axis)
+{
+    const double theta_o = acos(clamp(bounds.m_cos_theta_o, -1.0, 1.0));
+    const double theta_e = acos(clamp(bounds.m_cos_theta_e, -1.0, 1.0));
+    const double theta_w = std::min(theta_o + theta_e, PI);
+    const double sin_o = sin(theta_o);
+    const double m_omega = 2 * PI * (1 - bounds.m_cos_theta_o)
+                         + PI / 2 * (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_o + bounds.m_cos_theta_o);
+
+    const double max_extent = std::max({ diagonal.x(), diagonal.y(), diagonal.z() });
+    const double k_r = diagonal[axis] > 0 ? max_extent / diagonal[axis] : 1.0;
+
+    const vec3 d = bounds.m_box.max() - bounds.m_box.min();
+    const double area = 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    return bounds.m_power * m_omega * k_r * area;
+}
+
+inline uint32_t light_bvh::build(std::vector<build_light>& lights, size_t start, size_t end, uint32_t parent)
+{
+    const uint32_t index = static_cast<uint32_t>(m_nodes.size());
+    m_nodes.push_back({});
+    m_nodes[index].m_parent = parent;
+
+    if (end - start == 1)
+    {
+        m_nodes[index] = { lights[start].m_bounds, lights[start].m_light, parent, true };
+        m_leaf_of_light[lights[start].m_light] = index;
+        return index;
+    }
+
+    light_bounds bounds;
+    aabb centroids(lights[start].m_centroid, lights[start].m_centroid);
+    for (size_t i = start; i < end; i++)
+    {
+        bounds = union_bounds(bounds, lights[i].m_bounds);
+        centroids = surrounding_box(centroids, aabb(lights[i].m_centroid, lights[i].m_centroid));
+    }
+    const vec3 diagonal = bounds.m_box.max() - bounds.m_box.min();
+    const vec3 extent = centroids.max() - centroids.min();
+
+    // Binned SAOH: the split plane between buckets of centroids with the lowest cost.
+    double best_cost = INF;
+    int best_axis = -1;
+    int best_bucket = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (extent[axis] <= 0)
+            continue;
+
+        light_bounds buckets[BUCKETS];
+        for (size_t i = start; i < end; i++)
+        {
+            const int b = std::min(static_cast<int>(BUCKETS * (lights[i].m_centroid[axis] - centroids.min()[axis]) / extent[axis]), BUCKETS - 1);
+            buckets[b] = union_bounds(buckets[b], lights[i].m_bounds);
+        }
+
+        for (int split = 0; split < BUCKETS - 1; split++)
+        {
+            light_bounds below, above;
+            for (int b = 0; b <= split; b++)
+                below = union_bounds(below, buckets[b]);
+            for (int b = split + 1; b < BUCKETS; b++)
+                above = union_bounds(above, buckets[b]);
+
+            const double cost = split_cost(below, diagonal, axis) + split_cost(above, diagonal, axis);
+            if (below.m_power > 0 && above.m_power > 0 && cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_bucket = split;
+            }
+        }
+    }
+
+    size_t mid = start + (end - start) / 2;
+    if (best_axis >= 0)
+    {
+        const auto below = std::partition(lights.begin() + start, lights.begin() + end, [&](const build_light& light)
+        {
+            const int b = std::min(static_cast<int>(BUCKETS * (light.m_centroid[best_axis] - centroids.min()[best_axis]) / extent[best_axis]), BUCKETS - 1);
+            return b <= best_bucket;
+        });
+        mid = below - lights.begin();
+    }
+    if (mid == start || mid == end)
+        mid = start + (end - start) / 2;
+
+    build(lights, start, mid, index);
+    const uint32_t second = build(lights, mid, end, index);
+    m_nodes[index] = { bounds, second, parent, false };
+    return index;
+}
+
+inline const hittable* light_bvh::sample(const point3& p, const vec3& n, double u, double& pmf) const
+{
+    if (m_lights.empty())
+        return nullptr;
+
+    if (m_mode == light_sampling::uniform)
+    {
+        pmf = 1.0 / m_lights.size();
+        return m_lights[std::min(static_cast<size_t>(u * m_lights.size()), m_lights.size() - 1)];
+    }
+
+    if (m_nodes[0].m_bounds.importance(p, n) <= 0)
+        return nullptr;
+
+    uint32_t node = 0;
+    pmf = 1.0;
+    while (!m_nodes[node].m_leaf)
+    {
+        const uint32_t first = node + 1;
+        const uint32_t second = m_nodes[node].m_index;
+        const double importance_first = m_nodes[first].m_bounds.importance(p, n);
+        const double importance_second = m_nodes[second].m_bounds.importance(p, n);
+        if (importance_first <= 0 && importance_second <= 0)
+            return nullptr;
+
+        // Reuse u for the next level by rescaling it to the chosen side.
+        const double p_first = importance_first / (importance_first + importance_second);
+        if (u < p_first)
+        {
+            node = first;
+            u = std::min(u / p_first, 1 - 1e-12);
+            pmf *= p_first;
+        }
+        else
+        {
+            node = second;
+            u = std::min((u - p_first) / (1 - p_first), 1 - 1e-12);
+            pmf *= 1 - p_first;
+        }
+    }
+    return m_lights[m_nodes[node].m_index];
+}
+
+inline double light_bvh::pmf(const point3& p, const vec3& n, const hittable* light) const
+{
+    const auto found = m_light_index.find(light);
+    if (found == m_light_index.end())
+        return 0.0;
+
+    if (m_mode == light_sampling::uniform)
+        return 1.0 / m_lights.size();
+
+    if (m_nodes[0].m_bounds.importance(p, n) <= 0)
+        return 0.0;
+
+    // Walk up from the light's leaf, multiplying the probability of each choice on the way down.
+    double pmf = 1.0;
+    for (uint32_t node = m_leaf_of_light[found->second]; node != 0; node = m_nodes[node].m_parent)
+    {
+        const uint32_t parent = m_nodes[node].m_parent;
+        const double importance_first = m_nodes[parent + 1].m_bounds.importance(p, n);
+        const double importance_second = m_nodes[m_nodes[parent].m_index].m_bounds.importance(p, n);
+        const double total = importance_first + importance_second;
+        if (total <= 0)
+            return 0.0;
+        pmf *= (node == parent + 1 ? importance_first : importance_second) / total;
+    }
+    return pmf;
+}
+
+class photon_map;
+class radiance_cache;
+
+// Light sources the integrator samples directly at diffuse hits, besides finding them by chance, and the
+// caustic photons and radiance cache of the pass being rendered, which it gathers there and ends paths in.
+struct scene_lights
+{
+    const environment_map* m_environment = nullptr;
+    const light_bvh* m_emitters = nullptr;
+    const photon_map* m_caustics = nullptr;
+    const radiance_cache* m_radiance = nullptr;
+    int m_radiance_bounces = 0;  // lambertian hits a path makes before it ends in m_radiance
+};
@@ -0,0 +1,173 @@
+#pragma once
+#include "stats.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// A value as an lru_tile_cache holds it. m_used is set by lookups that find it without locking the cache, so that
+// eviction can tell it has been used since it last reached the end of the LRU list.
+template <typename Value>
+struct cached_value
+{
+    Value m_value;
+    mutable std::atomic<bool> m_used { false };
+};
+
+// Values read on demand, such as texture tiles or geometry clusters, under a memory budget with LRU eviction.
+// Values are keyed by 64 bits and handed out as shared_ptrs, so one evicted while a lookup still uses it stays
+// alive until that lookup ends. Each thread finds its last few values again without locking; those slots only
+// watch their values, so eviction still frees them, and a value found through them gets a second chance before
+// it is evicted.
+template <typename Value>
+class lru_tile_cache
+{
+public:
+    using handle = std::shared_ptr<const cached_value<Value>>;
+
+    explicit lru_tile_cache(const char* name) : m_name(name) {}
+
+    void set_budget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_budget = bytes;
+        evict_to_budget();
+    }
+
+    cache_stats stats()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return { m_name, m_budget, m_resident_bytes, m_misses, m_evictions };
+    }
+
+    // Value of key. On a miss load(value) fills it in, without the lock held, and returns the bytes it takes.
+    template <typename Load>
+    handle get(uint64_t key, Load&& load);
+
+    // Like get(), but the value is held by one pin per thread rather than by a handle: the reference stays valid
+    // until the calling thread's next pin() on this cache, and pinning the same key again costs no reference
+    // counting. Each thread keeps at most that one value alive past the budget.
+    template <typename Load>
+    const Value& pin(uint64_t key, Load&& load);
+
+private:
+    void evict_to_budget();
+
+private:
+    struct entry
+    {
+        handle m_value;
+        size_t m_bytes;
+        std::list<uint64_t>::iterator m_lru_pos;
+    };
+
+    const char* m_name;
+    std::mutex m_mutex;
+    std::unordered_map<uint64_t, entry> m_entries;
+    std::list<uint64_t> m_lru;  // most recently used first
+    size_t m_budget = size_t(256) << 20;
+    size_t m_resident_bytes = 0;
+    long long m_misses = 0;
+    long long m_evictions = 0;
+};
+
+// Values used without locking since they were last moved get one more round at the front (second chance).
+template <typename Value>
+void lru_tile_cache<Value>::evict_to_budget()
+{
+    size_t second_chances = m_lru.size();
+    while (m_resident_bytes > m_budget && !m_lru.empty())
+    {
+        const auto victim = m_entries.find(m_lru.back());
+        if (second_chances > 0 && victim->second.m_value->m_used.exchange(false, std::memory_order_relaxed))
+        {
+            second_chances--;
+            m_lru.splice(m_lru.begin(), m_lru, std::prev(m_lru.end()));
+            continue;
+        }
+        m_lru.pop_back();
+        m_resident_bytes -= victim->second.m_bytes;
+        m_entries.erase(victim);
+        ++m_evictions;
+    }
+}
+
+template <typename Value>
+template <typename Load>
+typename lru_tile_cache<Value>::handle lru_tile_cache<Value>::get(uint64_t key, Load&& load)
+{
+    struct recent_value
+    {
+        const lru_tile_cache* m_cache = nullptr;
+        uint64_t m_key = 0;
+        std::weak_ptr<const cached_value<Value>> m_value;
+    };
+    thread_local recent_value recent[8];
+    recent_value& slot = recent[(key ^ (key >> 13) ^ (key >> 32)) & 7];
+    if (slot.m_cache == this && slot.m_key == key)
+    {
+        if (handle value = slot.m_value.lock())
+        {
+            if (!value->m_used.load(std::memory_order_relaxed))
+                value->m_used.store(true, std::memory_order_relaxed);
+            return value;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    auto found = m_entries.find(key);
+    if (found != m_entries.end())
+    {
+        m_lru.splice(m_lru.begin(), m_lru, found->second.m_lru_pos);
+        slot = { this, key, found->second.m_value };
+        return found->second.m_value;
+    }
+
+    ++m_misses;
+    lock.unlock();
+
+    auto loaded = std::make_shared<cached_value<Value>>();
+    const size_t bytes = load(loaded->m_value);
+
+    lock.lock();
+
+    // Another thread may have loaded the same value meanwhile.
+    found = m_entries.find(key);
+    if (found != m_entries.end())
+    {
+        slot = { this, key, found->second.m_value };
+        return found->second.m_value;
+    }
+
+    m_lru.push_front(key);
+    m_entries[key] = { loaded, bytes, m_lru.begin() };
+    m_resident_bytes += bytes;
+    evict_to_budget();
+
+    slot = { this, key, loaded };
+    return loaded;
+}
+
+template <typename Value>
+template <typename Load>
+const Value& lru_tile_cache<Value>::pin(uint64_t key, Load&& load)
+{
+    struct pinned_value
+    {
+        const lru_tile_cache* m_cache = nullptr;
+        uint64_t m_key = 0;
+        handle m_value;
+    };
+    thread_local pinned_value pinned;
+    if (pinned.m_cache != this || pinned.m_key != key || !pinned.m_value)
+        pinned = { this, key, get(key, std::forward<Load>(load)) };
+    else if (!pinned.m_value->m_used.load(std::memory_order_relaxed))
+        pinned.m_value->m_used.store(true, std::memory_order_relaxed);
+    return pinned.m_value->m_value;
+}
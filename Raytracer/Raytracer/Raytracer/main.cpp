@@ -1,225 +1,395 @@
-#include "aarect.h"
-#include "box.h"
-#include "bvh.h"
 #include "camera.h"
 #include "color.h"
-#include "constant_env.h"
 #include "constants.h"
-#include "hittable_objects.h"
-#include "material.h"
-#include "ray.h"
-#include "sphere.h"
-#include "vec3.h"
-
+#include "distributed.h"
+#include "geometry_cache.h"
+#include "render.h"
+#include "render_server.h"
+#include "scenes.h"
+#include "stats.h"
+#include "streamed_image.h"
+#include "texture_cache.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <string>
 
-color ray_color(const ray& r_in, const color& background, const hittable& world, int depth)
+namespace
 {
-    hit_record hit_rec;
-
-    if (depth <= 0)
-        return color(0.f, 0.f, 0.f);
-
-    if (!world.hit(r_in, 0.001, INF, hit_rec))
-        return background;
-
-    ray scattered;
-    color attenuation;
-    color emitted = hit_rec.m_mat_ptr->emitted(hit_rec.m_u, hit_rec.m_v, hit_rec.m_point);
-
-    if (!hit_rec.m_mat_ptr->scatter(r_in, hit_rec, attenuation, scattered))
-        return emitted;
+    void print_usage(const char* program)
+    {
+        std::cerr << "Usage: " << program << " [options]\n"
+                  << "  --scene <n>              scene to render (asked on stdin if omitted)\n"
+                  << "  --width <px>             image width (height follows the scene's aspect ratio)\n"
+                  << "  --spp <n>                samples per pixel\n"
+                  << "  --seed <n>               base random seed\n"
+                  << "  --lookfrom <x,y,z>       move the camera (default: the scene's)\n"
+                  << "  --lookat <x,y,z>         point the camera at another point\n"
+                  << "  --vfov <degrees>         vertical field of view\n"
+                  << "  --tile <px>              tile size\n"
+                  << "  --passes <n>             split the samples of each tile into n jobs\n"
+                  << "  --accel <name>           acceleration structure: bvh (default), flat or compressed (less memory than flat, but slower)\n"
+                  << "  --split-budget <f>       let flat/compressed builds add up to f times the objects as spatial-split references\n"
+                  << "  --layout <name>          flat/compressed node order: depth_first (default), van_emde_boas or hot_first\n"
+                  << "  --trace <name>           ray order: recursive (default), batched, or sorted (batched with secondary rays binned)\n"
+                  << "  --env <file>             light the scene with an equirectangular HDR map (.hdr or .pfm)\n"
+                  << "  --density-grid <file> <nx> <ny> <nz>\n"
+                  << "                           raw float32 densities (x fastest) replacing the smoke of scene 3\n"
+                  << "  --lights <name>          direct light sampling at diffuse hits: none (default), uniform or bvh\n"
+                  << "  --guiding <n>            guide diffuse bounces by incident light learned over n training passes\n"
+                  << "  --photons <n>            trace n caustic photons per pass and gather them at diffuse hits\n"
+                  << "  --photon-radius <r>      gather radius of the first pass (default: from the scene's specular objects)\n"
+                  << "  --radiance-cache <n>     end paths in a radiance cache after n lambertian hits\n"
+                  << "  --cache-cell <size>      radiance cache cell size (default: 1/128 of the scene's diagonal)\n"
+                  << "  --cache-paths <n>        paths that fill the radiance cache in every pass (default 65536)\n"
+                  << "  --texture-cache-mb <n>   memory budget for image texture tiles (default 256)\n"
+                  << "  --page-geometry          keep static spheres on disk and page them in as rays reach them\n"
+                  << "  --geometry-cache-mb <n>  memory budget for paged geometry (default 256)\n"
+                  << "  --stats <file.json>      write render statistics\n"
+                  << "  --heatmap <prefix>       write per-pixel traversal cost images\n"
+                  << "  --stream <file>          write tiles into a .ppm or .pfm file as they finish instead of test.ppm\n"
+                  << "  --frames <n>             render an n-frame animation of the clip time [0, 1) to frame_NNNN.ppm\n"
+                  << "  --coordinator <endpoint> hand out tiles to workers (unix:<path> or tcp:<host>:<port>)\n"
+                  << "  --workers <n>            start n local workers for the coordinator\n"
+                  << "  --numa                   spread local workers over the NUMA nodes, each pinned with its own scene copy\n"
+                  << "  --worker <endpoint>      render jobs for a coordinator\n"
+                  << "  --numa-node <n>          pin a worker to NUMA node n before it loads anything\n"
+                  << "  --serve <endpoint>       keep scenes resident and render requests from --submit\n"
+                  << "  --submit <endpoint>      have a render server render the image\n"
+                  << "  --priority <n>           priority of the --submit request (default 0, higher first)\n";
+    }
 
-    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
+    bool parse_point(const char* text, point3& p)
+    {
+        double x, y, z;
+        if (sscanf(text, "%lf,%lf,%lf", &x, &y, &z) != 3)
+            return false;
+        p = point3(x, y, z);
+        return true;
+    }
 }
 
-hittable_objects materials_scene()
+int main(int argc, char* argv[])
 {
-    hittable_objects world;
-
-    auto material_ground = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
-
-    auto material_left = std::make_shared<lambertian>(color(0.7, 0.2, 0.5));
-    auto material_center = std::make_shared<dielectric>(1.5);
-    auto material_right = std::make_shared<metal>(color(0.8, 0.6, 0.2));
+    std::string stats_path;
+    std::string heatmap_prefix;
+    std::string stream_path;
+    std::string coordinator_endpoint;
+    std::string worker_endpoint;
+    std::string serve_endpoint;
+    std::string submit_endpoint;
+    int priority = 0;
+    int num = -1;
+    int width = 0;
+    int spp = 0;
+    int local_workers = 0;
+    bool numa_placement = false;
+    int pin_node = -1;
+    int frames = 0;
+    render_settings settings;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--scene") && has_value)
+            num = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--width") && has_value)
+            width = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--spp") && has_value)
+            spp = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && has_value)
+            settings.m_seed = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--lookfrom") && has_value)
+        {
+            if (!parse_point(argv[++i], settings.m_view.m_lookfrom))
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            settings.m_view.m_has_lookfrom = true;
+        }
+        else if (!strcmp(argv[i], "--lookat") && has_value)
+        {
+            if (!parse_point(argv[++i], settings.m_view.m_lookat))
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            settings.m_view.m_has_lookat = true;
+        }
+        else if (!strcmp(argv[i], "--vfov") && has_value)
+            settings.m_view.m_vfov = std::max(atof(argv[++i]), 0.0);
+        else if (!strcmp(argv[i], "--tile") && has_value)
+            settings.m_tile_size = std::max(atoi(argv[++i]), 1);
+        else if (!strcmp(argv[i], "--passes") && has_value)
+            settings.m_passes = std::max(atoi(argv[++i]), 1);
+        else if (!strcmp(argv[i], "--accel") && has_value)
+        {
+            if (!parse_accel(argv[++i], settings.m_accel))
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--split-budget") && has_value)
+            settings.m_split_budget = std::max(atof(argv[++i]), 0.0);
+        else if (!strcmp(argv[i], "--layout") && has_value)
+        {
+            if (!parse_layout(argv[++i], settings.m_layout))
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--trace") && has_value)
+        {
+            if (!parse_trace_order(argv[++i], settings.m_trace))
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--env") && has_value)
+            settings.m_environment = argv[++i];
+        else if (!strcmp(argv[i], "--density-grid") && i + 4 < argc)
+        {
+            settings.m_density_grid = argv[++i];
+            for (int a = 0; a < 3; a++)
+                settings.m_grid_size[a] = atoi(argv[++i]);
+            if (settings.m_grid_size[0] <= 0 || settings.m_grid_size[1] <= 0 || settings.m_grid_size[2] <= 0)
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--lights") && has_value)
+        {
+            if (!parse_light_sampling(argv[++i], settings.m_lights))
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--guiding") && has_value)
+            settings.m_guiding = std::max(atoi(argv[++i]), 0);
+        else if (!strcmp(argv[i], "--photons") && has_value)
+            settings.m_photons = std::max(atoi(argv[++i]), 0);
+        else if (!strcmp(argv[i], "--photon-radius") && has_value)
+            settings.m_photon_radius = std::max(atof(argv[++i]), 0.0);
+        else if (!strcmp(argv[i], "--radiance-cache") && has_value)
+            settings.m_radiance_cache = std::max(atoi(argv[++i]), 0);
+        else if (!strcmp(argv[i], "--cache-cell") && has_value)
+            settings.m_cache_cell = std::max(atof(argv[++i]), 0.0);
+        else if (!strcmp(argv[i], "--cache-paths") && has_value)
+            settings.m_cache_paths = std::max(atoi(argv[++i]), 1);
+        else if (!strcmp(argv[i], "--texture-cache-mb") && has_value)
+            texture_cache::instance().set_budget(static_cast<size_t>(atoi(argv[++i])) << 20);
+        else if (!strcmp(argv[i], "--page-geometry"))
+            settings.m_page_geometry = true;
+        else if (!strcmp(argv[i], "--geometry-cache-mb") && has_value)
+            geometry_cache::instance().set_budget(static_cast<size_t>(atoi(argv[++i])) << 20);
+        else if (!strcmp(argv[i], "--stats") && has_value)
+            stats_path = argv[++i];
+        else if (!strcmp(argv[i], "--heatmap") && has_value)
+            heatmap_prefix = argv[++i];
+        else if (!strcmp(argv[i], "--stream") && has_value)
+            stream_path = argv[++i];
+        else if (!strcmp(argv[i], "--frames") && has_value)
+            frames = std::max(atoi(argv[++i]), 1);
+        else if (!strcmp(argv[i], "--coordinator") && has_value)
+            coordinator_endpoint = argv[++i];
+        else if (!strcmp(argv[i], "--workers") && has_value)
+            local_workers = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--numa"))
+            numa_placement = true;
+        else if (!strcmp(argv[i], "--numa-node") && has_value)
+            pin_node = std::max(atoi(argv[++i]), 0);
+        else if (!strcmp(argv[i], "--worker") && has_value)
+            worker_endpoint = argv[++i];
+        else if (!strcmp(argv[i], "--serve") && has_value)
+            serve_endpoint = argv[++i];
+        else if (!strcmp(argv[i], "--submit") && has_value)
+            submit_endpoint = argv[++i];
+        else if (!strcmp(argv[i], "--priority") && has_value)
+            priority = atoi(argv[++i]);
+        else
+        {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
 
-    world.add(std::make_shared<sphere>(point3(0.f, -100, 0.f), 100.0, material_ground));
+    if (!worker_endpoint.empty())
+        return run_worker(worker_endpoint, pin_node);
+    if (!serve_endpoint.empty())
+        return run_server(serve_endpoint);
 
-    world.add(std::make_shared<sphere>(point3(0.f, 1.0, 0.f), 1.0, material_center));
-    world.add(std::make_shared<sphere>(point3(-4.0, 1.0, 0.5), 1.0, material_left));
-    world.add(std::make_shared<sphere>(point3(4.0, 1.0, -0.5), 1.0, material_right));
+#ifndef RT_ENABLE_STATS
+    if (!stats_path.empty() || !heatmap_prefix.empty())
+        std::cerr << "Statistics are not compiled in; rebuild with RT_ENABLE_STATS (CMake: -DRAYTRACER_STATS=ON).\n";
+#endif
 
-    return world;
-}
+    if (num < 0)
+    {
+        std::cout << "Choose type of scene:" << std::endl;
+        std::cout << "  0 - materials:" << std::endl;
+        std::cout << "  1 - cornell box with smokes:" << std::endl;
+        std::cout << "  2 - final scene:" << std::endl;
+        std::cout << "  3 - cornell box with grid smoke:" << std::endl;
+        std::cout << "  4 - textured spheres:" << std::endl;
+        std::cout << "  5 - motion blur:" << std::endl;
+        std::cout << "  6 - orbiting spheres (animated):" << std::endl;
+        std::cout << "  7 - sun and sky (environment map):" << std::endl;
+        std::cout << "  8 - many lights (for --lights):" << std::endl;
+        std::cout << "  9 - caustics (for --photons):" << std::endl;
+        std::cout << "  10 - million sphere field (paged geometry):" << std::endl;
+        std::cin >> num;
+    }
 
-hittable_objects cornell_box_with_smokes()
-{
-    hittable_objects objects;
-
-    auto red   = std::make_shared<lambertian>(color(.65, .05, .05));
-    auto white = std::make_shared<lambertian>(color(.73, .73, .73));
-    auto green = std::make_shared<lambertian>(color(.12, .45, .15));
-    auto light = std::make_shared<diffuse_light>(color(15, 15, 15));
-
-    std::shared_ptr<hittable> box1 = std::make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-         box1 = std::make_shared<rotate_y>(box1, 15);
-         box1 = std::make_shared<translate>(box1, vec3(265, 0, 295));
-
-    std::shared_ptr<hittable> box2 = std::make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-         box2 = std::make_shared<rotate_y>(box2, -18);
-         box2 = std::make_shared<translate>(box2, vec3(130, 0, 65));
-
-    objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(std::make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-    objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(std::make_shared<xy_rect>(0, 555, 0, 555, 555, white));
-    objects.add(std::make_shared<constant_env>(box1, 0.01, color(0, 0, 0)));
-    objects.add(std::make_shared<constant_env>(box2, 0.01, color(1, 1, 1)));
-
-    return objects;
-}
+    if (settings.m_accel == accel_kind::bvh && (settings.m_split_budget > 0 || settings.m_layout != bvh_layout::depth_first))
+        std::cerr << "--split-budget and --layout only affect --accel flat and compressed.\n";
+    if (!settings.m_density_grid.empty() && num != 3)
+        std::cerr << "--density-grid only replaces the smoke of scene 3.\n";
+    if (numa_placement && (coordinator_endpoint.empty() || local_workers <= 0))
+        std::cerr << "--numa only places the local --workers of a --coordinator.\n";
 
-hittable_objects final_scene()
-{
-    hittable_objects boxes;
-    auto white = std::make_shared<lambertian>(color(.73, .73, .73));
+    if (frames > 0 && (!coordinator_endpoint.empty() || !submit_endpoint.empty()))
+    {
+        std::cerr << "--frames is only supported for local rendering.\n";
+        return EXIT_FAILURE;
+    }
+    if (!stream_path.empty() && (frames > 0 || !submit_endpoint.empty()))
+    {
+        std::cerr << "--stream is only supported for single images rendered here or by a coordinator.\n";
+        return EXIT_FAILURE;
+    }
 
-    auto ground = std::make_shared<lambertian>(color(0.9, 0.13, 0.23));
+    settings.m_scene = num;
 
-    const int boxes_per_side = 20;
-    for (int i = 0; i < boxes_per_side; i++)
+    if (!submit_endpoint.empty())
     {
-        for (int j = 0; j < boxes_per_side; j++)
-        {
-            auto w = 100.0;
-            auto x0 = -1000.0 + i * w;
-            auto z0 = -1000.0 + j * w;
-            auto y0 = 0.0;
-            auto x1 = x0 + w;
-            auto y1 = random_double(1, 101);
-            auto z1 = z0 + w;
-
-            boxes.add(std::make_shared<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
-        }
+        // The server resolves the scene's default width and samples.
+        settings.m_image_width = width;
+        settings.m_samples_per_pixel = spp;
+
+        const auto start = std::chrono::steady_clock::now();
+        framebuffer fb(0, 0);
+        if (!submit_render(submit_endpoint, settings, priority, fb))
+            return EXIT_FAILURE;
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "\nDone in " << seconds << " s.\n";
+
+        std::ofstream ofs("test.ppm", std::ios_base::out | std::ios_base::binary);
+        fb.write_ppm(ofs);
+        return EXIT_SUCCESS;
     }
 
-    hittable_objects objects;
+    const auto build_start = std::chrono::steady_clock::now();
+    scene_description scene;
+    if (!load_render_scene(settings, scene))
+        return EXIT_FAILURE;
+    const double build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
 
-    objects.add(std::make_shared<bvh_node>(boxes, 0, 1));
+    resolve_image_settings(scene, width, spp, settings);
 
-    auto light = std::make_shared<diffuse_light>(color(7, 7, 7));
-    objects.add(std::make_shared<xz_rect>(123, 423, 147, 412, 554, light));
+    // A streamed image goes to disk tile by tile, and neither it nor unused heatmaps take memory for every pixel.
+    std::unique_ptr<streamed_image> stream;
+    if (!stream_path.empty() && !(stream = streamed_image::create(stream_path, settings.m_image_width, settings.m_image_height)))
+        return EXIT_FAILURE;
+    framebuffer fb(stream ? 0 : settings.m_image_width, stream ? 0 : settings.m_image_height);
+    tile_sink& out = stream ? static_cast<tile_sink&>(*stream) : fb;
 
-    std::shared_ptr<hittable> box1 = std::make_shared<box>(point3(0, 0, 0), point3(100, 200, 100), white);
-    box1 = std::make_shared<rotate_y>(box1, 15);
-    box1 = std::make_shared<translate>(box1, vec3(100, 150, 105));
+    const bool heatmaps = !heatmap_prefix.empty();
+    stats_heatmap node_heatmap(heatmaps ? settings.m_image_width : 0, heatmaps ? settings.m_image_height : 0);
+    stats_heatmap primitive_heatmap(heatmaps ? settings.m_image_width : 0, heatmaps ? settings.m_image_height : 0);
 
-    objects.add(std::make_shared<sphere>(point3(260, 150, 45), 50, std::make_shared<lambertian>(color(0.2, 0.8, 0.1))));
-    objects.add(std::make_shared<sphere>(point3(0, 150, 145), 50, std::make_shared<metal>(color(0.8, 0.8, 0.4))));
-    objects.add(std::make_shared<sphere>(point3(360, 150, 145), 70, std::make_shared<dielectric>(1.5)));
-    objects.add(std::make_shared<constant_env>(box1, 0.01, color(0.5, 0.5, 0.5)));
+    render_control control;
+    control.m_tile_done = [](const image_tile&, int tiles_done, int tile_count)
+    {
+        std::cerr << "\rTiles remaining: " << tile_count - tiles_done << ' ' << std::flush;
+    };
+    if (heatmaps)
+    {
+        control.m_node_heatmap = &node_heatmap;
+        control.m_primitive_heatmap = &primitive_heatmap;
+    }
 
-    return objects;
-}
+    const auto start = std::chrono::steady_clock::now();
 
-int main()
-{
-
-    // Image
-    double aspect_ratio = 3.0 / 2.0;
-    int image_width = 800;
-    int image_height = static_cast<int>(image_width / aspect_ratio);
-    int samples_per_pixel = 50;
-    const int max_depth = 50;
-
-    //World
-    hittable_objects world;
-
-    //Camera
-    point3 lookfrom;
-    point3 lookat;
-    const vec3 vup(0, 1, 0);
-    double vfov = 40.0;
-    const double dist_to_focus = 10.0;
-    double aperture = 0.0;
-    color background(0, 0, 0);
-
-    int num = 0;
-    std::cout << "Choose type of scene:" << std::endl;
-    std::cout << "  0 - materials:" << std::endl;
-    std::cout << "  1 - cornell box with smokes:" << std::endl;
-    std::cout << "  2 - final scene:" << std::endl;
-    std::cin >> num;
-
-    switch (num)
-    {
-        case 0:
-            world = materials_scene();
-            image_width = 800;
-            image_height = static_cast<int>(image_width / aspect_ratio);
-            samples_per_pixel = 100;
-            background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13, 2, 3);
-            lookat = point3(0, 0, 0);
-            vfov = 20.0;
-            aperture = 0.1;
-            break;
-
-        case 1:
-            world = cornell_box_with_smokes();
-            aspect_ratio = 1.0;
-            image_width = 800;
-            image_height = static_cast<int>(image_width / aspect_ratio);
-            samples_per_pixel = 200;
-            background = color(0, 0, 0);
-            lookfrom = point3(278, 278, -800);
-            lookat = point3(278, 278, 0);
-            vfov = 40.0;
-            break;
-        case 2:
-            world = final_scene();
-            aspect_ratio = 1.0;
-            image_width = 800;
-            image_height = static_cast<int>(image_width / aspect_ratio);
-            samples_per_pixel = 1000;
-            background = color(0, 0, 0);
-            lookfrom = point3(478, 278, -600);
-            lookat = point3(278, 278, 0);
-            vfov = 40.0;
-            break;
-        default:
-            break;
+    if (frames > 0)
+    {
+        // The scene stays resident; between frames only the bounds of moving objects are refitted.
+        std::cerr << "Scene built in " << build_seconds * 1000.0 << " ms.\n";
+        for (int frame = 0; frame < frames; frame++)
+        {
+            frame_shutter(scene, frame, frames, scene.m_time0, scene.m_time1);
+
+            const auto refit_start = std::chrono::steady_clock::now();
+            refit_summary summary;
+            scene.m_world.refit(scene.m_time0, scene.m_time1, summary);
+            const double refit_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - refit_start).count();
+
+            const auto frame_start = std::chrono::steady_clock::now();
+            framebuffer frame_fb(settings.m_image_width, settings.m_image_height);
+            render_local(scene, settings, frame_fb, control);
+            const double frame_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_start).count();
+
+            std::cerr << "\rFrame " << frame << ": refit " << refit_seconds * 1000.0 << " ms ("
+                      << summary.m_nodes_refit << " nodes refit, " << summary.m_subtrees_rebuilt << " subtrees with "
+                      << summary.m_objects_rebuilt << " objects rebuilt), render " << frame_seconds << " s.\n";
+
+            char name[32];
+            snprintf(name, sizeof(name), "frame_%04d.ppm", frame);
+            std::ofstream ofs(name, std::ios_base::out | std::ios_base::binary);
+            frame_fb.write_ppm(ofs);
+        }
+    }
+    else if (!coordinator_endpoint.empty())
+    {
+        if (!run_coordinator(settings, coordinator_endpoint, argv[0], local_workers, out, numa_placement,
+                             control.m_node_heatmap, control.m_primitive_heatmap))
+            return EXIT_FAILURE;
+    }
+    else
+    {
+        render_local(scene, settings, out, control);
     }
-    camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus);
 
-    // Render
-    //std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "\nDone in " << seconds << " s.\n";
 
-    std::ofstream ofs("test.ppm", std::ios_base::out | std::ios_base::binary);
-    ofs << "P3" << std::endl << image_width << ' ' << image_height << std::endl << "255" << std::endl;
+    if (stream && !stream->good())
+    {
+        std::cerr << "Writing " << stream_path << " failed.\n";
+        return EXIT_FAILURE;
+    }
+    if (frames == 0 && !stream)
+    {
+        std::ofstream ofs("test.ppm", std::ios_base::out | std::ios_base::binary);
+        fb.write_ppm(ofs);
+    }
+
+    render_stats::merge_local();
 
-    for (int j = image_height - 1; j >= 0; --j)
+#ifdef RT_ENABLE_STATS
+    if (!stats_path.empty())
     {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i = 0; i < image_width; ++i)
-        {
-            color pixel_color(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s)
-            {
-                auto u = (i + random_double()) / (image_width - 1);
-                auto v = (j + random_double()) / (image_height - 1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, background, world, max_depth);
-            }
-            write_color(ofs, pixel_color, samples_per_pixel);
+        std::ofstream stats_ofs(stats_path);
+        render_stats::merged().write_json(stats_ofs, MATERIAL_KIND_NAMES, static_cast<int>(material_kind::count), seconds,
+                                          { texture_cache::instance().stats(), geometry_cache::instance().stats() });
+    }
 
-        }
+    if (!heatmap_prefix.empty())
+    {
+        std::ofstream nodes_ofs(heatmap_prefix + "_nodes.ppm", std::ios_base::out | std::ios_base::binary);
+        node_heatmap.write_ppm(nodes_ofs);
+        std::ofstream prims_ofs(heatmap_prefix + "_primitives.ppm", std::ios_base::out | std::ios_base::binary);
+        primitive_heatmap.write_ppm(prims_ofs);
     }
-    std::cerr << "\nDone.\n";
-    ofs.close();
+#endif
 
     return EXIT_SUCCESS;
 }
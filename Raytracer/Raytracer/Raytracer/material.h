@@ -1,22 +1,52 @@
 #pragma once
+#include "arena.h"
 #include "constants.h"
 #include "hittable.h"
+#include "stats.h"
 #include "texture.h"
 
 struct hit_record;
 
+enum class material_kind
+{
+    lambertian,
+    metal,
+    dielectric,
+    diffuse_light,
+    isotropic,
+    custom,
+    count
+};
+
+const char* const MATERIAL_KIND_NAMES[] = { "lambertian", "metal", "dielectric", "diffuse_light", "isotropic", "custom" };
+
+static_assert(static_cast<int>(material_kind::count) <= MAX_MATERIAL_KINDS, "render_counters has too few material slots");
+
 class material
 {
 public:
+    material(material_kind kind = material_kind::custom) : m_kind(kind) {}
+
+    material_kind kind() const { return m_kind; }
+
     virtual bool scatter(const ray& r_in, const hit_record& hit_rec, color& attenuation, ray& scattered) const = 0;
     virtual color emitted(double u, double v, const point3& p) const { return color(0, 0, 0); }
+
+    // For materials that scatter over a continuum of directions: sets value to the attenuation of light
+    // arriving from dir times the cosine term, and pdf to the density with which scatter() picks dir,
+    // so that value / pdf equals the attenuation scatter() returns. Returns false for specular
+    // materials, which cannot be lit by sampling a light directly.
+    virtual bool evaluate(const ray& r_in, const hit_record& hit_rec, const vec3& dir, color& value, double& pdf) const { return false; }
+
+private:
+    material_kind m_kind;
 };
 
-class lambertian : public material
+class lambertian final : public material
 {
 public:
-    lambertian(const color& a) : m_albedo(std::make_shared<solid_color>(a)) {}
-    lambertian(std::shared_ptr<texture> a) : m_albedo(a) {}
+    lambertian(const color& a) : material(material_kind::lambertian), m_albedo(arena_make<solid_color>(a)) {}
+    lambertian(std::shared_ptr<texture> a) : material(material_kind::lambertian), m_albedo(a) {}
 
     virtual bool scatter(const ray& r_in, const hit_record& hit_rec, color& attenuation, ray& scattered) const override
     {
@@ -26,7 +56,16 @@ public:
             scatter_direction = hit_rec.m_normal;
 
         scattered = ray(hit_rec.m_point, scatter_direction, r_in.time());
-        attenuation = m_albedo->value(hit_rec.m_u, hit_rec.m_v, hit_rec.m_point);
+        attenuation = sample_texture(*m_albedo, hit_rec.m_u, hit_rec.m_v, hit_rec.m_point, hit_rec.m_footprint);
+        return true;
+    }
+
+    // scatter() picks directions with density cos / pi.
+    virtual bool evaluate(const ray& r_in, const hit_record& hit_rec, const vec3& dir, color& value, double& pdf) const override
+    {
+        const double cosine = dot(hit_rec.m_normal, unit_vector(dir));
+        pdf = std::max(cosine, 0.0) / PI;
+        value = pdf * sample_texture(*m_albedo, hit_rec.m_u, hit_rec.m_v, hit_rec.m_point, hit_rec.m_footprint);
         return true;
     }
 
@@ -34,10 +73,10 @@ private:
     std::shared_ptr<texture> m_albedo;
 };
 
-class metal : public material
+class metal final : public material
 {
 public:
-    metal(const color& a) : m_albedo(a) {}
+    metal(const color& a) : material(material_kind::metal), m_albedo(a) {}
 
     virtual bool scatter(const ray& r_in, const hit_record& hit_rec, color& attenuation, ray& scattered) const override
     {
@@ -51,10 +90,10 @@ private:
     color m_albedo;
 };
 
-class dielectric : public material
+class dielectric final : public material
 {
 public:
-    dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+    dielectric(double index_of_refraction) : material(material_kind::dielectric), ir(index_of_refraction) {}
 
     virtual bool scatter(const ray& r_in, const hit_record& hit_rec, color& attenuation, ray& scattered) const override
     {
@@ -90,11 +129,11 @@ private:
     double ir;
 };
 
-class diffuse_light : public material
+class diffuse_light final : public material
 {
 public:
-    diffuse_light(std::shared_ptr<texture> a) : emit(a) {}
-    diffuse_light(color c) : emit(std::make_shared<solid_color>(c)) {}
+    diffuse_light(std::shared_ptr<texture> a) : material(material_kind::diffuse_light), emit(a) {}
+    diffuse_light(color c) : material(material_kind::diffuse_light), emit(arena_make<solid_color>(c)) {}
 
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
@@ -105,27 +144,84 @@ public:
 
     virtual color emitted(double u, double v, const point3& p) const override
     {
-        return emit->value(u, v, p);
+        return sample_texture(*emit, u, v, p, 0.0);
     }
 
 public:
     std::shared_ptr<texture> emit;
 };
 
-class isotropic : public material
+class isotropic final : public material
 {
 public:
-    isotropic(color c) : m_albedo(std::make_shared<solid_color>(c)) {}
-    isotropic(std::shared_ptr<texture> a) : m_albedo(a) {}
+    isotropic(color c) : material(material_kind::isotropic), m_albedo(arena_make<solid_color>(c)) {}
+    isotropic(std::shared_ptr<texture> a) : material(material_kind::isotropic), m_albedo(a) {}
 
     virtual bool scatter(const ray& r_in, const hit_record& hit_rec, color& attenuation, ray& scattered
     ) const override
     {
         scattered = ray(hit_rec.m_point, random_in_unit_sphere(), r_in.time());
-        attenuation = m_albedo->value(hit_rec.m_u, hit_rec.m_v, hit_rec.m_point);
+        attenuation = sample_texture(*m_albedo, hit_rec.m_u, hit_rec.m_v, hit_rec.m_point, 0.0);
+        return true;
+    }
+
+    // scatter() picks directions uniformly over the sphere.
+    virtual bool evaluate(const ray& r_in, const hit_record& hit_rec, const vec3& dir, color& value, double& pdf) const override
+    {
+        pdf = 1 / (4 * PI);
+        value = pdf * sample_texture(*m_albedo, hit_rec.m_u, hit_rec.m_v, hit_rec.m_point, 0.0);
         return true;
     }
 
 public:
     std::shared_ptr<texture> m_albedo;
-};
\ No newline at end of file
+};
+
+// scatter() and emitted() dispatched on material::kind() over the closed set of built-in materials.
+// The qualified calls bypass the vtable so they can be inlined; custom materials use the virtual interface.
+inline bool scatter_material(const material& mat, const ray& r_in, const hit_record& hit_rec, color& attenuation, ray& scattered)
+{
+    switch (mat.kind())
+    {
+        case material_kind::lambertian:
+            return static_cast<const lambertian&>(mat).lambertian::scatter(r_in, hit_rec, attenuation, scattered);
+        case material_kind::metal:
+            return static_cast<const metal&>(mat).metal::scatter(r_in, hit_rec, attenuation, scattered);
+        case material_kind::dielectric:
+            return static_cast<const dielectric&>(mat).dielectric::scatter(r_in, hit_rec, attenuation, scattered);
+        case material_kind::diffuse_light:
+            return false;
+        case material_kind::isotropic:
+            return static_cast<const isotropic&>(mat).isotropic::scatter(r_in, hit_rec, attenuation, scattered);
+        default:
+            return mat.scatter(r_in, hit_rec, attenuation, scattered);
+    }
+}
+
+inline color emitted_material(const material& mat, double u, double v, const point3& p)
+{
+    switch (mat.kind())
+    {
+        case material_kind::diffuse_light:
+            return static_cast<const diffuse_light&>(mat).diffuse_light::emitted(u, v, p);
+        case material_kind::custom:
+            return mat.emitted(u, v, p);
+        default:
+            return color(0, 0, 0);
+    }
+}
+
+inline bool evaluate_material(const material& mat, const ray& r_in, const hit_record& hit_rec, const vec3& dir, color& value, double& pdf)
+{
+    switch (mat.kind())
+    {
+        case material_kind::lambertian:
+            return static_cast<const lambertian&>(mat).lambertian::evaluate(r_in, hit_rec, dir, value, pdf);
+        case material_kind::isotropic:
+            return static_cast<const isotropic&>(mat).isotropic::evaluate(r_in, hit_rec, dir, value, pdf);
+        case material_kind::custom:
+            return mat.evaluate(r_in, hit_rec, dir, value, pdf);
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "arena.h"
+#include "constants.h"
+#include "hittable.h"
+#include "hittable_objects.h"
+#include "primitive_dispatch.h"
+
+#include <algorithm>
+
+// BVH for moving geometry. Instead of one box around everything a node's children sweep over
+// the shutter, each node keeps a box for the start and one for the end of the shutter and
+// tests rays against their interpolation at the ray's time. Both boxes are grown until the
+// interpolated box contains the children at every time in the shutter, so fast or non-linear
+// motion only costs tightness, never correctness.
+class motion_bvh_node final : public hittable
+{
+public:
+    motion_bvh_node() : hittable(hittable_kind::motion_bvh_node) {}
+
+    motion_bvh_node(const hittable_objects& list, double time0, double time1)
+        : motion_bvh_node(list.get_m_objects(), 0, list.get_m_objects().size(), time0, time1)
+    {}
+
+    motion_bvh_node(const std::vector<std::shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1);
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+    virtual bool is_animated() const override { return m_left->is_animated() || m_right->is_animated(); }
+    virtual bool is_stochastic() const override { return m_left->is_stochastic() || m_right->is_stochastic(); }
+
+    // Moves the shutter to [time0, time1] and refits the start and end boxes for it.
+    virtual void refit(double time0, double time1, refit_summary& summary) override
+    {
+        m_time0 = time0;
+        m_time1 = time1;
+        m_left->refit(time0, time1, summary);
+        if (m_right != m_left)
+            m_right->refit(time0, time1, summary);
+        fit_boxes();
+        summary.m_nodes_refit++;
+    }
+
+    aabb box_at(double time) const
+    {
+        const double f = m_time1 > m_time0 ? clamp((time - m_time0) / (m_time1 - m_time0), 0.0, 1.0) : 0.0;
+        return aabb(m_box0.min() + f * (m_box1.min() - m_box0.min()),
+                    m_box0.max() + f * (m_box1.max() - m_box0.max()));
+    }
+
+private:
+    static bool hit_child(const hittable& child, const ray& r, double t_min, double t_max, hit_record& hit_rec)
+    {
+        if (child.kind() == hittable_kind::motion_bvh_node)
+            return static_cast<const motion_bvh_node&>(child).motion_bvh_node::hit(r, t_min, t_max, hit_rec);
+        return hit_primitive(child, r, t_min, t_max, hit_rec);
+    }
+
+    // Number of sub-intervals of the shutter checked when fitting the end boxes.
+    static constexpr int FIT_SEGMENTS = 8;
+
+    void fit_boxes();
+
+private:
+    std::shared_ptr<hittable> m_left;
+    std::shared_ptr<hittable> m_right;
+    aabb m_box0;
+    aabb m_box1;
+    double m_time0 = 0.0;
+    double m_time1 = 0.0;
+};
+
+inline bool motion_bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
+{
+    output_box = surrounding_box(box_at(time0), box_at(time1));
+    return true;
+}
+
+inline bool motion_bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& hit_rec) const
+{
+    RT_STAT(m_bvh_nodes_visited);
+
+    if (!box_at(r.time()).hit(r, t_min, t_max))
+        return false;
+
+    const bool hit_left = hit_child(*m_left, r, t_min, t_max, hit_rec);
+    const bool hit_right = m_right != m_left && hit_child(*m_right, r, t_min, hit_left ? hit_rec.m_t : t_max, hit_rec);
+
+    return hit_left || hit_right;
+}
+
+inline motion_bvh_node::motion_bvh_node(const std::vector<std::shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1)
+    : hittable(hittable_kind::motion_bvh_node)
+    , m_time0(time0)
+    , m_time1(time1)
+{
+    auto objects = src_objects;
+
+    // Split on positions in the middle of the shutter.
+    const double mid_time = 0.5 * (time0 + time1);
+    const int axis = random_int(0, 2);
+    const auto comparator = [mid_time, axis](const std::shared_ptr<hittable>& a, const std::shared_ptr<hittable>& b)
+    {
+        aabb box_a, box_b;
+        if (!a->bounding_box(mid_time, mid_time, box_a) || !b->bounding_box(mid_time, mid_time, box_b))
+            std::cerr << "No bounding box in motion_bvh_node constructor.\n";
+        return box_a.min()[axis] + box_a.max()[axis] < box_b.min()[axis] + box_b.max()[axis];
+    };
+
+    const size_t object_span = end - start;
+
+    if (object_span == 1)
+    {
+        m_left = m_right = objects[start];
+    }
+    else if (object_span == 2)
+    {
+        m_left = objects[start];
+        m_right = objects[start + 1];
+    }
+    else
+    {
+        std::sort(objects.begin() + start, objects.begin() + end, comparator);
+
+        const auto mid = start + object_span / 2;
+        m_left = arena_make<motion_bvh_node>(objects, start, mid, time0, time1);
+        m_right = arena_make<motion_bvh_node>(objects, mid, end, time0, time1);
+    }
+
+    fit_boxes();
+}
+
+inline void motion_bvh_node::fit_boxes()
+{
+    const auto children_box = [this](double a, double b)
+    {
+        aabb box_left, box_right;
+        if (!m_left->bounding_box(a, b, box_left) || !m_right->bounding_box(a, b, box_right))
+            std::cerr << "No bounding box in motion_bvh_node constructor.\n";
+        return surrounding_box(box_left, box_right);
+    };
+
+    m_box0 = children_box(m_time0, m_time0);
+    m_box1 = children_box(m_time1, m_time1);
+
+    if (m_time1 <= m_time0)
+        return;
+
+    // The children's swept box over each sub-interval must lie inside the interpolated box at
+    // both ends of that sub-interval; then, by linearity, it does at every time in between.
+    // A shortfall is added to both end boxes, which shifts the interpolation by the same amount
+    // everywhere and keeps the sub-intervals already fitted covered.
+    point3 lo0 = m_box0.min(), lo1 = m_box1.min();
+    point3 hi0 = m_box0.max(), hi1 = m_box1.max();
+
+    for (int s = 0; s < FIT_SEGMENTS; s++)
+    {
+        const double a = m_time0 + (m_time1 - m_time0) * s / FIT_SEGMENTS;
+        const double b = m_time0 + (m_time1 - m_time0) * (s + 1) / FIT_SEGMENTS;
+        const aabb swept = children_box(a, b);
+
+        for (const double f : { static_cast<double>(s) / FIT_SEGMENTS, static_cast<double>(s + 1) / FIT_SEGMENTS })
+            for (int c = 0; c < 3; c++)
+            {
+                const double lo = lo0[c] + f * (lo1[c] - lo0[c]);
+                const double hi = hi0[c] + f * (hi1[c] - hi0[c]);
+                if (lo > swept.min()[c])
+                {
+                    lo0[c] -= lo - swept.min()[c];
+                    lo1[c] -= lo - swept.min()[c];
+                }
+                if (hi < swept.max()[c])
+                {
+                    hi0[c] += swept.max()[c] - hi;
+                    hi1[c] += swept.max()[c] - hi;
+                }
+            }
+    }
+
+    m_box0 = aabb(lo0, hi0);
+    m_box1 = aabb(lo1, hi1);
+}
@@ -0,0 +1,189 @@
+#pragma once
+#include "constants.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <vector>
+
+// One keyframe of a motion_instance: the object is rotated about y by m_angle (degrees),
+// then moved by m_offset, as with rotate_y followed by translate.
+struct motion_key
+{
+    double m_time;
+    vec3 m_offset;
+    double m_angle;
+};
+
+// Instance whose transform is interpolated linearly between keyframes by ray time.
+// Before the first and after the last key the transform is held.
+class motion_instance : public hittable
+{
+public:
+    motion_instance(std::shared_ptr<hittable> p, std::vector<motion_key> keys);
+
+    virtual bool hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+    virtual bool is_animated() const override { return m_keys.size() > 1 || m_ptr->is_animated(); }
+    virtual bool is_stochastic() const override { return m_ptr->is_stochastic(); }
+
+    virtual void refit(double time0, double time1, refit_summary& summary) override
+    {
+        if (m_ptr->is_animated())
+        {
+            m_ptr->refit(time0, time1, summary);
+            update_object_box(time0, time1);
+        }
+    }
+
+private:
+    void update_object_box(double time0, double time1);
+
+    void transform_at(double time, vec3& offset, double& angle) const;
+
+    // Bounds of the object over a time span in which offset and angle both change linearly.
+    aabb segment_box(double time0, double time1) const;
+
+private:
+    std::shared_ptr<hittable> m_ptr;
+    std::vector<motion_key> m_keys;
+    aabb m_object_box;
+};
+
+inline motion_instance::motion_instance(std::shared_ptr<hittable> p, std::vector<motion_key> keys)
+    : m_ptr(p)
+    , m_keys(std::move(keys))
+{
+    std::sort(m_keys.begin(), m_keys.end(), [](const motion_key& a, const motion_key& b) { return a.m_time < b.m_time; });
+    update_object_box(0, 1);
+}
+
+inline void motion_instance::update_object_box(double time0, double time1)
+{
+    if (!m_ptr->bounding_box(time0, time1, m_object_box))
+        std::cerr << "No bounding box in motion_instance.\n";
+}
+
+inline void motion_instance::transform_at(double time, vec3& offset, double& angle) const
+{
+    if (m_keys.empty())
+    {
+        offset = vec3(0, 0, 0);
+        angle = 0.0;
+        return;
+    }
+
+    if (time <= m_keys.front().m_time)
+    {
+        offset = m_keys.front().m_offset;
+        angle = m_keys.front().m_angle;
+        return;
+    }
+
+    if (time >= m_keys.back().m_time)
+    {
+        offset = m_keys.back().m_offset;
+        angle = m_keys.back().m_angle;
+        return;
+    }
+
+    const auto next = std::upper_bound(m_keys.begin(), m_keys.end(), time,
+                                       [](double t, const motion_key& key) { return t < key.m_time; });
+    const auto prev = next - 1;
+    const double f = (time - prev->m_time) / (next->m_time - prev->m_time);
+
+    offset = prev->m_offset + f * (next->m_offset - prev->m_offset);
+    angle = prev->m_angle + f * (next->m_angle - prev->m_angle);
+}
+
+inline bool motion_instance::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+{
+    vec3 offset;
+    double angle;
+    transform_at(r_in.time(), offset, angle);
+
+    const double radians = degrees_to_radians(angle);
+    const double sin_theta = sin(radians);
+    const double cos_theta = cos(radians);
+
+    const point3 o = r_in.origin() - offset;
+    const vec3 d = r_in.dir();
+
+    const point3 origin(cos_theta * o[0] - sin_theta * o[2], o[1], sin_theta * o[0] + cos_theta * o[2]);
+    const vec3 direction(cos_theta * d[0] - sin_theta * d[2], d[1], sin_theta * d[0] + cos_theta * d[2]);
+    const ray object_r(origin, direction, r_in.time());
+
+    if (!m_ptr->hit(object_r, t_min, t_max, hit_rec))
+        return false;
+
+    const point3 p = hit_rec.m_point;
+    const vec3 n = hit_rec.m_normal;
+
+    hit_rec.m_point = point3(cos_theta * p[0] + sin_theta * p[2], p[1], -sin_theta * p[0] + cos_theta * p[2]) + offset;
+    hit_rec.set_face_normal(r_in, vec3(cos_theta * n[0] + sin_theta * n[2], n[1], -sin_theta * n[0] + cos_theta * n[2]));
+    hit_rec.m_object = nullptr;
+
+    return true;
+}
+
+inline aabb motion_instance::segment_box(double time0, double time1) const
+{
+    vec3 offset0, offset1;
+    double angle0, angle1;
+    transform_at(time0, offset0, angle0);
+    transform_at(time1, offset1, angle1);
+
+    // A corner at polar angle phi in object space sits at phi - angle in world space, so over
+    // the segment each corner sweeps an arc; bound the arc's ends and any axis extremes it passes.
+    const double turn0 = degrees_to_radians(fmin(angle0, angle1));
+    const double turn1 = degrees_to_radians(fmax(angle0, angle1));
+
+    point3 min(INF, m_object_box.min().y(), INF);
+    point3 max(-INF, m_object_box.max().y(), -INF);
+    for (int i = 0; i < 2; i++)
+        for (int k = 0; k < 2; k++)
+        {
+            const double x = i ? m_object_box.max().x() : m_object_box.min().x();
+            const double z = k ? m_object_box.max().z() : m_object_box.min().z();
+            const double radius = sqrt(x * x + z * z);
+            const double phi = atan2(z, x);
+
+            const auto include = [&](double a)
+            {
+                const double wx = radius * cos(a);
+                const double wz = radius * sin(a);
+                min[0] = fmin(min[0], wx);
+                max[0] = fmax(max[0], wx);
+                min[2] = fmin(min[2], wz);
+                max[2] = fmax(max[2], wz);
+            };
+
+            const double a0 = phi - turn1;
+            const double a1 = phi - turn0;
+            include(a0);
+            include(a1);
+            for (double a = ceil(a0 / (0.5 * PI)) * 0.5 * PI; a < a1; a += 0.5 * PI)
+                include(a);
+        }
+    const aabb rotated(min, max);
+
+    // Translation is linear over the segment, so the swept box is the union of its two ends.
+    return surrounding_box(aabb(rotated.min() + offset0, rotated.max() + offset0),
+                           aabb(rotated.min() + offset1, rotated.max() + offset1));
+}
+
+inline bool motion_instance::bounding_box(double time0, double time1, aabb& output_box) const
+{
+    // Split [time0, time1] at the keyframes inside it.
+    double start = time0;
+    output_box = segment_box(time0, time0);
+    for (const auto& key : m_keys)
+    {
+        if (key.m_time <= time0 || key.m_time >= time1)
+            continue;
+        output_box = surrounding_box(output_box, segment_box(start, key.m_time));
+        start = key.m_time;
+    }
+    output_box = surrounding_box(output_box, segment_box(start, time1));
+    return true;
+}
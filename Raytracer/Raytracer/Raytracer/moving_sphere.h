@@ -0,0 +1,77 @@
+#pragma once
+#include "hittable.h"
+#include "vec3.h"
+
+// Sphere whose centre moves linearly from center0 at time0 to center1 at time1.
+class moving_sphere final : public hittable
+{
+public:
+    moving_sphere() = delete;
+    moving_sphere(point3 center0, point3 center1, double time0, double time1, double radius, std::shared_ptr<material> m)
+        : hittable(hittable_kind::moving_sphere)
+        , m_center0(center0)
+        , m_center1(center1)
+        , m_time0(time0)
+        , m_time1(time1)
+        , m_radius(radius)
+        , m_mat_ptr(m)
+    {};
+
+    virtual bool hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool is_animated() const override { return (m_center1 - m_center0).length_squared() > 0; }
+
+    point3 center(double time) const
+    {
+        return m_center0 + ((time - m_time0) / (m_time1 - m_time0)) * (m_center1 - m_center0);
+    }
+
+private:
+    point3 m_center0, m_center1;
+    double m_time0, m_time1;
+    double m_radius;
+    std::shared_ptr<material> m_mat_ptr;
+};
+
+inline bool moving_sphere::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+{
+    RT_STAT(m_primitive_tests);
+
+    const point3 c = center(r_in.time());
+    const vec3 oc = r_in.origin() - c;
+    const double a = r_in.dir().length_squared();
+    const double half_b = dot(oc, r_in.dir());
+    const double cc = oc.length_squared() - m_radius * m_radius;
+    const double discriminant = half_b * half_b - a * cc;
+    if (discriminant < 0.f)
+        return false;
+
+    const double discrim_sqrt = sqrt(discriminant);
+    double root = (-half_b - discrim_sqrt) / a;
+    if (root < t_min || root > t_max)
+    {
+        root = (-half_b + discrim_sqrt) / a;
+        if (root < t_min || root > t_max)
+            return false;
+    }
+
+    hit_rec.m_t = root;
+    hit_rec.m_point = r_in.at(hit_rec.m_t);
+    const vec3 outward_normal = (hit_rec.m_point - c) / m_radius;
+    hit_rec.set_face_normal(r_in, outward_normal);
+    hit_rec.m_u = (atan2(-outward_normal.z(), outward_normal.x()) + PI) / (2 * PI);
+    hit_rec.m_v = acos(-outward_normal.y()) / PI;
+    hit_rec.m_uv_scale = 1.0 / (PI * m_radius);
+    hit_rec.m_mat_ptr = m_mat_ptr;
+    hit_rec.m_object = this;
+    return true;
+}
+
+inline bool moving_sphere::bounding_box(double time0, double time1, aabb& output_box) const
+{
+    const vec3 r(m_radius, m_radius, m_radius);
+    const aabb box0(center(time0) - r, center(time0) + r);
+    const aabb box1(center(time1) - r, center(time1) + r);
+    output_box = surrounding_box(box0, box1);
+    return true;
+}
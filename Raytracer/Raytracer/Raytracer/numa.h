@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// One NUMA node of this host and the CPUs that belong to it.
+struct numa_node
+{
+    int m_id;
+    std::vector<int> m_cpus;
+};
+
+// Parses a Linux CPU or node list such as "0-3,8-11"; false if it is malformed.
+inline bool parse_cpu_list(const std::string& text, std::vector<int>& cpus)
+{
+    size_t pos = 0;
+    while (pos < text.size() && text[pos] != '\n')
+    {
+        char* end;
+        const long first = strtol(text.c_str() + pos, &end, 10);
+        long last = first;
+        if (end == text.c_str() + pos || first < 0)
+            return false;
+        if (*end == '-')
+        {
+            const char* start = end + 1;
+            last = strtol(start, &end, 10);
+            if (end == start || last < first)
+                return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            cpus.push_back(static_cast<int>(cpu));
+        pos = end - text.c_str();
+        if (pos < text.size() && text[pos] == ',')
+            pos++;
+    }
+    return true;
+}
+
+// The NUMA nodes of this host, from /sys/devices/system/node on Linux. Elsewhere, or if that cannot be read, the
+// host counts as one node with an empty CPU list, which pins nothing.
+inline std::vector<numa_node> numa_topology()
+{
+    std::vector<numa_node> nodes;
+#ifdef __linux__
+    const std::string root = "/sys/devices/system/node/";
+    std::ifstream online(root + "online");
+    std::string list;
+    std::vector<int> ids;
+    if (online && std::getline(online, list) && parse_cpu_list(list, ids))
+    {
+        for (const int id : ids)
+        {
+            std::ifstream cpulist(root + "node" + std::to_string(id) + "/cpulist");
+            numa_node node { id, {} };
+            if (cpulist && std::getline(cpulist, list) && parse_cpu_list(list, node.m_cpus) && !node.m_cpus.empty())
+                nodes.push_back(node);
+        }
+    }
+#endif
+    if (nodes.empty())
+        nodes.push_back({ 0, {} });
+    return nodes;
+}
+
+// Restricts the calling thread, and the threads it starts from then on, to the CPUs of node. Memory is placed on
+// the node that first touches it, so whatever the thread allocates and fills afterwards is local to node.
+// Returns false if the thread could not be pinned.
+inline bool bind_to_numa_node(const numa_node& node)
+{
+#ifdef __linux__
+    if (node.m_cpus.empty())
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : node.m_cpus)
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// The node the calling thread is running on, or -1 if that is unknown.
+inline int current_numa_node(const std::vector<numa_node>& nodes)
+{
+#ifdef __linux__
+    const int cpu = sched_getcpu();
+    for (const numa_node& node : nodes)
+        for (const int c : node.m_cpus)
+            if (c == cpu)
+                return node.m_id;
+#endif
+    return -1;
+}
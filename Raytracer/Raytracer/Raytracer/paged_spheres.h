@@ -0,0 +1,375 @@
+#pragma once
+#include "arena.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "geometry_cache.h"
+#include "hittable.h"
+#include "hittable_objects.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Static spheres kept out of memory. A median-split hierarchy cuts them into clusters of at most CLUSTER_SIZE;
+// only its top, down to the clusters, stays in memory. Each cluster is written to a backing file with a BVH of its
+// own, and is read back through the geometry_cache when a ray first enters its box. What stays resident is the top
+// nodes, the cluster table and the materials, so the memory a render needs follows the cache budget rather than the
+// number of spheres. Hits report no hit_record::m_object: nothing resident could identify a paged sphere, so lights
+// and anything else looked up by address must stay ordinary objects (page_geometry() keeps them).
+class paged_spheres : public hittable, public cluster_source
+{
+public:
+    static constexpr int CLUSTER_SIZE = 512;  // about 28 KB a cluster with its nodes
+    static constexpr int LEAF_SIZE = 4;
+
+    // Takes the spheres, whose m_material index materials, and writes them out; the records are released.
+    paged_spheres(std::vector<sphere_record> spheres, std::vector<std::shared_ptr<material>> materials);
+    ~paged_spheres();
+
+    paged_spheres(const paged_spheres&) = delete;
+    paged_spheres& operator=(const paged_spheres&) = delete;
+
+    virtual bool hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+    {
+        output_box = m_bounds;
+        return !m_top.empty();
+    }
+
+    // Hits report no primitive (see above).
+    virtual void collect_primitives(std::vector<const hittable*>& primitives) const override {}
+
+    virtual void read_cluster(uint32_t cluster, geometry_cluster& out) const override;
+
+    size_t sphere_count() const { return m_sphere_count; }
+    size_t cluster_count() const { return m_clusters.size(); }
+
+    // Bytes kept in memory whatever the cache holds: the top nodes and the cluster table.
+    size_t memory_bytes() const
+    {
+        return m_top.size() * sizeof(flat_bvh_node) + m_clusters.size() * sizeof(cluster_entry);
+    }
+
+private:
+    struct cluster_entry
+    {
+        int64_t m_offset;  // of the nodes in the backing file; the spheres follow them
+        uint32_t m_node_count;
+        uint32_t m_sphere_count;
+    };
+
+    // Fills node index from spheres [begin, end), splitting at the median centroid along the widest axis until at
+    // most leaf_size are left. The children of an inner node are an adjacent pair, as in flat_bvh.
+    // make_leaf(node, begin, end) fills in the offset and count of a leaf.
+    template <class LeafMaker>
+    static void build(std::vector<sphere_record>& spheres, size_t begin, size_t end, size_t leaf_size,
+                      std::vector<flat_bvh_node>& nodes, uint32_t index, LeafMaker&& make_leaf);
+
+    // Visits the leaves whose boxes the ray enters, nearest child first, like flat_bvh::traverse.
+    template <class LeafVisitor>
+    static void traverse(const std::vector<flat_bvh_node>& nodes, const ray& r_in, double t_min, double t_max,
+                         LeafVisitor&& visit_leaf);
+
+    static bool seek(std::FILE* file, int64_t offset);
+
+private:
+    uint32_t m_id;
+    std::vector<flat_bvh_node> m_top;  // leaves name a cluster in m_offset
+    std::vector<cluster_entry> m_clusters;
+    std::vector<std::shared_ptr<material>> m_materials;
+    size_t m_sphere_count = 0;
+    aabb m_bounds;
+    std::FILE* m_backing;
+    mutable std::mutex m_backing_mutex;
+    mutable std::atomic<bool> m_read_failed { false };
+};
+
+inline paged_spheres::paged_spheres(std::vector<sphere_record> spheres, std::vector<std::shared_ptr<material>> materials)
+    : m_id(geometry_cache::instance().register_geometry())
+    , m_materials(std::move(materials))
+    , m_sphere_count(spheres.size())
+    , m_backing(std::tmpfile())
+{
+    if (!m_backing)
+        std::cerr << "Cannot create backing file for paged geometry.\n";
+    if (spheres.empty())
+        return;
+
+    struct cluster_range
+    {
+        size_t m_begin;
+        size_t m_end;
+    };
+    std::vector<cluster_range> ranges;
+    m_top.emplace_back();
+    build(spheres, 0, spheres.size(), CLUSTER_SIZE, m_top, 0, [&](flat_bvh_node& node, size_t begin, size_t end)
+    {
+        node.m_offset = static_cast<uint32_t>(ranges.size());
+        node.m_count = static_cast<uint16_t>(end - begin);
+        ranges.push_back({ begin, end });
+    });
+
+    const flat_bvh_node& root = m_top[0];
+    m_bounds = aabb(point3(root.m_min[0], root.m_min[1], root.m_min[2]), point3(root.m_max[0], root.m_max[1], root.m_max[2]));
+
+    // Clusters go to the file in the order the top leaves were made, so nearby clusters lie close together in it.
+    int64_t offset = 0;
+    std::vector<flat_bvh_node> nodes;
+    for (const cluster_range& range : ranges)
+    {
+        nodes.assign(1, flat_bvh_node());
+        build(spheres, range.m_begin, range.m_end, LEAF_SIZE, nodes, 0, [&](flat_bvh_node& node, size_t begin, size_t end)
+        {
+            node.m_offset = static_cast<uint32_t>(begin - range.m_begin);
+            node.m_count = static_cast<uint16_t>(end - begin);
+        });
+
+        const size_t count = range.m_end - range.m_begin;
+        m_clusters.push_back({ offset, static_cast<uint32_t>(nodes.size()), static_cast<uint32_t>(count) });
+        if (m_backing)
+        {
+            std::fwrite(nodes.data(), sizeof(flat_bvh_node), nodes.size(), m_backing);
+            std::fwrite(&spheres[range.m_begin], sizeof(sphere_record), count, m_backing);
+        }
+        offset += static_cast<int64_t>(nodes.size() * sizeof(flat_bvh_node) + count * sizeof(sphere_record));
+    }
+    if (m_backing && std::fflush(m_backing) != 0)
+        std::cerr << "Cannot write backing file for paged geometry.\n";
+}
+
+inline paged_spheres::~paged_spheres()
+{
+    if (m_backing)
+        std::fclose(m_backing);
+}
+
+template <class LeafMaker>
+void paged_spheres::build(std::vector<sphere_record>& spheres, size_t begin, size_t end, size_t leaf_size,
+                          std::vector<flat_bvh_node>& nodes, uint32_t index, LeafMaker&& make_leaf)
+{
+    double lo[3] = { INF, INF, INF }, hi[3] = { -INF, -INF, -INF };
+    double centroid_lo[3] = { INF, INF, INF }, centroid_hi[3] = { -INF, -INF, -INF };
+    for (size_t i = begin; i < end; i++)
+    {
+        const sphere_record& s = spheres[i];
+        for (int a = 0; a < 3; a++)
+        {
+            lo[a] = fmin(lo[a], s.m_center[a] - s.m_radius);
+            hi[a] = fmax(hi[a], s.m_center[a] + s.m_radius);
+            centroid_lo[a] = fmin(centroid_lo[a], s.m_center[a]);
+            centroid_hi[a] = fmax(centroid_hi[a], s.m_center[a]);
+        }
+    }
+
+    for (int a = 0; a < 3; a++)
+    {
+        nodes[index].m_min[a] = round_down_float(lo[a]);
+        nodes[index].m_max[a] = round_up_float(hi[a]);
+    }
+
+    if (end - begin <= leaf_size)
+        return make_leaf(nodes[index], begin, end);
+
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (centroid_hi[a] - centroid_lo[a] > centroid_hi[axis] - centroid_lo[axis])
+            axis = a;
+
+    const size_t middle = begin + (end - begin) / 2;
+    std::nth_element(spheres.begin() + begin, spheres.begin() + middle, spheres.begin() + end,
+                     [axis](const sphere_record& a, const sphere_record& b) { return a.m_center[axis] < b.m_center[axis]; });
+
+    const uint32_t left = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[index].m_offset = left;
+    nodes[index].m_count = 0;
+    nodes[index].m_axis = static_cast<uint8_t>(axis);
+
+    build(spheres, begin, middle, leaf_size, nodes, left, make_leaf);
+    build(spheres, middle, end, leaf_size, nodes, left + 1, make_leaf);
+}
+
+template <class LeafVisitor>
+void paged_spheres::traverse(const std::vector<flat_bvh_node>& nodes, const ray& r_in, double t_min, double t_max,
+                             LeafVisitor&& visit_leaf)
+{
+    if (nodes.empty())
+        return;
+
+    const point3 origin = r_in.origin();
+    const vec3 inv_dir(1.0 / r_in.dir().x(), 1.0 / r_in.dir().y(), 1.0 / r_in.dir().z());
+
+    uint32_t stack[flat_bvh::STACK_SIZE];
+    int stack_size = 0;
+    uint32_t index = 0;
+
+    while (true)
+    {
+        RT_STAT(m_bvh_nodes_visited);
+        RT_STAT(m_aabb_tests);
+
+        const flat_bvh_node& node = nodes[index];
+        const double lo[3] = { node.m_min[0], node.m_min[1], node.m_min[2] };
+        const double hi[3] = { node.m_max[0], node.m_max[1], node.m_max[2] };
+        double t_enter;
+
+        if (slab_hit(lo, hi, origin, inv_dir, t_min, t_max, t_enter))
+        {
+            if (node.m_count > 0)
+            {
+                visit_leaf(node.m_offset, node.m_count, t_max);
+            }
+            else
+            {
+                // Visit the child on the near side of the split plane first.
+                if (inv_dir[node.m_axis] < 0)
+                {
+                    stack[stack_size++] = node.m_offset;
+                    index = node.m_offset + 1;
+                }
+                else
+                {
+                    stack[stack_size++] = node.m_offset + 1;
+                    index = node.m_offset;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        index = stack[--stack_size];
+    }
+}
+
+inline bool paged_spheres::hit(const ray& r_in, double t_min, double t_max, hit_record& hit_rec) const
+{
+    bool hit_anything = false;
+    traverse(m_top, r_in, t_min, t_max, [&](uint32_t cluster_index, uint32_t, double& closest)
+    {
+        const geometry_cluster& cluster = geometry_cache::instance().cluster(*this, m_id, cluster_index);
+        bool hit_cluster = false;
+        traverse(cluster.m_nodes, r_in, t_min, closest, [&](uint32_t first, uint32_t count, double& nearest)
+        {
+            for (uint32_t i = first; i < first + count; i++)
+            {
+                RT_STAT(m_primitive_tests);
+                const sphere_record& s = cluster.m_spheres[i];
+                if (sphere::hit_surface(point3(s.m_center[0], s.m_center[1], s.m_center[2]), s.m_radius, r_in, t_min, nearest, hit_rec))
+                {
+                    hit_rec.m_mat_ptr = m_materials[s.m_material];
+                    hit_rec.m_object = nullptr;
+                    hit_cluster = true;
+                    nearest = hit_rec.m_t;
+                }
+            }
+        });
+        if (hit_cluster)
+        {
+            hit_anything = true;
+            closest = hit_rec.m_t;
+        }
+    });
+    return hit_anything;
+}
+
+inline bool paged_spheres::seek(std::FILE* file, int64_t offset)
+{
+#ifdef _MSC_VER
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+inline void paged_spheres::read_cluster(uint32_t cluster, geometry_cluster& out) const
+{
+    const cluster_entry& entry = m_clusters[cluster];
+    out.m_nodes.resize(entry.m_node_count);
+    out.m_spheres.resize(entry.m_sphere_count);
+
+    std::lock_guard<std::mutex> lock(m_backing_mutex);
+    if (!m_backing || !seek(m_backing, entry.m_offset)
+        || std::fread(out.m_nodes.data(), sizeof(flat_bvh_node), out.m_nodes.size(), m_backing) != out.m_nodes.size()
+        || std::fread(out.m_spheres.data(), sizeof(sphere_record), out.m_spheres.size(), m_backing) != out.m_spheres.size())
+    {
+        // An empty cluster is never hit, so a failed read leaves a hole in the image rather than garbage.
+        out.m_nodes.clear();
+        out.m_spheres.clear();
+        if (!m_read_failed.exchange(true))
+            std::cerr << "Cannot read paged geometry back from its backing file.\n";
+    }
+}
+
+// Moves the static spheres among the top-level objects of world, and among the leaves of its bvh_nodes, into one
+// paged_spheres; bvh_nodes that lose spheres are rebuilt over what is left. Lights stay ordinary spheres for light
+// sampling to find, and so do metal and glass spheres when keep_specular is set, since photons are aimed at them.
+// Returns the number of spheres paged.
+inline size_t page_geometry(hittable_objects& world, double time0, double time1, bool keep_specular)
+{
+    std::vector<sphere_record> spheres;
+    std::vector<std::shared_ptr<material>> materials;
+    std::unordered_map<const material*, uint32_t> material_index;
+
+    // Takes object if it can be paged.
+    const auto take = [&](const std::shared_ptr<hittable>& object)
+    {
+        if (object->kind() != hittable_kind::sphere)
+            return false;
+        const sphere& s = static_cast<const sphere&>(*object);
+        const material_kind kind = s.material_ptr()->kind();
+        if (kind == material_kind::diffuse_light
+            || (keep_specular && (kind == material_kind::metal || kind == material_kind::dielectric)))
+            return false;
+
+        const auto found = material_index.emplace(s.material_ptr().get(), static_cast<uint32_t>(materials.size()));
+        if (found.second)
+            materials.push_back(s.material_ptr());
+        spheres.push_back({ { s.center().x(), s.center().y(), s.center().z() }, s.radius(), found.first->second, 0 });
+        return true;
+    };
+
+    hittable_objects converted;
+    for (const auto& object : world.get_m_objects())
+    {
+        const auto node = dynamic_cast<const bvh_node*>(object.get());
+        if (object->is_animated() || (!node && !take(object)))
+        {
+            converted.add(object);
+            continue;
+        }
+        if (!node)
+            continue;
+
+        std::vector<std::shared_ptr<hittable>> leaves, rest;
+        node->collect_objects(leaves);
+        for (const auto& leaf : leaves)
+            if (!take(leaf))
+                rest.push_back(leaf);
+
+        if (rest.size() == leaves.size())
+            converted.add(object);
+        else if (rest.size() == 1)
+            converted.add(rest[0]);
+        else if (!rest.empty())
+            converted.add(arena_make<bvh_node>(rest, 0, rest.size(), time0, time1));
+    }
+
+    const size_t count = spheres.size();
+    if (count > 0)
+    {
+        converted.add(arena_make<paged_spheres>(std::move(spheres), std::move(materials)));
+        world = converted;
+    }
+    return count;
+}
@@ -0,0 +1,167 @@
+#pragma once
+#include "aabb.h"
+#include "constants.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+// How the rays of a tile are traced. recursive follows each path to its end before starting the next;
+// batched advances all paths of a tile one bounce at a time; sorted also reorders the rays of every
+// bounce after the first by direction octant and origin, so that rays traced together touch the same
+// parts of the scene.
+enum class trace_order { recursive, batched, sorted };
+
+// Parses the name given to --trace; returns false for an unknown name.
+inline bool parse_trace_order(const char* name, trace_order& order)
+{
+    if (!strcmp(name, "recursive"))
+        order = trace_order::recursive;
+    else if (!strcmp(name, "batched"))
+        order = trace_order::batched;
+    else if (!strcmp(name, "sorted"))
+        order = trace_order::sorted;
+    else
+        return false;
+    return true;
+}
+
+// A path of a batch between bounces.
+struct path_state
+{
+    path_state() = default;
+    explicit path_state(const ray& r) : m_ray(r) {}
+
+    ray m_ray;
+    color m_throughput { 1, 1, 1 };
+    color m_radiance { 0, 0, 0 };
+    scatter_vertex m_from;  // see ray_color
+#ifdef RT_ENABLE_STATS
+    long long m_bvh_nodes_visited = 0;
+    long long m_primitive_tests = 0;
+#endif
+};
+
+// Spreads the low 10 bits of v so that there are two zero bits between each of them.
+inline uint32_t spread_bits(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Bin of a ray: its direction octant above the Morton code of its origin on a grid of
+// 2^ORIGIN_BITS cells per axis over bounds.
+constexpr int ORIGIN_BITS = 4;
+constexpr uint32_t RAY_BIN_COUNT = 8u << (3 * ORIGIN_BITS);
+
+inline uint32_t ray_bin(const ray& r, const aabb& bounds)
+{
+    const point3 origin = r.origin();
+    const vec3 dir = r.dir();
+
+    uint32_t cell[3];
+    for (int a = 0; a < 3; a++)
+    {
+        const double extent = bounds.max()[a] - bounds.min()[a];
+        const double f = extent > 0 ? (origin[a] - bounds.min()[a]) / extent : 0.0;
+        cell[a] = std::min(static_cast<uint32_t>(clamp(f, 0.0, 1.0) * (1 << ORIGIN_BITS)), (1u << ORIGIN_BITS) - 1);
+    }
+
+    const uint32_t octant = (dir.x() < 0 ? 1u : 0u) | (dir.y() < 0 ? 2u : 0u) | (dir.z() < 0 ? 4u : 0u);
+    return (octant << (3 * ORIGIN_BITS)) | (spread_bits(cell[0]) << 2) | (spread_bits(cell[1]) << 1) | spread_bits(cell[2]);
+}
+
+// Traces a batch of paths one bounce at a time until all of them have ended or max_depth rays have been
+// traced, adding their radiance to m_radiance; lights are sampled and guide is followed as in ray_color, but
+// not recorded into. Paths stay where they are: each bounce walks a list of the indices of the paths still
+// going, which is compacted after every bounce and in sorted order also sorted by ray bin. Each path draws
+// its random numbers at each bounce from a stream of its own, derived from seed and its index, so the result
+// does not depend on the order rays are traced in.
+inline void trace_paths(std::vector<path_state>& paths, const hittable& world, const color& background, const scene_lights& lights,
+                        const guiding_field* guide, int max_depth, uint64_t seed, trace_order order, const aabb& bounds)
+{
+    std::vector<uint32_t> active(paths.size());
+    std::iota(active.begin(), active.end(), 0u);
+    std::vector<uint64_t> keys;  // ray bin above path index, for the paths still going in sorted order
+
+    for (int depth = 0; depth < max_depth && !active.empty(); depth++)
+    {
+        // Camera rays already arrive in pixel order, which is coherent; later bounces are traced in order
+        // of their bins, and of path index within a bin.
+        if (order == trace_order::sorted && depth > 0)
+        {
+            std::sort(keys.begin(), keys.end());
+            for (size_t i = 0; i < keys.size(); i++)
+                active[i] = static_cast<uint32_t>(keys[i]);
+        }
+        keys.clear();
+
+        size_t still_active = 0;
+        for (size_t i = 0; i < active.size(); i++)
+        {
+            const uint32_t index = active[i];
+            path_state& path = paths[index];
+            seed_random(seed ^ mix_seed((static_cast<uint64_t>(index) << 32) | static_cast<uint32_t>(depth)));
+
+#ifdef RT_ENABLE_STATS
+            const long long nodes_before = render_stats::local().m_bvh_nodes_visited;
+            const long long primitives_before = render_stats::local().m_primitive_tests;
+#endif
+            RT_STAT(m_rays);
+
+            hit_record hit_rec;
+            color emitted, attenuation;
+            ray scattered;
+            bool scatters = false;
+            if (!world.hit(path.m_ray, 0.001, INF, hit_rec))
+                path.m_radiance += path.m_throughput * background_light(lights, background, path.m_ray.dir(), path.m_from);
+            else
+            {
+                scatters = shade_hit(path.m_ray, hit_rec, emitted, attenuation, scattered);
+                emitted = emitter_light(lights, path.m_ray, hit_rec, emitted, path.m_from);
+                color cached;
+                if (scatters && cached_radiance(lights, hit_rec, path.m_from, path.m_from, cached))
+                {
+                    emitted += cached;
+                    scatters = false;
+                }
+                if (scatters)
+                {
+                    emitted += gather_caustics(lights, hit_rec, attenuation, path.m_from, path.m_from);
+                    const directional_tree* guide_tree = guide ? guide->lookup(hit_rec.m_point) : nullptr;
+                    double scatter_pdf = 0.0;
+                    if (guide || lights.m_environment || lights.m_emitters)
+                        scatter_pdf = guided_scatter(path.m_ray, hit_rec, guide_tree, scattered, attenuation);
+                    if (guide_tree && attenuation.near_zero())
+                        scatters = false;
+                    emitted += direct_light(path.m_ray, hit_rec, world, lights, guide_tree, scatter_pdf, path.m_from);
+                }
+                path.m_radiance += path.m_throughput * emitted;
+            }
+
+#ifdef RT_ENABLE_STATS
+            path.m_bvh_nodes_visited += render_stats::local().m_bvh_nodes_visited - nodes_before;
+            path.m_primitive_tests += render_stats::local().m_primitive_tests - primitives_before;
+#endif
+
+            if (scatters && depth + 1 < max_depth)
+            {
+                path.m_throughput = path.m_throughput * attenuation;
+                path.m_ray = scattered;
+                if (order == trace_order::sorted)
+                    keys.push_back((static_cast<uint64_t>(ray_bin(scattered, bounds)) << 32) | index);
+                active[still_active++] = index;
+            }
+        }
+        active.resize(still_active);
+    }
+}
@@ -0,0 +1,503 @@
+#pragma once
+#include "constants.h"
+#include "environment.h"
+#include "hittable.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+class caustic_photons;
+
+// A photon stored where it first met a diffuse surface after one or more specular bounces.
+struct photon
+{
+    float m_position[3];
+    float m_dir[3];  // direction of travel when it arrived
+    float m_power[3];
+};
+
+// The caustic photons of one pass in a hashed grid of cells twice the gather radius wide. Photons are stored
+// cell by cell, so a lookup reads eight contiguous runs of them.
+class photon_map
+{
+public:
+    photon_map(std::vector<photon> photons, double radius, const caustic_photons& sources);
+
+    // Flux per unit area arriving at p from the side of the surface that n faces, estimated from the photons
+    // within the gather radius.
+    color irradiance(const point3& p, const vec3& n) const;
+
+    const caustic_photons& sources() const { return m_sources; }
+    double radius() const { return m_radius; }
+    size_t size() const { return m_photons.size(); }
+    size_t memory_bytes() const { return m_photons.size() * sizeof(photon) + m_cell_start.size() * sizeof(uint32_t); }
+
+private:
+    uint32_t bucket(int64_t x, int64_t y, int64_t z) const;
+
+private:
+    const caustic_photons& m_sources;
+    std::vector<photon> m_photons;
+    std::vector<uint32_t> m_cell_start;  // photons of bucket b are [m_cell_start[b], m_cell_start[b + 1])
+    double m_low[3] = { 0, 0, 0 };        // bounds of the photons, widened by the radius
+    double m_high[3] = { 0, 0, 0 };
+    double m_radius;
+    double m_cell_size;
+    uint32_t m_mask;
+};
+
+// Photon maps for caustics: light that reaches a diffuse surface through dielectric or metal objects. Photons
+// leave the scene's diffuse_light spheres and rectangles, and its background or environment map, aimed at the
+// bounding spheres of the specular primitives (the targets). They follow specular bounces until they reach a
+// diffuse surface, where they are stored. Photons whose first hit is not a target are dropped, so the maps cover
+// exactly the light paths emitter -> target -> specular* -> diffuse, and camera paths leave those to them.
+// Each render pass traces its own map, with a gather radius that shrinks from pass to pass as in probabilistic
+// progressive photon mapping, so averaging the passes converges. Photons are traced at the shutter open time.
+class caustic_photons
+{
+public:
+    static constexpr int MAX_BOUNCES = 16;
+    static constexpr int CHUNK_PHOTONS = 1024;
+    static constexpr double RADIUS_ALPHA = 2.0 / 3.0;  // share of the photons in the radius kept from pass to pass
+    static constexpr int KEPT_PASSES = 2;  // newest traced maps kept for renders that ask for them again
+
+    // radius <= 0 picks a tenth of the largest target's radius.
+    caustic_photons(const hittable& world, const color& background, const environment_map* env, double time,
+                    int photons_per_pass, double radius, uint64_t seed);
+
+    // Whether there is nothing to trace: no targets or no light.
+    bool empty() const { return m_targets.empty() || (m_emitters.empty() && !m_background_light); }
+
+    bool is_target(const hittable* object) const { return m_target_set.count(object) != 0; }
+    bool is_emitter(const hittable* object) const { return m_emitter_set.count(object) != 0; }
+    bool lights_background() const { return m_background_light; }
+
+    double radius(int pass) const;
+
+    // Photon map of a render pass, traced on first use from seeds that depend only on the pass. Renders asking for
+    // the same pass at once wait for one trace; other passes are traced meanwhile. Maps older than the newest
+    // KEPT_PASSES live on only while some render still holds them, and are traced anew, identically, if needed again.
+    std::shared_ptr<const photon_map> pass(int pass) const;
+
+private:
+    struct pass_slot
+    {
+        std::once_flag m_traced;
+        std::shared_ptr<const photon_map> m_map;
+        bool m_ready = false;  // m_map is set; guarded by m_maps_mutex
+    };
+
+    struct target
+    {
+        point3 m_center;
+        double m_radius;
+        const hittable* m_object;
+    };
+
+    std::shared_ptr<const photon_map> trace_pass(int pass) const;
+
+    // Emits and traces one photon, appending it to photons if it is stored.
+    void trace_photon(std::vector<photon>& photons) const;
+
+    // Density of the ray (origin, dir) among background photons, per unit solid angle and unit area across it.
+    double background_pdf(const point3& origin, const vec3& dir) const;
+
+    // Density of dir among the directions of photons leaving the emitter at y, per unit solid angle.
+    double emitter_direction_pdf(const point3& y, const vec3& dir) const;
+
+    size_t pick_target(double u) const;
+
+private:
+    const hittable& m_world;
+    color m_background;
+    const environment_map* m_env;
+    double m_time;
+    int m_photons_per_pass;
+    double m_radius;
+    uint64_t m_seed;
+
+    std::vector<target> m_targets;
+    std::vector<double> m_target_cdf;  // by squared radius
+    std::unordered_set<const hittable*> m_target_set;
+
+    std::vector<const hittable*> m_emitters;
+    std::vector<double> m_emitter_cdf;  // by power
+    std::unordered_set<const hittable*> m_emitter_set;
+
+    bool m_background_light = false;
+    double m_background_share = 0.0;  // share of the photons that come from the background
+    point3 m_world_center;
+    double m_world_radius = 0.0;
+
+    mutable std::mutex m_maps_mutex;
+    mutable std::map<int, std::shared_ptr<pass_slot>> m_maps;
+    mutable int m_newest_pass = -1;
+};
+
+inline photon_map::photon_map(std::vector<photon> photons, double radius, const caustic_photons& sources)
+    : m_sources(sources)
+    , m_radius(radius)
+    , m_cell_size(2 * radius)
+{
+    uint32_t buckets = 1024;
+    while (buckets < 2 * photons.size())
+        buckets *= 2;
+    m_mask = buckets - 1;
+
+    // Counting sort of the photons by bucket.
+    std::vector<uint32_t> keys(photons.size());
+    m_cell_start.assign(buckets + 1, 0);
+    for (int a = 0; a < 3; a++)
+    {
+        m_low[a] = INF;
+        m_high[a] = -INF;
+    }
+    for (size_t i = 0; i < photons.size(); i++)
+    {
+        const float* p = photons[i].m_position;
+        for (int a = 0; a < 3; a++)
+        {
+            m_low[a] = std::min(m_low[a], p[a] - radius);
+            m_high[a] = std::max(m_high[a], p[a] + radius);
+        }
+        keys[i] = bucket(static_cast<int64_t>(floor(p[0] / m_cell_size)), static_cast<int64_t>(floor(p[1] / m_cell_size)),
+                         static_cast<int64_t>(floor(p[2] / m_cell_size)));
+        m_cell_start[keys[i] + 1]++;
+    }
+    for (uint32_t b = 0; b < buckets; b++)
+        m_cell_start[b + 1] += m_cell_start[b];
+
+    std::vector<uint32_t> next(m_cell_start.begin(), m_cell_start.end() - 1);
+    m_photons.resize(photons.size());
+    for (size_t i = 0; i < photons.size(); i++)
+        m_photons[next[keys[i]]++] = photons[i];
+}
+
+inline uint32_t photon_map::bucket(int64_t x, int64_t y, int64_t z) const
+{
+    const uint64_t h = static_cast<uint64_t>(x) * 73856093u ^ static_cast<uint64_t>(y) * 19349663u ^ static_cast<uint64_t>(z) * 83492791u;
+    return static_cast<uint32_t>(mix_seed(h)) & m_mask;
+}
+
+inline color photon_map::irradiance(const point3& p, const vec3& n) const
+{
+    if (m_photons.empty())
+        return color(0, 0, 0);
+    for (int a = 0; a < 3; a++)
+        if (p[a] < m_low[a] || p[a] > m_high[a])
+            return color(0, 0, 0);
+
+    // A sphere of the gather radius spans at most two cells along each axis. Buckets are visited once even
+    // when two cells hash to the same one.
+    int64_t low[3];
+    for (int a = 0; a < 3; a++)
+        low[a] = static_cast<int64_t>(floor((p[a] - m_radius) / m_cell_size));
+
+    // Photons are compared in single precision, as they are stored.
+    const float px = static_cast<float>(p.x()), py = static_cast<float>(p.y()), pz = static_cast<float>(p.z());
+    const float nx = static_cast<float>(n.x()), ny = static_cast<float>(n.y()), nz = static_cast<float>(n.z());
+    const float radius_squared = static_cast<float>(m_radius * m_radius);
+
+    uint32_t visited[8];
+    int visited_count = 0;
+    float sum[3] = { 0, 0, 0 };
+    for (int c = 0; c < 8; c++)
+    {
+        const uint32_t b = bucket(low[0] + (c & 1), low[1] + ((c >> 1) & 1), low[2] + (c >> 2));
+        if (std::find(visited, visited + visited_count, b) != visited + visited_count)
+            continue;
+        visited[visited_count++] = b;
+
+        for (uint32_t i = m_cell_start[b]; i < m_cell_start[b + 1]; i++)
+        {
+            const photon& ph = m_photons[i];
+            const float dx = ph.m_position[0] - px;
+            const float dy = ph.m_position[1] - py;
+            const float dz = ph.m_position[2] - pz;
+            if (dx * dx + dy * dy + dz * dz > radius_squared || ph.m_dir[0] * nx + ph.m_dir[1] * ny + ph.m_dir[2] * nz >= 0)
+                continue;
+            sum[0] += ph.m_power[0];
+            sum[1] += ph.m_power[1];
+            sum[2] += ph.m_power[2];
+        }
+    }
+    return color(sum[0], sum[1], sum[2]) / (PI * m_radius * m_radius);
+}
+
+inline caustic_photons::caustic_photons(const hittable& world, const color& background, const environment_map* env, double time,
+                                        int photons_per_pass, double radius, uint64_t seed)
+    : m_world(world)
+    , m_background(background)
+    , m_env(env)
+    , m_time(time)
+    , m_photons_per_pass(photons_per_pass)
+    , m_radius(radius)
+    , m_seed(seed)
+{
+    std::vector<const hittable*> primitives;
+    world.collect_primitives(primitives);
+
+    double largest = 0.0;
+    for (const hittable* primitive : primitives)
+    {
+        if (m_target_set.count(primitive) || m_emitter_set.count(primitive))
+            continue;
+
+        light_bounds bounds;
+        if (emitter_bounds(*primitive, bounds))
+        {
+            m_emitters.push_back(primitive);
+            m_emitter_cdf.push_back((m_emitter_cdf.empty() ? 0.0 : m_emitter_cdf.back()) + bounds.m_power);
+            m_emitter_set.insert(primitive);
+            continue;
+        }
+
+        const std::shared_ptr<material>& mat = light_material(*primitive);
+        aabb box;
+        if (!mat || (mat->kind() != material_kind::dielectric && mat->kind() != material_kind::metal)
+            || !primitive->bounding_box(time, time, box))
+            continue;
+
+        const double r = 0.5 * (box.max() - box.min()).length();
+        m_targets.push_back({ 0.5 * (box.min() + box.max()), r, primitive });
+        m_target_cdf.push_back((m_target_cdf.empty() ? 0.0 : m_target_cdf.back()) + r * r);
+        m_target_set.insert(primitive);
+        largest = std::max(largest, r);
+    }
+
+    if (m_radius <= 0)
+        m_radius = 0.1 * largest;
+
+    aabb world_box;
+    if (world.bounding_box(time, time, world_box))
+    {
+        m_world_center = 0.5 * (world_box.min() + world_box.max());
+        m_world_radius = 0.5 * (world_box.max() - world_box.min()).length();
+    }
+    m_background_light = m_world_radius > 0 && (env || luminance(background) > 0);
+    m_background_share = !m_background_light ? 0.0 : (m_emitters.empty() ? 1.0 : 0.5);
+}
+
+inline double caustic_photons::radius(int pass) const
+{
+    // r_{i+1}^2 = r_i^2 (i + alpha) / (i + 1)
+    double radius_squared = m_radius * m_radius;
+    for (int i = 0; i < pass; i++)
+        radius_squared *= (i + RADIUS_ALPHA) / (i + 1);
+    return sqrt(radius_squared);
+}
+
+inline size_t caustic_photons::pick_target(double u) const
+{
+    const auto found = std::upper_bound(m_target_cdf.begin(), m_target_cdf.end(), u * m_target_cdf.back());
+    return std::min(static_cast<size_t>(found - m_target_cdf.begin()), m_targets.size() - 1);
+}
+
+inline double caustic_photons::background_pdf(const point3& origin, const vec3& dir) const
+{
+    const double direction_pdf = m_env ? m_env->pdf(-dir) : 1 / (4 * PI);
+    double area_pdf = 0.0;
+    for (size_t i = 0; i < m_targets.size(); i++)
+    {
+        const target& t = m_targets[i];
+        const vec3 to_center = t.m_center - origin;
+        const vec3 across = to_center - dot(to_center, dir) * dir;
+        if (across.length_squared() <= t.m_radius * t.m_radius)
+        {
+            const double weight = (m_target_cdf[i] - (i ? m_target_cdf[i - 1] : 0.0)) / m_target_cdf.back();
+            area_pdf += weight / (PI * t.m_radius * t.m_radius);
+        }
+    }
+    return direction_pdf * area_pdf;
+}
+
+inline double caustic_photons::emitter_direction_pdf(const point3& y, const vec3& dir) const
+{
+    double pdf = 0.0;
+    for (size_t i = 0; i < m_targets.size(); i++)
+    {
+        const target& t = m_targets[i];
+        const double weight = (m_target_cdf[i] - (i ? m_target_cdf[i - 1] : 0.0)) / m_target_cdf.back();
+        const vec3 to_center = t.m_center - y;
+        const double distance_squared = to_center.length_squared();
+        const double one_minus_cos = sphere_cone_one_minus_cos(t.m_radius * t.m_radius, distance_squared);
+        if (one_minus_cos >= 2 || dot(dir, to_center) >= (1 - one_minus_cos) * sqrt(distance_squared))
+            pdf += weight / (2 * PI * one_minus_cos);
+    }
+    return pdf;
+}
+
+inline void caustic_photons::trace_photon(std::vector<photon>& photons) const
+{
+    ray r;
+    color power;
+    const double n = static_cast<double>(m_photons_per_pass);
+
+    if (random_double() < m_background_share)
+    {
+        // From the background, across a disk around a target, starting outside the scene.
+        const target& t = m_targets[pick_target(random_double())];
+        vec3 dir;
+        if (m_env)
+        {
+            vec3 to_light;
+            if (m_env->sample(random_double(), random_double(), to_light) <= 0)
+                return;
+            dir = -to_light;
+        }
+        else
+            dir = random_unit_vector();
+
+        const vec3 a = fabs(dir.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        const vec3 u = unit_vector(cross(dir, a));
+        const vec3 v = cross(dir, u);
+        const vec3 disk = t.m_radius * random_in_unit_disk();
+        const point3 origin = t.m_center + disk.x() * u + disk.y() * v - 3 * m_world_radius * dir;
+
+        const double pdf = m_background_share * background_pdf(origin, dir);
+        if (pdf <= 0)
+            return;
+        r = ray(origin, dir, m_time);
+        power = (m_env ? m_env->radiance(-dir) : m_background) / (n * pdf);
+    }
+    else
+    {
+        // From a point of an emitter picked by power, towards the bounding cone of a target.
+        const auto found = std::upper_bound(m_emitter_cdf.begin(), m_emitter_cdf.end(), random_double() * m_emitter_cdf.back());
+        const size_t index = std::min(static_cast<size_t>(found - m_emitter_cdf.begin()), m_emitters.size() - 1);
+        const hittable& light = *m_emitters[index];
+        const double emitter_pmf = (m_emitter_cdf[index] - (index ? m_emitter_cdf[index - 1] : 0.0)) / m_emitter_cdf.back();
+
+        vec3 normal;
+        double area;
+        const double point_u1 = random_double();
+        const double point_u2 = random_double();
+        const point3 y = sample_light_point(light, point_u1, point_u2, normal, area);
+
+        const target& t = m_targets[pick_target(random_double())];
+        const vec3 to_center = t.m_center - y;
+        const double distance_squared = to_center.length_squared();
+        const vec3 w = distance_squared > 0 ? to_center / sqrt(distance_squared) : vec3(0, 0, 1);
+        const double dir_u1 = random_double();
+        const double dir_u2 = random_double();
+        const vec3 dir = sample_cone(w, sphere_cone_one_minus_cos(t.m_radius * t.m_radius, distance_squared), dir_u1, dir_u2);
+
+        // Spheres only shine outwards; rectangles shine from both faces.
+        double cosine = dot(normal, dir);
+        if (light.kind() == hittable_kind::sphere ? cosine <= 0 : cosine == 0)
+            return;
+        const vec3 side = cosine > 0 ? normal : -normal;
+        cosine = fabs(cosine);
+
+        // Emission, texture included, from a hit on the emitter just above y.
+        hit_record light_rec;
+        if (!light.hit(ray(y + 1e-3 * side, -side, m_time), 0.0, INF, light_rec))
+            return;
+        const color emitted = emitted_material(*light_rec.m_mat_ptr, light_rec.m_u, light_rec.m_v, y);
+
+        const double pdf = (1 - m_background_share) * emitter_pmf / area * emitter_direction_pdf(y, dir);
+        if (pdf <= 0)
+            return;
+        r = ray(y, dir, m_time);
+        power = emitted * cosine / (n * pdf);
+    }
+
+    for (int bounce = 0; bounce < MAX_BOUNCES; bounce++)
+    {
+        hit_record hit_rec;
+        if (!m_world.hit(r, 0.001, INF, hit_rec) || (bounce == 0 && !is_target(hit_rec.m_object)))
+            return;
+
+        const material& mat = *hit_rec.m_mat_ptr;
+        const material_kind kind = mat.kind();
+        if (kind == material_kind::dielectric || kind == material_kind::metal)
+        {
+            color attenuation;
+            ray scattered;
+            if (!scatter_material(mat, r, hit_rec, attenuation, scattered))
+                return;
+            power = power * attenuation;
+            r = scattered;
+            continue;
+        }
+
+        if (kind == material_kind::lambertian && bounce > 0)
+        {
+            const vec3 dir = unit_vector(r.dir());
+            photon ph;
+            for (int a = 0; a < 3; a++)
+            {
+                ph.m_position[a] = static_cast<float>(hit_rec.m_point[a]);
+                ph.m_dir[a] = static_cast<float>(dir[a]);
+                ph.m_power[a] = static_cast<float>(power[a]);
+            }
+            photons.push_back(ph);
+        }
+        return;
+    }
+}
+
+inline std::shared_ptr<const photon_map> caustic_photons::pass(int pass) const
+{
+    std::shared_ptr<pass_slot> slot;
+    {
+        std::lock_guard<std::mutex> lock(m_maps_mutex);
+        std::shared_ptr<pass_slot>& found = m_maps[pass];
+        if (!found)
+            found = std::make_shared<pass_slot>();
+        slot = found;
+    }
+
+    std::call_once(slot->m_traced, [&]() { slot->m_map = trace_pass(pass); });
+
+    std::lock_guard<std::mutex> lock(m_maps_mutex);
+    slot->m_ready = true;
+    m_newest_pass = std::max(m_newest_pass, pass);
+    for (auto it = m_maps.begin(); it != m_maps.end() && it->first <= m_newest_pass - KEPT_PASSES;)
+        it = it->second->m_ready ? m_maps.erase(it) : std::next(it);
+    return slot->m_map;
+}
+
+inline std::shared_ptr<const photon_map> caustic_photons::trace_pass(int pass) const
+{
+    // Chunks of photons are traced on all cores, each from its own seed, and joined in chunk order, so the
+    // map does not depend on the number of threads.
+    const int chunks = (m_photons_per_pass + CHUNK_PHOTONS - 1) / CHUNK_PHOTONS;
+    std::vector<std::vector<photon>> chunk_photons(chunks);
+    std::atomic<int> next_chunk { 0 };
+    const uint64_t pass_seed = mix_seed(m_seed ^ mix_seed(0x70686f746f6e0000ULL | static_cast<uint32_t>(pass)));
+
+    const auto worker = [&]()
+    {
+        for (int c = next_chunk++; c < chunks; c = next_chunk++)
+        {
+            seed_random(mix_seed(pass_seed ^ static_cast<uint64_t>(c)));
+            const int count = std::min(CHUNK_PHOTONS, m_photons_per_pass - c * CHUNK_PHOTONS);
+            for (int i = 0; i < count; i++)
+                trace_photon(chunk_photons[c]);
+        }
+    };
+
+    const int thread_count = std::max(1, std::min(static_cast<int>(std::thread::hardware_concurrency()), chunks));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; i++)
+        threads.emplace_back(worker);
+    for (std::thread& thread : threads)
+        thread.join();
+
+    std::vector<photon> photons;
+    for (const std::vector<photon>& chunk : chunk_photons)
+        photons.insert(photons.end(), chunk.begin(), chunk.end());
+
+    return std::make_shared<photon_map>(std::move(photons), radius(pass), *this);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "aarect.h"
+#include "box.h"
+#include "hittable.h"
+#include "moving_sphere.h"
+#include "sphere.h"
+
+// hit() for the closed set of built-in primitives, dispatched on hittable::kind() instead of the vtable.
+// The qualified calls are direct, so the compiler can inline the intersection into the traversal loop.
+// Everything else, including the BVH nodes (handled by their own traversal), goes through the virtual call.
+inline bool hit_primitive(const hittable& object, const ray& r_in, double t_min, double t_max, hit_record& hit_rec)
+{
+    switch (object.kind())
+    {
+        case hittable_kind::sphere:
+            return static_cast<const sphere&>(object).sphere::hit(r_in, t_min, t_max, hit_rec);
+        case hittable_kind::moving_sphere:
+            return static_cast<const moving_sphere&>(object).moving_sphere::hit(r_in, t_min, t_max, hit_rec);
+        case hittable_kind::xy_rect:
+            return static_cast<const xy_rect&>(object).xy_rect::hit(r_in, t_min, t_max, hit_rec);
+        case hittable_kind::xz_rect:
+            return static_cast<const xz_rect&>(object).xz_rect::hit(r_in, t_min, t_max, hit_rec);
+        case hittable_kind::yz_rect:
+            return static_cast<const yz_rect&>(object).yz_rect::hit(r_in, t_min, t_max, hit_rec);
+        case hittable_kind::box:
+            return static_cast<const box&>(object).box::hit(r_in, t_min, t_max, hit_rec);
+        default:
+            return object.hit(r_in, t_min, t_max, hit_rec);
+    }
+}
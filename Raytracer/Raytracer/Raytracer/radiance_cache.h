@@ -0,0 +1,182 @@
+#pragma once
+#include "constants.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Radiance leaving lambertian surfaces and isotropic media, the same in every direction, averaged over the cells
+// of a hashed grid. Cells are cubes of a fixed size, split further by the axis and side the surface normal faces
+// most, so the two sides of a wall or the faces meeting at a corner do not share a cell; points in a medium, with
+// a zero normal, have a part of their own. The table uses open addressing with linear probing.
+class radiance_cache
+{
+public:
+    static constexpr uint32_t MIN_SAMPLES = 4;  // samples a cell needs before lookups use it
+
+    explicit radiance_cache(double cell_size);
+
+    // Mean radiance recorded in the cell of p on a surface facing n, if it has enough samples.
+    bool lookup(const point3& p, const vec3& n, color& radiance) const;
+
+    void add(const point3& p, const vec3& n, const color& radiance);
+
+    double cell_size() const { return m_cell_size; }
+    size_t size() const { return m_size; }
+    size_t memory_bytes() const { return m_entries.size() * sizeof(entry); }
+
+private:
+    struct entry
+    {
+        uint64_t m_key;  // 0 for an empty slot
+        float m_sum[3];
+        uint32_t m_count;
+    };
+
+    uint64_t key(const point3& p, const vec3& n) const;
+    size_t slot(uint64_t key) const;
+    void grow();
+
+private:
+    double m_cell_size;
+    std::vector<entry> m_entries;
+    size_t m_size = 0;
+};
+
+// The radiance caches of the render passes of a scene, together with how they are filled and used: paths end
+// in the cache at their diffuse hit after `bounces` of them. Each pass's cache starts as a copy of the one
+// before and adds fill_paths new paths (see radiance_cache_pass in render.h).
+class radiance_cache_passes
+{
+public:
+    static constexpr int KEPT_PASSES = 2;  // newest filled passes kept for renders that ask for them again
+
+    radiance_cache_passes(double cell_size, int bounces, int fill_paths)
+        : m_cell_size(cell_size), m_bounces(bounces), m_fill_paths(fill_paths) {}
+
+    double cell_size() const { return m_cell_size; }
+    int bounces() const { return m_bounces; }
+    int fill_paths() const { return m_fill_paths; }
+
+    // Cache of a pass. On first use it is filled by fill(pass, previous), with previous the cache of the pass
+    // before, fetched the same way, or nullptr for pass 0. Each pass is filled once however many renders ask for
+    // it at the same time, and only while it is being filled do they wait for each other. Passes older than the
+    // newest KEPT_PASSES live on only while some render still holds them; asked for again, they are filled anew,
+    // which gives the same cache.
+    template <typename Fill>
+    std::shared_ptr<const radiance_cache> pass(int pass, Fill&& fill);
+
+private:
+    struct pass_slot
+    {
+        std::once_flag m_filled;
+        std::shared_ptr<const radiance_cache> m_cache;
+        bool m_ready = false;  // m_cache is set; guarded by m_mutex
+    };
+
+private:
+    double m_cell_size;
+    int m_bounces;
+    int m_fill_paths;
+    std::map<int, std::shared_ptr<pass_slot>> m_slots;
+    int m_newest = -1;
+    std::mutex m_mutex;
+};
+
+inline radiance_cache::radiance_cache(double cell_size)
+    : m_cell_size(cell_size)
+    , m_entries(1024, entry { 0, { 0, 0, 0 }, 0 })
+{
+}
+
+inline uint64_t radiance_cache::key(const point3& p, const vec3& n) const
+{
+    // 20 bits per axis around the origin, then 3 bits for the face.
+    uint64_t k = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        const int64_t cell = static_cast<int64_t>(floor(p[a] / m_cell_size)) + (int64_t(1) << 19);
+        k = (k << 20) | (static_cast<uint64_t>(cell) & 0xfffff);
+    }
+
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (fabs(n[a]) > fabs(n[axis]))
+            axis = a;
+    const uint64_t face = n[axis] == 0 ? 6 : 2 * axis + (n[axis] < 0 ? 1 : 0);
+    return ((k << 3) | face) + 1;
+}
+
+inline size_t radiance_cache::slot(uint64_t key) const
+{
+    const size_t mask = m_entries.size() - 1;
+    size_t i = static_cast<size_t>(mix_seed(key)) & mask;
+    while (m_entries[i].m_key != 0 && m_entries[i].m_key != key)
+        i = (i + 1) & mask;
+    return i;
+}
+
+inline bool radiance_cache::lookup(const point3& p, const vec3& n, color& radiance) const
+{
+    const entry& e = m_entries[slot(key(p, n))];
+    if (e.m_count < MIN_SAMPLES)
+        return false;
+    radiance = color(e.m_sum[0], e.m_sum[1], e.m_sum[2]) / e.m_count;
+    return true;
+}
+
+inline void radiance_cache::add(const point3& p, const vec3& n, const color& radiance)
+{
+    if (2 * (m_size + 1) > m_entries.size())
+        grow();
+
+    const uint64_t k = key(p, n);
+    entry& e = m_entries[slot(k)];
+    if (e.m_key == 0)
+    {
+        e.m_key = k;
+        m_size++;
+    }
+    for (int a = 0; a < 3; a++)
+        e.m_sum[a] += static_cast<float>(radiance[a]);
+    e.m_count++;
+}
+
+inline void radiance_cache::grow()
+{
+    std::vector<entry> old(2 * m_entries.size(), entry { 0, { 0, 0, 0 }, 0 });
+    old.swap(m_entries);
+    for (const entry& e : old)
+        if (e.m_key != 0)
+            m_entries[slot(e.m_key)] = e;
+}
+
+template <typename Fill>
+std::shared_ptr<const radiance_cache> radiance_cache_passes::pass(int pass, Fill&& fill)
+{
+    std::shared_ptr<pass_slot> slot;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::shared_ptr<pass_slot>& found = m_slots[pass];
+        if (!found)
+            found = std::make_shared<pass_slot>();
+        slot = found;
+    }
+
+    std::call_once(slot->m_filled, [&]()
+    {
+        const std::shared_ptr<const radiance_cache> previous = pass > 0 ? this->pass(pass - 1, fill) : nullptr;
+        slot->m_cache = fill(pass, previous.get());
+    });
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    slot->m_ready = true;
+    m_newest = std::max(m_newest, pass);
+    for (auto it = m_slots.begin(); it != m_slots.end() && it->first <= m_newest - KEPT_PASSES;)
+        it = it->second->m_ready ? m_slots.erase(it) : std::next(it);
+    return slot->m_cache;
+}
@@ -17,8 +17,19 @@ public:
     point3 at(double t) const { return m_origin + t * m_dir; }
     double time() const { return m_tm; }
 
+    // Ray cone for texture filtering: width at the origin and growth per unit of travelled distance.
+    void set_cone(double width, double spread)
+    {
+        m_cone_width = width;
+        m_cone_spread = spread;
+    }
+    double cone_spread() const { return m_cone_spread; }
+    double cone_width_at(double t) const { return m_cone_width + t * m_dir.length() * m_cone_spread; }
+
 private:
     point3 m_origin;
     vec3 m_dir;
     double m_tm;
+    double m_cone_width = 0.0;
+    double m_cone_spread = 0.0;
 };
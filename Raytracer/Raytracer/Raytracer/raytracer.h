@@ -0,0 +1,29 @@
+#pragma once
+#include "render.h"
+#include "render_server.h"
+#include "scenes.h"
+
+// The renderer as a header-only library (CMake target raytracer_lib). Every header may be included from any number
+// of translation units. A render needs a scene, settings and a framebuffer owned by the caller:
+//
+//     render_settings settings;
+//     settings.m_scene = 2;
+//     scene_description scene;
+//     if (!load_render_scene(settings, scene))
+//         return false;
+//     resolve_image_settings(scene, 400, 64, settings);  // width and samples per pixel, 0 for the scene's
+//
+//     std::atomic<bool> cancel { false };
+//     render_control control;
+//     control.m_cancel = &cancel;
+//     control.m_tile_done = [](const image_tile& tile, int tiles_done, int tile_count) { ... };
+//
+//     framebuffer fb(settings.m_image_width, settings.m_image_height);
+//     const bool finished = render_local(scene, settings, fb, control);
+//
+// Renders are reentrant: each one keeps its random state and statistics in its own thread, so any number can run
+// at once on different threads, of different scenes or of the same one. Per-pass photon maps and radiance caches
+// of a shared scene are built once, by whichever render needs them first. A scene must not be changed (for
+// example refitted for another frame) while it is being rendered.
+//
+// submit_render (render_server.h) has a resident render server render the image instead.
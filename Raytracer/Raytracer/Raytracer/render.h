@@ -0,0 +1,645 @@
+#pragma once
+#include "accel.h"
+#include "camera.h"
+#include "color.h"
+#include "constants.h"
+#include "integrator.h"
+#include "paged_spheres.h"
+#include "path_batch.h"
+#include "scenes.h"
+#include "stats.h"
+
+#include <atomic>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Camera placement replacing the scene's own for the rendered image. Parts left unset keep the scene's values.
+struct view_override
+{
+    bool m_has_lookfrom = false;
+    bool m_has_lookat = false;
+    point3 m_lookfrom;
+    point3 m_lookat;
+    double m_vfov = 0.0;  // vertical field of view in degrees, 0 for the scene's
+};
+
+struct render_settings
+{
+    int m_scene = 0;
+    int m_image_width = 800;
+    int m_image_height = 800;
+    int m_samples_per_pixel = 50;
+    int m_max_depth = 50;
+    int m_tile_size = 32;
+    int m_passes = 1;
+    uint64_t m_seed = 0;
+    accel_kind m_accel = accel_kind::bvh;
+    double m_split_budget = 0.0;  // extra references allowed for spatial splits in flat and compressed BVHs
+    bvh_layout m_layout = bvh_layout::depth_first;
+    trace_order m_trace = trace_order::recursive;
+    std::string m_environment;  // HDR environment map replacing the scene's background, if not empty
+    std::string m_density_grid;  // raw float32 grid replacing the smoke of scene 3, if not empty
+    int m_grid_size[3] = { 0, 0, 0 };  // voxels of m_density_grid along x, y and z
+    light_sampling m_lights = light_sampling::none;
+    int m_guiding = 0;  // training passes for path guiding, 0 for none
+    int m_photons = 0;  // caustic photons emitted per pass, 0 for none
+    double m_photon_radius = 0.0;  // gather radius of the first pass, 0 to pick one from the scene
+    int m_radiance_cache = 0;  // diffuse hits before paths end in a radiance cache, 0 for no cache
+    double m_cache_cell = 0.0;  // radiance cache cell size, 0 to pick one from the scene
+    int m_cache_paths = 1 << 16;  // paths that fill the radiance cache in every pass
+    bool m_page_geometry = false;  // keep static spheres out of memory, paged in through the geometry_cache
+    view_override m_view;  // camera of the image, where it differs from the scene's
+};
+
+// Whether a scene loaded with settings a renders settings b exactly as one loaded with b would. This covers
+// everything load_render_scene builds, including the layout profile and guiding training, which trace paths with
+// the settings' depth and tiles. The radiance cache is filled later with the render's image height as well.
+inline bool same_scene_build(const render_settings& a, const render_settings& b)
+{
+    return a.m_scene == b.m_scene && a.m_seed == b.m_seed && a.m_max_depth == b.m_max_depth
+        && a.m_tile_size == b.m_tile_size && a.m_accel == b.m_accel && a.m_split_budget == b.m_split_budget
+        && a.m_layout == b.m_layout && a.m_environment == b.m_environment && a.m_lights == b.m_lights
+        && a.m_density_grid == b.m_density_grid && a.m_grid_size[0] == b.m_grid_size[0]
+        && a.m_grid_size[1] == b.m_grid_size[1] && a.m_grid_size[2] == b.m_grid_size[2]
+        && a.m_guiding == b.m_guiding && a.m_photons == b.m_photons && a.m_photon_radius == b.m_photon_radius
+        && a.m_radiance_cache == b.m_radiance_cache && a.m_cache_paths == b.m_cache_paths
+        && a.m_cache_cell == b.m_cache_cell && a.m_page_geometry == b.m_page_geometry
+        && (a.m_radiance_cache == 0 || a.m_image_height == b.m_image_height);
+}
+
+// Pixel rectangle [m_x0, m_x1) x [m_y0, m_y1). Rows are counted from the bottom, as in the render loop.
+struct image_tile
+{
+    int width() const { return m_x1 - m_x0; }
+    int height() const { return m_y1 - m_y0; }
+    int pixel_count() const { return width() * height(); }
+
+    int m_x0, m_y0, m_x1, m_y1;
+};
+
+inline std::vector<image_tile> make_tiles(int width, int height, int tile_size)
+{
+    std::vector<image_tile> tiles;
+    for (int y = height; y > 0; y -= tile_size)
+        for (int x = 0; x < width; x += tile_size)
+            tiles.push_back({ x, std::max(y - tile_size, 0), std::min(x + tile_size, width), y });
+    return tiles;
+}
+
+// Samples per pixel rendered in the given pass; the total is split as evenly as possible.
+inline int pass_samples(const render_settings& settings, int pass)
+{
+    const int base = settings.m_samples_per_pixel / settings.m_passes;
+    return base + (pass < settings.m_samples_per_pixel % settings.m_passes ? 1 : 0);
+}
+
+// Every (tile, pass) job draws from its own stream, so the result does not depend on
+// which thread or process renders it, or in what order.
+inline uint64_t tile_seed(uint64_t seed, int tile_index, int pass)
+{
+    return mix_seed(seed ^ mix_seed((static_cast<uint64_t>(tile_index) << 32) | static_cast<uint32_t>(pass)));
+}
+
+// Width 0 and samples 0 stand for the scene's own image width and samples per pixel. The height follows the width
+// and the scene's aspect ratio, and there are never more passes than samples.
+inline void resolve_image_settings(const scene_description& scene, int width, int samples_per_pixel, render_settings& settings)
+{
+    settings.m_image_width = width > 0 ? width : scene.m_image_width;
+    settings.m_image_height = width > 0 ? static_cast<int>(width / scene.m_aspect_ratio) : scene.m_image_height;
+    settings.m_samples_per_pixel = samples_per_pixel > 0 ? samples_per_pixel : scene.m_samples_per_pixel;
+    settings.m_passes = std::min(settings.m_passes, settings.m_samples_per_pixel);
+}
+
+// The scene's own camera, which guiding is trained and the radiance cache filled from whatever the view.
+inline camera make_scene_camera(const scene_description& scene, const render_settings& settings)
+{
+    camera cam = scene.make_camera();
+    cam.set_image_height(settings.m_image_height);
+    return cam;
+}
+
+// The camera the image is rendered with: the scene's, moved by settings.m_view.
+inline camera make_render_camera(const scene_description& scene, const render_settings& settings)
+{
+    const view_override& view = settings.m_view;
+    if (!view.m_has_lookfrom && !view.m_has_lookat && view.m_vfov <= 0)
+        return make_scene_camera(scene, settings);
+
+    camera cam(view.m_has_lookfrom ? view.m_lookfrom : scene.m_lookfrom, view.m_has_lookat ? view.m_lookat : scene.m_lookat,
+               scene.m_vup, view.m_vfov > 0 ? view.m_vfov : scene.m_vfov, scene.m_aspect_ratio, scene.m_aperture,
+               scene.m_dist_to_focus, scene.m_time0, scene.m_time1);
+    cam.set_image_height(settings.m_image_height);
+    return cam;
+}
+
+// Fills the radiance cache of a render pass: a copy of the previous pass's cache plus the diffuse
+// hits of fill paths from the camera. Each fill path walks a few bounces into the scene and records, at every
+// hit the cache can hold (see cacheable_hit), the radiance ray_color brings back from it, ending in the previous pass's cache one bounce
+// after the hit. The first pass has no cache to end in, so its paths are traced in full and record only their
+// first hit; the cache converges over the passes. Paths are traced on all cores in chunks with seeds of their own and recorded in chunk order, so the
+// cache is the same in every process.
+inline std::shared_ptr<const radiance_cache> fill_radiance_cache(const scene_description& scene, const render_settings& settings,
+                                                                 int pass, const radiance_cache* previous)
+{
+    constexpr int FILL_CHUNK = 1024;
+    constexpr int FILL_HITS = 4;
+
+    auto cache = previous ? std::make_unique<radiance_cache>(*previous)
+                          : std::make_unique<radiance_cache>(scene.m_radiance->cell_size());
+
+    scene_lights lights = scene.lights();
+    lights.m_radiance = previous;
+    lights.m_radiance_bounces = 1;
+
+    struct sample
+    {
+        point3 m_point;
+        vec3 m_normal;
+        color m_radiance;
+    };
+
+    const camera cam = make_scene_camera(scene, settings);
+    const int paths = scene.m_radiance->fill_paths();
+    const int fill_hits = previous ? FILL_HITS : 1;
+    const int chunks = (paths + FILL_CHUNK - 1) / FILL_CHUNK;
+    std::vector<std::vector<sample>> chunk_samples(chunks);
+    std::atomic<int> next_chunk { 0 };
+    const uint64_t pass_seed = mix_seed(settings.m_seed ^ mix_seed(0x6361636865000000ULL | static_cast<uint32_t>(pass)));
+
+    const auto worker = [&]()
+    {
+        for (int c = next_chunk++; c < chunks; c = next_chunk++)
+        {
+            seed_random(mix_seed(pass_seed ^ static_cast<uint64_t>(c)));
+            const int count = std::min(FILL_CHUNK, paths - c * FILL_CHUNK);
+            for (int i = 0; i < count; i++)
+            {
+                ray r = cam.get_ray(random_double(), random_double());
+                for (int hit = 0; hit < fill_hits && hit < settings.m_max_depth; hit++)
+                {
+                    hit_record hit_rec;
+                    if (!scene.m_world.hit(r, 0.001, INF, hit_rec))
+                        break;
+
+                    vec3 normal;
+                    if (cacheable_hit(hit_rec, normal))
+                    {
+                        const color radiance = ray_color(r, scene.m_background, scene.m_world, settings.m_max_depth - hit,
+                                                         lights, scene.m_guide.get());
+                        if (std::isfinite(radiance.x()) && std::isfinite(radiance.y()) && std::isfinite(radiance.z()))
+                            chunk_samples[c].push_back({ hit_rec.m_point, normal, radiance });
+                    }
+
+                    ray scattered;
+                    color emitted, attenuation;
+                    if (!shade_hit(r, hit_rec, emitted, attenuation, scattered))
+                        break;
+                    r = scattered;
+                }
+            }
+        }
+    };
+
+    const int thread_count = std::max(1, std::min(static_cast<int>(std::thread::hardware_concurrency()), chunks));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; i++)
+        threads.emplace_back(worker);
+    for (std::thread& thread : threads)
+        thread.join();
+
+    for (const std::vector<sample>& samples : chunk_samples)
+        for (const sample& s : samples)
+            cache->add(s.m_point, s.m_normal, s.m_radiance);
+    return cache;
+}
+
+// Radiance cache of a render pass, filled on first use. Hold on to it while rendering the pass.
+inline std::shared_ptr<const radiance_cache> radiance_cache_pass(const scene_description& scene, const render_settings& settings, int pass)
+{
+    return scene.m_radiance->pass(pass, [&](int filled_pass, const radiance_cache* previous)
+    {
+        return fill_radiance_cache(scene, settings, filled_pass, previous);
+    });
+}
+
+// Renders one pass of a tile with trace_paths, in batches of whole pixels. Each batch draws its camera rays and
+// paths from a stream of its own and sums the samples of a pixel in order, so batched and sorted tracing
+// produce the same image.
+inline void render_tile_batched(const scene_description& scene, const camera& cam, const render_settings& settings,
+                                const scene_lights& lights, const image_tile& tile, int samples, uint64_t seed, std::vector<float>& out,
+                                stats_heatmap* node_heatmap, stats_heatmap* primitive_heatmap)
+{
+    constexpr int MAX_BATCH_PATHS = 1 << 16;
+    const int batch_pixels = std::max(MAX_BATCH_PATHS / std::max(samples, 1), 1);
+
+    aabb bounds;
+    if (!scene.m_world.bounding_box(scene.m_time0, scene.m_time1, bounds))
+        bounds = aabb(point3(0, 0, 0), point3(0, 0, 0));
+
+    std::vector<path_state> paths;
+    for (int first = 0; first < tile.pixel_count(); first += batch_pixels)
+    {
+        const int last = std::min(first + batch_pixels, tile.pixel_count());
+        const uint64_t batch_seed = mix_seed(seed ^ static_cast<uint64_t>(first));
+        seed_random(batch_seed);
+
+        paths.clear();
+        for (int p = first; p < last; p++)
+        {
+            const int i = tile.m_x0 + p % tile.width();
+            const int j = tile.m_y0 + p / tile.width();
+            for (int s = 0; s < samples; ++s)
+            {
+                auto u = (i + random_double()) / (settings.m_image_width - 1);
+                auto v = (j + random_double()) / (settings.m_image_height - 1);
+                paths.emplace_back(cam.get_ray(u, v));
+                RT_STAT(m_camera_rays);
+            }
+        }
+
+        trace_paths(paths, scene.m_world, scene.m_background, lights, scene.m_guide.get(), settings.m_max_depth, batch_seed, settings.m_trace, bounds);
+
+        size_t k = 0;
+        for (int p = first; p < last; p++)
+        {
+            color pixel_color(0, 0, 0);
+#ifdef RT_ENABLE_STATS
+            long long nodes = 0, primitives = 0;
+#endif
+            for (int s = 0; s < samples; ++s, ++k)
+            {
+                pixel_color += paths[k].m_radiance;
+#ifdef RT_ENABLE_STATS
+                nodes += paths[k].m_bvh_nodes_visited;
+                primitives += paths[k].m_primitive_tests;
+#endif
+            }
+
+            out[3 * p + 0] = static_cast<float>(pixel_color.x());
+            out[3 * p + 1] = static_cast<float>(pixel_color.y());
+            out[3 * p + 2] = static_cast<float>(pixel_color.z());
+
+#ifdef RT_ENABLE_STATS
+            const int i = tile.m_x0 + p % tile.width();
+            const int j = tile.m_y0 + p / tile.width();
+            if (node_heatmap)
+                node_heatmap->add(i, j, static_cast<double>(nodes) / settings.m_samples_per_pixel);
+            if (primitive_heatmap)
+                primitive_heatmap->add(i, j, static_cast<double>(primitives) / settings.m_samples_per_pixel);
+#endif
+        }
+    }
+}
+
+// Renders one pass of a tile. out receives the RGB radiance sums of the pass, row by row from the bottom.
+inline void render_tile(const scene_description& scene, const camera& cam, const render_settings& settings,
+                        const std::vector<image_tile>& tiles, int tile_index, int pass, std::vector<float>& out,
+                        stats_heatmap* node_heatmap = nullptr, stats_heatmap* primitive_heatmap = nullptr)
+{
+    const image_tile& tile = tiles[tile_index];
+    const int samples = pass_samples(settings, pass);
+
+    // The pass's photons and radiance cache are traced before the tile is seeded, on first use.
+    scene_lights lights = scene.lights();
+    std::shared_ptr<const photon_map> caustics;
+    if (scene.m_caustics)
+    {
+        caustics = scene.m_caustics->pass(pass);
+        lights.m_caustics = caustics.get();
+    }
+    std::shared_ptr<const radiance_cache> radiance;
+    if (scene.m_radiance)
+    {
+        radiance = radiance_cache_pass(scene, settings, pass);
+        lights.m_radiance = radiance.get();
+        lights.m_radiance_bounces = scene.m_radiance->bounces();
+    }
+
+    seed_random(tile_seed(settings.m_seed, tile_index, pass));
+    out.assign(static_cast<size_t>(tile.pixel_count()) * 3, 0.f);
+
+    if (settings.m_trace != trace_order::recursive)
+    {
+        render_tile_batched(scene, cam, settings, lights, tile, samples, tile_seed(settings.m_seed, tile_index, pass), out,
+                            node_heatmap, primitive_heatmap);
+        return;
+    }
+
+    size_t idx = 0;
+    for (int j = tile.m_y0; j < tile.m_y1; ++j)
+    {
+        for (int i = tile.m_x0; i < tile.m_x1; ++i)
+        {
+#ifdef RT_ENABLE_STATS
+            const render_counters before = render_stats::local();
+#endif
+            color pixel_color(0, 0, 0);
+            for (int s = 0; s < samples; ++s)
+            {
+                auto u = (i + random_double()) / (settings.m_image_width - 1);
+                auto v = (j + random_double()) / (settings.m_image_height - 1);
+                ray r = cam.get_ray(u, v);
+                RT_STAT(m_camera_rays);
+                pixel_color += ray_color(r, scene.m_background, scene.m_world, settings.m_max_depth, lights, scene.m_guide.get());
+            }
+
+            out[idx++] = static_cast<float>(pixel_color.x());
+            out[idx++] = static_cast<float>(pixel_color.y());
+            out[idx++] = static_cast<float>(pixel_color.z());
+
+#ifdef RT_ENABLE_STATS
+            const render_counters& after = render_stats::local();
+            if (node_heatmap)
+                node_heatmap->add(i, j, static_cast<double>(after.m_bvh_nodes_visited - before.m_bvh_nodes_visited) / settings.m_samples_per_pixel);
+            if (primitive_heatmap)
+                primitive_heatmap->add(i, j, static_cast<double>(after.m_primitive_tests - before.m_primitive_tests) / settings.m_samples_per_pixel);
+#endif
+        }
+    }
+}
+
+// Reorders the nodes of the scene's flat BVHs. A hot_first layout is guided by the node visits of a
+// small one-sample pre-render, which depends only on the scene and so is the same in every process.
+inline void layout_render_scene(const scene_description& scene, const render_settings& settings)
+{
+    const std::vector<flat_bvh*> flats = flat_bvhs(scene.m_world);
+
+    if (settings.m_layout == bvh_layout::hot_first)
+    {
+        constexpr int PROFILE_WIDTH = 160;
+
+        render_settings profile = settings;
+        profile.m_image_width = PROFILE_WIDTH;
+        profile.m_image_height = std::max(static_cast<int>(PROFILE_WIDTH / scene.m_aspect_ratio), 1);
+        profile.m_samples_per_pixel = 1;
+        profile.m_passes = 1;
+
+#ifdef RT_ENABLE_STATS
+        const render_counters counters = render_stats::local();
+#endif
+        for (flat_bvh* flat : flats)
+            flat->set_profiling(true);
+
+        const camera cam = make_scene_camera(scene, profile);
+        const std::vector<image_tile> tiles = make_tiles(profile.m_image_width, profile.m_image_height, profile.m_tile_size);
+        std::vector<float> sums;
+        for (size_t t = 0; t < tiles.size(); t++)
+            render_tile(scene, cam, profile, tiles, static_cast<int>(t), 0, sums);
+
+#ifdef RT_ENABLE_STATS
+        render_stats::local() = counters;
+#endif
+    }
+
+    for (flat_bvh* flat : flats)
+    {
+        flat->reorder(settings.m_layout);
+        flat->set_profiling(false);
+    }
+}
+
+// Learns a guiding_field for the scene over settings.m_guiding passes of a small pre-render, each with twice the
+// samples of the one before. Like a hot_first profile it depends only on the scene and the seed, so every process
+// learns the same one. The pre-render is traced path by path, which is how paths record what they find.
+inline void train_guiding(scene_description& scene, const render_settings& settings)
+{
+    constexpr int TRAINING_WIDTH = 128;
+
+    aabb bounds;
+    if (!scene.m_world.bounding_box(scene.m_time0, scene.m_time1, bounds))
+        return;
+
+    render_settings training = settings;
+    training.m_image_width = TRAINING_WIDTH;
+    training.m_image_height = std::max(static_cast<int>(TRAINING_WIDTH / scene.m_aspect_ratio), 1);
+    training.m_passes = 1;
+    training.m_trace = trace_order::recursive;
+
+#ifdef RT_ENABLE_STATS
+    const render_counters counters = render_stats::local();
+#endif
+    scene.m_guide = std::make_shared<guiding_field>(bounds);
+    scene.m_guide->set_recording(true);
+
+    const camera cam = make_scene_camera(scene, training);
+    const std::vector<image_tile> tiles = make_tiles(training.m_image_width, training.m_image_height, training.m_tile_size);
+    std::vector<float> sums;
+    for (int pass = 0; pass < settings.m_guiding; pass++)
+    {
+        training.m_samples_per_pixel = 1 << std::min(pass, 16);
+        training.m_seed = mix_seed(settings.m_seed + pass + 1);
+        for (size_t t = 0; t < tiles.size(); t++)
+            render_tile(scene, cam, training, tiles, static_cast<int>(t), 0, sums);
+        scene.m_guide->refine(pass);
+    }
+
+    scene.m_guide->set_recording(false);
+#ifdef RT_ENABLE_STATS
+    render_stats::local() = counters;
+#endif
+}
+
+// The scene is built from the render seed so that every process constructs an identical world.
+inline bool load_render_scene(const render_settings& settings, scene_description& scene)
+{
+    std::shared_ptr<density_grid> smoke;
+    if (!settings.m_density_grid.empty()
+        && !(smoke = density_grid::load_raw(settings.m_density_grid, settings.m_grid_size[0], settings.m_grid_size[1],
+                                            settings.m_grid_size[2])))
+        return false;
+
+    seed_random(settings.m_seed);
+    if (!load_scene(settings.m_scene, scene, smoke))
+    {
+        std::cerr << "Unknown scene " << settings.m_scene << ".\n";
+        return false;
+    }
+    if (!settings.m_environment.empty() && !(scene.m_environment = environment_map::load(settings.m_environment)))
+        return false;
+
+    // Spheres are paged out first; the acceleration structure then holds the paged_spheres as one object.
+    if (settings.m_page_geometry)
+        page_geometry(scene.m_world, scene.m_time0, scene.m_time1, settings.m_photons > 0);
+
+    // A compressed BVH is encoded from a flat one after its nodes have been laid out.
+    flat_bvh_settings accel_settings;
+    accel_settings.m_split_budget = settings.m_split_budget;
+    apply_accel(scene.m_world, settings.m_accel == accel_kind::bvh ? accel_kind::bvh : accel_kind::flat,
+                scene.m_time0, scene.m_time1, accel_settings);
+    if (settings.m_layout != bvh_layout::depth_first)
+        layout_render_scene(scene, settings);
+    if (settings.m_accel == accel_kind::compressed)
+        compress_accel(scene.m_world);
+    if (settings.m_lights != light_sampling::none)
+        scene.m_emitters = std::make_shared<light_bvh>(scene.m_world, settings.m_lights);
+    if (settings.m_photons > 0)
+    {
+        scene.m_caustics = std::make_shared<caustic_photons>(scene.m_world, scene.m_background, scene.m_environment.get(),
+                                                             scene.m_time0, settings.m_photons, settings.m_photon_radius,
+                                                             settings.m_seed);
+        if (scene.m_caustics->empty())
+        {
+            std::cerr << "Scene " << settings.m_scene << " has no caustics to trace photons for.\n";
+            scene.m_caustics.reset();
+        }
+    }
+    if (settings.m_guiding > 0)
+        train_guiding(scene, settings);
+    if (settings.m_radiance_cache > 0)
+    {
+        // By default a cell is 1/128 of the scene's diagonal.
+        double cell_size = settings.m_cache_cell;
+        aabb bounds;
+        if (cell_size <= 0)
+            cell_size = scene.m_world.bounding_box(scene.m_time0, scene.m_time1, bounds)
+                      ? std::max((bounds.max() - bounds.min()).length() / 128, 1e-6) : 1.0;
+        scene.m_radiance = std::make_shared<radiance_cache_passes>(cell_size, settings.m_radiance_cache, settings.m_cache_paths);
+    }
+    return true;
+}
+
+// Shutter of frame `frame` of an animation of `frames` frames covering the clip time [0, 1).
+// Scenes with motion blur keep the shutter open for the whole frame; still scenes sample its start.
+inline void frame_shutter(const scene_description& scene, int frame, int frames, double& time0, double& time1)
+{
+    time0 = static_cast<double>(frame) / frames;
+    time1 = scene.m_time1 > scene.m_time0 ? static_cast<double>(frame + 1) / frames : time0;
+}
+
+// Where finished tiles of an image go: a framebuffer in memory, or a streamed_image written to disk as it renders.
+class tile_sink
+{
+public:
+    virtual ~tile_sink() = default;
+
+    virtual int width() const = 0;
+    virtual int height() const = 0;
+
+    // Adds a finished tile with the radiance sums of every pass, in pass order. Each tile is added once.
+    virtual void add_passes(const image_tile& tile, const std::vector<std::vector<float>>& passes,
+                            const render_settings& settings) = 0;
+};
+
+// Accumulated radiance and sample counts for the whole image.
+class framebuffer : public tile_sink
+{
+public:
+    framebuffer(int width, int height)
+        : m_width(width)
+        , m_height(height)
+        , m_sums(static_cast<size_t>(width) * height)
+        , m_samples(static_cast<size_t>(width) * height, 0)
+    {}
+
+    int width() const override { return m_width; }
+    int height() const override { return m_height; }
+
+    void add_passes(const image_tile& tile, const std::vector<std::vector<float>>& passes,
+                    const render_settings& settings) override
+    {
+        for (size_t pass = 0; pass < passes.size(); pass++)
+            add_tile(tile, passes[pass].data(), pass_samples(settings, static_cast<int>(pass)));
+    }
+
+    // Passes of a pixel must always be added in the same order for the image to be bit-for-bit reproducible.
+    void add_tile(const image_tile& tile, const float* sums, int samples)
+    {
+        for (int j = tile.m_y0; j < tile.m_y1; ++j)
+            for (int i = tile.m_x0; i < tile.m_x1; ++i, sums += 3)
+            {
+                const size_t p = static_cast<size_t>(j) * m_width + i;
+                m_sums[p] += color(sums[0], sums[1], sums[2]);
+                m_samples[p] += samples;
+            }
+    }
+
+    void write_ppm(std::ostream& out) const
+    {
+        out << "P3" << std::endl << m_width << ' ' << m_height << std::endl << "255" << std::endl;
+        for (int j = m_height - 1; j >= 0; --j)
+            for (int i = 0; i < m_width; ++i)
+            {
+                const size_t p = static_cast<size_t>(j) * m_width + i;
+                write_color(out, m_sums[p], std::max(m_samples[p], 1));
+            }
+    }
+
+    // Mean radiance of pixel (i, j), counting rows from the bottom.
+    color pixel(int i, int j) const
+    {
+        const size_t p = static_cast<size_t>(j) * m_width + i;
+        return m_sums[p] / std::max(m_samples[p], 1);
+    }
+
+    // Writes the mean radiance as a portable float map in the host's byte order; its rows also run from the bottom.
+    void write_pfm(std::ostream& out) const
+    {
+        const uint16_t probe = 1;
+        const bool little_endian = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+        out << "PF\n" << m_width << ' ' << m_height << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+        std::vector<float> row(static_cast<size_t>(m_width) * 3);
+        for (int j = 0; j < m_height; ++j)
+        {
+            for (int i = 0; i < m_width; ++i)
+            {
+                const color c = pixel(i, j);
+                for (int a = 0; a < 3; a++)
+                    row[3 * i + a] = static_cast<float>(c[a]);
+            }
+            out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+        }
+    }
+
+private:
+    int m_width;
+    int m_height;
+    std::vector<color> m_sums;
+    std::vector<int> m_samples;
+};
+
+// Progress reporting and cancellation of a render_local call. The callback runs on the rendering thread after each
+// tile is added to the framebuffer; m_cancel may be set from any thread and is checked before every pass of a tile.
+struct render_control
+{
+    std::function<void(const image_tile& tile, int tiles_done, int tile_count)> m_tile_done;
+    const std::atomic<bool>* m_cancel = nullptr;
+    stats_heatmap* m_node_heatmap = nullptr;  // per-pixel traversal costs, with RT_ENABLE_STATS
+    stats_heatmap* m_primitive_heatmap = nullptr;
+};
+
+// Renders every tile on the calling thread, in the same job and merge order as the coordinator, so that local and
+// distributed renders produce identical images. Several renders may run at once on different threads, also of the
+// same scene; the output and control belong to one render. Returns false if the render was cancelled, leaving the
+// tiles finished so far in out, or if out does not have the settings' size.
+inline bool render_local(const scene_description& scene, const render_settings& settings, tile_sink& out,
+                         const render_control& control = {})
+{
+    if (out.width() != settings.m_image_width || out.height() != settings.m_image_height)
+    {
+        std::cerr << "The output image is " << out.width() << "x" << out.height() << ", not " << settings.m_image_width
+                  << "x" << settings.m_image_height << ".\n";
+        return false;
+    }
+
+    const camera cam = make_render_camera(scene, settings);
+    const std::vector<image_tile> tiles = make_tiles(settings.m_image_width, settings.m_image_height, settings.m_tile_size);
+    std::vector<std::vector<float>> passes(settings.m_passes);
+
+    for (size_t t = 0; t < tiles.size(); t++)
+    {
+        for (int pass = 0; pass < settings.m_passes; pass++)
+        {
+            if (control.m_cancel && control.m_cancel->load(std::memory_order_relaxed))
+                return false;
+            render_tile(scene, cam, settings, tiles, static_cast<int>(t), pass, passes[pass], control.m_node_heatmap,
+                        control.m_primitive_heatmap);
+        }
+        out.add_passes(tiles[t], passes, settings);
+        if (control.m_tile_done)
+            control.m_tile_done(tiles[t], static_cast<int>(t) + 1, static_cast<int>(tiles.size()));
+    }
+    return true;
+}
@@ -0,0 +1,510 @@
+#pragma once
+#include "distributed.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A long-running render process that keeps scenes resident between jobs.
+//
+// Clients connect to the server's endpoint (see distributed.h) and send render requests: the settings of a whole
+// image, with width and samples per pixel 0 for the scene's own, and a priority. The server renders one request at
+// a time, tile by tile, always continuing with the highest-priority request queued (the earliest of equal ones),
+// so a new request of a higher priority takes over at the next tile. Every pass of every tile is streamed back as
+// soon as it is done, in the same order as a local render adds them, so the client's image matches one rendered
+// with the same settings by `raytracer` itself. Closing the connection cancels the client's requests.
+//
+// Loaded scenes, with their acceleration structures, light BVH, photons, guiding and radiance caches, stay resident
+// for as long as requests keep using them (see same_scene_build). A request that only moves the camera or changes
+// the resolution or samples renders with a resident scene straight away.
+//
+// Requests are read without blocking into a buffer per client and only queued once complete, so a client that sends
+// part of a request and stalls holds up nobody else. Replies go the same way: they are queued in a buffer per client
+// and sent as the socket accepts them. Rendering for a client pauses while MAX_UNSENT_BYTES of its replies are
+// waiting, and a client that takes nothing for SEND_TIMEOUT_SECONDS while replies are waiting is dropped.
+
+#ifndef _WIN32
+
+struct render_request
+{
+    uint32_t m_request_id;  // echoed in the replies
+    int32_t m_priority;     // higher first
+    job_message m_job;      // the image; its job id, tile and pass are not used
+};
+
+struct render_started_message
+{
+    uint32_t m_request_id;
+    int32_t m_image_width;
+    int32_t m_image_height;
+    int32_t m_tile_count;
+    int32_t m_passes;        // tile messages per tile
+    int32_t m_scene_reused;  // 1 if a resident scene was used, 0 if it was loaded for this request
+    double m_load_seconds;
+};
+
+struct tile_header
+{
+    uint32_t m_request_id;
+    int32_t m_pass;
+    int32_t m_x0, m_y0, m_x1, m_y1;
+    int32_t m_samples;
+    uint32_t m_float_count;
+};
+
+struct render_done_message
+{
+    uint32_t m_request_id;
+    int32_t m_ok;  // 0 if the request could not be rendered
+};
+
+namespace render_server_detail
+{
+    constexpr size_t MAX_RESIDENT_SCENES = 4;  // the least recently used one is dropped to load another
+    constexpr int SEND_TIMEOUT_SECONDS = 10;
+    constexpr size_t MAX_UNSENT_BYTES = size_t(8) << 20;
+
+    struct client_connection
+    {
+        int m_fd;
+        std::vector<char> m_received;  // bytes of requests not yet complete
+        std::vector<char> m_unsent;    // replies not yet taken by the socket, from m_sent on
+        size_t m_sent = 0;
+        std::chrono::steady_clock::time_point m_last_sent;  // last time the socket took some of m_unsent
+
+        size_t unsent_bytes() const { return m_unsent.size() - m_sent; }
+
+        void queue(const void* data, size_t size)
+        {
+            if (unsent_bytes() == 0)
+            {
+                m_unsent.clear();
+                m_sent = 0;
+                m_last_sent = std::chrono::steady_clock::now();
+            }
+            const char* bytes = static_cast<const char*>(data);
+            m_unsent.insert(m_unsent.end(), bytes, bytes + size);
+        }
+
+        template <typename T>
+        void queue_message(message_type type, const T& body)
+        {
+            queue(&type, sizeof(type));
+            queue(&body, sizeof(body));
+        }
+
+        // Sends as much of m_unsent as the socket takes without blocking. Returns false if the connection failed.
+        bool flush()
+        {
+            while (m_sent < m_unsent.size())
+            {
+                const ssize_t n = send(m_fd, m_unsent.data() + m_sent, m_unsent.size() - m_sent, MSG_DONTWAIT);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                if (n <= 0)
+                    return false;
+                m_sent += static_cast<size_t>(n);
+                m_last_sent = std::chrono::steady_clock::now();
+            }
+
+            // Drop what has been sent once it outweighs what is left, so the buffer does not grow while a client
+            // keeps up.
+            if (m_sent > unsent_bytes())
+            {
+                m_unsent.erase(m_unsent.begin(), m_unsent.begin() + static_cast<std::ptrdiff_t>(m_sent));
+                m_sent = 0;
+            }
+            return true;
+        }
+    };
+
+    struct resident_scene
+    {
+        render_settings m_settings;
+        std::shared_ptr<const scene_description> m_scene;
+        uint64_t m_last_used;
+    };
+
+    struct queued_render
+    {
+        int m_client;
+        uint64_t m_order;
+        render_request m_request;
+
+        // Set once the render has started.
+        render_settings m_settings;
+        std::shared_ptr<const scene_description> m_scene;
+        std::vector<image_tile> m_tiles;
+        size_t m_next_tile = 0;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    template <typename T>
+    bool send_message(int fd, message_type type, const T& body)
+    {
+        return send_all(fd, &type, sizeof(type)) && send_all(fd, &body, sizeof(body));
+    }
+
+    // Request ids of this process. They start from the process id, so concurrent clients of one server rarely share
+    // them and its log tells their requests apart.
+    inline uint32_t next_request_id()
+    {
+        static std::atomic<uint32_t> next { static_cast<uint32_t>(getpid()) << 12 };
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+inline int run_server(const std::string& endpoint)
+{
+    using namespace render_server_detail;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    const int listen_fd = open_endpoint(endpoint, true);
+    if (listen_fd < 0)
+    {
+        std::cerr << "Server cannot listen on " << endpoint << ".\n";
+        return EXIT_FAILURE;
+    }
+    std::cerr << "Serving renders on " << endpoint << ".\n";
+
+    std::vector<resident_scene> resident;
+    std::vector<client_connection> clients;
+    std::vector<queued_render> queue;
+    uint64_t clock = 0;
+    std::vector<float> sums;
+
+    const auto find_client = [&](int fd)
+    {
+        return std::find_if(clients.begin(), clients.end(), [fd](const client_connection& c) { return c.m_fd == fd; });
+    };
+
+    const auto drop_client = [&](int fd)
+    {
+        for (size_t q = queue.size(); q-- > 0; )
+            if (queue[q].m_client == fd)
+                queue.erase(queue.begin() + q);
+        clients.erase(find_client(fd));
+        close(fd);
+    };
+
+    // Reads what the client has sent so far and queues the requests it completes. Returns false if the client has
+    // closed the connection or sent something other than a request.
+    const auto receive_requests = [&](client_connection& client)
+    {
+        char buffer[4096];
+        while (true)
+        {
+            const ssize_t n = recv(client.m_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n <= 0)
+                return false;
+            client.m_received.insert(client.m_received.end(), buffer, buffer + n);
+        }
+
+        constexpr size_t message_size = sizeof(message_type) + sizeof(render_request);
+        size_t used = 0;
+        for (; client.m_received.size() - used >= message_size; used += message_size)
+        {
+            message_type type;
+            memcpy(&type, &client.m_received[used], sizeof(type));
+            if (type != message_type::render_request)
+                return false;
+
+            queued_render job {};
+            memcpy(&job.m_request, &client.m_received[used + sizeof(type)], sizeof(job.m_request));
+            job.m_client = client.m_fd;
+            job.m_order = ++clock;
+            queue.push_back(std::move(job));
+        }
+        client.m_received.erase(client.m_received.begin(), client.m_received.begin() + used);
+        return true;
+    };
+
+    // Finds a resident scene built with the request's settings, or loads one. The image size is resolved on the way,
+    // since the radiance cache depends on it and the scene's defaults are only known once it is loaded.
+    const auto find_scene = [&](const render_request& request, render_settings& settings, bool& reused)
+        -> std::shared_ptr<const scene_description>
+    {
+        settings = job_settings(request.m_job);
+        const int width = settings.m_image_width;
+        const int samples_per_pixel = settings.m_samples_per_pixel;
+        settings.m_tile_size = std::max(settings.m_tile_size, 1);
+        settings.m_passes = std::max(settings.m_passes, 1);
+
+        for (resident_scene& r : resident)
+            if (r.m_settings.m_scene == settings.m_scene)
+            {
+                resolve_image_settings(*r.m_scene, width, samples_per_pixel, settings);
+                break;
+            }
+        for (resident_scene& r : resident)
+            if (same_scene_build(r.m_settings, settings))
+            {
+                r.m_last_used = ++clock;
+                reused = true;
+                return r.m_scene;
+            }
+
+        auto scene = std::make_shared<scene_description>();
+        if (!load_render_scene(settings, *scene))
+            return nullptr;
+        resolve_image_settings(*scene, width, samples_per_pixel, settings);
+        reused = false;
+
+        if (resident.size() >= MAX_RESIDENT_SCENES)
+            resident.erase(std::min_element(resident.begin(), resident.end(), [](const resident_scene& a, const resident_scene& b)
+            {
+                return a.m_last_used < b.m_last_used;
+            }));
+        resident.push_back({ settings, scene, ++clock });
+        return scene;
+    };
+
+    // Starts the render if needed, renders its next tile and queues the replies for client. Returns false if the client
+    // is gone.
+    const auto render_next_tile = [&](queued_render& job, client_connection& client, bool& finished)
+    {
+        finished = false;
+        if (!job.m_scene)
+        {
+            job.m_start = std::chrono::steady_clock::now();
+            bool reused = false;
+            job.m_scene = find_scene(job.m_request, job.m_settings, reused);
+            const render_settings& s = job.m_settings;
+            if (!job.m_scene || s.m_image_width <= 0 || s.m_image_height <= 0 || s.m_samples_per_pixel <= 0)
+            {
+                std::cerr << "Cannot render request " << job.m_request.m_request_id << " for scene " << s.m_scene << ".\n";
+                finished = true;
+                client.queue_message(message_type::render_done, render_done_message { job.m_request.m_request_id, 0 });
+                return client.flush();
+            }
+            job.m_tiles = make_tiles(s.m_image_width, s.m_image_height, s.m_tile_size);
+            const double load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job.m_start).count();
+            const render_started_message started { job.m_request.m_request_id, s.m_image_width, s.m_image_height,
+                                                   static_cast<int32_t>(job.m_tiles.size()), s.m_passes, reused ? 1 : 0,
+                                                   load_seconds };
+            client.queue_message(message_type::render_started, started);
+        }
+
+        const render_settings& settings = job.m_settings;
+        const camera cam = make_render_camera(*job.m_scene, settings);
+        const int t = static_cast<int>(job.m_next_tile++);
+        const image_tile& tile = job.m_tiles[t];
+        for (int pass = 0; pass < settings.m_passes; pass++)
+        {
+            render_tile(*job.m_scene, cam, settings, job.m_tiles, t, pass, sums);
+            const tile_header header { job.m_request.m_request_id, pass, tile.m_x0, tile.m_y0, tile.m_x1, tile.m_y1,
+                                       pass_samples(settings, pass), static_cast<uint32_t>(sums.size()) };
+            client.queue_message(message_type::tile, header);
+            client.queue(sums.data(), sums.size() * sizeof(float));
+        }
+
+        if (job.m_next_tile < job.m_tiles.size())
+            return client.flush();
+
+        finished = true;
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job.m_start).count();
+        std::cerr << "Request " << job.m_request.m_request_id << ": scene " << settings.m_scene << ", "
+                  << settings.m_image_width << "x" << settings.m_image_height << ", " << settings.m_samples_per_pixel
+                  << " spp in " << seconds * 1000.0 << " ms.\n";
+        client.queue_message(message_type::render_done, render_done_message { job.m_request.m_request_id, 1 });
+        return client.flush();
+    };
+
+    // A queued render can go on unless too many of its client's replies are still waiting to be sent.
+    const auto can_render = [&](const queued_render& job)
+    {
+        return find_client(job.m_client)->unsent_bytes() < MAX_UNSENT_BYTES;
+    };
+
+    while (true)
+    {
+        // Wait for requests or for clients to take their replies when nothing can be rendered; otherwise only look
+        // for them between tiles.
+        std::vector<pollfd> fds;
+        fds.push_back({ listen_fd, POLLIN, 0 });
+        bool unsent = false;
+        for (const client_connection& client : clients)
+        {
+            fds.push_back({ client.m_fd, static_cast<short>(POLLIN | (client.unsent_bytes() > 0 ? POLLOUT : 0)), 0 });
+            unsent = unsent || client.unsent_bytes() > 0;
+        }
+        const bool runnable = std::any_of(queue.begin(), queue.end(), can_render);
+
+        const int ready = poll(fds.data(), fds.size(), runnable ? 0 : (unsent ? 1000 : -1));
+        if (ready < 0 && errno != EINTR)
+            break;
+
+        if (ready > 0)
+        {
+            for (size_t c = fds.size() - 1; c > 0; c--)
+            {
+                // Clients are only added after the poll set was built, so entry c is still client c - 1.
+                client_connection& client = clients[c - 1];
+                bool ok = true;
+                if (fds[c].revents & (POLLOUT | POLLERR))
+                    ok = client.flush();
+                if (ok && (fds[c].revents & (POLLIN | POLLHUP | POLLERR)))
+                    ok = receive_requests(client);
+                if (!ok)
+                    drop_client(fds[c].fd);
+            }
+
+            if (fds[0].revents & POLLIN)
+            {
+                const int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd >= 0)
+                    clients.push_back({ fd, {}, {}, 0, std::chrono::steady_clock::now() });
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        for (size_t c = clients.size(); c-- > 0; )
+            if (clients[c].unsent_bytes() > 0 && now - clients[c].m_last_sent > std::chrono::seconds(SEND_TIMEOUT_SECONDS))
+            {
+                std::cerr << "Dropping a client that has not read its replies for " << SEND_TIMEOUT_SECONDS << " s.\n";
+                drop_client(clients[c].m_fd);
+            }
+
+        auto next = queue.end();
+        for (auto q = queue.begin(); q != queue.end(); ++q)
+        {
+            if (!can_render(*q))
+                continue;
+            if (next == queue.end() || q->m_request.m_priority > next->m_request.m_priority
+                || (q->m_request.m_priority == next->m_request.m_priority && q->m_order < next->m_order))
+                next = q;
+        }
+        if (next == queue.end())
+            continue;
+
+        bool finished = false;
+        if (!render_next_tile(*next, *find_client(next->m_client), finished))
+            drop_client(next->m_client);
+        else if (finished)
+            queue.erase(next);
+    }
+
+    for (const client_connection& client : clients)
+        close(client.m_fd);
+    close(listen_fd);
+    return EXIT_FAILURE;
+}
+
+// Sends settings to a render server and collects the image in fb. The image width and samples per pixel may be 0 for
+// the scene's own.
+inline bool submit_render(const std::string& endpoint, const render_settings& settings, int priority, framebuffer& fb)
+{
+    using namespace render_server_detail;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (settings.m_environment.size() >= sizeof(job_message::m_environment))
+    {
+        std::cerr << "Environment map path is too long for the render server.\n";
+        return false;
+    }
+    if (settings.m_density_grid.size() >= sizeof(job_message::m_density_grid))
+    {
+        std::cerr << "Density grid path is too long for the render server.\n";
+        return false;
+    }
+
+    const int fd = open_endpoint(endpoint, false);
+    if (fd < 0)
+    {
+        std::cerr << "Cannot connect to a render server at " << endpoint << ".\n";
+        return false;
+    }
+
+    const uint32_t request_id = next_request_id();
+    const render_request request { request_id, priority, make_job_message(settings, 0, 0, 0) };
+    bool ok = send_message(fd, message_type::render_request, request);
+    int tiles_left = 0;
+    int passes = 1;
+    std::vector<float> sums;
+
+    while (ok)
+    {
+        message_type type;
+        if (!recv_all(fd, &type, sizeof(type)))
+        {
+            ok = false;
+            break;
+        }
+
+        if (type == message_type::render_started)
+        {
+            render_started_message started;
+            ok = recv_all(fd, &started, sizeof(started)) && started.m_request_id == request_id;
+            if (!ok)
+                break;
+            fb = framebuffer(started.m_image_width, started.m_image_height);
+            tiles_left = started.m_tile_count;
+            passes = started.m_passes;
+            if (started.m_scene_reused)
+                std::cerr << "Server reused a resident scene.\n";
+            else
+                std::cerr << "Server loaded the scene in " << started.m_load_seconds * 1000.0 << " ms.\n";
+        }
+        else if (type == message_type::tile)
+        {
+            tile_header header;
+            ok = recv_all(fd, &header, sizeof(header)) && header.m_request_id == request_id;
+            if (!ok)
+                break;
+            const image_tile tile { header.m_x0, header.m_y0, header.m_x1, header.m_y1 };
+            ok = tile.m_x0 >= 0 && tile.m_y0 >= 0 && tile.m_x1 <= fb.width() && tile.m_y1 <= fb.height()
+              && tile.width() > 0 && tile.height() > 0 && header.m_float_count == static_cast<uint32_t>(tile.pixel_count()) * 3;
+            if (!ok)
+                break;
+            sums.resize(header.m_float_count);
+            ok = recv_all(fd, sums.data(), sums.size() * sizeof(float));
+            if (!ok)
+                break;
+            fb.add_tile(tile, sums.data(), header.m_samples);
+            if (header.m_pass == passes - 1)
+                std::cerr << "\rTiles remaining: " << --tiles_left << ' ' << std::flush;
+        }
+        else if (type == message_type::render_done)
+        {
+            render_done_message done;
+            ok = recv_all(fd, &done, sizeof(done)) && done.m_request_id == request_id && done.m_ok;
+            if (!ok)
+                std::cerr << "The server could not render scene " << settings.m_scene << ".\n";
+            break;
+        }
+        else
+            ok = false;
+    }
+
+    close(fd);
+    return ok;
+}
+
+#else
+
+inline int run_server(const std::string& endpoint)
+{
+    std::cerr << "The render server is only available on POSIX systems.\n";
+    return EXIT_FAILURE;
+}
+
+inline bool submit_render(const std::string& endpoint, const render_settings& settings, int priority, framebuffer& fb)
+{
+    std::cerr << "The render server is only available on POSIX systems.\n";
+    return false;
+}
+
+#endif
@@ -0,0 +1,515 @@
+#pragma once
+#include "aarect.h"
+#include "arena.h"
+#include "box.h"
+#include "bvh.h"
+#include "camera.h"
+#include "constant_env.h"
+#include "constants.h"
+#include "environment.h"
+#include "grid_env.h"
+#include "guiding.h"
+#include "hittable_objects.h"
+#include "image_texture.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "motion_bvh.h"
+#include "motion_instance.h"
+#include "moving_sphere.h"
+#include "paged_spheres.h"
+#include "photon_map.h"
+#include "radiance_cache.h"
+#include "sphere.h"
+
+// Textures used by the built-in scenes. CMake points this at Raytracer/Raytracer/Assets.
+#ifndef RAYTRACER_ASSET_DIR
+#define RAYTRACER_ASSET_DIR "../Assets"
+#endif
+
+inline hittable_objects materials_scene()
+{
+    hittable_objects world;
+
+    auto material_ground = arena_make<lambertian>(color(0.5, 0.5, 0.5));
+
+    auto material_left = arena_make<lambertian>(color(0.7, 0.2, 0.5));
+    auto material_center = arena_make<dielectric>(1.5);
+    auto material_right = arena_make<metal>(color(0.8, 0.6, 0.2));
+
+    world.add(arena_make<sphere>(point3(0.f, -100, 0.f), 100.0, material_ground));
+
+    world.add(arena_make<sphere>(point3(0.f, 1.0, 0.f), 1.0, material_center));
+    world.add(arena_make<sphere>(point3(-4.0, 1.0, 0.5), 1.0, material_left));
+    world.add(arena_make<sphere>(point3(4.0, 1.0, -0.5), 1.0, material_right));
+
+    return world;
+}
+
+inline hittable_objects cornell_box_with_smokes()
+{
+    hittable_objects objects;
+
+    auto red   = arena_make<lambertian>(color(.65, .05, .05));
+    auto white = arena_make<lambertian>(color(.73, .73, .73));
+    auto green = arena_make<lambertian>(color(.12, .45, .15));
+    auto light = arena_make<diffuse_light>(color(15, 15, 15));
+
+    std::shared_ptr<hittable> box1 = arena_make<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+         box1 = arena_make<rotate_y>(box1, 15);
+         box1 = arena_make<translate>(box1, vec3(265, 0, 295));
+
+    std::shared_ptr<hittable> box2 = arena_make<box>(point3(0, 0, 0), point3(165, 165, 165), white);
+         box2 = arena_make<rotate_y>(box2, -18);
+         box2 = arena_make<translate>(box2, vec3(130, 0, 65));
+
+    objects.add(arena_make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena_make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena_make<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(arena_make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena_make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena_make<xy_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena_make<constant_env>(box1, 0.01, color(0, 0, 0)));
+    objects.add(arena_make<constant_env>(box2, 0.01, color(1, 1, 1)));
+
+    return objects;
+}
+
+// smoke, if given, replaces the procedural plume and is stretched over the same box.
+inline hittable_objects cornell_box_with_grid_smoke(std::shared_ptr<density_grid> smoke = nullptr)
+{
+    hittable_objects objects;
+
+    auto red   = arena_make<lambertian>(color(.65, .05, .05));
+    auto white = arena_make<lambertian>(color(.73, .73, .73));
+    auto green = arena_make<lambertian>(color(.12, .45, .15));
+    auto light = arena_make<diffuse_light>(color(15, 15, 15));
+
+    objects.add(arena_make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena_make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena_make<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(arena_make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena_make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena_make<xy_rect>(0, 555, 0, 555, 555, white));
+
+    // A rising plume: dense at the bottom, thinning and curling towards the top, empty elsewhere.
+    if (!smoke)
+        smoke = arena_make<density_grid>(64, 64, 64, [](const point3& p)
+        {
+            const double cx = 0.5 + 0.15 * sin(6.0 * p.y());
+            const double cz = 0.5 + 0.15 * cos(5.0 * p.y());
+            const double radius = 0.12 + 0.18 * p.y();
+            const double dx = p.x() - cx;
+            const double dz = p.z() - cz;
+            const double falloff = 1.0 - (dx * dx + dz * dz) / (radius * radius);
+            if (falloff <= 0.0)
+                return 0.0;
+            const double wisps = 0.6 + 0.4 * sin(23.0 * p.x() + 17.0 * p.y()) * sin(19.0 * p.z() - 11.0 * p.y());
+            return falloff * wisps * (1.0 - 0.7 * p.y());
+        });
+
+    objects.add(arena_make<grid_env>(smoke, aabb(point3(100, 0, 100), point3(455, 500, 455)), 0.05, color(0.8, 0.8, 0.8)));
+
+    return objects;
+}
+
+inline hittable_objects final_scene()
+{
+    hittable_objects boxes;
+    auto white = arena_make<lambertian>(color(.73, .73, .73));
+
+    auto ground = arena_make<lambertian>(color(0.9, 0.13, 0.23));
+
+    const int boxes_per_side = 20;
+    for (int i = 0; i < boxes_per_side; i++)
+    {
+        for (int j = 0; j < boxes_per_side; j++)
+        {
+            auto w = 100.0;
+            auto x0 = -1000.0 + i * w;
+            auto z0 = -1000.0 + j * w;
+            auto y0 = 0.0;
+            auto x1 = x0 + w;
+            auto y1 = random_double(1, 101);
+            auto z1 = z0 + w;
+
+            boxes.add(arena_make<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
+        }
+    }
+
+    hittable_objects objects;
+
+    objects.add(arena_make<bvh_node>(boxes, 0, 1));
+
+    auto light = arena_make<diffuse_light>(color(7, 7, 7));
+    objects.add(arena_make<xz_rect>(123, 423, 147, 412, 554, light));
+
+    std::shared_ptr<hittable> box1 = arena_make<box>(point3(0, 0, 0), point3(100, 200, 100), white);
+    box1 = arena_make<rotate_y>(box1, 15);
+    box1 = arena_make<translate>(box1, vec3(100, 150, 105));
+
+    objects.add(arena_make<sphere>(point3(260, 150, 45), 50, arena_make<lambertian>(color(0.2, 0.8, 0.1))));
+    objects.add(arena_make<sphere>(point3(0, 150, 145), 50, arena_make<metal>(color(0.8, 0.8, 0.4))));
+    objects.add(arena_make<sphere>(point3(360, 150, 145), 70, arena_make<dielectric>(1.5)));
+    objects.add(arena_make<constant_env>(box1, 0.01, color(0.5, 0.5, 0.5)));
+
+    return objects;
+}
+
+// Fine checker with thin grid lines: aliases badly without mip filtering.
+inline std::shared_ptr<image_texture> checker_image(int size)
+{
+    std::vector<float> texels(static_cast<size_t>(size) * size * 3);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+        {
+            const bool odd = ((x / 16) + (y / 16)) % 2 != 0;
+            const bool line = x % 64 == 0 || y % 64 == 0;
+            float* t = &texels[(static_cast<size_t>(y) * size + x) * 3];
+            t[0] = line ? 0.05f : (odd ? 0.9f : 0.2f);
+            t[1] = line ? 0.05f : (odd ? 0.9f : 0.3f);
+            t[2] = line ? 0.05f : (odd ? 0.9f : 0.6f);
+        }
+    return arena_make<image_texture>(size, size, texels);
+}
+
+inline hittable_objects textured_scene()
+{
+    hittable_objects world;
+
+    auto ground = arena_make<lambertian>(checker_image(4096));
+    world.add(arena_make<xz_rect>(-100, 100, -100, 100, 0, ground));
+
+    std::shared_ptr<texture> globe_texture = image_texture::load_ppm(RAYTRACER_ASSET_DIR "/globe.ppm");
+    if (!globe_texture)
+        globe_texture = checker_image(1024);
+
+    world.add(arena_make<sphere>(point3(0.f, 1.0, 0.f), 1.0, arena_make<lambertian>(globe_texture)));
+    world.add(arena_make<sphere>(point3(-4.0, 1.0, 0.5), 1.0, arena_make<dielectric>(1.5)));
+    world.add(arena_make<sphere>(point3(4.0, 1.0, -0.5), 1.0, arena_make<metal>(color(0.8, 0.6, 0.2))));
+
+    return world;
+}
+
+// Bouncing balls and a box that slides and spins while the shutter is open.
+inline hittable_objects motion_scene()
+{
+    hittable_objects objects;
+
+    auto ground = arena_make<lambertian>(color(0.5, 0.5, 0.5));
+    objects.add(arena_make<sphere>(point3(0, -1000, 0), 1000, ground));
+
+    for (int a = -8; a < 8; a++)
+    {
+        for (int b = -8; b < 8; b++)
+        {
+            const point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+            const point3 center1 = center + vec3(0, random_double(0, 0.5), 0);
+            auto albedo = color::random() * color::random();
+            objects.add(arena_make<moving_sphere>(center, center1, 0.0, 1.0, 0.2, arena_make<lambertian>(albedo)));
+        }
+    }
+
+    std::shared_ptr<hittable> spinner = arena_make<box>(point3(-0.5, 0, -0.5), point3(0.5, 1, 0.5), arena_make<metal>(color(0.8, 0.6, 0.2)));
+    objects.add(arena_make<motion_instance>(spinner, std::vector<motion_key> {
+        { 0.0, vec3(-2, 0.5, 1), 0.0 },
+        { 0.5, vec3(0, 1.0, 1), 45.0 },
+        { 1.0, vec3(2, 0.5, 1), 60.0 },
+    }));
+
+    hittable_objects world;
+    world.add(arena_make<motion_bvh_node>(objects, 0.0, 1.0));
+    return world;
+}
+
+// Swarm of spheres circling the y axis at different speeds over the clip time [0, 1], above a
+// static field of boxes. Meant for --frames: the spheres drift apart and the BVH has to adapt.
+inline hittable_objects orbit_scene()
+{
+    hittable_objects objects;
+
+    auto ground = arena_make<lambertian>(color(0.48, 0.83, 0.53));
+    for (int i = -10; i < 10; i++)
+        for (int j = -10; j < 10; j++)
+            objects.add(arena_make<box>(point3(i, -1, j), point3(i + 1, random_double(-0.9, -0.6), j + 1), ground));
+
+    for (int n = 0; n < 400; n++)
+    {
+        const double radius = random_double(0.5, 5.0);
+        const double height = random_double(0.2, 2.5);
+        const double start = random_double(0, 360);
+        const double turns = static_cast<double>(random_int(-2, 2) | 1);
+        auto albedo = color::random() * color::random();
+
+        std::shared_ptr<hittable> ball = arena_make<sphere>(point3(radius, 0, 0), random_double(0.05, 0.15), arena_make<lambertian>(albedo));
+
+        std::vector<motion_key> keys;
+        for (int k = 0; k <= 8; k++)
+        {
+            const double t = k / 8.0;
+            keys.push_back({ t, vec3(0, height + 0.2 * sin(2 * PI * (2 * t + start / 360)), 0), start + 360 * turns * t });
+        }
+        objects.add(arena_make<motion_instance>(ball, keys));
+    }
+
+    hittable_objects world;
+    world.add(arena_make<bvh_node>(objects, 0, 0));
+    return world;
+}
+
+// A room lit only by thousands of small lights of different brightness: a grid of ceiling panels, strips on
+// the back wall and glowing spheres on the floor, each giving off a small part of the light. Meant for --lights.
+inline hittable_objects many_lights_scene()
+{
+    hittable_objects objects;
+
+    auto red   = arena_make<lambertian>(color(.65, .05, .05));
+    auto white = arena_make<lambertian>(color(.73, .73, .73));
+    auto green = arena_make<lambertian>(color(.12, .45, .15));
+
+    objects.add(arena_make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena_make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena_make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena_make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena_make<xy_rect>(0, 555, 0, 555, 555, white));
+
+    for (int i = 0; i < 48; i++)
+        for (int j = 0; j < 48; j++)
+        {
+            const double x = 5 + 11.5 * i;
+            const double z = 5 + 11.5 * j;
+            auto light = arena_make<diffuse_light>(random_double(0.5, 8.0) * (color(0.6, 0.6, 0.6) + 0.4 * color::random()));
+            objects.add(arena_make<xz_rect>(x, x + 4, z, z + 4, 554, light));
+        }
+
+    for (int i = 0; i < 16; i++)
+    {
+        const double x = 20 + 33 * i;
+        auto light = arena_make<diffuse_light>(random_double(2.0, 10.0) * (color(0.3, 0.3, 0.3) + 0.7 * color::random()));
+        objects.add(arena_make<xy_rect>(x, x + 15, 60, 64, 554, light));
+    }
+
+    for (int n = 0; n < 200; n++)
+    {
+        const double radius = random_double(2.0, 5.0);
+        const point3 center(random_double(20, 535), radius, random_double(20, 535));
+        auto light = arena_make<diffuse_light>(random_double(5.0, 20.0) * (color(0.2, 0.2, 0.2) + 0.8 * color::random()));
+        objects.add(arena_make<sphere>(center, radius, light));
+    }
+
+    objects.add(arena_make<box>(point3(100, 0, 300), point3(230, 260, 430), white));
+    objects.add(arena_make<box>(point3(330, 0, 120), point3(460, 130, 250), white));
+    objects.add(arena_make<sphere>(point3(400, 230, 400), 60, arena_make<metal>(color(0.8, 0.85, 0.9))));
+
+    hittable_objects world;
+    world.add(arena_make<bvh_node>(objects, 0, 0));
+    return world;
+}
+
+// A room lit by one small sphere light, with a glass and a metal sphere that focus it onto the floor and walls.
+// Unidirectional paths find those caustics only by hitting the light through the spheres, so they stay noisy.
+inline hittable_objects caustics_scene()
+{
+    hittable_objects objects;
+
+    auto red   = arena_make<lambertian>(color(.65, .05, .05));
+    auto white = arena_make<lambertian>(color(.73, .73, .73));
+    auto green = arena_make<lambertian>(color(.12, .45, .15));
+
+    objects.add(arena_make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena_make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena_make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena_make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena_make<xy_rect>(0, 555, 0, 555, 555, white));
+
+    objects.add(arena_make<sphere>(point3(278, 470, 300), 12, arena_make<diffuse_light>(color(150, 140, 120))));
+    objects.add(arena_make<sphere>(point3(190, 110, 260), 90, arena_make<dielectric>(1.5)));
+    objects.add(arena_make<sphere>(point3(400, 80, 380), 80, arena_make<metal>(color(0.9, 0.85, 0.7))));
+
+    hittable_objects world;
+    world.add(arena_make<bvh_node>(objects, 0, 0));
+    return world;
+}
+
+// A million small spheres on a jittered grid, built straight into paged_spheres: they never exist as objects, and
+// while it renders only the clusters that rays reach are in memory. The ground is an ordinary sphere.
+inline hittable_objects sphere_field_scene()
+{
+    hittable_objects world;
+    world.add(arena_make<sphere>(point3(0, -1000, 0), 1000, arena_make<lambertian>(color(0.5, 0.5, 0.5))));
+
+    std::vector<std::shared_ptr<material>> materials;
+    for (int m = 0; m < 12; m++)
+        materials.push_back(arena_make<lambertian>(color::random() * color::random()));
+    for (int m = 0; m < 4; m++)
+        materials.push_back(arena_make<metal>(color::random(0.5, 1)));
+
+    const int per_side = 1000;
+    const double spacing = 0.12;
+    std::vector<sphere_record> spheres;
+    spheres.reserve(static_cast<size_t>(per_side) * per_side);
+    for (int i = 0; i < per_side; i++)
+    {
+        for (int j = 0; j < per_side; j++)
+        {
+            const double radius = random_double(0.02, 0.05);
+            const double x = (i - per_side / 2 + random_double(0.3, 0.7)) * spacing;
+            const double z = (j - per_side / 2 + random_double(0.3, 0.7)) * spacing;
+            const uint32_t mat = static_cast<uint32_t>(random_int(0, static_cast<int>(materials.size()) - 1));
+            spheres.push_back({ { x, radius, z }, radius, mat, 0 });
+        }
+    }
+    world.add(arena_make<paged_spheres>(std::move(spheres), std::move(materials)));
+
+    return world;
+}
+
+// Everything main() needs to render one of the built-in scenes.
+struct scene_description
+{
+    camera make_camera() const
+    {
+        return camera(m_lookfrom, m_lookat, m_vup, m_vfov, m_aspect_ratio, m_aperture, m_dist_to_focus, m_time0, m_time1);
+    }
+
+    hittable_objects m_world;
+    point3 m_lookfrom;
+    point3 m_lookat;
+    vec3   m_vup = vec3(0, 1, 0);
+    color  m_background = color(0, 0, 0);
+    std::shared_ptr<environment_map> m_environment;     // replaces m_background when set
+    std::shared_ptr<light_bvh> m_emitters;              // emitters sampled directly, if any
+    std::shared_ptr<guiding_field> m_guide;             // learned incident light that diffuse hits scatter by, if any
+    std::shared_ptr<caustic_photons> m_caustics;        // photons gathered for caustics, if any
+    std::shared_ptr<radiance_cache_passes> m_radiance;  // radiance cache that paths end in, if any
+
+    scene_lights lights() const { return { m_environment.get(), m_emitters.get() }; }
+
+    double m_vfov = 40.0;
+    double m_aperture = 0.0;
+    double m_dist_to_focus = 10.0;
+    double m_aspect_ratio = 1.0;
+    double m_time0 = 0.0;  // shutter interval
+    double m_time1 = 0.0;
+    int m_image_width = 800;
+    int m_image_height = 800;
+    int m_samples_per_pixel = 50;
+};
+
+// smoke, if given, is the density of the medium in scene 3.
+inline bool load_scene(int num, scene_description& scene, std::shared_ptr<density_grid> smoke = nullptr)
+{
+    // Everything the scene function creates lands in one arena, released with the last object.
+    scene_arena::scope arena;
+
+    switch (num)
+    {
+        case 0:
+            scene.m_world = materials_scene();
+            scene.m_aspect_ratio = 3.0 / 2.0;
+            scene.m_samples_per_pixel = 100;
+            scene.m_background = color(0.70, 0.80, 1.00);
+            scene.m_lookfrom = point3(13, 2, 3);
+            scene.m_lookat = point3(0, 0, 0);
+            scene.m_vfov = 20.0;
+            scene.m_aperture = 0.1;
+            break;
+        case 1:
+            scene.m_world = cornell_box_with_smokes();
+            scene.m_aspect_ratio = 1.0;
+            scene.m_samples_per_pixel = 200;
+            scene.m_background = color(0, 0, 0);
+            scene.m_lookfrom = point3(278, 278, -800);
+            scene.m_lookat = point3(278, 278, 0);
+            scene.m_vfov = 40.0;
+            break;
+        case 2:
+            scene.m_world = final_scene();
+            scene.m_aspect_ratio = 1.0;
+            scene.m_samples_per_pixel = 1000;
+            scene.m_background = color(0, 0, 0);
+            scene.m_lookfrom = point3(478, 278, -600);
+            scene.m_lookat = point3(278, 278, 0);
+            scene.m_vfov = 40.0;
+            break;
+        case 3:
+            scene.m_world = cornell_box_with_grid_smoke(smoke);
+            scene.m_aspect_ratio = 1.0;
+            scene.m_samples_per_pixel = 200;
+            scene.m_background = color(0, 0, 0);
+            scene.m_lookfrom = point3(278, 278, -800);
+            scene.m_lookat = point3(278, 278, 0);
+            scene.m_vfov = 40.0;
+            break;
+        case 4:
+            scene.m_world = textured_scene();
+            scene.m_aspect_ratio = 3.0 / 2.0;
+            scene.m_samples_per_pixel = 100;
+            scene.m_background = color(0.70, 0.80, 1.00);
+            scene.m_lookfrom = point3(13, 2, 3);
+            scene.m_lookat = point3(0, 0, 0);
+            scene.m_vfov = 20.0;
+            break;
+        case 5:
+            scene.m_world = motion_scene();
+            scene.m_aspect_ratio = 3.0 / 2.0;
+            scene.m_samples_per_pixel = 100;
+            scene.m_background = color(0.70, 0.80, 1.00);
+            scene.m_lookfrom = point3(13, 2, 3);
+            scene.m_lookat = point3(0, 0, 0);
+            scene.m_vfov = 20.0;
+            scene.m_time0 = 0.0;
+            scene.m_time1 = 1.0;
+            break;
+        case 6:
+            scene.m_world = orbit_scene();
+            scene.m_aspect_ratio = 16.0 / 9.0;
+            scene.m_samples_per_pixel = 50;
+            scene.m_background = color(0.70, 0.80, 1.00);
+            scene.m_lookfrom = point3(0, 6, 14);
+            scene.m_lookat = point3(0, 0.5, 0);
+            scene.m_vfov = 35.0;
+            break;
+        case 7:
+            scene.m_world = materials_scene();
+            scene.m_environment = environment_map::sun_sky(1024, 35.0, 120.0, 1.5, 2000.0);
+            scene.m_aspect_ratio = 3.0 / 2.0;
+            scene.m_samples_per_pixel = 64;
+            scene.m_lookfrom = point3(13, 2, 3);
+            scene.m_lookat = point3(0, 0, 0);
+            scene.m_vfov = 20.0;
+            break;
+        case 8:
+            scene.m_world = many_lights_scene();
+            scene.m_aspect_ratio = 1.0;
+            scene.m_samples_per_pixel = 64;
+            scene.m_background = color(0, 0, 0);
+            scene.m_lookfrom = point3(278, 278, -800);
+            scene.m_lookat = point3(278, 278, 0);
+            scene.m_vfov = 40.0;
+            break;
+        case 9:
+            scene.m_world = caustics_scene();
+            scene.m_aspect_ratio = 1.0;
+            scene.m_samples_per_pixel = 64;
+            scene.m_background = color(0, 0, 0);
+            scene.m_lookfrom = point3(278, 278, -800);
+            scene.m_lookat = point3(278, 278, 0);
+            scene.m_vfov = 40.0;
+            break;
+        case 10:
+            scene.m_world = sphere_field_scene();
+            scene.m_aspect_ratio = 16.0 / 9.0;
+            scene.m_samples_per_pixel = 64;
+            scene.m_background = color(0.70, 0.80, 1.00);
+            scene.m_lookfrom = point3(0, 2.5, 10);
+            scene.m_lookat = point3(0, 0, 0);
+            scene.m_vfov = 30.0;
+            break;
+        default:
+            return false;
+    }
+
+    scene.m_image_width = 800;
+    scene.m_image_height = static_cast<int>(scene.m_image_width / scene.m_aspect_ratio);
+    return true;
+}
@@ -2,18 +2,29 @@
 #include "hittable.h"
 #include "vec3.h"
 
-class sphere : public hittable
+class sphere final : public hittable
 {
 public:
     sphere() = delete;
     sphere(point3 center, double radius, std::shared_ptr<material> m) 
-        : m_center(center)
+        : hittable(hittable_kind::sphere)
+        , m_center(center)
         , m_radius(radius)
         , m_mat_ptr(m)
     {};
 
     virtual bool hit(const ray& ray, double t_min, double t_max, hit_record& hit_rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool clipped_box(double time0, double time1, int axis, double lo, double hi, aabb& output_box) const override;
+    virtual bool hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const override;
+
+    point3 center() const { return m_center; }
+    double radius() const { return m_radius; }
+    const std::shared_ptr<material>& material_ptr() const { return m_mat_ptr; }
+
+    // Nearest intersection in [t_min, t_max] of the sphere with the given centre and radius, filling in everything
+    // in hit_rec except the material and the object; shared with spheres stored out of memory (paged_spheres).
+    static bool hit_surface(const point3& center, double radius, const ray& ray, double t_min, double t_max, hit_record& hit_rec);
 
 private:
     static void get_sphere_uv(const point3& p, double& u, double& v)
@@ -38,12 +49,23 @@ private:
     std::shared_ptr<material> m_mat_ptr;
 };
 
-bool sphere::hit(const ray& ray, double t_min, double t_max, hit_record& hit_rec) const
+inline bool sphere::hit(const ray& ray, double t_min, double t_max, hit_record& hit_rec) const
 {
-    const vec3 oc = ray.origin() - m_center;
+    RT_STAT(m_primitive_tests);
+
+    if (!hit_surface(m_center, m_radius, ray, t_min, t_max, hit_rec))
+        return false;
+    hit_rec.m_mat_ptr = m_mat_ptr;
+    hit_rec.m_object = this;
+    return true;
+}
+
+inline bool sphere::hit_surface(const point3& center, double radius, const ray& ray, double t_min, double t_max, hit_record& hit_rec)
+{
+    const vec3 oc = ray.origin() - center;
     const double a = ray.dir().length_squared();
     const double half_b = dot(oc, ray.dir());
-    const double c = oc.length_squared() - m_radius * m_radius;
+    const double c = oc.length_squared() - radius * radius;
     const double discriminant = half_b * half_b - a * c;
     if (discriminant < 0.f)
         return false;
@@ -59,16 +81,53 @@ bool sphere::hit(const ray& ray, double t_min, double t_max, hit_record& hit_rec
         }
         hit_rec.m_t = root;
         hit_rec.m_point = ray.at(hit_rec.m_t);
-        const vec3 outward_normal = (hit_rec.m_point - m_center) / m_radius;
+        const vec3 outward_normal = (hit_rec.m_point - center) / radius;
         hit_rec.set_face_normal(ray, outward_normal);
         get_sphere_uv(outward_normal, hit_rec.m_u, hit_rec.m_v);
-        hit_rec.m_mat_ptr = m_mat_ptr;
+        hit_rec.m_uv_scale = 1.0 / (PI * radius);
         return true;
     }
 }
 
-bool sphere::bounding_box(double time0, double time1, aabb& output_box) const
+inline bool sphere::hit_interval(const ray& r_in, double t_min, double t_max, double& t_enter, double& t_exit) const
+{
+    const vec3 oc = r_in.origin() - m_center;
+    const double a = r_in.dir().length_squared();
+    const double half_b = dot(oc, r_in.dir());
+    const double c = oc.length_squared() - m_radius * m_radius;
+    const double discriminant = half_b * half_b - a * c;
+    if (discriminant < 0.f)
+        return false;
+
+    const double discrim_sqrt = sqrt(discriminant);
+    t_enter = fmax((-half_b - discrim_sqrt) / a, t_min);
+    t_exit = fmin((-half_b + discrim_sqrt) / a, t_max);
+
+    return t_enter < t_exit;
+}
+
+inline bool sphere::bounding_box(double time0, double time1, aabb& output_box) const
 {
     output_box = aabb(m_center - vec3(m_radius, m_radius, m_radius), m_center + vec3(m_radius, m_radius, m_radius));
     return true;
 }
+
+inline bool sphere::clipped_box(double time0, double time1, int axis, double lo, double hi, aabb& output_box) const
+{
+    const double c = m_center[axis];
+    const double a = fmax(lo, c - m_radius);
+    const double b = fmin(hi, c + m_radius);
+    if (a > b)
+        return false;
+
+    // The widest cross-section inside the slab is at the plane nearest the centre.
+    const double d = a <= c && c <= b ? 0.0 : fmin(fabs(a - c), fabs(b - c));
+    const double r = sqrt(fmax(m_radius * m_radius - d * d, 0.0));
+
+    point3 small = m_center - vec3(r, r, r);
+    point3 big = m_center + vec3(r, r, r);
+    small[axis] = a;
+    big[axis] = b;
+    output_box = aabb(small, big);
+    return true;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Render statistics. Counting is compiled in only when RT_ENABLE_STATS is defined, so the
+// default build pays nothing for it. Each thread bumps its own counters (render_stats::local())
+// and folds them into the process-wide totals with render_stats::merge_local() when it is done.
+
+#ifdef RT_ENABLE_STATS
+#define RT_STAT(counter) (++render_stats::local().counter)
+#define RT_STAT_MATERIAL(counter, kind) (++render_stats::local().counter[static_cast<int>(kind)])
+#else
+#define RT_STAT(counter) ((void)0)
+#define RT_STAT_MATERIAL(counter, kind) ((void)0)
+#endif
+
+constexpr int MAX_MATERIAL_KINDS = 8;
+
+// Occupancy and traffic of one of the memory-budgeted caches, read under its lock.
+struct cache_stats
+{
+    const char* m_name;
+    size_t m_budget;
+    size_t m_resident_bytes;
+    long long m_misses;
+    long long m_evictions;
+};
+
+struct render_counters
+{
+    long long m_camera_rays = 0;
+    long long m_rays = 0;
+    long long m_bvh_nodes_visited = 0;
+    long long m_aabb_tests = 0;
+    long long m_list_tests = 0;
+    long long m_primitive_tests = 0;
+
+    // Indexed by material_kind.
+    long long m_material_hits[MAX_MATERIAL_KINDS] = {};
+    long long m_scatters[MAX_MATERIAL_KINDS] = {};
+    long long m_emissions[MAX_MATERIAL_KINDS] = {};
+
+    render_counters& operator += (const render_counters& other)
+    {
+        m_camera_rays += other.m_camera_rays;
+        m_rays += other.m_rays;
+        m_bvh_nodes_visited += other.m_bvh_nodes_visited;
+        m_aabb_tests += other.m_aabb_tests;
+        m_list_tests += other.m_list_tests;
+        m_primitive_tests += other.m_primitive_tests;
+
+        for (int i = 0; i < MAX_MATERIAL_KINDS; i++)
+        {
+            m_material_hits[i] += other.m_material_hits[i];
+            m_scatters[i] += other.m_scatters[i];
+            m_emissions[i] += other.m_emissions[i];
+        }
+        return *this;
+    }
+
+    void write_json(std::ostream& out, const char* const material_names[], int material_count, double seconds,
+                    const std::vector<cache_stats>& caches) const;
+};
+
+class render_stats
+{
+public:
+    static render_counters& local()
+    {
+        thread_local render_counters counters;
+        return counters;
+    }
+
+    // Adds the calling thread's counters to the totals and resets them.
+    static void merge_local()
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        totals() += local();
+        local() = render_counters();
+    }
+
+    static render_counters merged()
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        return totals();
+    }
+
+private:
+    static std::mutex& mutex()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    static render_counters& totals()
+    {
+        static render_counters t;
+        return t;
+    }
+};
+
+inline void render_counters::write_json(std::ostream& out, const char* const material_names[], int material_count, double seconds,
+                                        const std::vector<cache_stats>& caches) const
+{
+    const auto per_ray = [this](long long n) { return m_rays > 0 ? static_cast<double>(n) / m_rays : 0.0; };
+
+    out << "{\n"
+        << "  \"seconds\": " << seconds << ",\n"
+        << "  \"camera_rays\": " << m_camera_rays << ",\n"
+        << "  \"rays\": " << m_rays << ",\n"
+        << "  \"mrays_per_second\": " << (seconds > 0 ? m_rays / seconds * 1e-6 : 0.0) << ",\n"
+        << "  \"bvh_nodes_visited\": " << m_bvh_nodes_visited << ",\n"
+        << "  \"aabb_tests\": " << m_aabb_tests << ",\n"
+        << "  \"list_tests\": " << m_list_tests << ",\n"
+        << "  \"primitive_tests\": " << m_primitive_tests << ",\n"
+        << "  \"bvh_nodes_per_ray\": " << per_ray(m_bvh_nodes_visited) << ",\n"
+        << "  \"primitive_tests_per_ray\": " << per_ray(m_primitive_tests) << ",\n"
+        << "  \"materials\": {";
+
+    for (int i = 0; i < material_count && i < MAX_MATERIAL_KINDS; i++)
+    {
+        out << (i ? "," : "") << "\n    \"" << material_names[i] << "\": { "
+            << "\"hits\": " << m_material_hits[i] << ", "
+            << "\"scatters\": " << m_scatters[i] << ", "
+            << "\"emissions\": " << m_emissions[i] << " }";
+    }
+
+    out << "\n  },\n  \"caches\": {";
+    for (size_t i = 0; i < caches.size(); i++)
+    {
+        out << (i ? "," : "") << "\n    \"" << caches[i].m_name << "\": { "
+            << "\"budget_bytes\": " << caches[i].m_budget << ", "
+            << "\"resident_bytes\": " << caches[i].m_resident_bytes << ", "
+            << "\"misses\": " << caches[i].m_misses << ", "
+            << "\"evictions\": " << caches[i].m_evictions << " }";
+    }
+
+    out << "\n  }\n}\n";
+}
+
+// Per-pixel cost image: a value per pixel, written as a false-colour PPM.
+class stats_heatmap
+{
+public:
+    stats_heatmap(int width, int height)
+        : m_width(width), m_height(height), m_values(static_cast<size_t>(width) * height, 0.0)
+    {}
+
+    // (i, j) as in the render loop: j = 0 is the bottom row.
+    void add(int i, int j, double value) { m_values[static_cast<size_t>(j) * m_width + i] += value; }
+
+    // The value at (i, j), which is cleared; a worker sends the costs of each tile this way.
+    double take(int i, int j)
+    {
+        double& value = m_values[static_cast<size_t>(j) * m_width + i];
+        const double taken = value;
+        value = 0.0;
+        return taken;
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    // Normalised to the 99th percentile so a handful of pathological pixels do not flatten the rest.
+    void write_ppm(std::ostream& out) const
+    {
+        std::vector<double> sorted(m_values);
+        std::sort(sorted.begin(), sorted.end());
+        const double scale = sorted.empty() ? 0.0 : sorted[static_cast<size_t>(0.99 * (sorted.size() - 1))];
+
+        out << "P3\n" << m_width << ' ' << m_height << "\n255\n";
+        for (int j = m_height - 1; j >= 0; --j)
+            for (int i = 0; i < m_width; ++i)
+            {
+                const double x = scale > 0 ? std::min(m_values[static_cast<size_t>(j) * m_width + i] / scale, 1.0) : 0.0;
+                double r, g, b;
+                false_colour(x, r, g, b);
+                out << static_cast<int>(255.999 * r) << ' '
+                    << static_cast<int>(255.999 * g) << ' '
+                    << static_cast<int>(255.999 * b) << '\n';
+            }
+    }
+
+private:
+    // Dark blue -> cyan -> green -> yellow -> red.
+    static void false_colour(double x, double& r, double& g, double& b)
+    {
+        static const double ramp[5][3] = { { 0.0, 0.0, 0.3 }, { 0.0, 0.8, 1.0 }, { 0.0, 0.9, 0.0 }, { 1.0, 1.0, 0.0 }, { 1.0, 0.0, 0.0 } };
+        const double f = x * 4.0;
+        const int k = std::min(static_cast<int>(f), 3);
+        const double t = f - k;
+        r = ramp[k][0] + t * (ramp[k + 1][0] - ramp[k][0]);
+        g = ramp[k][1] + t * (ramp[k + 1][1] - ramp[k][1]);
+        b = ramp[k][2] + t * (ramp[k + 1][2] - ramp[k][2]);
+    }
+
+private:
+    int m_width;
+    int m_height;
+    std::vector<double> m_values;
+};
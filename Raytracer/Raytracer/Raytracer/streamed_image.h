@@ -0,0 +1,135 @@
+#pragma once
+#include "color.h"
+#include "render.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// An image file that finished tiles are written into as soon as they arrive, so only the tiles being rendered are
+// held in memory, whatever the size of the image. The file is laid out in full when it is created and every pixel
+// has a fixed place in it. Each row of a tile is then one write at a known offset. The extension picks the format:
+// .ppm is binary PPM (P6) with the 8-bit pixels of framebuffer::write_ppm, and .pfm is a portable float map of the
+// mean radiance, as framebuffer::write_pfm writes it.
+class streamed_image : public tile_sink
+{
+public:
+    // Creates the file at its full size; nullptr if the extension is unknown or the file cannot be written.
+    static std::unique_ptr<streamed_image> create(const std::string& path, int width, int height);
+
+    int width() const override { return m_width; }
+    int height() const override { return m_height; }
+
+    void add_passes(const image_tile& tile, const std::vector<std::vector<float>>& passes,
+                    const render_settings& settings) override;
+
+    // False once a write has failed.
+    bool good() const { return static_cast<bool>(m_file); }
+
+private:
+    streamed_image(std::ofstream file, int width, int height, bool floats, std::streamoff header_size)
+        : m_file(std::move(file)), m_width(width), m_height(height), m_floats(floats), m_header_size(header_size) {}
+
+    // Offset of pixel (i, j), counting rows from the bottom as the render loop does.
+    std::streamoff offset(int i, int j) const;
+
+private:
+    std::ofstream m_file;
+    int m_width;
+    int m_height;
+    bool m_floats;  // .pfm rather than .ppm
+    std::streamoff m_header_size;
+    std::vector<char> m_row;
+};
+
+inline std::unique_ptr<streamed_image> streamed_image::create(const std::string& path, int width, int height)
+{
+    const size_t dot = path.rfind('.');
+    const std::string extension = dot == std::string::npos ? "" : path.substr(dot);
+    if (extension != ".ppm" && extension != ".pfm")
+    {
+        std::cerr << "Cannot stream to " << path << ": the image must be a .ppm or .pfm file.\n";
+        return nullptr;
+    }
+    const bool floats = extension == ".pfm";
+
+    std::ostringstream header;
+    if (floats)
+    {
+        const uint16_t probe = 1;
+        const bool little_endian = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+        header << "PF\n" << width << ' ' << height << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+    }
+    else
+        header << "P6\n" << width << ' ' << height << "\n255\n";
+
+    std::ofstream file(path, std::ios::binary);
+    const std::string text = header.str();
+    file.write(text.data(), text.size());
+
+    // Writing the last byte gives the file its full size; most file systems leave the rest unallocated until written.
+    const std::streamoff pixels = static_cast<std::streamoff>(width) * height * (floats ? 3 * sizeof(float) : 3);
+    if (pixels > 0)
+    {
+        file.seekp(static_cast<std::streamoff>(text.size()) + pixels - 1);
+        file.put('\0');
+    }
+    if (!file)
+    {
+        std::cerr << "Cannot write " << path << ".\n";
+        return nullptr;
+    }
+    return std::unique_ptr<streamed_image>(new streamed_image(std::move(file), width, height, floats,
+                                                              static_cast<std::streamoff>(text.size())));
+}
+
+inline std::streamoff streamed_image::offset(int i, int j) const
+{
+    // Float maps store their rows from the bottom, PPM from the top.
+    if (m_floats)
+        return m_header_size + (static_cast<std::streamoff>(j) * m_width + i) * 3 * static_cast<std::streamoff>(sizeof(float));
+    return m_header_size + (static_cast<std::streamoff>(m_height - 1 - j) * m_width + i) * 3;
+}
+
+inline void streamed_image::add_passes(const image_tile& tile, const std::vector<std::vector<float>>& passes,
+                                       const render_settings& settings)
+{
+    int samples = 0;
+    for (size_t pass = 0; pass < passes.size(); pass++)
+        samples += pass_samples(settings, static_cast<int>(pass));
+
+    // Passes are summed in the same order as framebuffer::add_tile, so the pixels match an image rendered in memory.
+    m_row.resize(static_cast<size_t>(tile.width()) * (m_floats ? 3 * sizeof(float) : 3));
+    for (int j = tile.m_y0; j < tile.m_y1; ++j)
+    {
+        for (int i = tile.m_x0; i < tile.m_x1; ++i)
+        {
+            const size_t p = 3 * (static_cast<size_t>(j - tile.m_y0) * tile.width() + (i - tile.m_x0));
+            color sum(0, 0, 0);
+            for (const std::vector<float>& sums : passes)
+                sum += color(sums[p], sums[p + 1], sums[p + 2]);
+
+            if (m_floats)
+            {
+                const color mean = sum / std::max(samples, 1);
+                const float rgb[3] = { static_cast<float>(mean.x()), static_cast<float>(mean.y()), static_cast<float>(mean.z()) };
+                memcpy(&m_row[(i - tile.m_x0) * sizeof(rgb)], rgb, sizeof(rgb));
+            }
+            else
+            {
+                int rgb[3];
+                color_bytes(sum, std::max(samples, 1), rgb);
+                for (int a = 0; a < 3; a++)
+                    m_row[3 * (i - tile.m_x0) + a] = static_cast<char>(rgb[a]);
+            }
+        }
+        m_file.seekp(offset(tile.m_x0, j));
+        m_file.write(m_row.data(), m_row.size());
+    }
+}
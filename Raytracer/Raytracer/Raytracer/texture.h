@@ -1,17 +1,38 @@
 #pragma once
 #include "constants.h"
 
+// Built-in texture types that sample_texture() handles without a virtual call.
+enum class texture_kind
+{
+    solid_color,
+    custom
+};
+
 class texture
 {
 public:
+    texture(texture_kind kind = texture_kind::custom) : m_kind(kind) {}
+
+    texture_kind kind() const { return m_kind; }
+
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    // footprint: approximate width of the lookup in uv units, 0 if unknown. Textures without
+    // prefiltered data ignore it.
+    virtual color filtered_value(double u, double v, const point3& p, double footprint) const
+    {
+        return value(u, v, p);
+    }
+
+private:
+    texture_kind m_kind;
 };
 
-class solid_color : public texture
+class solid_color final : public texture
 {
 public:
-    solid_color() {}
-    solid_color(color c) : m_color_value(c) {}
+    solid_color() : texture(texture_kind::solid_color) {}
+    solid_color(color c) : texture(texture_kind::solid_color), m_color_value(c) {}
 
     solid_color(double red, double green, double blue)
         : solid_color(color(red, green, blue))
@@ -22,6 +43,16 @@ public:
         return m_color_value;
     }
 
+    const color& color_value() const { return m_color_value; }
+
 private:
     color m_color_value;
-};
\ No newline at end of file
+};
+
+// filtered_value() with the common constant case inlined.
+inline color sample_texture(const texture& tex, double u, double v, const point3& p, double footprint)
+{
+    if (tex.kind() == texture_kind::solid_color)
+        return static_cast<const solid_color&>(tex).color_value();
+    return tex.filtered_value(u, v, p, footprint);
+}
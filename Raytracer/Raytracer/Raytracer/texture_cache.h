@@ -0,0 +1,77 @@
+#pragma once
+#include "lru_tile_cache.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Texels are stored in square tiles; inside a tile they follow Morton (Z) order, so a bilinear
+// footprint usually touches one or two cache lines instead of two rows far apart.
+constexpr int TEXTURE_TILE_LOG2 = 5;
+constexpr int TEXTURE_TILE_SIZE = 1 << TEXTURE_TILE_LOG2;
+constexpr size_t TEXTURE_TILE_FLOATS = TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3;
+
+using texture_tile = std::vector<float>;
+
+using cached_tile = cached_value<texture_tile>;
+
+inline uint32_t morton_index(uint32_t x, uint32_t y)
+{
+    const auto spread = [](uint32_t v)
+    {
+        v = (v | (v << 8)) & 0x00ff00ffu;
+        v = (v | (v << 4)) & 0x0f0f0f0fu;
+        v = (v | (v << 2)) & 0x33333333u;
+        v = (v | (v << 1)) & 0x55555555u;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Anything that can produce tiles on demand; the cache calls read_tile on a miss.
+class tile_source
+{
+public:
+    virtual void read_tile(int level, int tile_x, int tile_y, texture_tile& out) const = 0;
+};
+
+// Process-wide texture tile cache. Callers pin a tile once per footprint rather than once per texel.
+class texture_cache
+{
+public:
+    static texture_cache& instance()
+    {
+        static texture_cache cache;
+        return cache;
+    }
+
+    // Ids are never reused, so stale thread-local entries can never alias a new texture.
+    uint32_t register_texture() { return m_next_texture_id++; }
+
+    void set_budget(size_t bytes) { m_tiles.set_budget(bytes); }
+    cache_stats stats() { return m_tiles.stats(); }
+
+    std::shared_ptr<const cached_tile> tile(const tile_source& source, uint32_t texture_id, int level, int tile_x, int tile_y)
+    {
+        return m_tiles.get(make_key(texture_id, level, tile_x, tile_y), [&](texture_tile& texels)
+        {
+            texels.resize(TEXTURE_TILE_FLOATS);
+            source.read_tile(level, tile_x, tile_y, texels);
+            return TEXTURE_TILE_FLOATS * sizeof(float);
+        });
+    }
+
+private:
+    texture_cache() : m_tiles("texture") {}
+
+    static uint64_t make_key(uint32_t texture_id, int level, int tile_x, int tile_y)
+    {
+        return (static_cast<uint64_t>(texture_id) << 32) | (static_cast<uint64_t>(level) << 26)
+             | (static_cast<uint64_t>(tile_y) << 13) | static_cast<uint64_t>(tile_x);
+    }
+
+private:
+    lru_tile_cache<texture_tile> m_tiles;
+    std::atomic<uint32_t> m_next_texture_id { 1 };
+};
@@ -129,7 +129,13 @@ inline vec3 unit_vector(const vec3& v)
     return v / v.length();
 }
 
-vec3 random_in_unit_sphere()
+// Rec. 709 luminance of a linear colour.
+inline double luminance(const color& c)
+{
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+inline vec3 random_in_unit_sphere()
 {
     while (true)
     {
@@ -139,7 +145,7 @@ vec3 random_in_unit_sphere()
     }
 }
 
-vec3 random_in_hemisphere(const vec3& normal)
+inline vec3 random_in_hemisphere(const vec3& normal)
 {
     const vec3 in_unit_sphere = random_in_unit_sphere();
     if (dot(in_unit_sphere, normal) > 0.0)
@@ -148,17 +154,17 @@ vec3 random_in_hemisphere(const vec3& normal)
         return -in_unit_sphere;
 }
 
-vec3 random_unit_vector()
+inline vec3 random_unit_vector()
 {
     return unit_vector(random_in_unit_sphere());
 }
 
-vec3 reflect(const vec3& v, const vec3& n)
+inline vec3 reflect(const vec3& v, const vec3& n)
 {
     return v - 2 * dot(v, n) * n;
 }
 
-vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
+inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
 {
     const double cos_theta = fmin(dot(-uv, n), 1.0);
     const vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
@@ -166,7 +172,7 @@ vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
     return r_out_perp + r_out_parallel;
 }
 
-vec3 random_in_unit_disk()
+inline vec3 random_in_unit_disk()
 {
     while (true)
     {